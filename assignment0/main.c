@@ -4,6 +4,10 @@
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include "../common/imagewriter.h"
 
 typedef struct {
     unsigned char red;
@@ -11,23 +15,207 @@ typedef struct {
     unsigned char blue;
 } RGBColor;
 
+/*
+* A batch of pixels, a row or part of a rectangle. real and imaginary hold each point's starting value and end up
+* holding its last values. Only the points listed in pixelIdxs are iterated. Julia points add the same constant
+* every iteration, Mandelbrot points add their own starting value.
+*/
+typedef struct {
+    int count;
+    int* pixelIdxs;
+    int pixelCount;
+    double* real;
+    double* imaginary;
+    int* iterations;
+    bool julia;
+    bool checkPeriodicity;
+    double realConstant;
+    double imaginaryConstant;
+} FractalPoints;
+
+typedef void (*FractalKernel)(FractalPoints* points, int maxIter);
+
+/*
+* The center's orbit for perturbation, computed once in quad precision by the first strip that needs it and kept as
+* doubles until its image is written.
+*/
+typedef struct {
+    __float128 centerReal;
+    __float128 centerImaginary;
+    double* real;
+    double* imaginary;
+    int length;
+    bool ready;
+    pthread_mutex_t mutex;
+} FractalReference;
+
+/*
+* The part of the plane an image shows. zoom 1 is the original view, larger zooms magnify around the center. Deep
+* zooms use perturbation: every pixel follows the reference orbit of the center and only iterates its small
+* difference from it in doubles. The constant is only used by the Julia set.
+*/
+typedef struct {
+    int width;
+    int height;
+    double centerReal;
+    double centerImaginary;
+    double zoom;
+    double constantReal;
+    double constantImaginary;
+    FractalReference* reference; // NULL unless the view is deep enough for perturbation
+} FractalView;
+
+// One step of a sweep, a Julia constant or a Mandelbrot center and zoom.
+typedef struct {
+    __float128 real;
+    __float128 imaginary;
+    double zoom;
+} FractalKeyframe;
+
+// Options after the pattern on the command line.
+typedef struct {
+    bool subdivide;
+    __float128 centerReal;
+    __float128 centerImaginary;
+    double zoom;
+    double constantReal;
+    double constantImaginary;
+    int frameCount; // 0 unless sweeping
+    FractalKeyframe* keyframes;
+    int keyframeCount;
+} FractalOptions;
+
+// Computes the colors of count pixels given by their coordinates. Functions that don't iterate in lanes ignore kernel.
+typedef void (*FractalPixelFunction)(FractalKernel kernel, const FractalView* view, const int* xs, const int* ys, int count, RGBColor* colors);
+
+// pixels and done hold the rows of one strip, starting at firstRow.
+typedef struct {
+    FractalView view;
+    RGBColor* pixels;
+    bool* done; // pixels already computed or filled in when subdividing
+    int firstRow;
+    FractalKernel kernel;
+    FractalPixelFunction computePixels;
+    bool subdivide;
+} FractalJob;
+
+// Inclusive pixel bounds.
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} FractalRect;
+
+// Per-thread room for the pixels of one batch.
+typedef struct {
+    int* xs;
+    int* ys;
+    RGBColor* colors;
+    int count;
+} FractalScratch;
+
+/*
+* Consecutive rows of an image. Patterns format their pixels into text, or into packed bytes for the binary formats,
+* and those that compute a whole strip before formatting it, like the fractals, can use pixels and done. PNG strips
+* are compressed into chunk by the worker that computed them.
+*/
+typedef struct {
+    int frameIdx;
+    int firstRow;
+    int rowCount;
+    RGBColor* pixels;
+    bool* done;
+    ImageFormat format;
+    char* text;
+    size_t textLength;
+    size_t textCapacity;
+    ImageChunk chunk;
+    bool ready; // computed and not written yet
+} PatternStrip;
+
+// Computes and formats the rows of a strip. pattern holds whatever the pattern needs besides the strip, patterns
+// without any settings ignore it.
+typedef void (*PatternStripFunction)(const void* pattern, int width, PatternStrip* strip);
+// Called once a frame is completely written, to free what its pattern no longer needs.
+typedef void (*PatternFrameFunction)(const void* pattern);
+
+/*
+* Images are produced in strips, so an image of any height only ever has a few strips in memory. Worker threads
+* take the next strip, compute it into one of a ring of slots and format it, and a writer thread writes the slots
+* out in order as they become ready. Workers wait while the writer is a whole ring behind. The strips of a sequence
+* of frames are numbered one after the other, so the same threads go straight from one frame to the next.
+*/
+typedef struct {
+    FILE* outputFilePtr;
+    char** outputFileNames; // one per frame, or NULL to write the only frame to outputFilePtr
+    const void** patterns; // one per frame
+    int frameCount;
+    ImageFormat format;
+    PatternStripFunction computeStrip;
+    PatternFrameFunction finishFrame;
+    int width;
+    int height;
+    int stripHeight;
+    int frameStripCount;
+    int stripCount;
+    PatternStrip* slots;
+    int slotCount;
+    int nextStripIdx;
+    int writtenStripCount;
+    pthread_mutex_t mutex;
+    pthread_cond_t stripReady;
+    pthread_cond_t slotFreed;
+} PatternStream;
+
 static int maxInputFileNameLength = 100;
 /*
-* 17 is the minimum number of chars required to allow for an input.txt file
-* with the maximum display resolution of 7680x4320 with this format:
-                        imsize 7680 4320
+* 27 is the number of chars needed for the largest width and height of
+* 9 digits each, including the final newline:
+                        imsize 999999999 999999999
 */
-static int maxInputFileSize = 17;
+static int maxInputFileSize = 27;
+static int maxDimensionLength = 9;
 static char* imSizeKeyword = "imsize";
-static char* outputFileSuffix = "_out.ppm";
-static char* magicNumber = "P3";
-static char* maxColorComponentValue = "255";
+static char* outputFileSuffix = "_out";
+// Set once from the `format` option before any image is written.
+static ImageFormat outputFormat = IMAGE_FORMAT_P3;
 /*
 * 5 is chosen to ensure a max line length of 70 character. If each pixel
 * is the maximum character count "255 255 255" with "\t" in between,
 * it makes 12 char per pixel, meaning 5 pixels per line to stay below 70.
 */
 static int maxPixelsOnLine = 5;
+// The longest a pixel can get as text, three negative ints, two spaces and the separator.
+static int maxPixelTextLength = 36;
+static int maxThreadCount = 256;
+// Strips aim for this many pixels, so wide images get fewer rows per strip, and have at most maxStripHeight rows.
+static int stripPixelCount = 1 << 16;
+static int maxStripHeight = 64;
+// Every worker gets this many strips on average, so strips that take longer even out.
+static int stripsPerWorker = 4;
+static int fractalTileSize = 64;
+// Rectangles this small that still have differently colored borders are computed pixel by pixel.
+static int minFractalSubdivisionSize = 6;
+static char* subdivideOption = "subdivide";
+static char* centerOption = "center";
+static char* zoomOption = "zoom";
+static char* constantOption = "constant";
+static char* sweepOption = "sweep";
+static char* formatOption = "format";
+static int maxFrameCount = 1000000;
+// Frame numbers in file names have at least this many digits, so they sort in order.
+static int minFrameNumberLength = 4;
+// Enough digits for maxFrameCount frames, which also bounds the file name buffers.
+#define MAX_FRAME_NUMBER_LENGTH 7
+// Both fractals color by iteration count with a palette that repeats every 255 iterations, shared by all frames.
+static RGBColor fractalPalette[255];
+/*
+* Beyond this zoom, neighboring pixels are too close together for doubles to tell apart around the center, so the
+* Mandelbrot pattern switches to perturbation. Quad precision reference orbits hold up to zooms of about 1e30.
+*/
+static double perturbationZoom = 1e10;
+static int mandelbrotMaxIter = 100000;
 
 char* substr(char* s, int x, int y) {
     char* ret = malloc(strlen(s) + 1);
@@ -47,9 +235,24 @@ char* substr(char* s, int x, int y) {
     return ret;
 }
 
+/*
+* Any pattern can end with `format <p3|p6|png>`. Returns the argument count without it, so the pattern and its own
+* options are read as if it was not there.
+*/
+int readOutputFormat(int argc, char* argv[]) {
+    if (argc < 5 || strcmp(argv[argc - 2], formatOption) != 0) {
+        return argc;
+    }
+    if (!parseImageFormat(argv[argc - 1], &outputFormat)) {
+        fprintf(stderr, "Incorrect usage. format must be p3, p6 or png.");
+        exit(-1);
+    }
+    return argc - 2;
+}
+
 void checkArgs(int argc, char* argv[]) {
-    if (argc > 3 || argc < 2) {
-        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./assignment0 <path/to/input_file.txt> <pattern>`");
+    if (argc < 2) {
+        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./assignment0 <path/to/input_file.txt> <pattern> <options>`");
         exit(-1);
     } else if (argc > 2) {
         if (strcmp(argv[2], "solid") != 0 && strcmp(argv[2], "grid") != 0 && strcmp(argv[2], "mandelbrot") != 0 &&
@@ -58,8 +261,12 @@ void checkArgs(int argc, char* argv[]) {
             exit(-1);
         }
     }
+    if (argc > 3 && strcmp(argv[2], "mandelbrot") != 0 && strcmp(argv[2], "julia") != 0) {
+        fprintf(stderr, "Incorrect usage. Only the mandelbrot and julia patterns take options.");
+        exit(-1);
+    }
 
-    if (strlen(argv[1]) > maxInputFileNameLength) {
+    if ((int) strlen(argv[1]) > maxInputFileNameLength) {
         fprintf(stderr, "Input file name specified is too long. It must be under %d characters.", maxInputFileNameLength);
         exit(-1);
     }
@@ -70,6 +277,158 @@ void checkArgs(int argc, char* argv[]) {
     }
 }
 
+// Reads a decimal number like -1.7687788022447e-15 into quad precision, since deep zoom centers need more digits
+// than a double holds.
+bool parseQuadPrecision(const char* s, __float128* value) {
+    int i = 0;
+    bool negative = s[i] == '-';
+    if (s[i] == '-' || s[i] == '+') {
+        i++;
+    }
+    __float128 mantissa = 0;
+    int decimalExponent = 0;
+    int digitCount = 0;
+    bool fraction = false;
+    for (; (s[i] >= '0' && s[i] <= '9') || (s[i] == '.' && !fraction); i++) {
+        if (s[i] == '.') {
+            fraction = true;
+            continue;
+        }
+        mantissa = mantissa * 10 + (s[i] - '0');
+        decimalExponent -= fraction;
+        digitCount++;
+    }
+    if (digitCount == 0) {
+        return false;
+    }
+    if (s[i] == 'e' || s[i] == 'E') {
+        char* end;
+        decimalExponent += (int) strtol(&s[i + 1], &end, 10);
+        if (end == &s[i + 1] || *end != '\0') {
+            return false;
+        }
+    } else if (s[i] != '\0') {
+        return false;
+    }
+
+    __float128 scale = 1;
+    __float128 power = 10;
+    for (int exponent = abs(decimalExponent); exponent > 0; exponent /= 2) {
+        if (exponent % 2 == 1) {
+            scale *= power;
+        }
+        power *= power;
+    }
+    mantissa = decimalExponent < 0 ? mantissa / scale : mantissa * scale;
+    *value = negative ? -mantissa : mantissa;
+    return true;
+}
+
+bool parseZoom(const char* s, double* zoom) {
+    char* end;
+    *zoom = strtod(s, &end);
+    return end != s && *end == '\0' && *zoom > 0.0 && !isinf(*zoom);
+}
+
+/*
+* Reads the keyframes after `sweep <frameCount>`, as many as follow: pairs of a Julia constant's real and imaginary
+* part, or triples of a Mandelbrot center and zoom. Returns the index of the last argument read.
+*/
+int readSweepKeyframes(int argc, char* argv[], int i, bool mandelbrot, FractalOptions* options) {
+    int valuesPerKeyframe = mandelbrot ? 3 : 2;
+    options->keyframes = malloc((size_t) argc * sizeof(FractalKeyframe));
+    if (options->keyframes == NULL) {
+        fprintf(stderr, "Memory allocation error while reading the sweep.");
+        exit(-1);
+    }
+    options->keyframeCount = 0;
+    __float128 value;
+    while (i + 1 < argc && parseQuadPrecision(argv[i + 1], &value)) {
+        FractalKeyframe* keyframe = &options->keyframes[options->keyframeCount++];
+        keyframe->zoom = 1.0;
+        if (i + valuesPerKeyframe >= argc || !parseQuadPrecision(argv[i + 1], &keyframe->real)
+                || !parseQuadPrecision(argv[i + 2], &keyframe->imaginary) || (mandelbrot && !parseZoom(argv[i + 3], &keyframe->zoom))) {
+            fprintf(stderr, "Incorrect usage. Every sweep keyframe takes %s.", mandelbrot ? "a center's real and imaginary part and a positive zoom" : "a constant's real and imaginary part");
+            exit(-1);
+        }
+        i += valuesPerKeyframe;
+    }
+    if (options->keyframeCount < 2) {
+        fprintf(stderr, "Incorrect usage. A sweep needs at least 2 keyframes.");
+        exit(-1);
+    }
+    return i;
+}
+
+/*
+* Options are `subdivide`, `center <real> <imaginary>` and `zoom <factor>` for the Mandelbrot set, `constant <real>
+* <imaginary>` for the Julia set and `sweep <frameCount> <keyframes>` for either, in any order. A sweep renders
+* numbered frames that move evenly from keyframe to keyframe, so it replaces the center, zoom and constant.
+*/
+FractalOptions readFractalOptions(int argc, char* argv[]) {
+    FractalOptions options = (FractalOptions) {
+            .subdivide = false,
+            .centerReal = 0,
+            .centerImaginary = 0,
+            .zoom = 1.0,
+            // The constants -0.7 and 0.27015 give the "classic" Julia set image.
+            .constantReal = -0.7,
+            .constantImaginary = 0.27015,
+            .frameCount = 0,
+            .keyframes = NULL,
+            .keyframeCount = 0,
+    };
+    bool mandelbrot = argc > 2 && strcmp(argv[2], "mandelbrot") == 0;
+    bool viewGiven = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], subdivideOption) == 0) {
+            options.subdivide = true;
+        } else if (strcmp(argv[i], centerOption) == 0 && i + 2 < argc && mandelbrot) {
+            if (!parseQuadPrecision(argv[i + 1], &options.centerReal) || !parseQuadPrecision(argv[i + 2], &options.centerImaginary)) {
+                fprintf(stderr, "Incorrect usage. center takes two numbers, the real and the imaginary part.");
+                exit(-1);
+            }
+            viewGiven = true;
+            i += 2;
+        } else if (strcmp(argv[i], zoomOption) == 0 && i + 1 < argc && mandelbrot) {
+            if (!parseZoom(argv[i + 1], &options.zoom)) {
+                fprintf(stderr, "Incorrect usage. zoom must be a positive number.");
+                exit(-1);
+            }
+            viewGiven = true;
+            i++;
+        } else if (strcmp(argv[i], constantOption) == 0 && i + 2 < argc && !mandelbrot) {
+            char* realEnd;
+            char* imaginaryEnd;
+            options.constantReal = strtod(argv[i + 1], &realEnd);
+            options.constantImaginary = strtod(argv[i + 2], &imaginaryEnd);
+            if (realEnd == argv[i + 1] || *realEnd != '\0' || imaginaryEnd == argv[i + 2] || *imaginaryEnd != '\0') {
+                fprintf(stderr, "Incorrect usage. constant takes two numbers, the real and the imaginary part.");
+                exit(-1);
+            }
+            viewGiven = true;
+            i += 2;
+        } else if (strcmp(argv[i], sweepOption) == 0 && i + 1 < argc && options.frameCount == 0) {
+            char* end;
+            long frameCount = strtol(argv[i + 1], &end, 10);
+            if (end == argv[i + 1] || *end != '\0' || frameCount < 1 || frameCount > maxFrameCount) {
+                fprintf(stderr, "Incorrect usage. sweep takes a frame count from 1 to %d before its keyframes.", maxFrameCount);
+                exit(-1);
+            }
+            options.frameCount = (int) frameCount;
+            i = readSweepKeyframes(argc, argv, i + 1, mandelbrot, &options);
+        } else {
+            fprintf(stderr, "Incorrect usage. Options are `subdivide`, `sweep <frameCount> <keyframes>` and, for mandelbrot, `center <real> <imaginary>` and `zoom <factor>`, for julia, `constant <real> <imaginary>`, followed by `format <p3|p6|png>`.");
+            exit(-1);
+        }
+    }
+    if (options.frameCount > 0 && viewGiven) {
+        fprintf(stderr, "Incorrect usage. A sweep takes its %s from its keyframes.", mandelbrot ? "centers and zooms" : "constants");
+        exit(-1);
+    }
+    return options;
+}
+
 void getInputFileContent(char* inputFileName, char* inputFileContents) {
     FILE* inputFilePtr;
     inputFilePtr = fopen(inputFileName, "r");
@@ -83,10 +442,12 @@ void getInputFileContent(char* inputFileName, char* inputFileContents) {
             exit(-1);
         }
 
-        fgets(inputFileContents, maxInputFileSize, inputFilePtr);
+        // One more than the file size, so the final newline is read with the rest of the line.
+        fgets(inputFileContents, maxInputFileSize + 1, inputFilePtr);
 
-        char extraLines[maxInputFileSize];
-        fgets(extraLines, maxInputFileSize, inputFilePtr);
+        char extraLines[maxInputFileSize + 1];
+        extraLines[0] = '\0';
+        fgets(extraLines, maxInputFileSize + 1, inputFilePtr);
         if (strlen(extraLines) > 0) {
             fprintf(stderr, "Improper file format. No extra lines should be included beyond 'imsize <width> <height>'");
             exit(-1);
@@ -143,13 +504,13 @@ void checkFileContent(char** fileContent) {
         exit(-1);
     }
 
-    if (strlen(fileContent[1]) > 4 || strlen(fileContent[1]) <= 0) {
-        fprintf(stderr, "Improper file format. width must be present and be max of 4 characters long.");
+    if ((int) strlen(fileContent[1]) > maxDimensionLength || strlen(fileContent[1]) <= 0) {
+        fprintf(stderr, "Improper file format. width must be present and be max of %d characters long.", maxDimensionLength);
         exit(-1);
     }
 
-    if (strlen(fileContent[2]) > 4 || strlen(fileContent[2]) <= 0) {
-        fprintf(stderr, "Improper file format. height must be present and be max of 4 characters long.");
+    if ((int) strlen(fileContent[2]) > maxDimensionLength || strlen(fileContent[2]) <= 0) {
+        fprintf(stderr, "Improper file format. height must be present and be max of %d characters long.", maxDimensionLength);
         exit(-1);
     }
 }
@@ -170,46 +531,302 @@ int convertStringToPositiveInt(char* s) {
 
 FILE* openOutputFile(char* inputFileName, char* optionalPattern) {
     char outputFileName[maxInputFileNameLength + 9];
-    snprintf(outputFileName, sizeof(outputFileName), "%s_%s%s", substr(inputFileName, 0, strlen(inputFileName) - 4), optionalPattern, outputFileSuffix);
+    snprintf(outputFileName, sizeof(outputFileName), "%s_%s%s%s", substr(inputFileName, 0, strlen(inputFileName) - 4), optionalPattern, outputFileSuffix,
+             getImageFormatExtension(outputFormat));
 
     FILE* outputFilePtr;
-    outputFilePtr = fopen(outputFileName, "w");
+    outputFilePtr = fopen(outputFileName, "wb");
     return outputFilePtr;
 }
 
-void writeHeader(FILE* outputFilePtr, int width, int height) {
-    fprintf(outputFilePtr, "%s\n%d %d\n%s\n", magicNumber, width, height, maxColorComponentValue);
+int getThreadCount() {
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) {
+        threadCount = 1;
+    } else if (threadCount > maxThreadCount) {
+        threadCount = maxThreadCount;
+    }
+    return (int) threadCount;
 }
 
-void enforceMaxPixelsOnLine(int x, FILE* outputFilePtr) {
-    if (x % (maxPixelsOnLine) == (maxPixelsOnLine - 1)) {
-        fprintf(outputFilePtr, "\n");
-    } else {
-        fprintf(outputFilePtr, "\t");
+// Components outside of 0 to 255 only come from the Gaussian noise pattern, which writes them as they are.
+char* appendPixelComponent(char* text, int value) {
+    if (value < 0 || value > 255) {
+        return text + sprintf(text, "%d", value);
+    }
+    if (value >= 100) {
+        *text++ = (char) ('0' + value / 100);
     }
+    if (value >= 10) {
+        *text++ = (char) ('0' + value / 10 % 10);
+    }
+    *text++ = (char) ('0' + value % 10);
+    return text;
 }
 
-void writeSolidColorContents(FILE* outputFilePtr, int width, int height) {
-    for (int y = 0; y < height; y++) {
+unsigned char clampPixelComponent(int value) {
+    return (unsigned char) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+/*
+* Formats a pixel like "%d %d %d" followed by a tab, or a newline after every maxPixelsOnLine pixels of a row. The
+* binary formats store its three bytes instead, which can not hold components outside of 0 to 255.
+*/
+void appendStripPixel(PatternStrip* strip, int x, int red, int green, int blue) {
+    if (strip->format != IMAGE_FORMAT_P3) {
+        unsigned char* bytes = (unsigned char*) &strip->text[strip->textLength];
+        bytes[0] = clampPixelComponent(red);
+        bytes[1] = clampPixelComponent(green);
+        bytes[2] = clampPixelComponent(blue);
+        strip->textLength += 3;
+        return;
+    }
+    if (strip->textLength + maxPixelTextLength > strip->textCapacity) {
+        strip->textCapacity *= 2;
+        strip->text = realloc(strip->text, strip->textCapacity);
+        if (strip->text == NULL) {
+            fprintf(stderr, "Memory allocation error while formatting the image.");
+            exit(-1);
+        }
+    }
+    char* text = &strip->text[strip->textLength];
+    text = appendPixelComponent(text, red);
+    *text++ = ' ';
+    text = appendPixelComponent(text, green);
+    *text++ = ' ';
+    text = appendPixelComponent(text, blue);
+    *text++ = x % maxPixelsOnLine == maxPixelsOnLine - 1 ? '\n' : '\t';
+    strip->textLength = text - strip->text;
+}
+
+void* computePatternStrips(void* arg) {
+    PatternStream* stream = (PatternStream*) arg;
+    while (true) {
+        pthread_mutex_lock(&stream->mutex);
+        int stripIdx = stream->nextStripIdx++;
+        while (stripIdx < stream->stripCount && stripIdx - stream->writtenStripCount >= stream->slotCount) {
+            pthread_cond_wait(&stream->slotFreed, &stream->mutex);
+        }
+        pthread_mutex_unlock(&stream->mutex);
+        if (stripIdx >= stream->stripCount) {
+            break;
+        }
+
+        PatternStrip* strip = &stream->slots[stripIdx % stream->slotCount];
+        strip->frameIdx = stripIdx / stream->frameStripCount;
+        strip->firstRow = stripIdx % stream->frameStripCount * stream->stripHeight;
+        strip->rowCount = stream->height - strip->firstRow < stream->stripHeight ? stream->height - strip->firstRow : stream->stripHeight;
+        strip->textLength = 0;
+        stream->computeStrip(stream->patterns[strip->frameIdx], stream->width, strip);
+        if (strip->format == IMAGE_FORMAT_PNG) {
+            if (!encodeImageRows(IMAGE_FORMAT_PNG, (const unsigned char*) strip->text, NULL, stream->width, strip->rowCount, &strip->chunk)) {
+                exit(-1);
+            }
+        }
+
+        pthread_mutex_lock(&stream->mutex);
+        strip->ready = true;
+        pthread_cond_signal(&stream->stripReady);
+        pthread_mutex_unlock(&stream->mutex);
+    }
+    return NULL;
+}
+
+// Writes the frames one after the other, each one to its own file when there are file names.
+void* writePatternStrips(void* arg) {
+    PatternStream* stream = (PatternStream*) arg;
+    int stripIdx = 0;
+    for (int frameIdx = 0; frameIdx < stream->frameCount; frameIdx++) {
+        FILE* outputFilePtr = stream->outputFilePtr;
+        if (stream->outputFileNames != NULL) {
+            outputFilePtr = fopen(stream->outputFileNames[frameIdx], "wb");
+            if (outputFilePtr == NULL) {
+                fprintf(stderr, "Unable to open the output file %s.", stream->outputFileNames[frameIdx]);
+                exit(-1);
+            }
+        }
+        ImageWriter writer;
+        if (!beginImage(&writer, outputFilePtr, stream->format, stream->width, stream->height)) {
+            exit(-1);
+        }
+
+        for (int frameStripIdx = 0; frameStripIdx < stream->frameStripCount; frameStripIdx++, stripIdx++) {
+            PatternStrip* strip = &stream->slots[stripIdx % stream->slotCount];
+            pthread_mutex_lock(&stream->mutex);
+            while (!strip->ready) {
+                pthread_cond_wait(&stream->stripReady, &stream->mutex);
+            }
+            pthread_mutex_unlock(&stream->mutex);
+
+            if (strip->format == IMAGE_FORMAT_PNG) {
+                if (!writeImageChunk(&writer, &strip->chunk)) {
+                    exit(-1);
+                }
+            } else if (fwrite(strip->text, 1, strip->textLength, outputFilePtr) != strip->textLength) {
+                fprintf(stderr, "Unable to write the output file.");
+                exit(-1);
+            }
+
+            pthread_mutex_lock(&stream->mutex);
+            strip->ready = false;
+            stream->writtenStripCount++;
+            pthread_cond_broadcast(&stream->slotFreed);
+            pthread_mutex_unlock(&stream->mutex);
+        }
+        if (!finishImage(&writer)) {
+            exit(-1);
+        }
+
+        if (stream->outputFileNames != NULL && fclose(outputFilePtr) != 0) {
+            fprintf(stderr, "Unable to write the output file %s.", stream->outputFileNames[frameIdx]);
+            exit(-1);
+        }
+        if (stream->finishFrame != NULL) {
+            stream->finishFrame(stream->patterns[frameIdx]);
+        }
+    }
+    return NULL;
+}
+
+// Rows per strip for a pattern with no strip size of its own.
+int getStripHeight(int width, int height, int workerCount) {
+    int stripHeight = width > 0 ? stripPixelCount / width : maxStripHeight;
+    int balancedStripHeight = (height + workerCount * stripsPerWorker - 1) / (workerCount * stripsPerWorker);
+    if (stripHeight > balancedStripHeight) {
+        stripHeight = balancedStripHeight;
+    }
+    if (stripHeight > maxStripHeight) {
+        stripHeight = maxStripHeight;
+    }
+    return stripHeight < 1 ? 1 : stripHeight;
+}
+
+/*
+* Writes frameCount frames of the same size strip by strip, each with its own pattern. ordered patterns compute each
+* row from the ones before it, so they get a single worker that goes through the strips in order. stripHeight 0 picks
+* one from the image size.
+*/
+void streamPatternFrames(FILE* outputFilePtr, char** outputFileNames, int frameCount, int width, int height, int stripHeight, bool ordered,
+                         const void** patterns, PatternStripFunction computeStrip, PatternFrameFunction finishFrame) {
+    int workerCount = ordered ? 1 : getThreadCount();
+    if (stripHeight == 0) {
+        stripHeight = getStripHeight(width, height, workerCount);
+    }
+    int frameStripCount = (height + stripHeight - 1) / stripHeight;
+    if ((long long) frameCount * frameStripCount > INT_MAX) {
+        fprintf(stderr, "Too many frames of this size to write in one run.");
+        exit(-1);
+    }
+    PatternStream stream = (PatternStream) {
+            .outputFilePtr = outputFilePtr,
+            .outputFileNames = outputFileNames,
+            .patterns = patterns,
+            .frameCount = frameCount,
+            .format = outputFormat,
+            .computeStrip = computeStrip,
+            .finishFrame = finishFrame,
+            .width = width,
+            .height = height,
+            .stripHeight = stripHeight,
+            .frameStripCount = frameStripCount,
+            .stripCount = frameCount * frameStripCount,
+            .slotCount = 2 * workerCount,
+            .nextStripIdx = 0,
+            .writtenStripCount = 0,
+    };
+    if (stream.slotCount > stream.stripCount) {
+        stream.slotCount = stream.stripCount > 0 ? stream.stripCount : 1;
+    }
+    stream.slots = calloc(stream.slotCount, sizeof(PatternStrip));
+    if (stream.slots == NULL) {
+        fprintf(stderr, "Memory allocation error while writing the image.");
+        exit(-1);
+    }
+    size_t stripPixels = (size_t) stripHeight * width;
+    for (int slotIdx = 0; slotIdx < stream.slotCount; slotIdx++) {
+        PatternStrip* strip = &stream.slots[slotIdx];
+        strip->pixels = malloc(stripPixels * sizeof(RGBColor) + 1);
+        strip->done = malloc(stripPixels * sizeof(bool) + 1);
+        strip->format = stream.format;
+        initImageChunk(&strip->chunk);
+        // Pixels of 0 to 255 take at most 12 chars, anything longer grows the text.
+        strip->textCapacity = stripPixels * 12 + maxPixelTextLength;
+        strip->text = malloc(strip->textCapacity);
+        if (strip->pixels == NULL || strip->done == NULL || strip->text == NULL) {
+            fprintf(stderr, "Memory allocation error while writing the image.");
+            exit(-1);
+        }
+    }
+    pthread_mutex_init(&stream.mutex, NULL);
+    pthread_cond_init(&stream.stripReady, NULL);
+    pthread_cond_init(&stream.slotFreed, NULL);
+
+    pthread_t writer;
+    pthread_t workers[workerCount];
+    if (pthread_create(&writer, NULL, writePatternStrips, &stream) != 0) {
+        fprintf(stderr, "Unable to start the writer thread.");
+        exit(-1);
+    }
+    for (int workerIdx = 0; workerIdx < workerCount; workerIdx++) {
+        if (pthread_create(&workers[workerIdx], NULL, computePatternStrips, &stream) != 0) {
+            fprintf(stderr, "Unable to start the worker threads.");
+            exit(-1);
+        }
+    }
+    for (int workerIdx = 0; workerIdx < workerCount; workerIdx++) {
+        pthread_join(workers[workerIdx], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    pthread_mutex_destroy(&stream.mutex);
+    pthread_cond_destroy(&stream.stripReady);
+    pthread_cond_destroy(&stream.slotFreed);
+    for (int slotIdx = 0; slotIdx < stream.slotCount; slotIdx++) {
+        free(stream.slots[slotIdx].pixels);
+        free(stream.slots[slotIdx].done);
+        free(stream.slots[slotIdx].text);
+        freeImageChunk(&stream.slots[slotIdx].chunk);
+    }
+    free(stream.slots);
+}
+
+void streamPatternContents(FILE* outputFilePtr, int width, int height, int stripHeight, bool ordered, const void* pattern, PatternStripFunction computeStrip) {
+    const void* patterns[1] = {pattern};
+    streamPatternFrames(outputFilePtr, NULL, 1, width, height, stripHeight, ordered, patterns, computeStrip, NULL);
+}
+
+void computeSolidColorStrip(const void* pattern, int width, PatternStrip* strip) {
+    (void) pattern;
+    for (int y = strip->firstRow; y < strip->firstRow + strip->rowCount; y++) {
         for (int x = 0; x < width; x++) {
-            fprintf(outputFilePtr, "255 222 111");
-            enforceMaxPixelsOnLine(x, outputFilePtr);
+            appendStripPixel(strip, x, 255, 222, 111);
         }
     }
 }
 
-void writeGridContents(FILE* outputFilePtr, int width, int height) {
-    bool firstColor = true;
+void writeSolidColorContents(FILE* outputFilePtr, int width, int height) {
+    streamPatternContents(outputFilePtr, width, height, 0, false, NULL, computeSolidColorStrip);
+}
+
+/*
+* The color flips at every square along a row and once more after every row that starts a square, so a strip's
+* first color follows from how many flips came before it.
+*/
+void computeGridStrip(const void* pattern, int width, PatternStrip* strip) {
+    (void) pattern;
     int squareSize = width / 10;
     bool dividesWithoutRemainder = width % 10 == 0;
-    for (int y = 0; y < height; y++) {
+    int rowFlipCount = (width + squareSize - 1) / squareSize - (dividesWithoutRemainder ? 0 : 1);
+    int y = strip->firstRow;
+    long long flipCount = (long long) y * rowFlipCount + (y + squareSize - 1) / squareSize;
+    bool firstColor = flipCount % 2 == 0;
+    for (; y < strip->firstRow + strip->rowCount; y++) {
         for (int x = 0; x < width; x++) {
             if ((x % squareSize == 0) && (dividesWithoutRemainder || x != 0)) {
                 firstColor = !firstColor;
             }
             int color = firstColor ? 255 : 0;
-            fprintf(outputFilePtr, "%d %d %d", color, color, color);
-            enforceMaxPixelsOnLine(x, outputFilePtr);
+            appendStripPixel(strip, x, color, color, color);
         }
         if (y % squareSize == 0) {
             firstColor = !firstColor;
@@ -217,100 +834,716 @@ void writeGridContents(FILE* outputFilePtr, int width, int height) {
     }
 }
 
-RGBColor mandelbrot(int x, int y, int width, int height, int maxIter) {
-    double real = (x - width / 2.0) * 4.0 / width;
-    double imaginary = (y - height / 2.0) * 4.0 / height;
-
-    double realTemp, imagTemp;
-    double realSquared, imagSquared;
-
-    int i = 0;
+void writeGridContents(FILE* outputFilePtr, int width, int height) {
+    streamPatternContents(outputFilePtr, width, height, 0, false, NULL, computeGridStrip);
+}
 
-    realTemp = real;
-    imagTemp = imaginary;
+/*
+* Each lane of a kernel works through the batch's pixels on its own. As soon as a lane's pixel escapes or runs out of
+* iterations its last values are stored and the lane moves on to the next pixel, so one slow pixel never holds up
+* the others. The arithmetic is the same as the one-pixel-at-a-time loop, so every escaping pixel ends with exactly
+* the same values. The Julia loop checks the squares from before the update rather than the new magnitude, and so
+* do its lanes. Iterations are counted in doubles, which compare in one instruction on every instruction set.
+*
+* Orbits that settle into a cycle never escape. With checkPeriodicity each lane remembers its value at every power
+* of two iterations (Brent's cycle detection) and, once the orbit lands exactly on the remembered value again,
+* reports the pixel as having used up all of its iterations.
+*/
+#define DEFINE_FRACTAL_KERNEL(name, laneCount, targetAttribute) \
+    typedef double name##Lanes __attribute__((vector_size(laneCount * sizeof(double)))); \
+    typedef long long name##Mask __attribute__((vector_size(laneCount * sizeof(long long)))); \
+    \
+    targetAttribute void name(FractalPoints* points, int maxIter) { \
+        double laneRealStarts[laneCount], laneImaginaryStarts[laneCount], laneReals[laneCount], laneImaginaries[laneCount], laneIterations[laneCount]; \
+        double laneSavedReals[laneCount], laneSavedImaginaries[laneCount], laneNextSaves[laneCount]; \
+        long long laneFinished[laneCount], laneCycled[laneCount]; \
+        int pixelIdxs[laneCount]; \
+        int nextPixel = 0; \
+        int occupiedCount = 0; \
+        for (int lane = 0; lane < laneCount; lane++) { \
+            pixelIdxs[lane] = nextPixel < points->pixelCount && maxIter > 0 ? points->pixelIdxs[nextPixel++] : -1; \
+            laneReals[lane] = pixelIdxs[lane] != -1 ? points->real[pixelIdxs[lane]] : 0.0; \
+            laneImaginaries[lane] = pixelIdxs[lane] != -1 ? points->imaginary[pixelIdxs[lane]] : 0.0; \
+            laneRealStarts[lane] = points->julia ? points->realConstant : laneReals[lane]; \
+            laneImaginaryStarts[lane] = points->julia ? points->imaginaryConstant : laneImaginaries[lane]; \
+            laneIterations[lane] = 0.0; \
+            laneSavedReals[lane] = laneReals[lane]; \
+            laneSavedImaginaries[lane] = laneImaginaries[lane]; \
+            laneNextSaves[lane] = 1.0; \
+            occupiedCount += pixelIdxs[lane] != -1; \
+        } \
+        name##Lanes realStart, imaginaryStart, real, imaginary, iterations, savedReal, savedImaginary, nextSave; \
+        memcpy(&realStart, laneRealStarts, sizeof(name##Lanes)); \
+        memcpy(&imaginaryStart, laneImaginaryStarts, sizeof(name##Lanes)); \
+        memcpy(&real, laneReals, sizeof(name##Lanes)); \
+        memcpy(&imaginary, laneImaginaries, sizeof(name##Lanes)); \
+        memcpy(&iterations, laneIterations, sizeof(name##Lanes)); \
+        memcpy(&savedReal, laneSavedReals, sizeof(name##Lanes)); \
+        memcpy(&savedImaginary, laneSavedImaginaries, sizeof(name##Lanes)); \
+        memcpy(&nextSave, laneNextSaves, sizeof(name##Lanes)); \
+        name##Lanes zero = iterations; \
+        name##Lanes one = zero + 1.0; \
+        name##Lanes two = zero + 2.0; \
+        name##Lanes escapeRadiusSquared = zero + 16.0; \
+        name##Lanes maxIterations = zero + maxIter; \
+        \
+        while (occupiedCount > 0) { \
+            name##Lanes realSquared = real * real - imaginary * imaginary; \
+            name##Lanes imagSquared = two * real * imaginary; \
+            \
+            real = realSquared + realStart; \
+            imaginary = imagSquared + imaginaryStart; \
+            \
+            name##Mask escaped = points->julia \
+                                 ? realSquared + imagSquared > escapeRadiusSquared \
+                                 : real * real + imaginary * imaginary > escapeRadiusSquared; \
+            iterations += (name##Lanes) ((name##Mask) one & ~escaped); \
+            name##Mask cycled = (name##Mask) zero; \
+            if (points->checkPeriodicity) { \
+                cycled = (real == savedReal) & (imaginary == savedImaginary) & ~escaped; \
+                name##Mask save = iterations == nextSave; \
+                savedReal = (name##Lanes) (((name##Mask) real & save) | ((name##Mask) savedReal & ~save)); \
+                savedImaginary = (name##Lanes) (((name##Mask) imaginary & save) | ((name##Mask) savedImaginary & ~save)); \
+                nextSave += (name##Lanes) ((name##Mask) nextSave & save); \
+            } \
+            name##Mask finished = escaped | cycled | (iterations == maxIterations); \
+            memcpy(laneFinished, &finished, sizeof(name##Mask)); \
+            long long anyFinished = 0; \
+            for (int lane = 0; lane < laneCount; lane++) { \
+                anyFinished |= laneFinished[lane]; \
+            } \
+            if (anyFinished == 0) { \
+                continue; \
+            } \
+            \
+            memcpy(laneCycled, &cycled, sizeof(name##Mask)); \
+            memcpy(laneReals, &real, sizeof(name##Lanes)); \
+            memcpy(laneImaginaries, &imaginary, sizeof(name##Lanes)); \
+            memcpy(laneIterations, &iterations, sizeof(name##Lanes)); \
+            memcpy(laneSavedReals, &savedReal, sizeof(name##Lanes)); \
+            memcpy(laneSavedImaginaries, &savedImaginary, sizeof(name##Lanes)); \
+            memcpy(laneNextSaves, &nextSave, sizeof(name##Lanes)); \
+            for (int lane = 0; lane < laneCount; lane++) { \
+                if (laneFinished[lane] == 0 || pixelIdxs[lane] == -1) { \
+                    continue; \
+                } \
+                points->real[pixelIdxs[lane]] = laneReals[lane]; \
+                points->imaginary[pixelIdxs[lane]] = laneImaginaries[lane]; \
+                points->iterations[pixelIdxs[lane]] = laneCycled[lane] != 0 ? maxIter : (int) laneIterations[lane]; \
+                /* Lanes left without a pixel keep iterating until the batch is done, nothing reads their results. */ \
+                pixelIdxs[lane] = nextPixel < points->pixelCount ? points->pixelIdxs[nextPixel++] : -1; \
+                if (pixelIdxs[lane] == -1) { \
+                    occupiedCount--; \
+                    continue; \
+                } \
+                laneReals[lane] = points->real[pixelIdxs[lane]]; \
+                laneImaginaries[lane] = points->imaginary[pixelIdxs[lane]]; \
+                laneRealStarts[lane] = points->julia ? points->realConstant : laneReals[lane]; \
+                laneImaginaryStarts[lane] = points->julia ? points->imaginaryConstant : laneImaginaries[lane]; \
+                laneIterations[lane] = 0.0; \
+                laneSavedReals[lane] = laneReals[lane]; \
+                laneSavedImaginaries[lane] = laneImaginaries[lane]; \
+                laneNextSaves[lane] = 1.0; \
+            } \
+            memcpy(&realStart, laneRealStarts, sizeof(name##Lanes)); \
+            memcpy(&imaginaryStart, laneImaginaryStarts, sizeof(name##Lanes)); \
+            memcpy(&real, laneReals, sizeof(name##Lanes)); \
+            memcpy(&imaginary, laneImaginaries, sizeof(name##Lanes)); \
+            memcpy(&iterations, laneIterations, sizeof(name##Lanes)); \
+            memcpy(&savedReal, laneSavedReals, sizeof(name##Lanes)); \
+            memcpy(&savedImaginary, laneSavedImaginaries, sizeof(name##Lanes)); \
+            memcpy(&nextSave, laneNextSaves, sizeof(name##Lanes)); \
+        } \
+    }
 
-    while (i < maxIter) {
-        realSquared = real * real - imaginary * imaginary;
-        imagSquared = 2.0 * real * imaginary;
+// One kernel per instruction set, each as wide as that instruction set's registers.
+DEFINE_FRACTAL_KERNEL(iterateFractalPointsAvx512, 8, __attribute__((target("avx512f,avx512dq"))))
+DEFINE_FRACTAL_KERNEL(iterateFractalPointsAvx2, 4, __attribute__((target("avx2"))))
+DEFINE_FRACTAL_KERNEL(iterateFractalPointsSse2, 2, )
+
+FractalKernel getFractalKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        return iterateFractalPointsAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        return iterateFractalPointsAvx2;
+    }
+    return iterateFractalPointsSse2;
+}
 
-        real = realSquared + realTemp;
-        imaginary = imagSquared + imagTemp;
+void initFractalPalette() {
+    for (int i = 0; i < 255; i++) {
+        fractalPalette[i].red = (i * 5) % 255;
+        fractalPalette[i].green = (i * 10) % 255;
+        fractalPalette[i].blue = (i * 20) % 255;
+    }
+}
 
-        if (real * real + imaginary * imaginary > 16.0) {
-            break;
-        }
+RGBColor getFractalPaletteColor(int i) {
+    if (i >= 0) {
+        return fractalPalette[i % 255];
+    }
+    // Smoothing takes pixels that escape right away below 0, where the remainders are negative.
+    RGBColor color;
+    color.red = (i * 5) % 255;
+    color.green = (i * 10) % 255;
+    color.blue = (i * 20) % 255;
+    return color;
+}
 
-        i++;
+RGBColor getMandelbrotColor(double real, double imaginary, int i, int maxIter) {
+    RGBColor black;
+    black.red = 0;
+    black.green = 0;
+    black.blue = 0;
+    // Pixels that never escape are black no matter where their orbit ended, so interior pixels can stop early.
+    if (i >= maxIter) {
+        return black;
     }
 
     double squaredMagnitudeLog = log(real * real + imaginary * imaginary) / 2.0;
     double smoothIterationCount = log(squaredMagnitudeLog / log(2.0)) / log(2.0);
     i = (int)(i + 1 - smoothIterationCount);
 
-    RGBColor color;
-    color.red = (i * 5) % 255;
-    color.green = (i * 10) % 255;
-    color.blue = (i * 20) % 255;
+    RGBColor color = getFractalPaletteColor(i);
 
     if (i >= maxIter) {
-        RGBColor black;
-        black.red = 0;
-        black.green = 0;
-        black.blue = 0;
         return black;
     }
 
     return color;
 }
 
-void writeMandelbrotContents(FILE* outputFilePtr, int width, int height) {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            RGBColor pixelColor = mandelbrot(x, y, width, height, 100000);
-            fprintf(outputFilePtr, "%d %d %d", pixelColor.red, pixelColor.green, pixelColor.blue);
-            enforceMaxPixelsOnLine(x, outputFilePtr);
-        }
+/*
+* Points inside the main cardioid or the period-2 bulb never escape, which a closed-form test shows without
+* iterating at all.
+*/
+bool isInsideMandelbrotInterior(double real, double imaginary) {
+    double shiftedReal = real - 0.25;
+    double q = shiftedReal * shiftedReal + imaginary * imaginary;
+    if (q * (q + shiftedReal) <= 0.25 * imaginary * imaginary) {
+        return true;
     }
+    return (real + 1.0) * (real + 1.0) + imaginary * imaginary <= 0.0625;
 }
 
-RGBColor julia(int x, int y, int width, int height, int maxIter, double realConstant, double imaginaryConstant) {
-    double zx = 1.5 * (x - width / 2.0) / (0.5 * width);
-    double zy = (y - height / 2.0) / (0.5 * height);
+RGBColor getJuliaColor(int i) {
+    return getFractalPaletteColor(i);
+}
 
-    double realSquared, imagSquared;
+FractalPoints createFractalPoints(int count, bool julia, bool checkPeriodicity, double realConstant, double imaginaryConstant) {
+    FractalPoints points = (FractalPoints) {
+            .count = count,
+            .pixelIdxs = malloc((size_t) count * sizeof(int) + 1),
+            .pixelCount = 0,
+            .real = malloc((size_t) count * sizeof(double) + 1),
+            .imaginary = malloc((size_t) count * sizeof(double) + 1),
+            .iterations = malloc((size_t) count * sizeof(int) + 1),
+            .julia = julia,
+            .checkPeriodicity = checkPeriodicity,
+            .realConstant = realConstant,
+            .imaginaryConstant = imaginaryConstant,
+    };
+    if (points.pixelIdxs == NULL || points.real == NULL || points.imaginary == NULL || points.iterations == NULL) {
+        fprintf(stderr, "Memory allocation error while rendering the fractal.");
+        exit(-1);
+    }
+    return points;
+}
 
-    int i = 0;
+void freeFractalPoints(FractalPoints points) {
+    free(points.pixelIdxs);
+    free(points.real);
+    free(points.imaginary);
+    free(points.iterations);
+}
 
-    while (i < maxIter) {
-        realSquared = zx * zx - zy * zy;
-        imagSquared = 2.0 * zx * zy;
+// With the original view this is exactly the original mapping, the division and addition change nothing.
+double getMandelbrotOffsetReal(const FractalView* view, int x) {
+    return (x - view->width / 2.0) * 4.0 / view->width / view->zoom;
+}
 
-        zx = realSquared + realConstant;
-        zy = imagSquared + imaginaryConstant;
+double getMandelbrotOffsetImaginary(const FractalView* view, int y) {
+    return (y - view->height / 2.0) * 4.0 / view->height / view->zoom;
+}
 
-        if (realSquared + imagSquared > 16.0) {
+void computeMandelbrotPixels(FractalKernel kernel, const FractalView* view, const int* xs, const int* ys, int count, RGBColor* colors) {
+    int maxIter = mandelbrotMaxIter;
+    FractalPoints points = createFractalPoints(count, false, true, 0.0, 0.0);
+    for (int i = 0; i < count; i++) {
+        points.real[i] = view->centerReal + getMandelbrotOffsetReal(view, xs[i]);
+        points.imaginary[i] = view->centerImaginary + getMandelbrotOffsetImaginary(view, ys[i]);
+        points.iterations[i] = maxIter;
+        if (!isInsideMandelbrotInterior(points.real[i], points.imaginary[i])) {
+            points.pixelIdxs[points.pixelCount++] = i;
+        }
+    }
+    kernel(&points, maxIter);
+    for (int i = 0; i < count; i++) {
+        colors[i] = getMandelbrotColor(points.real[i], points.imaginary[i], points.iterations[i], maxIter);
+    }
+    freeFractalPoints(points);
+}
+
+void computeJuliaPixels(FractalKernel kernel, const FractalView* view, const int* xs, const int* ys, int count, RGBColor* colors) {
+    FractalPoints points = createFractalPoints(count, true, false, view->constantReal, view->constantImaginary);
+    for (int i = 0; i < count; i++) {
+        points.real[i] = 1.5 * (xs[i] - view->width / 2.0) / (0.5 * view->width);
+        points.imaginary[i] = (ys[i] - view->height / 2.0) / (0.5 * view->height);
+        points.pixelIdxs[points.pixelCount++] = i;
+    }
+    kernel(&points, 1000000);
+    for (int i = 0; i < count; i++) {
+        colors[i] = getJuliaColor(points.iterations[i]);
+    }
+    freeFractalPoints(points);
+}
+
+void initFractalReference(FractalReference* reference, __float128 centerReal, __float128 centerImaginary) {
+    reference->centerReal = centerReal;
+    reference->centerImaginary = centerImaginary;
+    reference->real = NULL;
+    reference->imaginary = NULL;
+    reference->length = 0;
+    reference->ready = false;
+    pthread_mutex_init(&reference->mutex, NULL);
+}
+
+// The center's orbit in quad precision, kept as doubles. It stops after the first value that escapes.
+void computeReferenceOrbit(FractalReference* reference, int maxIter) {
+    reference->real = malloc(((size_t) maxIter + 1) * sizeof(double));
+    reference->imaginary = malloc(((size_t) maxIter + 1) * sizeof(double));
+    if (reference->real == NULL || reference->imaginary == NULL) {
+        fprintf(stderr, "Memory allocation error while computing the reference orbit.");
+        exit(-1);
+    }
+    __float128 real = 0;
+    __float128 imaginary = 0;
+    reference->length = 0;
+    while (reference->length <= maxIter) {
+        reference->real[reference->length] = (double) real;
+        reference->imaginary[reference->length] = (double) imaginary;
+        reference->length++;
+        if (real * real + imaginary * imaginary > 16) {
             break;
         }
+        __float128 nextReal = real * real - imaginary * imaginary + reference->centerReal;
+        imaginary = 2 * real * imaginary + reference->centerImaginary;
+        real = nextReal;
+    }
+}
 
+// The first strip of an image computes its reference, the others wait for it.
+void prepareFractalReference(FractalReference* reference) {
+    pthread_mutex_lock(&reference->mutex);
+    if (!reference->ready) {
+        computeReferenceOrbit(reference, mandelbrotMaxIter);
+        reference->ready = true;
+    }
+    pthread_mutex_unlock(&reference->mutex);
+}
+
+void releaseFractalReference(FractalReference* reference) {
+    free(reference->real);
+    free(reference->imaginary);
+    reference->real = NULL;
+    reference->imaginary = NULL;
+    reference->ready = false;
+    pthread_mutex_destroy(&reference->mutex);
+}
+
+/*
+* Perturbation: with Z the reference orbit and c the pixel's offset from the center, the pixel's difference d from
+* the reference follows d' = (2Z + d)d + c, which stays small enough for doubles at any zoom. When the pixel's value
+* Z + d gets smaller than d itself, or the reference runs out, the difference would lose its precision (a glitch),
+* so the pixel rebases: its full value becomes the new difference and it follows the reference from the start
+* again (Zhuoran's rebasing). Pixels count iterations and escape exactly like they do without perturbation.
+*/
+RGBColor computePerturbedMandelbrotPixel(const FractalView* view, double offsetReal, double offsetImaginary, int maxIter) {
+    // Like the double kernel, pixels start at c, the reference's first step from 0.
+    double deltaReal = offsetReal;
+    double deltaImaginary = offsetImaginary;
+    double real = 0.0;
+    double imaginary = 0.0;
+    int referenceIdx = 1;
+    int i = 0;
+    while (i < maxIter) {
+        if (referenceIdx == view->reference->length - 1) {
+            deltaReal += view->reference->real[referenceIdx];
+            deltaImaginary += view->reference->imaginary[referenceIdx];
+            referenceIdx = 0;
+        }
+        double twiceReferencePlusDeltaReal = 2.0 * view->reference->real[referenceIdx] + deltaReal;
+        double twiceReferencePlusDeltaImaginary = 2.0 * view->reference->imaginary[referenceIdx] + deltaImaginary;
+        double nextDeltaReal = twiceReferencePlusDeltaReal * deltaReal - twiceReferencePlusDeltaImaginary * deltaImaginary + offsetReal;
+        deltaImaginary = twiceReferencePlusDeltaReal * deltaImaginary + twiceReferencePlusDeltaImaginary * deltaReal + offsetImaginary;
+        deltaReal = nextDeltaReal;
+        referenceIdx++;
+
+        real = view->reference->real[referenceIdx] + deltaReal;
+        imaginary = view->reference->imaginary[referenceIdx] + deltaImaginary;
+        double squaredMagnitude = real * real + imaginary * imaginary;
+        if (squaredMagnitude > 16.0) {
+            break;
+        }
         i++;
+
+        if (squaredMagnitude < deltaReal * deltaReal + deltaImaginary * deltaImaginary) {
+            deltaReal = real;
+            deltaImaginary = imaginary;
+            referenceIdx = 0;
+        }
     }
+    return getMandelbrotColor(real, imaginary, i, maxIter);
+}
 
-    RGBColor color;
-    color.red = (i * 5) % 255;
-    color.green = (i * 10) % 255;
-    color.blue = (i * 20) % 255;
+void computePerturbedMandelbrotPixels(FractalKernel kernel, const FractalView* view, const int* xs, const int* ys, int count, RGBColor* colors) {
+    (void) kernel; // the reference orbit keeps every pixel on its own path, so there are no lanes to fill
+    for (int i = 0; i < count; i++) {
+        colors[i] = computePerturbedMandelbrotPixel(view, getMandelbrotOffsetReal(view, xs[i]), getMandelbrotOffsetImaginary(view, ys[i]), mandelbrotMaxIter);
+    }
+}
 
-    return color;
+FractalScratch createFractalScratch(int capacity) {
+    FractalScratch scratch = (FractalScratch) {
+            .xs = malloc((size_t) capacity * sizeof(int) + 1),
+            .ys = malloc((size_t) capacity * sizeof(int) + 1),
+            .colors = malloc((size_t) capacity * sizeof(RGBColor) + 1),
+            .count = 0,
+    };
+    if (scratch.xs == NULL || scratch.ys == NULL || scratch.colors == NULL) {
+        fprintf(stderr, "Memory allocation error while rendering the fractal.");
+        exit(-1);
+    }
+    return scratch;
+}
+
+void freeFractalScratch(FractalScratch scratch) {
+    free(scratch.xs);
+    free(scratch.ys);
+    free(scratch.colors);
 }
 
-void writeJuliaContents(FILE* outputFilePtr, int width, int height) {
-    for (int y = 0; y < height; y++) {
+size_t getFractalPixelIdx(const FractalJob* job, int x, int y) {
+    return (size_t) (y - job->firstRow) * job->view.width + x;
+}
+
+// Pixels are marked done as soon as they are queued, so rectangles sharing a border queue it once.
+void addScratchPixel(FractalJob* job, FractalScratch* scratch, int x, int y) {
+    size_t pixelIdx = getFractalPixelIdx(job, x, y);
+    if (!job->done[pixelIdx]) {
+        job->done[pixelIdx] = true;
+        scratch->xs[scratch->count] = x;
+        scratch->ys[scratch->count] = y;
+        scratch->count++;
+    }
+}
+
+// Computes the scratch pixels and stores them in the image.
+void computeScratchPixels(FractalJob* job, FractalScratch* scratch) {
+    if (scratch->count == 0) {
+        return;
+    }
+    job->computePixels(job->kernel, &job->view, scratch->xs, scratch->ys, scratch->count, scratch->colors);
+    for (int i = 0; i < scratch->count; i++) {
+        job->pixels[getFractalPixelIdx(job, scratch->xs[i], scratch->ys[i])] = scratch->colors[i];
+    }
+    scratch->count = 0;
+}
+
+bool isSameColor(RGBColor a, RGBColor b) {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
+void addRectBorder(FractalJob* job, FractalScratch* scratch, FractalRect rect) {
+    for (int x = rect.x0; x <= rect.x1; x++) {
+        addScratchPixel(job, scratch, x, rect.y0);
+        addScratchPixel(job, scratch, x, rect.y1);
+    }
+    for (int y = rect.y0 + 1; y < rect.y1; y++) {
+        addScratchPixel(job, scratch, rect.x0, y);
+        addScratchPixel(job, scratch, rect.x1, y);
+    }
+}
+
+bool hasUniformBorder(const FractalJob* job, FractalRect rect) {
+    RGBColor borderColor = job->pixels[getFractalPixelIdx(job, rect.x0, rect.y0)];
+    for (int x = rect.x0; x <= rect.x1; x++) {
+        if (!isSameColor(job->pixels[getFractalPixelIdx(job, x, rect.y0)], borderColor) || !isSameColor(job->pixels[getFractalPixelIdx(job, x, rect.y1)], borderColor)) {
+            return false;
+        }
+    }
+    for (int y = rect.y0 + 1; y < rect.y1; y++) {
+        if (!isSameColor(job->pixels[getFractalPixelIdx(job, rect.x0, y)], borderColor) || !isSameColor(job->pixels[getFractalPixelIdx(job, rect.x1, y)], borderColor)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+* Mariani-Silver subdivision. Neither set has holes, so when the whole border of a rectangle comes out one color
+* the inside is that color too and is filled without iterating. Otherwise the rectangle is split in two along its
+* longer side, and small rectangles are simply computed pixel by pixel. The halves share the split line. Every
+* level of the subdivision computes the borders of all of its rectangles in one batch, so the kernel's lanes
+* stay busy even though single borders are short.
+*/
+void subdivideFractalTile(FractalJob* job, FractalScratch* scratch, FractalRect tile) {
+    int rectCapacity = fractalTileSize * fractalTileSize;
+    FractalRect* rects = malloc((size_t) rectCapacity * sizeof(FractalRect));
+    FractalRect* nextRects = malloc((size_t) rectCapacity * sizeof(FractalRect));
+    if (rects == NULL || nextRects == NULL) {
+        fprintf(stderr, "Memory allocation error while rendering the fractal.");
+        exit(-1);
+    }
+    rects[0] = tile;
+    int rectCount = 1;
+    addRectBorder(job, scratch, tile);
+
+    while (rectCount > 0) {
+        computeScratchPixels(job, scratch);
+        int nextRectCount = 0;
+        for (int rectIdx = 0; rectIdx < rectCount; rectIdx++) {
+            FractalRect rect = rects[rectIdx];
+            if (rect.x1 - rect.x0 < 2 || rect.y1 - rect.y0 < 2) {
+                continue;
+            }
+            if (hasUniformBorder(job, rect)) {
+                RGBColor borderColor = job->pixels[getFractalPixelIdx(job, rect.x0, rect.y0)];
+                for (int y = rect.y0 + 1; y < rect.y1; y++) {
+                    for (int x = rect.x0 + 1; x < rect.x1; x++) {
+                        job->pixels[getFractalPixelIdx(job, x, y)] = borderColor;
+                        job->done[getFractalPixelIdx(job, x, y)] = true;
+                    }
+                }
+            } else if (rect.x1 - rect.x0 <= minFractalSubdivisionSize && rect.y1 - rect.y0 <= minFractalSubdivisionSize) {
+                for (int y = rect.y0 + 1; y < rect.y1; y++) {
+                    for (int x = rect.x0 + 1; x < rect.x1; x++) {
+                        addScratchPixel(job, scratch, x, y);
+                    }
+                }
+            } else {
+                FractalRect first = rect;
+                FractalRect second = rect;
+                if (rect.x1 - rect.x0 >= rect.y1 - rect.y0) {
+                    first.x1 = (rect.x0 + rect.x1) / 2;
+                    second.x0 = first.x1;
+                } else {
+                    first.y1 = (rect.y0 + rect.y1) / 2;
+                    second.y0 = first.y1;
+                }
+                nextRects[nextRectCount++] = first;
+                nextRects[nextRectCount++] = second;
+                addRectBorder(job, scratch, first);
+                addRectBorder(job, scratch, second);
+            }
+        }
+        FractalRect* swap = rects;
+        rects = nextRects;
+        nextRects = swap;
+        rectCount = nextRectCount;
+    }
+    computeScratchPixels(job, scratch);
+    free(rects);
+    free(nextRects);
+}
+
+/*
+* Computes a strip's rows one by one, or its tiles one by one when subdividing. Subdividing strips are exactly one
+* row of tiles high.
+*/
+void computeFractalStrip(const void* pattern, int width, PatternStrip* strip) {
+    FractalJob job = *(const FractalJob*) pattern;
+    job.pixels = strip->pixels;
+    job.done = strip->done;
+    job.firstRow = strip->firstRow;
+    if (job.view.reference != NULL) {
+        prepareFractalReference(job.view.reference);
+    }
+    int lastRow = strip->firstRow + strip->rowCount - 1;
+    FractalScratch scratch = createFractalScratch(width > fractalTileSize * fractalTileSize ? width : fractalTileSize * fractalTileSize);
+    if (job.subdivide) {
+        memset(job.done, 0, (size_t) strip->rowCount * width * sizeof(bool));
+        for (int x0 = 0; x0 < width; x0 += fractalTileSize) {
+            FractalRect tile;
+            tile.x0 = x0;
+            tile.y0 = strip->firstRow;
+            tile.x1 = x0 + fractalTileSize - 1 < width - 1 ? x0 + fractalTileSize - 1 : width - 1;
+            tile.y1 = lastRow;
+            subdivideFractalTile(&job, &scratch, tile);
+        }
+    } else {
+        for (int y = strip->firstRow; y <= lastRow; y++) {
+            for (int x = 0; x < width; x++) {
+                scratch.xs[x] = x;
+                scratch.ys[x] = y;
+            }
+            job.computePixels(job.kernel, &job.view, scratch.xs, scratch.ys, width, &job.pixels[getFractalPixelIdx(&job, 0, y)]);
+        }
+    }
+    freeFractalScratch(scratch);
+
+    for (int y = strip->firstRow; y <= lastRow; y++) {
         for (int x = 0; x < width; x++) {
-            RGBColor pixelColor = julia(x, y, width, height, 1000000, -0.7, 0.27015);
-            fprintf(outputFilePtr, "%d %d %d", pixelColor.red, pixelColor.green, pixelColor.blue);
-            enforceMaxPixelsOnLine(x, outputFilePtr);
+            RGBColor pixelColor = job.pixels[getFractalPixelIdx(&job, x, y)];
+            appendStripPixel(strip, x, pixelColor.red, pixelColor.green, pixelColor.blue);
+        }
+    }
+}
+
+FractalJob createFractalJob(FractalView view, FractalPixelFunction computePixels, bool subdivide) {
+    return (FractalJob) {
+            .view = view,
+            .pixels = NULL,
+            .done = NULL,
+            .firstRow = 0,
+            .kernel = getFractalKernel(),
+            .computePixels = computePixels,
+            .subdivide = subdivide,
+    };
+}
+
+void writeFractalContents(FILE* outputFilePtr, FractalView view, FractalPixelFunction computePixels, bool subdivide) {
+    initFractalPalette();
+    FractalJob job = createFractalJob(view, computePixels, subdivide);
+    streamPatternContents(outputFilePtr, view.width, view.height, subdivide ? fractalTileSize : 0, false, &job, computeFractalStrip);
+    if (view.reference != NULL) {
+        releaseFractalReference(view.reference);
+    }
+}
+
+// Views past perturbationZoom get the reference, which is computed once the image is rendered.
+FractalView createMandelbrotView(int width, int height, __float128 centerReal, __float128 centerImaginary, double zoom, FractalReference* reference) {
+    FractalView view = (FractalView) {
+            .width = width,
+            .height = height,
+            .centerReal = (double) centerReal,
+            .centerImaginary = (double) centerImaginary,
+            .zoom = zoom,
+            .constantReal = 0.0,
+            .constantImaginary = 0.0,
+            .reference = NULL,
+    };
+    if (zoom >= perturbationZoom) {
+        initFractalReference(reference, centerReal, centerImaginary);
+        view.reference = reference;
+    }
+    return view;
+}
+
+// The Julia set always shows the original view.
+FractalView createJuliaView(int width, int height, double constantReal, double constantImaginary) {
+    return (FractalView) {
+            .width = width,
+            .height = height,
+            .centerReal = 0.0,
+            .centerImaginary = 0.0,
+            .zoom = 1.0,
+            .constantReal = constantReal,
+            .constantImaginary = constantImaginary,
+            .reference = NULL,
+    };
+}
+
+FractalPixelFunction getMandelbrotPixelFunction(const FractalView* view) {
+    return view->reference != NULL ? computePerturbedMandelbrotPixels : computeMandelbrotPixels;
+}
+
+void writeMandelbrotContents(FILE* outputFilePtr, int width, int height, FractalOptions options) {
+    FractalReference reference;
+    FractalView view = createMandelbrotView(width, height, options.centerReal, options.centerImaginary, options.zoom, &reference);
+    writeFractalContents(outputFilePtr, view, getMandelbrotPixelFunction(&view), options.subdivide);
+}
+
+void writeJuliaContents(FILE* outputFilePtr, int width, int height, FractalOptions options) {
+    FractalView view = createJuliaView(width, height, options.constantReal, options.constantImaginary);
+    writeFractalContents(outputFilePtr, view, computeJuliaPixels, options.subdivide);
+}
+
+/*
+* Frames are spread evenly over the keyframes. Centers and constants move linearly between two keyframes, zooms
+* geometrically so that every frame magnifies by the same factor.
+*/
+FractalKeyframe getSweepKeyframe(const FractalOptions* options, int frameIdx) {
+    double position = options->frameCount > 1 ? (double) frameIdx * (options->keyframeCount - 1) / (options->frameCount - 1) : 0.0;
+    int keyframeIdx = (int) position;
+    if (keyframeIdx > options->keyframeCount - 2) {
+        keyframeIdx = options->keyframeCount - 2;
+    }
+    double progress = position - keyframeIdx;
+    FractalKeyframe from = options->keyframes[keyframeIdx];
+    FractalKeyframe to = options->keyframes[keyframeIdx + 1];
+    FractalKeyframe keyframe;
+    keyframe.real = from.real + (to.real - from.real) * progress;
+    keyframe.imaginary = from.imaginary + (to.imaginary - from.imaginary) * progress;
+    keyframe.zoom = from.zoom * pow(to.zoom / from.zoom, progress);
+    return keyframe;
+}
+
+void finishFractalFrame(const void* pattern) {
+    const FractalJob* job = (const FractalJob*) pattern;
+    if (job->view.reference != NULL) {
+        releaseFractalReference(job->view.reference);
+    }
+}
+
+/*
+* Renders the frames of a sweep as <input>_<pattern>_<frame>_out.ppm, or .png, numbered from 0. All frames go through one
+* stream, so its threads move on to the next frame while the last strips of one are still being written.
+*/
+void writeFractalSweep(char* inputFileName, char* pattern, int width, int height, FractalOptions options) {
+    initFractalPalette();
+    bool mandelbrot = strcmp(pattern, "mandelbrot") == 0;
+    int frameNumberLength = minFrameNumberLength;
+    for (int frameLimit = 10000; frameLimit < options.frameCount && frameNumberLength < MAX_FRAME_NUMBER_LENGTH; frameLimit *= 10) {
+        frameNumberLength++;
+    }
+
+    FractalJob* jobs = malloc((size_t) options.frameCount * sizeof(FractalJob));
+    FractalReference* references = malloc((size_t) options.frameCount * sizeof(FractalReference));
+    const void** patterns = malloc((size_t) options.frameCount * sizeof(void*));
+    char** outputFileNames = malloc((size_t) options.frameCount * sizeof(char*));
+    if (jobs == NULL || references == NULL || patterns == NULL || outputFileNames == NULL) {
+        fprintf(stderr, "Memory allocation error while setting up the sweep.");
+        exit(-1);
+    }
+    char* inputFileBaseName = substr(inputFileName, 0, strlen(inputFileName) - 4);
+    for (int frameIdx = 0; frameIdx < options.frameCount; frameIdx++) {
+        FractalKeyframe keyframe = getSweepKeyframe(&options, frameIdx);
+        if (mandelbrot) {
+            FractalView view = createMandelbrotView(width, height, keyframe.real, keyframe.imaginary, keyframe.zoom, &references[frameIdx]);
+            jobs[frameIdx] = createFractalJob(view, getMandelbrotPixelFunction(&view), options.subdivide);
+        } else {
+            FractalView view = createJuliaView(width, height, (double) keyframe.real, (double) keyframe.imaginary);
+            jobs[frameIdx] = createFractalJob(view, computeJuliaPixels, options.subdivide);
+        }
+        patterns[frameIdx] = &jobs[frameIdx];
+
+        size_t outputFileNameSize = strlen(inputFileBaseName) + strlen(pattern) + MAX_FRAME_NUMBER_LENGTH + strlen(outputFileSuffix) + strlen(getImageFormatExtension(outputFormat)) + 3;
+        outputFileNames[frameIdx] = malloc(outputFileNameSize);
+        if (outputFileNames[frameIdx] == NULL) {
+            fprintf(stderr, "Memory allocation error while setting up the sweep.");
+            exit(-1);
         }
+        int outputFileNameLength = snprintf(outputFileNames[frameIdx], outputFileNameSize, "%s_%s_%0*d%s%s", inputFileBaseName, pattern,
+                                            frameNumberLength, frameIdx, outputFileSuffix, getImageFormatExtension(outputFormat));
+        if (outputFileNameLength < 0 || (size_t) outputFileNameLength >= outputFileNameSize) {
+            fprintf(stderr, "The file name of frame %d does not fit.", frameIdx);
+            exit(-1);
+        }
+    }
+
+    streamPatternFrames(NULL, outputFileNames, options.frameCount, width, height, options.subdivide ? fractalTileSize : 0, false,
+                        patterns, computeFractalStrip, finishFractalFrame);
+
+    for (int frameIdx = 0; frameIdx < options.frameCount; frameIdx++) {
+        free(outputFileNames[frameIdx]);
     }
+    free(inputFileBaseName);
+    free(outputFileNames);
+    free(patterns);
+    free(references);
+    free(jobs);
 }
 
 int pointInsideCircle(int x, int y, int centerX, int centerY, int radius) {
@@ -318,9 +1551,10 @@ int pointInsideCircle(int x, int y, int centerX, int centerY, int radius) {
     return distance <= radius * radius;
 }
 
-void writeCheckerboardContents(FILE* outputFilePtr, int width, int height) {
+void computeCheckerboardStrip(const void* pattern, int width, PatternStrip* strip) {
+    (void) pattern;
     int squareSize = width / 10;
-    for (int y = 0; y < height; y++) {
+    for (int y = strip->firstRow; y < strip->firstRow + strip->rowCount; y++) {
         for (int x = 0; x < width; x++) {
             bool alternatingColor = ((x / squareSize) % 2 == 0) ^ ((y / squareSize) % 2 == 0);
             RGBColor color;
@@ -335,12 +1569,15 @@ void writeCheckerboardContents(FILE* outputFilePtr, int width, int height) {
                 color.green = 0;
                 color.blue = 0;
             }
-            fprintf(outputFilePtr, "%d %d %d", color.red, color.green, color.blue);
-            enforceMaxPixelsOnLine(x, outputFilePtr);
+            appendStripPixel(strip, x, color.red, color.green, color.blue);
         }
     }
 }
 
+void writeCheckerboardContents(FILE* outputFilePtr, int width, int height) {
+    streamPatternContents(outputFilePtr, width, height, 0, false, NULL, computeCheckerboardStrip);
+}
+
 double generateGaussianNoise() {
     double u1 = ((double)rand() / RAND_MAX);
     double u2 = ((double)rand() / RAND_MAX);
@@ -348,28 +1585,35 @@ double generateGaussianNoise() {
     return (z + 3.0) / 6.0;
 }
 
-void writeGaussianNoiseContents(FILE* outputFilePtr, int width, int height) {
+void computeGaussianNoiseStrip(const void* pattern, int width, PatternStrip* strip) {
+    (void) pattern;
     double intensity = 30.0;
-    for (int y = 0; y < height; y++) {
+    for (int y = strip->firstRow; y < strip->firstRow + strip->rowCount; y++) {
         for (int x = 0; x < width; x++) {
             double noise = generateGaussianNoise() * intensity;
             int color = (int)(noise * 255);
-            fprintf(outputFilePtr, "%d %d %d", color, color, color);
-            enforceMaxPixelsOnLine(x, outputFilePtr);
+            appendStripPixel(strip, x, color, color, color);
         }
     }
 }
 
+// The noise comes from one sequence of rand() calls, so its strips are computed in order.
+void writeGaussianNoiseContents(FILE* outputFilePtr, int width, int height) {
+    streamPatternContents(outputFilePtr, width, height, 0, true, NULL, computeGaussianNoiseStrip);
+}
+
 
 int main(int argc, char* argv[]) {
+    argc = readOutputFormat(argc, argv);
     checkArgs(argc, argv);
 
-    char* optionalPattern;
-    if (argc == 3) {
+    char* optionalPattern = NULL;
+    if (argc >= 3) {
         optionalPattern = argv[2];
     }
+    FractalOptions fractalOptions = readFractalOptions(argc, argv);
 
-    char inputFileContent[maxInputFileSize];
+    char inputFileContent[maxInputFileSize + 1];
     getInputFileContent(argv[1], inputFileContent);
 
     char* fileContent[3];
@@ -379,16 +1623,21 @@ int main(int argc, char* argv[]) {
     int width = convertStringToPositiveInt(fileContent[1]);
     int height = convertStringToPositiveInt(fileContent[2]);
 
+    if (fractalOptions.frameCount > 0) {
+        writeFractalSweep(argv[1], optionalPattern, width, height, fractalOptions);
+        free(fractalOptions.keyframes);
+        return 0;
+    }
+
     FILE* outputFilePtr = openOutputFile(argv[1], argv[2]);
-    writeHeader(outputFilePtr, width, height);
     if (argc == 2 || strcmp(optionalPattern, "solid") == 0) {
         writeSolidColorContents(outputFilePtr, width, height);
     } else if (strcmp(optionalPattern, "grid") == 0) {
         writeGridContents(outputFilePtr, width, height);
     } else if (strcmp(optionalPattern, "mandelbrot") == 0) {
-        writeMandelbrotContents(outputFilePtr, width, height);
+        writeMandelbrotContents(outputFilePtr, width, height, fractalOptions);
     } else if (strcmp(optionalPattern, "julia") == 0) {
-        writeJuliaContents(outputFilePtr, width, height);
+        writeJuliaContents(outputFilePtr, width, height, fractalOptions);
     } else if (strcmp(optionalPattern, "checkerboard") == 0) {
         writeCheckerboardContents(outputFilePtr, width, height);
     } else if (strcmp(optionalPattern, "gaussian") == 0) {
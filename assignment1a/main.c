@@ -2,17 +2,18 @@
 #include "output.h"
 #include "render.h"
 
-void render(FILE* outputFilePtr, Scene scene, ViewParameters viewParameters, char* argv) {
+void render(RGBColor* pixels, Scene scene, ViewParameters viewParameters, char* argv) {
     for (int y = 0; y < scene.imSize.height; y++) {
         for (int x = 0; x < scene.imSize.width; x++) {
             Ray ray = createRay(scene, viewParameters, x, y);
-            writePixel(outputFilePtr, getPixelColor(ray, scene, y, argv), x, scene.imSize.width);
+            pixels[y * scene.imSize.width + x] = getPixelColor(ray, scene, y, argv);
         }
     }
 }
 
 int main(int argc, char* argv[]) {
     checkArgs(argc, argv);
+    ImageFormat format = readImageFormat(argc, argv, 2);
 
     char*** inputFileWordsByLine = readInputFile(argv[1]);
 
@@ -53,9 +54,10 @@ int main(int argc, char* argv[]) {
     };
     setViewingWindow(scene, &viewParameters);
 
-    FILE* outputFilePtr = openOutputFile(argv[1]);
-    writeHeader(outputFilePtr, scene.imSize.width, scene.imSize.height);
-    render(outputFilePtr, scene, viewParameters, argv[1]);
+    RGBColor* pixels = allocatePixels(scene.imSize.width, scene.imSize.height);
+    render(pixels, scene, viewParameters, argv[1]);
+    writeImage(argv[1], pixels, scene.imSize.width, scene.imSize.height, format);
+    free(pixels);
 
     freeInput(scene);
     exit(0);
@@ -3,43 +3,35 @@
 
 #include "render.h"
 #include "stringhelper.h"
+#include "../common/imagewriter.h"
 
 #define MAX_INPUT_FILE_NAME_LENGTH 100
-#define OUTPUT_FILE_SUFFIX ".ppm"
-#define MAGIC_NUMBER "P3"
-#define MAX_COLOR_COMPONENT_VALUE "255"
-#define MAX_PIXELS_ON_LINE 5
 
-FILE* openOutputFile(char* inputFileName) {
+_Static_assert(sizeof(RGBColor) == 3, "Images are written as packed RGB bytes.");
+
+RGBColor* allocatePixels(int width, int height) {
+    RGBColor* pixels = (RGBColor*) malloc((size_t) width * height * sizeof(RGBColor));
+    if (pixels == NULL) {
+        fprintf(stderr, "Memory allocation failed for the image.\n");
+        exit(-1);
+    }
+    return pixels;
+}
+
+// The image is written next to the input file, e.g. example.txt becomes example.ppm or example.png.
+void writeImage(char* inputFileName, const RGBColor* pixels, int width, int height, ImageFormat format) {
     if (!endsWith(inputFileName, ".txt")) {
         fprintf(stderr, "Incorrect input file format. Input file must be a '.txt' file.");
         exit(-1);
     }
     char outputFileName[MAX_INPUT_FILE_NAME_LENGTH + 3];
     char* inputFileNameWithoutExtension = substr(inputFileName, 0, (int)strlen(inputFileName) - 4);
-    snprintf(outputFileName, sizeof(outputFileName), "%s%s", inputFileNameWithoutExtension, OUTPUT_FILE_SUFFIX);
+    snprintf(outputFileName, sizeof(outputFileName), "%s%s", inputFileNameWithoutExtension, getImageFormatExtension(format));
     free(inputFileNameWithoutExtension);
 
-    FILE* outputFilePtr;
-    outputFilePtr = fopen(outputFileName, "w");
-    return outputFilePtr;
-}
-
-void writeHeader(FILE* outputFilePtr, int width, int height) {
-    fprintf(outputFilePtr, "%s\n%d %d\n%s\n", MAGIC_NUMBER, width, height, MAX_COLOR_COMPONENT_VALUE);
-}
-
-void enforceMaxPixelsOnLine(FILE* outputFilePtr, int x, int width) {
-    if ((x % (MAX_PIXELS_ON_LINE) == (MAX_PIXELS_ON_LINE - 1)) || x == width - 1) {
-        fprintf(outputFilePtr, "\n");
-    } else {
-        fprintf(outputFilePtr, "\t");
+    if (!writeImageFile(outputFileName, (const unsigned char*) pixels, width, height, format)) {
+        exit(-1);
     }
 }
 
-void writePixel(FILE* outputFilePtr, RGBColor pixelColor, int x, int width) {
-    fprintf(outputFilePtr, "%d %d %d", pixelColor.red, pixelColor.green, pixelColor.blue);
-    enforceMaxPixelsOnLine(outputFilePtr, x, width);
-}
-
 #endif
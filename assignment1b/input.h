@@ -8,6 +8,7 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include "types.h"
+#include "../common/imagewriter.h"
 #include <math.h>
 
 #define MAX_LINE_COUNT 500
@@ -16,8 +17,8 @@
 #define KEYWORD_COUNT 13
 
 void checkArgs(int argc, char* argv[]) {
-    if (argc > 3 || argc < 2) {
-        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1b [-s:soft shadows] <path/to/input_file>`");
+    if (argc < 2 || argc > (strcmp(argv[1], "-s") == 0 ? 4 : 3)) {
+        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1b [-s:soft shadows] <path/to/input_file> [p3|p6|png]`");
         exit(-1);
     }
 //    if (strcmp(argv[0], "./raytracer1b") != 0) {
@@ -26,6 +27,16 @@ void checkArgs(int argc, char* argv[]) {
 //    }
 }
 
+// The optional argument after the input file picks the image format. P3 is the default.
+ImageFormat readImageFormat(int argc, char* argv[], int formatArgIdx) {
+    ImageFormat format = IMAGE_FORMAT_P3;
+    if (argc > formatArgIdx && !parseImageFormat(argv[formatArgIdx], &format)) {
+        fprintf(stderr, "The image format must be p3, p6 or png.\n");
+        exit(-1);
+    }
+    return format;
+}
+
 char** readLine(char* line, char** wordsInLine) {
     char* delimiters = " \t\n";
     char* token = strtok(line, delimiters);
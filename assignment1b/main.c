@@ -2,18 +2,19 @@
 #include "output.h"
 #include "render.h"
 
-void render(FILE* outputFilePtr, Scene scene, ViewParameters viewParameters) {
+void render(RGBColor* pixels, Scene scene, ViewParameters viewParameters) {
     for (int y = 0; y < scene.imSize.height; y++) {
         for (int x = 0; x < scene.imSize.width; x++) {
             Vector3 viewingWindowLocation = getViewingWindowLocation(viewParameters, x, y);
             Ray viewingRay = traceRay(scene, viewingWindowLocation);
-            writePixel(outputFilePtr, shadeRay(viewingRay, scene), x, scene.imSize.width);
+            pixels[y * scene.imSize.width + x] = shadeRay(viewingRay, scene);
         }
     }
 }
 
 int main(int argc, char* argv[]) {
     checkArgs(argc, argv);
+    ImageFormat format = readImageFormat(argc, argv, strcmp(argv[1], "-s") == 0 ? 3 : 2);
 
     // todo: check for -s in only one spot
     char*** inputFileWordsByLine = readInputFile(argv);
@@ -62,9 +63,10 @@ int main(int argc, char* argv[]) {
 
     setViewingWindow(scene, &viewParameters);
 
-    FILE* outputFilePtr = openOutputFile(strcmp(argv[1], "-s") != 0 ? argv[1] : argv[2]);
-    writeHeader(outputFilePtr, scene.imSize.width, scene.imSize.height);
-    render(outputFilePtr, scene, viewParameters);
+    RGBColor* pixels = allocatePixels(scene.imSize.width, scene.imSize.height);
+    render(pixels, scene, viewParameters);
+    writeImage(strcmp(argv[1], "-s") != 0 ? argv[1] : argv[2], pixels, scene.imSize.width, scene.imSize.height, format);
+    free(pixels);
 
     freeInput(scene);
 
@@ -2,6 +2,7 @@
 #define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_INPUT_H
 
 #include "types.h"
+#include "../common/imagewriter.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -27,8 +28,8 @@
 #define INITIAL_FACE_COUNT 10000
 
 void checkArgs(int argc, char* argv[]) {
-    if (argc > 3 || argc < 2) {
-        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1c [-s:soft shadows] <path/to/input_file>`\n");
+    if (argc < 2 || argc > (strcmp(argv[1], "-s") == 0 ? 4 : 3)) {
+        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1c [-s:soft shadows] <path/to/input_file> [p3|p6|png]`\n");
         exit(-1);
     }
     if (strcmp(argv[0], "./raytracer1c") != 0 && strcmp(argv[0], "/home/ben/github.com/fundamentals-of-computer-graphics/assignment1c/main") != 0  && strcmp(argv[0], "/Users/Z003YW4/github.com/fundamentals-of-computer-graphics/assignment1c/main") != 0) {
@@ -37,6 +38,16 @@ void checkArgs(int argc, char* argv[]) {
     }
 }
 
+// The optional argument after the input file picks the image format. P3 is the default.
+ImageFormat readImageFormat(int argc, char* argv[], int formatArgIdx) {
+    ImageFormat format = IMAGE_FORMAT_P3;
+    if (argc > formatArgIdx && !parseImageFormat(argv[formatArgIdx], &format)) {
+        fprintf(stderr, "The image format must be p3, p6 or png.\n");
+        exit(-1);
+    }
+    return format;
+}
+
 char** readLine(char* line, char** wordsInLine, int maxWordsPerLine) {
     char* delimiters = " \t\n\r";
     char* token = strtok(line, delimiters);
@@ -19,13 +19,13 @@ void progressBar(int total, int current) {
     fflush(stdout);
 }
 
-void render(FILE* outputFilePtr, Scene scene, ViewParameters viewParameters, bool parallel) {
+void render(RGBColor* pixels, Scene scene, ViewParameters viewParameters, bool parallel) {
     int i = 0;
     for (int y = 0; y < scene.imSize.height; y++) {
         for (int x = 0; x < scene.imSize.width; x++) {
             Vector3 viewingWindowLocation = getViewingWindowLocation(viewParameters, x, y);
             Ray viewingRay = traceRay(scene, viewingWindowLocation, parallel);
-            writePixel(outputFilePtr, shadeRay(viewingRay, scene), x, scene.imSize.width);
+            pixels[y * scene.imSize.width + x] = shadeRay(viewingRay, scene);
             progressBar(scene.imSize.width * scene.imSize.height, i);
             i++;
         }
@@ -35,6 +35,7 @@ void render(FILE* outputFilePtr, Scene scene, ViewParameters viewParameters, boo
 int main(int argc, char* argv[]) {
     checkArgs(argc, argv);
     bool softShadows = strcmp(argv[1], "-s") == 0;
+    ImageFormat format = readImageFormat(argc, argv, softShadows ? 3 : 2);
 
     char*** inputFileWordsByLine = readInputFile(argv, softShadows);
 
@@ -104,10 +105,11 @@ int main(int argc, char* argv[]) {
 
     setViewingWindow(scene, &viewParameters, parallel);
 
-    FILE* outputFilePtr = openOutputFile(softShadows ? argv[2] : argv[1]);
-    writeHeader(outputFilePtr, scene.imSize.width, scene.imSize.height);
+    RGBColor* pixels = allocatePixels(scene.imSize.width, scene.imSize.height);
 
-    render(outputFilePtr, scene, viewParameters, parallel);
+    render(pixels, scene, viewParameters, parallel);
+    writeImage(softShadows ? argv[2] : argv[1], pixels, scene.imSize.width, scene.imSize.height, format);
+    free(pixels);
 
     freeInput(scene);
 
@@ -0,0 +1,116 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_BATCH_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_BATCH_H
+
+#include "frame.h"
+
+/*
+* A batch renders several scenes in one process, each to the file a single render of it would write. Loading a scene
+* is a task on the same pool as the tiles, so while some scenes render the next ones are parsed on the other cores.
+* Only one scene more than there are threads is loaded at a time, and a scene is freed as soon as its image is
+* written. Textures and normal maps go through one cache keyed by their contents, so an image that several scenes
+* use, even under different paths, is read and decoded once.
+*/
+
+void loadBatchScene(void* arg);
+
+// Queues the next scene that has not been loaded yet, if any.
+void startNextBatchScene(RenderBatch* batch) {
+    pthread_mutex_lock(&batch->mutex);
+    int sceneIdx = batch->nextSceneIdx < batch->sceneCount ? batch->nextSceneIdx++ : -1;
+    pthread_mutex_unlock(&batch->mutex);
+    if (sceneIdx >= 0) {
+        submitThreadPoolTask(&batch->pool, loadBatchScene, &batch->scenes[sceneIdx]);
+    }
+}
+
+void finishBatchScene(void* arg) {
+    BatchScene* batchScene = (BatchScene*) arg;
+    RenderBatch* batch = batchScene->batch;
+    bool written = !batchScene->frame.writeFailed;
+    if (written) {
+        printf("Rendered %s to %s.\n", batchScene->inputFileName, batchScene->frame.outputFileName);
+    }
+    destroyFrameRender(&batchScene->frame);
+    freeInput(&batchScene->scene);
+    free(batchScene->tiles);
+    batchScene->tiles = NULL;
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->renderedSceneCount += written ? 1 : 0;
+    pthread_mutex_unlock(&batch->mutex);
+    startNextBatchScene(batch);
+}
+
+void loadBatchScene(void* arg) {
+    BatchScene* batchScene = (BatchScene*) arg;
+    RenderBatch* batch = batchScene->batch;
+    const RenderOptions* options = batch->options;
+
+    char*** inputFileWordsByLine = readInputFile(batchScene->inputFileName);
+    char* missingImageFileName = findMissingSceneImage(inputFileWordsByLine);
+    if (missingImageFileName != NULL) {
+        fprintf(stderr, "Skipping %s, unable to open %s.\n", batchScene->inputFileName, missingImageFileName);
+        freeInputFileWordsByLine(inputFileWordsByLine);
+        pthread_mutex_lock(&batch->mutex);
+        batch->skippedSceneCount++;
+        pthread_mutex_unlock(&batch->mutex);
+        startNextBatchScene(batch);
+        return;
+    }
+    batchScene->scene = createScene(options, &batch->textureCache);
+    loadScene(&batchScene->scene, inputFileWordsByLine, options->softShadows);
+    freeInputFileWordsByLine(inputFileWordsByLine);
+
+    ImageRegion region = getFullImageRegion(&batchScene->scene);
+    batchScene->tiles = (RenderTile*) malloc((size_t) getRegionTileCount(region) * sizeof(RenderTile));
+    if (batchScene->tiles == NULL) {
+        fprintf(stderr, "Memory allocation error while scheduling %s.\n", batchScene->inputFileName);
+        exit(-1);
+    }
+    initFrameRender(&batchScene->frame, &batchScene->scene, options, NULL, -1, region);
+    getOutputFileName(batchScene->inputFileName, -1, options->imageFormat, batchScene->frame.outputFileName);
+    batchScene->frame.frameWritten = finishBatchScene;
+    batchScene->frame.frameWrittenArg = batchScene;
+    submitFrameTiles(&batch->pool, &batchScene->frame, batchScene->tiles);
+}
+
+// Returns whether every scene was rendered and written.
+bool runRenderBatch(const RenderOptions* options) {
+    RenderBatch batch = (RenderBatch) {
+            .options = options,
+            .scenes = (BatchScene*) calloc(options->inputFileCount, sizeof(BatchScene)),
+            .sceneCount = options->inputFileCount,
+            .nextSceneIdx = 0,
+            .renderedSceneCount = 0,
+            .skippedSceneCount = 0,
+    };
+    if (batch.scenes == NULL) {
+        fprintf(stderr, "Memory allocation error while scheduling the batch.\n");
+        exit(-1);
+    }
+    for (int sceneIdx = 0; sceneIdx < batch.sceneCount; sceneIdx++) {
+        batch.scenes[sceneIdx].batch = &batch;
+        batch.scenes[sceneIdx].inputFileName = options->inputFileNames[sceneIdx];
+    }
+    pthread_mutex_init(&batch.mutex, NULL);
+    initTextureCache(&batch.textureCache);
+    int threadCount = options->threadCount > 0 ? options->threadCount : getDefaultThreadCount();
+    createThreadPool(&batch.pool, threadCount);
+    // Scenes finish in any order, so a progress bar over all of them would jump around. Each scene reports instead.
+    showProgress = false;
+
+    for (int sceneIdx = 0; sceneIdx <= threadCount; sceneIdx++) {
+        startNextBatchScene(&batch);
+    }
+    waitThreadPool(&batch.pool);
+    destroyThreadPool(&batch.pool);
+
+    printf("Rendered %d of %d scenes, %d skipped. Parsed %d distinct images, %d more loads came from the cache.\n",
+           batch.renderedSceneCount, batch.sceneCount, batch.skippedSceneCount, batch.textureCache.entryCount, batch.textureCache.hitCount);
+    freeTextureCache(&batch.textureCache);
+    pthread_mutex_destroy(&batch.mutex);
+    free(batch.scenes);
+    return batch.renderedSceneCount == batch.sceneCount;
+}
+
+#endif
@@ -0,0 +1,480 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_BVH_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_BVH_H
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "types.h"
+#include "vector.h"
+
+#define BVH_LEAF_FACE_COUNT 4
+#define BVH_MAX_LEAF_FACE_COUNT 16
+#define BVH_SAH_BIN_COUNT 16
+#define BVH_TRAVERSAL_COST 1.0f
+#define MAX_BVH_DEPTH 64 // build depth limit, which also bounds the traversal stacks
+#define BVH_REFIT_COST_LIMIT 1.5f // refitted hierarchies costing more than this times their built cost are rebuilt
+
+void growBounds(Vector3* boundsMin, Vector3* boundsMax, Vector3 point) {
+    boundsMin->x = fminf(boundsMin->x, point.x);
+    boundsMin->y = fminf(boundsMin->y, point.y);
+    boundsMin->z = fminf(boundsMin->z, point.z);
+    boundsMax->x = fmaxf(boundsMax->x, point.x);
+    boundsMax->y = fmaxf(boundsMax->y, point.y);
+    boundsMax->z = fmaxf(boundsMax->z, point.z);
+}
+
+void resetBounds(Vector3* boundsMin, Vector3* boundsMax) {
+    (*boundsMin) = (Vector3) { .x = FLT_MAX, .y = FLT_MAX, .z = FLT_MAX };
+    (*boundsMax) = (Vector3) { .x = -FLT_MAX, .y = -FLT_MAX, .z = -FLT_MAX };
+}
+
+float getSurfaceArea(Vector3 boundsMin, Vector3 boundsMax) {
+    Vector3 extent = subtract(boundsMax, boundsMin);
+    if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+float getAxis(Vector3 v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+int getBvhBin(Vector3 centroid, int axis, Vector3 centroidMin, Vector3 centroidMax) {
+    float low = getAxis(centroidMin, axis);
+    int binIdx = (int) ((getAxis(centroid, axis) - low) * ((float) BVH_SAH_BIN_COUNT / (getAxis(centroidMax, axis) - low)));
+    return binIdx < BVH_SAH_BIN_COUNT ? binIdx : BVH_SAH_BIN_COUNT - 1;
+}
+
+// Finds the cheapest binned surface area split of the node's items. Returns false when every centroid sits in the
+// same place and there is nothing to split by.
+bool findBvhSplit(const BvhBuild* build, int first, int count, Vector3 centroidMin, Vector3 centroidMax, int* bestAxis, int* bestBin, float* bestCost) {
+    (*bestCost) = FLT_MAX;
+    bool splittable = false;
+    for (int axis = 0; axis < 3; axis++) {
+        float low = getAxis(centroidMin, axis);
+        float high = getAxis(centroidMax, axis);
+        if (high <= low) {
+            continue;
+        }
+        splittable = true;
+        int binCounts[BVH_SAH_BIN_COUNT] = { 0 };
+        Vector3 binMins[BVH_SAH_BIN_COUNT];
+        Vector3 binMaxs[BVH_SAH_BIN_COUNT];
+        for (int binIdx = 0; binIdx < BVH_SAH_BIN_COUNT; binIdx++) {
+            resetBounds(&binMins[binIdx], &binMaxs[binIdx]);
+        }
+        for (int itemIdx = first; itemIdx < first + count; itemIdx++) {
+            int item = build->itemIdxs[itemIdx];
+            int binIdx = getBvhBin(build->centroids[item - build->itemOffset], axis, centroidMin, centroidMax);
+            binCounts[binIdx]++;
+            growBounds(&binMins[binIdx], &binMaxs[binIdx], build->itemMins[item - build->itemOffset]);
+            growBounds(&binMins[binIdx], &binMaxs[binIdx], build->itemMaxs[item - build->itemOffset]);
+        }
+
+        // Sweep from the right to know the cost of every right side, then from the left to combine them.
+        float rightCosts[BVH_SAH_BIN_COUNT];
+        Vector3 rightMin;
+        Vector3 rightMax;
+        resetBounds(&rightMin, &rightMax);
+        int rightCount = 0;
+        for (int binIdx = BVH_SAH_BIN_COUNT - 1; binIdx > 0; binIdx--) {
+            rightCount += binCounts[binIdx];
+            if (binCounts[binIdx] > 0) {
+                growBounds(&rightMin, &rightMax, binMins[binIdx]);
+                growBounds(&rightMin, &rightMax, binMaxs[binIdx]);
+            }
+            rightCosts[binIdx] = getSurfaceArea(rightMin, rightMax) * (float) rightCount;
+        }
+        Vector3 leftMin;
+        Vector3 leftMax;
+        resetBounds(&leftMin, &leftMax);
+        int leftCount = 0;
+        for (int binIdx = 0; binIdx < BVH_SAH_BIN_COUNT - 1; binIdx++) {
+            leftCount += binCounts[binIdx];
+            if (binCounts[binIdx] > 0) {
+                growBounds(&leftMin, &leftMax, binMins[binIdx]);
+                growBounds(&leftMin, &leftMax, binMaxs[binIdx]);
+            }
+            if (leftCount == 0 || leftCount == count) {
+                continue;
+            }
+            float cost = getSurfaceArea(leftMin, leftMax) * (float) leftCount + rightCosts[binIdx + 1];
+            if (cost < (*bestCost)) {
+                (*bestCost) = cost;
+                (*bestAxis) = axis;
+                (*bestBin) = binIdx;
+            }
+        }
+    }
+    return splittable && (*bestCost) < FLT_MAX;
+}
+
+// Items binned at or below the split bin go first. Binning the same way as findBvhSplit keeps both sides non-empty.
+int partitionBvhItems(BvhBuild* build, int first, int count, int axis, int splitBin, Vector3 centroidMin, Vector3 centroidMax) {
+    int left = first;
+    int right = first + count - 1;
+    while (left <= right) {
+        if (getBvhBin(build->centroids[build->itemIdxs[left] - build->itemOffset], axis, centroidMin, centroidMax) <= splitBin) {
+            left++;
+        } else {
+            int item = build->itemIdxs[left];
+            build->itemIdxs[left] = build->itemIdxs[right];
+            build->itemIdxs[right] = item;
+            right--;
+        }
+    }
+    return left - first;
+}
+
+void buildBvhNode(BvhBuild* build, int nodeIdx, int first, int count, int depth) {
+    BvhNode* node = &build->nodes[nodeIdx];
+    Vector3 centroidMin;
+    Vector3 centroidMax;
+    resetBounds(&node->boundsMin, &node->boundsMax);
+    resetBounds(&centroidMin, &centroidMax);
+    for (int itemIdx = first; itemIdx < first + count; itemIdx++) {
+        int item = build->itemIdxs[itemIdx];
+        growBounds(&node->boundsMin, &node->boundsMax, build->itemMins[item - build->itemOffset]);
+        growBounds(&node->boundsMin, &node->boundsMax, build->itemMaxs[item - build->itemOffset]);
+        growBounds(&centroidMin, &centroidMax, build->centroids[item - build->itemOffset]);
+    }
+    node->first = first;
+    node->count = count;
+    if (count <= build->leafSize || depth >= MAX_BVH_DEPTH - 1) {
+        return;
+    }
+
+    int axis = 0;
+    int splitBin = 0;
+    float splitCost;
+    int leftCount;
+    if (findBvhSplit(build, first, count, centroidMin, centroidMax, &axis, &splitBin, &splitCost)) {
+        float leafCost = getSurfaceArea(node->boundsMin, node->boundsMax) * (float) count;
+        splitCost += BVH_TRAVERSAL_COST * getSurfaceArea(node->boundsMin, node->boundsMax);
+        if (splitCost >= leafCost && count <= BVH_MAX_LEAF_FACE_COUNT) {
+            return;
+        }
+        leftCount = partitionBvhItems(build, first, count, axis, splitBin, centroidMin, centroidMax);
+    } else if (count <= BVH_MAX_LEAF_FACE_COUNT) {
+        return;
+    } else {
+        // Coincident centroids cannot be told apart, so the items are simply halved.
+        leftCount = count / 2;
+    }
+
+    int childIdx = build->nodeCount;
+    build->nodeCount += 2;
+    node->first = childIdx;
+    node->count = 0;
+    buildBvhNode(build, childIdx, first, leftCount, depth + 1);
+    buildBvhNode(build, childIdx + 1, first + leftCount, count - leftCount, depth + 1);
+}
+
+// Builds a hierarchy over items[first] up to items[first + count] and returns the root's node index. Nodes are
+// appended to build->nodes, which needs room for 2 * count - 1 more of them.
+int buildBvh(BvhBuild* build, int first, int count) {
+    int rootIdx = build->nodeCount;
+    build->nodeCount++;
+    buildBvhNode(build, rootIdx, first, count, 0);
+    return rootIdx;
+}
+
+// Objects are stored in face order, so the owner of a face is the last object starting at or before it. Objects
+// without faces share their start with the next object and are skipped that way.
+int getFaceObjectIdx(const Scene* scene, int faceIdx) {
+    int low = 0;
+    int high = scene->objectCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (scene->objects[middle].firstFace <= faceIdx) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+const ObjectInstance* getFaceInstance(const Scene* scene, int faceIdx) {
+    return &scene->instanceHierarchy.instances[getFaceObjectIdx(scene, faceIdx)];
+}
+
+void getFaceBounds(const Scene* scene, int faceIdx, Vector3* boundsMin, Vector3* boundsMax) {
+    const Face* face = &scene->faces[faceIdx];
+    resetBounds(boundsMin, boundsMax);
+    growBounds(boundsMin, boundsMax, scene->vertexes[face->v1 - 1]);
+    growBounds(boundsMin, boundsMax, scene->vertexes[face->v2 - 1]);
+    growBounds(boundsMin, boundsMax, scene->vertexes[face->v3 - 1]);
+}
+
+// Expected cost of a ray that reaches the root: every node's box is weighted by the chance of entering it.
+float getBvhCost(const BvhNode* nodes, int rootIdx, int nodeCount) {
+    float rootArea = getSurfaceArea(nodes[rootIdx].boundsMin, nodes[rootIdx].boundsMax);
+    if (rootArea <= 0.0f) {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (int nodeIdx = rootIdx; nodeIdx < rootIdx + nodeCount; nodeIdx++) {
+        float area = getSurfaceArea(nodes[nodeIdx].boundsMin, nodes[nodeIdx].boundsMax);
+        cost += area * (nodes[nodeIdx].count == 0 ? BVH_TRAVERSAL_COST : (float) nodes[nodeIdx].count);
+    }
+    return cost / rootArea;
+}
+
+// Builds, or rebuilds, one object's hierarchy in its own range of scene->objectNodes. Faces are never reordered,
+// only the leaf order in objectFaceIdxs, so face indexes keep meaning the same thing to exclusions, textures and
+// the rasterizer.
+void buildObjectHierarchy(Scene* scene, int objectIdx) {
+    MeshObject* object = &scene->objects[objectIdx];
+    Vector3* faceMins = (Vector3*) malloc((size_t) object->faceCount * sizeof(Vector3));
+    Vector3* faceMaxs = (Vector3*) malloc((size_t) object->faceCount * sizeof(Vector3));
+    Vector3* centroids = (Vector3*) malloc((size_t) object->faceCount * sizeof(Vector3));
+    if (faceMins == NULL || faceMaxs == NULL || centroids == NULL) {
+        fprintf(stderr, "Memory allocation error while building the object hierarchies.\n");
+        exit(-1);
+    }
+    for (int faceIdx = object->firstFace; faceIdx < object->firstFace + object->faceCount; faceIdx++) {
+        int localIdx = faceIdx - object->firstFace;
+        getFaceBounds(scene, faceIdx, &faceMins[localIdx], &faceMaxs[localIdx]);
+        centroids[localIdx] = multiply(add(faceMins[localIdx], faceMaxs[localIdx]), 0.5f);
+    }
+
+    BvhBuild build = (BvhBuild) {
+            .itemMins = faceMins,
+            .itemMaxs = faceMaxs,
+            .centroids = centroids,
+            .itemIdxs = scene->objectFaceIdxs,
+            .nodes = scene->objectNodes,
+            .nodeCount = object->rootNodeIdx,
+            .leafSize = BVH_LEAF_FACE_COUNT,
+            .itemOffset = object->firstFace,
+    };
+    buildBvh(&build, object->firstFace, object->faceCount);
+    object->nodeCount = build.nodeCount - object->rootNodeIdx;
+    object->builtCost = getBvhCost(scene->objectNodes, object->rootNodeIdx, object->nodeCount);
+
+    free(faceMins);
+    free(faceMaxs);
+    free(centroids);
+}
+
+// One bottom-level hierarchy per object, in object space. Each object owns the most nodes its faces can ever need,
+// so a rebuild after its vertexes move stays in place.
+void buildObjectHierarchies(Scene* scene) {
+    scene->objectNodes = (BvhNode*) malloc((size_t) (2 * scene->faceCount + 1) * sizeof(BvhNode));
+    scene->objectFaceIdxs = (int*) malloc((size_t) (scene->faceCount + 1) * sizeof(int));
+    if (scene->objectNodes == NULL || scene->objectFaceIdxs == NULL) {
+        fprintf(stderr, "Memory allocation error while building the object hierarchies.\n");
+        exit(-1);
+    }
+    for (int faceIdx = 0; faceIdx < scene->faceCount; faceIdx++) {
+        scene->objectFaceIdxs[faceIdx] = faceIdx;
+    }
+    int nodeBase = 0;
+    for (int objectIdx = 0; objectIdx < scene->objectCount; objectIdx++) {
+        MeshObject* object = &scene->objects[objectIdx];
+        object->rootNodeIdx = object->faceCount > 0 ? nodeBase : -1;
+        object->nodeCount = 0;
+        object->builtCost = 0.0f;
+        if (object->faceCount > 0) {
+            buildObjectHierarchy(scene, objectIdx);
+            nodeBase += 2 * object->faceCount - 1;
+        }
+    }
+    scene->objectNodeCount = nodeBase;
+}
+
+// Recomputes the object's boxes from the current vertexes without changing the tree. Children always come after
+// their parent, so one backwards pass sees every child before its parent. Returns true when the refitted tree had
+// degraded past BVH_REFIT_COST_LIMIT and was rebuilt instead.
+bool refitObjectHierarchy(Scene* scene, int objectIdx) {
+    MeshObject* object = &scene->objects[objectIdx];
+    if (object->rootNodeIdx < 0) {
+        return false;
+    }
+    for (int nodeIdx = object->rootNodeIdx + object->nodeCount - 1; nodeIdx >= object->rootNodeIdx; nodeIdx--) {
+        BvhNode* node = &scene->objectNodes[nodeIdx];
+        resetBounds(&node->boundsMin, &node->boundsMax);
+        if (node->count == 0) {
+            for (int childIdx = node->first; childIdx <= node->first + 1; childIdx++) {
+                growBounds(&node->boundsMin, &node->boundsMax, scene->objectNodes[childIdx].boundsMin);
+                growBounds(&node->boundsMin, &node->boundsMax, scene->objectNodes[childIdx].boundsMax);
+            }
+            continue;
+        }
+        for (int leafIdx = node->first; leafIdx < node->first + node->count; leafIdx++) {
+            Vector3 faceMin;
+            Vector3 faceMax;
+            getFaceBounds(scene, scene->objectFaceIdxs[leafIdx], &faceMin, &faceMax);
+            growBounds(&node->boundsMin, &node->boundsMax, faceMin);
+            growBounds(&node->boundsMin, &node->boundsMax, faceMax);
+        }
+    }
+    if (getBvhCost(scene->objectNodes, object->rootNodeIdx, object->nodeCount) > object->builtCost * BVH_REFIT_COST_LIMIT) {
+        buildObjectHierarchy(scene, objectIdx);
+        return true;
+    }
+    return false;
+}
+
+bool isIdentityTransform(const ObjectTransform* transform) {
+    return transform->translation.x == 0.0f && transform->translation.y == 0.0f && transform->translation.z == 0.0f &&
+           transform->rotationAngle == 0.0f &&
+           transform->scale.x == 1.0f && transform->scale.y == 1.0f && transform->scale.z == 1.0f;
+}
+
+// Translation, then rotation about the axis through the object's origin, then scale: objectToWorld = T * R * S.
+void setInstanceMatrices(ObjectInstance* instance, const ObjectTransform* transform) {
+    Vector3 axis = normalize(transform->rotationAxis);
+    float c = cosf(transform->rotationAngle);
+    float s = sinf(transform->rotationAngle);
+    float t = 1.0f - c;
+    float rotation[3][3] = {
+            { t * axis.x * axis.x + c, t * axis.x * axis.y - s * axis.z, t * axis.x * axis.z + s * axis.y },
+            { t * axis.x * axis.y + s * axis.z, t * axis.y * axis.y + c, t * axis.y * axis.z - s * axis.x },
+            { t * axis.x * axis.z - s * axis.y, t * axis.y * axis.z + s * axis.x, t * axis.z * axis.z + c },
+    };
+    float scale[3] = { transform->scale.x, transform->scale.y, transform->scale.z };
+    float translation[3] = { transform->translation.x, transform->translation.y, transform->translation.z };
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            instance->objectToWorld.m[row][column] = rotation[row][column] * scale[column];
+            // The inverse is S^-1 * R^T, rotations being orthonormal.
+            instance->worldToObject.m[row][column] = rotation[column][row] / scale[row];
+        }
+        instance->objectToWorld.m[row][3] = translation[row];
+    }
+    for (int row = 0; row < 3; row++) {
+        instance->worldToObject.m[row][3] = -(instance->worldToObject.m[row][0] * translation[0] +
+                                              instance->worldToObject.m[row][1] * translation[1] +
+                                              instance->worldToObject.m[row][2] * translation[2]);
+    }
+}
+
+Vector3 transformPoint(const Matrix3x4* matrix, Vector3 point) {
+    return (Vector3) {
+            .x = matrix->m[0][0] * point.x + matrix->m[0][1] * point.y + matrix->m[0][2] * point.z + matrix->m[0][3],
+            .y = matrix->m[1][0] * point.x + matrix->m[1][1] * point.y + matrix->m[1][2] * point.z + matrix->m[1][3],
+            .z = matrix->m[2][0] * point.x + matrix->m[2][1] * point.y + matrix->m[2][2] * point.z + matrix->m[2][3],
+    };
+}
+
+Vector3 transformDirection(const Matrix3x4* matrix, Vector3 direction) {
+    return (Vector3) {
+            .x = matrix->m[0][0] * direction.x + matrix->m[0][1] * direction.y + matrix->m[0][2] * direction.z,
+            .y = matrix->m[1][0] * direction.x + matrix->m[1][1] * direction.y + matrix->m[1][2] * direction.z,
+            .z = matrix->m[2][0] * direction.x + matrix->m[2][1] * direction.y + matrix->m[2][2] * direction.z,
+    };
+}
+
+// Normals go to world space with the inverse transpose, which stays correct under non-uniform scale.
+Vector3 transformNormal(const ObjectInstance* instance, Vector3 normal) {
+    const Matrix3x4* inverse = &instance->worldToObject;
+    return normalize((Vector3) {
+            .x = inverse->m[0][0] * normal.x + inverse->m[1][0] * normal.y + inverse->m[2][0] * normal.z,
+            .y = inverse->m[0][1] * normal.x + inverse->m[1][1] * normal.y + inverse->m[2][1] * normal.z,
+            .z = inverse->m[0][2] * normal.x + inverse->m[1][2] * normal.y + inverse->m[2][2] * normal.z,
+    });
+}
+
+// The direction is not renormalized, so a hit's t is the same along the object space ray and the world ray.
+Ray transformRayToObject(const ObjectInstance* instance, const Ray* ray) {
+    return (Ray) {
+            .origin = transformPoint(&instance->worldToObject, ray->origin),
+            .direction = transformDirection(&instance->worldToObject, ray->direction),
+    };
+}
+
+// Places every object with its transform, or where it was loaded when transforms is NULL, and builds the top level
+// over the world bounds of the objects that have faces. This is all a moving object costs per frame.
+void buildInstanceHierarchy(const Scene* scene, const ObjectTransform* transforms, InstanceHierarchy* hierarchy) {
+    int objectCount = scene->objectCount;
+    hierarchy->instances = (ObjectInstance*) malloc((size_t) (objectCount + 1) * sizeof(ObjectInstance));
+    hierarchy->nodes = (BvhNode*) malloc((size_t) (2 * objectCount + 1) * sizeof(BvhNode));
+    hierarchy->instanceIdxs = (int*) malloc((size_t) (objectCount + 1) * sizeof(int));
+    Vector3* instanceMins = (Vector3*) malloc((size_t) (objectCount + 1) * sizeof(Vector3));
+    Vector3* instanceMaxs = (Vector3*) malloc((size_t) (objectCount + 1) * sizeof(Vector3));
+    Vector3* centroids = (Vector3*) malloc((size_t) (objectCount + 1) * sizeof(Vector3));
+    if (hierarchy->instances == NULL || hierarchy->nodes == NULL || hierarchy->instanceIdxs == NULL ||
+        instanceMins == NULL || instanceMaxs == NULL || centroids == NULL) {
+        fprintf(stderr, "Memory allocation error while building the instance hierarchy.\n");
+        exit(-1);
+    }
+
+    int instanceCount = 0;
+    for (int objectIdx = 0; objectIdx < objectCount; objectIdx++) {
+        ObjectInstance* instance = &hierarchy->instances[objectIdx];
+        const MeshObject* object = &scene->objects[objectIdx];
+        instance->transformed = transforms != NULL && !isIdentityTransform(&transforms[objectIdx]);
+        if (instance->transformed) {
+            setInstanceMatrices(instance, &transforms[objectIdx]);
+        }
+        resetBounds(&instance->boundsMin, &instance->boundsMax);
+        if (object->rootNodeIdx < 0) {
+            continue;
+        }
+        const BvhNode* root = &scene->objectNodes[object->rootNodeIdx];
+        for (int cornerIdx = 0; cornerIdx < 8; cornerIdx++) {
+            Vector3 corner = (Vector3) {
+                    .x = (cornerIdx & 1) ? root->boundsMax.x : root->boundsMin.x,
+                    .y = (cornerIdx & 2) ? root->boundsMax.y : root->boundsMin.y,
+                    .z = (cornerIdx & 4) ? root->boundsMax.z : root->boundsMin.z,
+            };
+            growBounds(&instance->boundsMin, &instance->boundsMax, instance->transformed ? transformPoint(&instance->objectToWorld, corner) : corner);
+        }
+        instanceMins[objectIdx] = instance->boundsMin;
+        instanceMaxs[objectIdx] = instance->boundsMax;
+        centroids[objectIdx] = multiply(add(instance->boundsMin, instance->boundsMax), 0.5f);
+        hierarchy->instanceIdxs[instanceCount] = objectIdx;
+        instanceCount++;
+    }
+
+    BvhBuild build = (BvhBuild) {
+            .itemMins = instanceMins,
+            .itemMaxs = instanceMaxs,
+            .centroids = centroids,
+            .itemIdxs = hierarchy->instanceIdxs,
+            .nodes = hierarchy->nodes,
+            .nodeCount = 0,
+            .leafSize = 1,
+            .itemOffset = 0,
+    };
+    if (instanceCount > 0) {
+        buildBvh(&build, 0, instanceCount);
+    }
+    hierarchy->nodeCount = build.nodeCount;
+
+    free(instanceMins);
+    free(instanceMaxs);
+    free(centroids);
+}
+
+void freeInstanceHierarchy(InstanceHierarchy* hierarchy) {
+    free(hierarchy->instances);
+    free(hierarchy->nodes);
+    free(hierarchy->instanceIdxs);
+    hierarchy->instances = NULL;
+    hierarchy->nodes = NULL;
+    hierarchy->instanceIdxs = NULL;
+    hierarchy->nodeCount = 0;
+}
+
+// Everything a frame of vertex animation needs after writing new positions into scene->vertexes: every object is
+// refitted, the ones that degraded too far are rebuilt, and the top level is rebuilt over the new object bounds.
+// The scene's own top level is rebuilt with transforms == NULL, so it places every object where it was loaded. A
+// frame with object transforms has to build its own top level after this call, as initFrameRender does; one built
+// before it keeps the old object bounds. Camera path frames with `vertex` lines call it through moveSceneVertexes.
+// Returns how many objects were rebuilt.
+int refitSceneHierarchies(Scene* scene) {
+    int rebuiltCount = 0;
+    for (int objectIdx = 0; objectIdx < scene->objectCount; objectIdx++) {
+        rebuiltCount += refitObjectHierarchy(scene, objectIdx) ? 1 : 0;
+    }
+    freeInstanceHierarchy(&scene->instanceHierarchy);
+    buildInstanceHierarchy(scene, NULL, &scene->instanceHierarchy);
+    return rebuiltCount;
+}
+
+#endif
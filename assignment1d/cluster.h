@@ -0,0 +1,261 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_CLUSTER_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_CLUSTER_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "types.h"
+
+#define CLUSTER_FILE_MAGIC "RTCLUST2"
+#define OCTAHEDRAL_NORMAL_SCALE 32767.0f
+#define MISSING_OCTAHEDRAL_NORMAL (-32768)
+#define DEFAULT_CLUSTER_BUDGET_MEGABYTES 1024
+#define MAX_CLUSTER_HIERARCHY_DEPTH 64
+#define MAX_DECODED_CLUSTER_VERTEXES 512
+
+// Added to a cluster's refCount while it is unmapped. A ray that pins it meanwhile sees a negative count.
+#define CLUSTER_EVICTING (-(1 << 30))
+
+ClusterCache* createClusterCache(size_t budget) {
+    ClusterCache* cache = (ClusterCache*) malloc(sizeof(ClusterCache));
+    if (cache == NULL) {
+        fprintf(stderr, "Memory allocation error while creating the cluster cache.\n");
+        exit(-1);
+    }
+    (*cache) = (ClusterCache) {
+            .files = NULL,
+            .fileCount = 0,
+            .fileCapacity = 0,
+            .clusters = NULL,
+            .clusterCount = 0,
+            .clusterCapacity = 0,
+            .nodes = NULL,
+            .nodeCount = 0,
+            .triangleCount = 0,
+            .budget = budget,
+            .residentSize = 0,
+            .residentClusterIdxs = NULL,
+            .residentCount = 0,
+            .clockHand = 0,
+    };
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+// Called with the mutex held, once the cluster is claimed with CLUSTER_EVICTING.
+void unmapCluster(ClusterCache* cache, int clusterIdx) {
+    Cluster* cluster = &cache->clusters[clusterIdx];
+    atomic_store(&cluster->data, NULL);
+    munmap(cluster->mapping, cluster->mappingSize);
+    cache->residentSize -= cluster->mappingSize;
+    cluster->mapping = NULL;
+    cluster->mappingSize = 0;
+
+    int lastIdx = cache->residentClusterIdxs[--cache->residentCount];
+    cache->residentClusterIdxs[cluster->residentIdx] = lastIdx;
+    cache->clusters[lastIdx].residentIdx = cluster->residentIdx;
+    cluster->residentIdx = -1;
+}
+
+// Sweeps the clock hand at most twice around the resident clusters: once to clear what was read since its last
+// pass, and once more to unmap what still wasn't. A cluster is only unmapped when no ray holds it, so the budget can
+// be overshot while every resident cluster is in use.
+void evictClusters(ClusterCache* cache) {
+    for (int step = 0; cache->residentSize > cache->budget && cache->residentCount > 0 && step < 2 * cache->residentCount; step++) {
+        if (cache->clockHand >= cache->residentCount) {
+            cache->clockHand = 0;
+        }
+        int clusterIdx = cache->residentClusterIdxs[cache->clockHand];
+        Cluster* cluster = &cache->clusters[clusterIdx];
+        int unused = 0;
+        if (atomic_exchange(&cluster->referenced, false) || !atomic_compare_exchange_strong(&cluster->refCount, &unused, CLUSTER_EVICTING)) {
+            cache->clockHand++;
+            continue;
+        }
+        // The last resident cluster moves into this slot, so the hand stays put.
+        unmapCluster(cache, clusterIdx);
+        // Rays that pinned the cluster meanwhile keep their count and are waiting for the mutex to map it again.
+        atomic_fetch_sub(&cluster->refCount, CLUSTER_EVICTING);
+    }
+}
+
+// Pins the cluster until releaseCluster, mapping it in if needed. A resident cluster is pinned without the mutex.
+// Mappings start on a page boundary, so the cluster's data sits a little past the start of the mapping.
+const void* acquireCluster(ClusterCache* cache, int clusterIdx) {
+    Cluster* cluster = &cache->clusters[clusterIdx];
+    // Once pinned with a count that isn't negative, the cluster can't be claimed for unmapping.
+    bool evicting = atomic_fetch_add(&cluster->refCount, 1) < 0;
+    const void* data = evicting ? NULL : atomic_load(&cluster->data);
+    if (data != NULL) {
+        if (!atomic_load_explicit(&cluster->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&cluster->referenced, true, memory_order_relaxed);
+        }
+        return data;
+    }
+
+    // The pin stays held, so once another thread's unmapping is done the cluster can't be unmapped again.
+    pthread_mutex_lock(&cache->mutex);
+    data = atomic_load(&cluster->data);
+    if (data == NULL) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        long mappingOffset = cluster->info.offset - cluster->info.offset % pageSize;
+        size_t mappingSize = (size_t) (cluster->info.offset - mappingOffset) + (size_t) cluster->info.size;
+        void* mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, cache->files[cluster->fileIdx].fileDescriptor, mappingOffset);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Unable to map cluster %d of the out-of-core geometry.\n", clusterIdx);
+            exit(-1);
+        }
+        madvise(mapping, mappingSize, MADV_WILLNEED);
+        cluster->mapping = mapping;
+        cluster->mappingSize = mappingSize;
+        cluster->residentIdx = cache->residentCount;
+        cache->residentClusterIdxs[cache->residentCount++] = clusterIdx;
+        cache->residentSize += mappingSize;
+        data = (const char*) mapping + (cluster->info.offset - mappingOffset);
+        atomic_store(&cluster->data, data);
+    }
+    atomic_store_explicit(&cluster->referenced, true, memory_order_relaxed);
+    evictClusters(cache);
+    pthread_mutex_unlock(&cache->mutex);
+    return data;
+}
+
+void releaseCluster(ClusterCache* cache, int clusterIdx) {
+    atomic_fetch_sub(&cache->clusters[clusterIdx].refCount, 1);
+}
+
+// Clusters are numbered in file order, so their first triangles ascend and a binary search finds the owner.
+int findTriangleCluster(const ClusterCache* cache, int triangleIdx) {
+    int low = 0;
+    int high = cache->clusterCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (cache->clusters[middle].info.firstTriangleIdx <= triangleIdx) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+float getOctahedralSign(float value) {
+    return value >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Octahedral normal encoding (Cigolle et al. 2014): the unit sphere is projected onto an octahedron whose lower
+// half is folded over the upper one, which leaves two numbers per normal.
+void encodeOctahedralNormal(Vector3 normal, short* encoded) {
+    float length = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+    if (length == 0.0f) {
+        encoded[0] = MISSING_OCTAHEDRAL_NORMAL;
+        encoded[1] = MISSING_OCTAHEDRAL_NORMAL;
+        return;
+    }
+    float u = normal.x / length;
+    float v = normal.y / length;
+    if (normal.z < 0.0f) {
+        float foldedU = (1.0f - fabsf(v)) * getOctahedralSign(u);
+        float foldedV = (1.0f - fabsf(u)) * getOctahedralSign(v);
+        u = foldedU;
+        v = foldedV;
+    }
+    encoded[0] = (short) roundf(fmaxf(-1.0f, fminf(u, 1.0f)) * OCTAHEDRAL_NORMAL_SCALE);
+    encoded[1] = (short) roundf(fmaxf(-1.0f, fminf(v, 1.0f)) * OCTAHEDRAL_NORMAL_SCALE);
+}
+
+Vector3 decodeOctahedralNormal(const short* encoded) {
+    if (encoded[0] == MISSING_OCTAHEDRAL_NORMAL) {
+        return (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f };
+    }
+    float u = (float) encoded[0] / OCTAHEDRAL_NORMAL_SCALE;
+    float v = (float) encoded[1] / OCTAHEDRAL_NORMAL_SCALE;
+    float z = 1.0f - fabsf(u) - fabsf(v);
+    if (z < 0.0f) {
+        float unfoldedU = (1.0f - fabsf(v)) * getOctahedralSign(u);
+        float unfoldedV = (1.0f - fabsf(u)) * getOctahedralSign(v);
+        u = unfoldedU;
+        v = unfoldedV;
+    }
+    float length = sqrtf(u * u + v * v + z * z);
+    return (Vector3) { .x = u / length, .y = v / length, .z = z / length };
+}
+
+Vector3 decodeQuantizedPosition(const ClusterFile* file, const QuantizedClusterHeader* header, const QuantizedVertex* vertex) {
+    return (Vector3) {
+            .x = file->quantizationOrigin.x + (float) (header->base[0] + vertex->position[0]) * file->quantizationStep,
+            .y = file->quantizationOrigin.y + (float) (header->base[1] + vertex->position[1]) * file->quantizationStep,
+            .z = file->quantizationOrigin.z + (float) (header->base[2] + vertex->position[2]) * file->quantizationStep,
+    };
+}
+
+const MaterialRun* getQuantizedMaterialRuns(const QuantizedClusterHeader* header) {
+    return (const MaterialRun*) (header + 1);
+}
+
+const QuantizedVertex* getQuantizedVertexes(const QuantizedClusterHeader* header) {
+    return (const QuantizedVertex*) (getQuantizedMaterialRuns(header) + header->runCount);
+}
+
+const unsigned short* getQuantizedTriangles(const QuantizedClusterHeader* header) {
+    return (const unsigned short*) (getQuantizedVertexes(header) + header->vertexCount);
+}
+
+ClusterTriangle decodeQuantizedTriangle(const ClusterFile* file, const QuantizedClusterHeader* header, int triangleIdx) {
+    const QuantizedVertex* vertexes = getQuantizedVertexes(header);
+    const unsigned short* indexes = &getQuantizedTriangles(header)[triangleIdx * 3];
+    const MaterialRun* runs = getQuantizedMaterialRuns(header);
+    int runIdx = 0;
+    int runEnd = runs[0].triangleCount;
+    while (triangleIdx >= runEnd) {
+        runIdx++;
+        runEnd += runs[runIdx].triangleCount;
+    }
+    return (ClusterTriangle) {
+            .v1 = decodeQuantizedPosition(file, header, &vertexes[indexes[0]]),
+            .v2 = decodeQuantizedPosition(file, header, &vertexes[indexes[1]]),
+            .v3 = decodeQuantizedPosition(file, header, &vertexes[indexes[2]]),
+            .n1 = decodeOctahedralNormal(vertexes[indexes[0]].normal),
+            .n2 = decodeOctahedralNormal(vertexes[indexes[1]].normal),
+            .n3 = decodeOctahedralNormal(vertexes[indexes[2]].normal),
+            .mtlColorIdx = runs[runIdx].mtlColorIdx,
+    };
+}
+
+// Copies one triangle out of its cluster, with the material resolved to a scene mtlcolor.
+ClusterTriangle readClusterTriangle(ClusterCache* cache, int triangleIdx) {
+    int clusterIdx = findTriangleCluster(cache, triangleIdx);
+    const Cluster* cluster = &cache->clusters[clusterIdx];
+    const ClusterFile* file = &cache->files[cluster->fileIdx];
+    const void* data = acquireCluster(cache, clusterIdx);
+    int localIdx = triangleIdx - cluster->info.firstTriangleIdx;
+    ClusterTriangle triangle = file->quantized ? decodeQuantizedTriangle(file, (const QuantizedClusterHeader*) data, localIdx) : ((const ClusterTriangle*) data)[localIdx];
+    releaseCluster(cache, clusterIdx);
+    triangle.mtlColorIdx = triangle.mtlColorIdx < 0 ? file->defaultMtlColorIdx : file->mtlColorBase + triangle.mtlColorIdx;
+    return triangle;
+}
+
+void freeClusterCache(ClusterCache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (int clusterIdx = 0; clusterIdx < cache->clusterCount; clusterIdx++) {
+        if (cache->clusters[clusterIdx].mapping != NULL) {
+            munmap(cache->clusters[clusterIdx].mapping, cache->clusters[clusterIdx].mappingSize);
+        }
+    }
+    for (int fileIdx = 0; fileIdx < cache->fileCount; fileIdx++) {
+        close(cache->files[fileIdx].fileDescriptor);
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->residentClusterIdxs);
+    free(cache->clusters);
+    free(cache->nodes);
+    free(cache->files);
+    free(cache);
+}
+
+#endif
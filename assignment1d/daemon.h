@@ -0,0 +1,570 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_DAEMON_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_DAEMON_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "frame.h"
+
+#define DAEMON_MAX_LINE_LENGTH (MAX_OUTPUT_FILE_NAME_LENGTH + 64)
+#define DAEMON_MAX_WORDS 8
+#define DAEMON_SOCKET_BACKLOG 16
+// Admission control: jobs past either limit are rejected instead of queued, so a client can not queue more work
+// than the daemon could finish in reasonable time. A single job is always admitted when nothing is queued.
+#define DAEMON_MAX_QUEUED_JOBS 32
+#define DAEMON_MAX_QUEUED_PIXELS ((size_t) 1 << 26)
+
+#define DAEMON_SETTING_EYE 1
+#define DAEMON_SETTING_VIEWDIR 2
+#define DAEMON_SETTING_UPDIR 4
+#define DAEMON_SETTING_FOV 8
+#define DAEMON_SETTING_REGION 16
+#define DAEMON_SETTING_FORMAT 32
+#define DAEMON_SETTING_OUTPUT 64
+#define DAEMON_SETTING_COUNT 7
+
+/*
+* A daemon loads the scene once and renders jobs for as long as it runs. Clients send lines, either over stdin or a
+* Unix socket, each connection on its own thread:
+*
+*     eye x y z, viewdir x y z, updir x y z, hfov degrees, vfov degrees   override the scene's camera
+*     region x y width height                                           render only part of the image
+*     format p3|p6|png                                                  override -f
+*     output path/to/image                                              where to write the image, required
+*     render                                                            queue a job with the lines above
+*     reset                                                             drop the lines sent since the last job
+*     status                                                            reply with the queued jobs and pixels
+*     shutdown                                                          finish the queued jobs and exit
+*
+* Every job starts from the scene's camera and the whole image, the overrides only apply to the next `render`. The
+* daemon replies `queued <job>` and later `done <job> <path>`, or `error <job> ...` if the image could not be
+* written. It replies `rejected <reason>` when the queue is full, and `error <reason>` for lines it can not read. A
+* setting whose line could not be read blocks `render` until it is sent again or the client sends `reset`, so no job
+* is ever rendered with settings other than the ones the client asked for. Tiles of all jobs share one thread pool,
+* in the order they were queued.
+*/
+
+// Replies are single lines. A client that went away simply misses them.
+void sendDaemonReply(DaemonClient* client, const char* format, ...) {
+    char reply[DAEMON_MAX_LINE_LENGTH + 64];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(reply, sizeof(reply) - 1, format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+        return;
+    }
+    if (length > (int) sizeof(reply) - 2) {
+        length = (int) sizeof(reply) - 2;
+    }
+    reply[length++] = '\n';
+
+    pthread_mutex_lock(&client->mutex);
+    for (int written = 0; written < length;) {
+        ssize_t count = write(client->outputFd, &reply[written], (size_t) (length - written));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        written += (int) count;
+    }
+    pthread_mutex_unlock(&client->mutex);
+}
+
+DaemonClient* createDaemonClient(RenderDaemon* daemon, int inputFd, int outputFd, bool ownsFds) {
+    DaemonClient* client = (DaemonClient*) malloc(sizeof(DaemonClient));
+    if (client == NULL) {
+        fprintf(stderr, "Memory allocation error while accepting a daemon client.\n");
+        exit(-1);
+    }
+    (*client) = (DaemonClient) {
+            .daemon = daemon,
+            .inputFd = inputFd,
+            .outputFd = outputFd,
+            .ownsFds = ownsFds,
+            .referenceCount = 1,
+            .next = NULL,
+    };
+    pthread_mutex_init(&client->mutex, NULL);
+
+    pthread_mutex_lock(&daemon->mutex);
+    client->next = daemon->clients;
+    daemon->clients = client;
+    daemon->clientCount++;
+    // A client that connected while the daemon was being stopped is not read from.
+    if (daemon->stopping && ownsFds) {
+        shutdown(inputFd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&daemon->mutex);
+    return client;
+}
+
+void retainDaemonClient(DaemonClient* client) {
+    pthread_mutex_lock(&client->mutex);
+    client->referenceCount++;
+    pthread_mutex_unlock(&client->mutex);
+}
+
+void releaseDaemonClient(DaemonClient* client) {
+    pthread_mutex_lock(&client->mutex);
+    bool lastReference = --client->referenceCount == 0;
+    pthread_mutex_unlock(&client->mutex);
+    if (!lastReference) {
+        return;
+    }
+    if (client->ownsFds) {
+        close(client->inputFd);
+    }
+    pthread_mutex_destroy(&client->mutex);
+    free(client);
+}
+
+// Called by the thread that finished reading from the client. Its queued jobs still hold it until they reply.
+void disconnectDaemonClient(DaemonClient* client) {
+    RenderDaemon* daemon = client->daemon;
+    pthread_mutex_lock(&daemon->mutex);
+    for (DaemonClient** link = &daemon->clients; (*link) != NULL; link = &(*link)->next) {
+        if ((*link) == client) {
+            (*link) = client->next;
+            break;
+        }
+    }
+    daemon->clientCount--;
+    pthread_cond_broadcast(&daemon->clientsFinished);
+    pthread_mutex_unlock(&daemon->mutex);
+    releaseDaemonClient(client);
+}
+
+void resetDaemonJobRequest(const RenderDaemon* daemon, DaemonJobRequest* request) {
+    request->camera = (CameraKeyframe) {
+            .eye = daemon->scene->eye,
+            .viewDir = daemon->scene->viewDir,
+            .upDir = daemon->scene->upDir,
+            .fov = daemon->scene->fov,
+            .objectTransforms = NULL,
+    };
+    request->region = getFullImageRegion(daemon->scene);
+    request->imageFormat = daemon->options->imageFormat;
+    request->outputFileName[0] = '\0';
+    request->invalidSettings = 0;
+}
+
+// Remembers whether a setting's last line was read, so `render` can refuse a job that would ignore it.
+void setDaemonSettingValid(DaemonJobRequest* request, int setting, bool valid) {
+    if (valid) {
+        request->invalidSettings &= ~setting;
+    } else {
+        request->invalidSettings |= setting;
+    }
+}
+
+// Lists the invalid settings' keywords, separated by spaces.
+void getInvalidDaemonSettingNames(const DaemonJobRequest* request, char* names, size_t size) {
+    const char* settingNames[DAEMON_SETTING_COUNT] = {"eye", "viewdir", "updir", "fov", "region", "format", "output"};
+    size_t length = 0;
+    names[0] = '\0';
+    for (int settingIdx = 0; settingIdx < DAEMON_SETTING_COUNT; settingIdx++) {
+        if ((request->invalidSettings & (1 << settingIdx)) != 0 && length < size) {
+            length += (size_t) snprintf(&names[length], size - length, "%s%s", length > 0 ? " " : "", settingNames[settingIdx]);
+        }
+    }
+}
+
+bool parseDaemonFloats(char** words, int count, float* values) {
+    for (int valueIdx = 0; valueIdx < count; valueIdx++) {
+        char* end;
+        if (words[valueIdx + 1] == NULL) {
+            return false;
+        }
+        values[valueIdx] = strtof(words[valueIdx + 1], &end);
+        if (end == words[valueIdx + 1] || *end != '\0' || !isfinite(values[valueIdx])) {
+            return false;
+        }
+    }
+    return words[count + 1] == NULL;
+}
+
+bool parseDaemonVector(char** words, Vector3* vector) {
+    float values[3];
+    if (!parseDaemonFloats(words, 3, values)) {
+        return false;
+    }
+    (*vector) = (Vector3) { .x = values[0], .y = values[1], .z = values[2] };
+    return true;
+}
+
+// The image is only written once the job is done, so an output path that can not be written is caught up front.
+bool isDaemonOutputWritable(char* outputFileName) {
+    if (access(outputFileName, F_OK) == 0) {
+        return access(outputFileName, W_OK) == 0;
+    }
+    char directoryName[MAX_OUTPUT_FILE_NAME_LENGTH];
+    char* directoryEnd = strrchr(outputFileName, '/');
+    if (directoryEnd == NULL) {
+        return access(".", W_OK) == 0;
+    }
+    snprintf(directoryName, sizeof(directoryName), "%.*s", directoryEnd == outputFileName ? 1 : (int) (directoryEnd - outputFileName), outputFileName);
+    return access(directoryName, W_OK) == 0;
+}
+
+void finishDaemonJob(void* arg) {
+    DaemonJob* job = (DaemonJob*) arg;
+    RenderDaemon* daemon = job->daemon;
+    size_t pixelCount = job->pixelCount;
+    if (job->frame.writeFailed) {
+        sendDaemonReply(job->client, "error %d %s could not be written", job->jobId, job->frame.outputFileName);
+    } else {
+        sendDaemonReply(job->client, "done %d %s", job->jobId, job->frame.outputFileName);
+    }
+    releaseDaemonClient(job->client);
+    destroyFrameRender(&job->frame);
+    free(job->tiles);
+    free(job);
+
+    pthread_mutex_lock(&daemon->mutex);
+    daemon->queuedJobCount--;
+    daemon->queuedPixelCount -= pixelCount;
+    pthread_cond_broadcast(&daemon->jobsFinished);
+    pthread_mutex_unlock(&daemon->mutex);
+}
+
+void submitDaemonJob(RenderDaemon* daemon, DaemonClient* client, DaemonJobRequest* request) {
+    if (request->invalidSettings != 0) {
+        char names[64];
+        getInvalidDaemonSettingNames(request, names, sizeof(names));
+        sendDaemonReply(client, "error render needs valid %s first, or reset", names);
+        return;
+    }
+    if (request->outputFileName[0] == '\0') {
+        sendDaemonReply(client, "error render needs an output path first");
+        return;
+    }
+    if (magnitude(request->camera.viewDir) == 0.0f || magnitude(cross(request->camera.viewDir, request->camera.upDir)) == 0.0f) {
+        sendDaemonReply(client, "error viewdir must be nonzero and not parallel to updir");
+        return;
+    }
+    if (!isDaemonOutputWritable(request->outputFileName)) {
+        sendDaemonReply(client, "error %s can not be written", request->outputFileName);
+        return;
+    }
+
+    ImageRegion region = request->region;
+    size_t pixelCount = (size_t) (region.x1 - region.x0) * (size_t) (region.y1 - region.y0);
+    pthread_mutex_lock(&daemon->mutex);
+    if (daemon->stopping) {
+        pthread_mutex_unlock(&daemon->mutex);
+        sendDaemonReply(client, "rejected the daemon is shutting down");
+        return;
+    }
+    if (daemon->queuedJobCount >= DAEMON_MAX_QUEUED_JOBS) {
+        pthread_mutex_unlock(&daemon->mutex);
+        sendDaemonReply(client, "rejected %d jobs are already queued", DAEMON_MAX_QUEUED_JOBS);
+        return;
+    }
+    if (daemon->queuedJobCount > 0 && daemon->queuedPixelCount + pixelCount > DAEMON_MAX_QUEUED_PIXELS) {
+        size_t queuedPixelCount = daemon->queuedPixelCount;
+        pthread_mutex_unlock(&daemon->mutex);
+        sendDaemonReply(client, "rejected %zu pixels are already queued", queuedPixelCount);
+        return;
+    }
+    int jobId = daemon->nextJobId++;
+    daemon->queuedJobCount++;
+    daemon->queuedPixelCount += pixelCount;
+    pthread_mutex_unlock(&daemon->mutex);
+
+    DaemonJob* job = (DaemonJob*) malloc(sizeof(DaemonJob));
+    RenderTile* tiles = (RenderTile*) malloc((size_t) getRegionTileCount(region) * sizeof(RenderTile));
+    if (job == NULL || tiles == NULL) {
+        fprintf(stderr, "Memory allocation error while queueing a daemon job.\n");
+        exit(-1);
+    }
+    job->daemon = daemon;
+    job->client = client;
+    job->jobId = jobId;
+    job->pixelCount = pixelCount;
+    job->options = (*daemon->options);
+    job->options.imageFormat = request->imageFormat;
+    job->tiles = tiles;
+    initFrameRender(&job->frame, daemon->scene, &job->options, &request->camera, -1, region);
+    snprintf(job->frame.outputFileName, MAX_OUTPUT_FILE_NAME_LENGTH, "%s", request->outputFileName);
+    job->frame.frameWritten = finishDaemonJob;
+    job->frame.frameWrittenArg = job;
+    retainDaemonClient(client);
+
+    // The reply goes out before any tile can finish, so `queued` always comes before `done`.
+    sendDaemonReply(client, "queued %d", jobId);
+    submitFrameTiles(&daemon->pool, &job->frame, tiles);
+}
+
+void stopRenderDaemon(RenderDaemon* daemon) {
+    pthread_mutex_lock(&daemon->mutex);
+    daemon->stopping = true;
+    // Unblocks accept and every client's read, so their threads see that the daemon is stopping.
+    if (daemon->listenFd >= 0) {
+        shutdown(daemon->listenFd, SHUT_RDWR);
+    }
+    for (DaemonClient* client = daemon->clients; client != NULL; client = client->next) {
+        if (client->ownsFds) {
+            shutdown(client->inputFd, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&daemon->mutex);
+}
+
+// Returns false once the client asked the daemon to shut down.
+bool readDaemonLine(RenderDaemon* daemon, DaemonClient* client, DaemonJobRequest* request, char* line) {
+    char* words[DAEMON_MAX_WORDS + 1];
+    int wordCount = 0;
+    char* savePtr;
+    for (char* word = strtok_r(line, " \t\r\n", &savePtr); word != NULL; word = strtok_r(NULL, " \t\r\n", &savePtr)) {
+        if (wordCount == DAEMON_MAX_WORDS) {
+            sendDaemonReply(client, "error a line can have at most %d words", DAEMON_MAX_WORDS);
+            return true;
+        }
+        words[wordCount++] = word;
+    }
+    words[wordCount] = NULL;
+    if (wordCount == 0 || words[0][0] == '#') {
+        return true;
+    }
+
+    float values[4];
+    if (strcmp(words[0], "eye") == 0) {
+        bool valid = parseDaemonVector(words, &request->camera.eye);
+        setDaemonSettingValid(request, DAEMON_SETTING_EYE, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error eye takes 3 numbers");
+        }
+    } else if (strcmp(words[0], "viewdir") == 0) {
+        bool valid = parseDaemonVector(words, &request->camera.viewDir);
+        setDaemonSettingValid(request, DAEMON_SETTING_VIEWDIR, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error viewdir takes 3 numbers");
+        }
+    } else if (strcmp(words[0], "updir") == 0) {
+        bool valid = parseDaemonVector(words, &request->camera.upDir);
+        setDaemonSettingValid(request, DAEMON_SETTING_UPDIR, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error updir takes 3 numbers");
+        }
+    } else if (strcmp(words[0], "hfov") == 0 || strcmp(words[0], "vfov") == 0) {
+        bool valid = parseDaemonFloats(words, 1, values) && values[0] > 0.0f && values[0] < 180.0f;
+        setDaemonSettingValid(request, DAEMON_SETTING_FOV, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error %s takes an angle between 0 and 180 degrees", words[0]);
+        } else if (words[0][0] == 'h') {
+            request->camera.fov.h = values[0] * (float) M_PI / 180.0f; // convert to radians
+        } else {
+            request->camera.fov.v = values[0] * (float) M_PI / 180.0f; // convert to radians
+            request->camera.fov.h = 0.0f; // hfov wins when both are set, like in camera paths
+        }
+    } else if (strcmp(words[0], "region") == 0) {
+        int width = daemon->scene->imSize.width;
+        int height = daemon->scene->imSize.height;
+        bool valid = parseDaemonFloats(words, 4, values) && values[0] == floorf(values[0]) && values[1] == floorf(values[1]) &&
+            values[2] == floorf(values[2]) && values[3] == floorf(values[3]) && values[0] >= 0.0f && values[1] >= 0.0f &&
+            values[2] >= 1.0f && values[3] >= 1.0f && values[0] + values[2] <= (float) width && values[1] + values[3] <= (float) height;
+        setDaemonSettingValid(request, DAEMON_SETTING_REGION, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error region takes x y width height inside the %dx%d image", width, height);
+        } else {
+            request->region = (ImageRegion) {
+                    .x0 = (int) values[0],
+                    .y0 = (int) values[1],
+                    .x1 = (int) (values[0] + values[2]),
+                    .y1 = (int) (values[1] + values[3]),
+            };
+        }
+    } else if (strcmp(words[0], "format") == 0) {
+        bool valid = wordCount == 2 && parseImageFormat(words[1], &request->imageFormat);
+        setDaemonSettingValid(request, DAEMON_SETTING_FORMAT, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error format is p3, p6 or png");
+        }
+    } else if (strcmp(words[0], "output") == 0) {
+        bool valid = wordCount == 2 && strlen(words[1]) < MAX_OUTPUT_FILE_NAME_LENGTH;
+        setDaemonSettingValid(request, DAEMON_SETTING_OUTPUT, valid);
+        if (!valid) {
+            sendDaemonReply(client, "error output takes one path without spaces");
+        } else {
+            snprintf(request->outputFileName, MAX_OUTPUT_FILE_NAME_LENGTH, "%s", words[1]);
+        }
+    } else if (strcmp(words[0], "render") == 0) {
+        submitDaemonJob(daemon, client, request);
+        // A request with invalid settings is kept, so the client only has to send those again.
+        if (request->invalidSettings == 0) {
+            resetDaemonJobRequest(daemon, request);
+        }
+    } else if (strcmp(words[0], "reset") == 0) {
+        resetDaemonJobRequest(daemon, request);
+    } else if (strcmp(words[0], "status") == 0) {
+        pthread_mutex_lock(&daemon->mutex);
+        int queuedJobCount = daemon->queuedJobCount;
+        size_t queuedPixelCount = daemon->queuedPixelCount;
+        pthread_mutex_unlock(&daemon->mutex);
+        sendDaemonReply(client, "status %d jobs %zu pixels", queuedJobCount, queuedPixelCount);
+    } else if (strcmp(words[0], "shutdown") == 0) {
+        return false;
+    } else {
+        sendDaemonReply(client, "error unknown command %s", words[0]);
+    }
+    return true;
+}
+
+// Reads the client's lines until it disconnects or asks for a shutdown. Returns whether it asked for one.
+bool serveDaemonClient(DaemonClient* client) {
+    RenderDaemon* daemon = client->daemon;
+    int inputFd = dup(client->inputFd);
+    FILE* input = inputFd >= 0 ? fdopen(inputFd, "r") : NULL;
+    if (input == NULL) {
+        fprintf(stderr, "Unable to read from a daemon client.\n");
+        exit(-1);
+    }
+    DaemonJobRequest request;
+    resetDaemonJobRequest(daemon, &request);
+
+    char line[DAEMON_MAX_LINE_LENGTH];
+    bool shutdownRequested = false;
+    while (!shutdownRequested && fgets(line, sizeof(line), input) != NULL) {
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            int c;
+            while ((c = fgetc(input)) != EOF && c != '\n') {
+            }
+            sendDaemonReply(client, "error lines can be at most %d characters long", DAEMON_MAX_LINE_LENGTH - 2);
+            continue;
+        }
+        shutdownRequested = !readDaemonLine(daemon, client, &request, line);
+    }
+    fclose(input);
+    return shutdownRequested;
+}
+
+void* runDaemonClientThread(void* arg) {
+    DaemonClient* client = (DaemonClient*) arg;
+    if (serveDaemonClient(client)) {
+        sendDaemonReply(client, "shutting down");
+        stopRenderDaemon(client->daemon);
+    }
+    disconnectDaemonClient(client);
+    return NULL;
+}
+
+int openDaemonSocket(char* socketName) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketName) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The daemon socket path %s is too long.\n", socketName);
+        exit(-1);
+    }
+    strcpy(address.sun_path, socketName);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        fprintf(stderr, "Unable to create the daemon socket.\n");
+        exit(-1);
+    }
+    // A socket left behind by a daemon that did not shut down is replaced, one that still answers is not.
+    struct stat socketStat;
+    if (stat(socketName, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+        if (connect(listenFd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+            fprintf(stderr, "Another daemon is already listening on %s.\n", socketName);
+            exit(-1);
+        }
+        unlink(socketName);
+        close(listenFd);
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listenFd, DAEMON_SOCKET_BACKLOG) != 0) {
+        fprintf(stderr, "Unable to listen on the daemon socket %s.\n", socketName);
+        exit(-1);
+    }
+    return listenFd;
+}
+
+// Serves jobs for the already loaded scene until a client sends `shutdown`, or stdin ends when reading from it.
+void runRenderDaemon(Scene* scene, const RenderOptions* options) {
+    RenderDaemon daemon = (RenderDaemon) {
+            .scene = scene,
+            .options = options,
+            .listenFd = -1,
+            .clients = NULL,
+            .clientCount = 0,
+            .queuedJobCount = 0,
+            .queuedPixelCount = 0,
+            .nextJobId = 1,
+            .stopping = false,
+    };
+    pthread_mutex_init(&daemon.mutex, NULL);
+    pthread_cond_init(&daemon.jobsFinished, NULL);
+    pthread_cond_init(&daemon.clientsFinished, NULL);
+    createThreadPool(&daemon.pool, options->threadCount > 0 ? options->threadCount : getDefaultThreadCount());
+    // Replies to clients that went away must not kill the daemon, and stdout carries replies instead of progress.
+    signal(SIGPIPE, SIG_IGN);
+    showProgress = false;
+
+    bool readStdin = strcmp(options->daemonSocketName, "-") == 0;
+    if (readStdin) {
+        DaemonClient* client = createDaemonClient(&daemon, STDIN_FILENO, STDOUT_FILENO, false);
+        if (serveDaemonClient(client)) {
+            sendDaemonReply(client, "shutting down");
+        }
+        stopRenderDaemon(&daemon);
+        disconnectDaemonClient(client);
+    } else {
+        daemon.listenFd = openDaemonSocket(options->daemonSocketName);
+        fprintf(stderr, "Listening on %s.\n", options->daemonSocketName);
+        while (true) {
+            int clientFd = accept(daemon.listenFd, NULL, NULL);
+            pthread_mutex_lock(&daemon.mutex);
+            bool stopping = daemon.stopping;
+            pthread_mutex_unlock(&daemon.mutex);
+            if (stopping) {
+                if (clientFd >= 0) {
+                    close(clientFd);
+                }
+                break;
+            }
+            if (clientFd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                fprintf(stderr, "Unable to accept a daemon client.\n");
+                exit(-1);
+            }
+            DaemonClient* client = createDaemonClient(&daemon, clientFd, clientFd, true);
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, runDaemonClientThread, client) != 0) {
+                fprintf(stderr, "Unable to start a daemon client thread.\n");
+                exit(-1);
+            }
+            pthread_detach(thread);
+        }
+    }
+
+    pthread_mutex_lock(&daemon.mutex);
+    while (daemon.clientCount > 0) {
+        pthread_cond_wait(&daemon.clientsFinished, &daemon.mutex);
+    }
+    while (daemon.queuedJobCount > 0) {
+        pthread_cond_wait(&daemon.jobsFinished, &daemon.mutex);
+    }
+    pthread_mutex_unlock(&daemon.mutex);
+
+    destroyThreadPool(&daemon.pool);
+    if (daemon.listenFd >= 0) {
+        close(daemon.listenFd);
+        unlink(options->daemonSocketName);
+    }
+    pthread_mutex_destroy(&daemon.mutex);
+    pthread_cond_destroy(&daemon.jobsFinished);
+    pthread_cond_destroy(&daemon.clientsFinished);
+}
+
+#endif
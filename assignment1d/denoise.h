@@ -0,0 +1,93 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_DENOISE_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_DENOISE_H
+
+#include "types.h"
+#include "vector.h"
+
+#define DENOISE_ITERATION_COUNT 5
+#define DENOISE_NORMAL_EXPONENT 64.0f
+#define DENOISE_DEPTH_SIGMA 0.02f // relative to the pixel's own depth, per pixel of filter step
+#define DENOISE_ALBEDO_SIGMA 0.1f
+#define DENOISE_COLOR_SIGMA 0.5f
+
+float getLuminance(Vector3 color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+float getSquaredDistance(Vector3 v1, Vector3 v2) {
+    Vector3 difference = subtract(v1, v2);
+    return dot(difference, difference);
+}
+
+// Edge-stopping weight between two pixels. Geometry edges come from the normal and depth buffers, texture
+// edges from the albedo buffer. The color term lets real lighting detail such as hard shadow borders survive.
+float getDenoiseWeight(const PixelFeatures* p, const PixelFeatures* q, Vector3 pColor, Vector3 qColor, int step, float colorSigma) {
+    float normalWeight = powf(max(dot(p->normal, q->normal), 0.0f), DENOISE_NORMAL_EXPONENT);
+    float depthWeight = expf(-fabsf(p->depth - q->depth) / (DENOISE_DEPTH_SIGMA * p->depth * (float) step + 1e-4f));
+    float albedoWeight = expf(-getSquaredDistance(p->albedo, q->albedo) / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA));
+    float colorWeight = expf(-fabsf(getLuminance(pColor) - getLuminance(qColor)) / colorSigma);
+    return normalWeight * depthWeight * albedoWeight * colorWeight;
+}
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010): a 5x5 B3-spline kernel applied with holes
+// that double every iteration, so five passes cover a 61x61 footprint. Pixels that missed the scene are
+// left alone and never used as neighbors.
+void denoiseFrame(Vector3* colors, const PixelFeatures* features, int width, int height) {
+    const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    Vector3* scratch = (Vector3*) malloc((size_t) width * (size_t) height * sizeof(Vector3));
+    if (scratch == NULL) {
+        fprintf(stderr, "Memory allocation error while denoising.\n");
+        exit(-1);
+    }
+
+    Vector3* input = colors;
+    Vector3* output = scratch;
+    for (int iteration = 0; iteration < DENOISE_ITERATION_COUNT; iteration++) {
+        int step = 1 << iteration;
+        float colorSigma = DENOISE_COLOR_SIGMA / (float) step;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int pixelIdx = y * width + x;
+                const PixelFeatures* p = &features[pixelIdx];
+                if (!p->hit) {
+                    output[pixelIdx] = input[pixelIdx];
+                    continue;
+                }
+
+                Vector3 colorSum = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f };
+                float weightSum = 0.0f;
+                for (int dy = -2; dy <= 2; dy++) {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height) {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width) {
+                            continue;
+                        }
+                        int neighborIdx = qy * width + qx;
+                        const PixelFeatures* q = &features[neighborIdx];
+                        if (!q->hit) {
+                            continue;
+                        }
+                        float weight = kernel[abs(dx)] * kernel[abs(dy)] * getDenoiseWeight(p, q, input[pixelIdx], input[neighborIdx], step, colorSigma);
+                        colorSum = add(colorSum, multiply(input[neighborIdx], weight));
+                        weightSum += weight;
+                    }
+                }
+                output[pixelIdx] = weightSum > 0.0f ? divide(colorSum, weightSum) : input[pixelIdx];
+            }
+        }
+        Vector3* swap = input;
+        input = output;
+        output = swap;
+    }
+
+    if (input != colors) {
+        memcpy(colors, input, (size_t) width * (size_t) height * sizeof(Vector3));
+    }
+    free(scratch);
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_FRAME_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_FRAME_H
+
+#include "output.h"
+#include "render.h"
+#include "denoise.h"
+#include "raster.h"
+#include "threadpool.h"
+
+void progressBar(int total, int current) {
+    const int barLength = 50;
+    float progress = (float) current / (float) total;
+    int barProgress = (int) (progress * (float) barLength);
+
+    printf("[");
+    for (int i = 0; i < barLength; ++i) {
+        if (i < barProgress) {
+            printf("=");
+        } else {
+            printf(" ");
+        }
+    }
+    printf("] %.2f%%\r", progress * 100);
+    fflush(stdout);
+}
+
+#define RENDER_TILE_SIZE 16
+
+atomic_int renderedTileCount = 0;
+int totalTileCount = 0;
+bool showProgress = true; // off when stdout carries something else, like daemon replies
+pthread_mutex_t progressMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void freeFrameBuffers(FrameRender* frame) {
+    if (frame->triangleBinsReady) {
+        freeTriangleBins(&frame->triangleBins);
+        frame->triangleBinsReady = false;
+    }
+    free(frame->pixels);
+    free(frame->colors);
+    free(frame->features);
+    frame->pixels = NULL;
+    frame->colors = NULL;
+    frame->features = NULL;
+}
+
+void renderTile(void* arg) {
+    RenderTile* tile = (RenderTile*) arg;
+    FrameRender* frame = tile->frame;
+    Scene* scene = &frame->scene;
+
+    // Frames are allocated by their first tile and freed once written, so a long camera path only holds
+    // the frames that are currently being rendered.
+    int regionWidth = frame->region.x1 - frame->region.x0;
+    int regionHeight = frame->region.y1 - frame->region.y0;
+    size_t pixelCount = (size_t) regionWidth * (size_t) regionHeight;
+    pthread_mutex_lock(&frame->pixelsMutex);
+    if (frame->pixels == NULL) {
+        frame->pixels = (RGBColor*) malloc(pixelCount * sizeof(RGBColor));
+        if (frame->options->denoise) {
+            frame->colors = (Vector3*) malloc(pixelCount * sizeof(Vector3));
+        }
+        if (frame->options->denoise || frame->options->writeAovs) {
+            frame->features = (PixelFeatures*) malloc(pixelCount * sizeof(PixelFeatures));
+        }
+        if (frame->pixels == NULL || (frame->options->denoise && frame->colors == NULL) ||
+            ((frame->options->denoise || frame->options->writeAovs) && frame->features == NULL)) {
+            fprintf(stderr, "Memory allocation error while allocating the frame %s.\n", frame->outputFileName);
+            exit(-1);
+        }
+    }
+    if (!frame->triangleBinsReady && scene->faceCount > 0) {
+        binTriangles(scene, &frame->viewParameters, frame->parallel, RENDER_TILE_SIZE, &frame->triangleBins);
+        frame->triangleBinsReady = true;
+    }
+    pthread_mutex_unlock(&frame->pixelsMutex);
+
+    int tileWidth = tile->x1 - tile->x0;
+    Ray viewingRays[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+    Hit faceHits[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+    for (int y = tile->y0; y < tile->y1; y++) {
+        for (int x = tile->x0; x < tile->x1; x++) {
+            Vector3 viewingWindowLocation = getViewingWindowLocation(&frame->viewParameters, x, y);
+            viewingRays[(y - tile->y0) * tileWidth + (x - tile->x0)] = traceViewingRay(scene, viewingWindowLocation, frame->parallel);
+        }
+    }
+    TileFrustum frustum = getTileFrustum(scene, &frame->viewParameters, frame->parallel, tile->x0, tile->y0, tile->x1, tile->y1);
+    TileCandidates tileCandidates;
+    buildTileCandidates(scene, &frustum, &tileCandidates);
+    if (frame->tileMaterialMasks != NULL) {
+        shadedMaterialMask = &frame->tileMaterialMasks[(size_t) tile->tileIdx * (size_t) frame->materialMaskWordCount];
+        memset(shadedMaterialMask, 0, (size_t) frame->materialMaskWordCount * sizeof(uint64_t));
+    }
+
+    // Nothing can be seen through an empty tile, so its pixels are all background and no rays are cast.
+    if (isTileEmpty(&tileCandidates, &frame->triangleBins, frame->triangleBinsReady, tile->tileIdx)) {
+        for (int y = tile->y0; y < tile->y1; y++) {
+            for (int x = tile->x0; x < tile->x1; x++) {
+                int pixelIdx = (y - frame->region.y0) * regionWidth + (x - frame->region.x0);
+                if (frame->features != NULL) {
+                    frame->features[pixelIdx] = (PixelFeatures) {
+                            .normal = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
+                            .albedo = scene->bkgColor.color,
+                            .depth = 0.0f,
+                            .hit = false,
+                    };
+                }
+                if (frame->colors != NULL) {
+                    frame->colors[pixelIdx] = scene->bkgColor.color;
+                } else {
+                    frame->pixels[pixelIdx] = convertColorToRGBColor(scene->bkgColor.color);
+                }
+            }
+        }
+    } else {
+        if (frame->triangleBinsReady) {
+            rasterizeTile(scene, &frame->triangleBins, tile->tileIdx, viewingRays, tile->x0, tile->y0, tile->x1, tile->y1, faceHits);
+        }
+        for (int y = tile->y0; y < tile->y1; y++) {
+            for (int x = tile->x0; x < tile->x1; x++) {
+                seedRandom(x, y);
+                int tilePixelIdx = (y - tile->y0) * tileWidth + (x - tile->x0);
+                RayCandidates candidates = (RayCandidates) {
+                        .sphereBatches = &tileCandidates.sphereBatches,
+                        .ellipsoidBatches = &tileCandidates.ellipsoidBatches,
+                        .faceHit = frame->triangleBinsReady ? &faceHits[tilePixelIdx] : NULL,
+                };
+                Ray viewingRay = viewingRays[tilePixelIdx];
+                RayState rayState = (RayState) {
+                    .exclusion = (Exclusion) {
+                            .excludeSphereIdx = -1,
+                            .excludeEllipsoidIdx = -1,
+                            .excludeFaceIdx = -1
+                    },
+                    .reflectionDepth = 0,
+                    .shadow = 1.0f,
+                    .previousRefractionIndex = scene->bkgColor.refractionIndex
+                };
+                int pixelIdx = (y - frame->region.y0) * regionWidth + (x - frame->region.x0);
+                Vector3 color = shadePrimaryRay(viewingRay, scene, rayState, &candidates,
+                                                frame->features != NULL ? &frame->features[pixelIdx] : NULL);
+                if (frame->colors != NULL) {
+                    frame->colors[pixelIdx] = color;
+                } else {
+                    frame->pixels[pixelIdx] = convertColorToRGBColor(color);
+                }
+            }
+        }
+    }
+
+    freeTileCandidates(&tileCandidates);
+    shadedMaterialMask = NULL;
+
+    int renderedTiles = atomic_fetch_add(&renderedTileCount, 1) + 1;
+    if (showProgress) {
+        pthread_mutex_lock(&progressMutex);
+        progressBar(totalTileCount, renderedTiles);
+        pthread_mutex_unlock(&progressMutex);
+    }
+
+    if (atomic_fetch_sub(&frame->remainingTileCount, 1) == 1) {
+        if (frame->colors != NULL) {
+            // Kept colors must stay undenoised, because the next pass only re-renders some of them.
+            Vector3* colors = frame->colors;
+            if (frame->keepBuffers) {
+                colors = (Vector3*) malloc(pixelCount * sizeof(Vector3));
+                if (colors == NULL) {
+                    fprintf(stderr, "Memory allocation error while denoising the frame %s.\n", frame->outputFileName);
+                    exit(-1);
+                }
+                memcpy(colors, frame->colors, pixelCount * sizeof(Vector3));
+            }
+            denoiseFrame(colors, frame->features, regionWidth, regionHeight);
+            for (size_t pixelIdx = 0; pixelIdx < pixelCount; pixelIdx++) {
+                frame->pixels[pixelIdx] = convertColorToRGBColor(colors[pixelIdx]);
+            }
+            if (colors != frame->colors) {
+                free(colors);
+            }
+        }
+        bool written = writeImage(frame->outputFileName, frame->pixels, regionWidth, regionHeight, frame->options->imageFormat);
+        if (frame->options->writeAovs) {
+            written = writeAovImages(frame->outputFileName, frame->features, regionWidth, regionHeight, frame->options->imageFormat) && written;
+        }
+        // Frames with a callback may share the process with other frames, so the callback decides what a failed write means.
+        if (!written && frame->frameWritten == NULL) {
+            exit(-1);
+        }
+        frame->writeFailed = !written;
+        if (!frame->keepBuffers) {
+            freeFrameBuffers(frame);
+        }
+        // The callback may free the frame and this tile, so nothing touches them after it.
+        if (frame->frameWritten != NULL) {
+            frame->frameWritten(frame->frameWrittenArg);
+        }
+    }
+}
+
+Scene createScene(const RenderOptions* options, TextureCache* textureCache) {
+    return (Scene) {
+            .eye = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
+            .viewDir = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
+            .upDir = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
+            .fov = {.h = 0.0f, .v = 0.0f },
+            .imSize = {.width = 0, .height = 0},
+            .bkgColor = (Background) {
+                .color = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
+                .refractionIndex = 1.0f
+            },
+            .parallel = {.frustumWidth = 0.0f},
+            .mtlColors = NULL,
+            .mtlColorCount = 0,
+            .bvhSpheres = NULL,
+            .bvhSphereCount = 0,
+            .spheres = NULL,
+            .sphereCount = 0,
+            .ellipsoids = NULL,
+            .ellipsoidCount = 0,
+            .lights = NULL,
+            .lightCount = 0,
+            .softShadows = false,
+            .shadowRayCount = options->shadowRayCount,
+            .vertexes = NULL,
+            .vertexCount = 0,
+            .vertexNormals = NULL,
+            .vertexNormalCount = 0,
+            .vertexTextures = NULL,
+            .vertexTextureCount = 0,
+            .faces = NULL,
+            .faceCount = 0,
+            .textures = NULL,
+            .textureCount = 0,
+            .normals = NULL,
+            .normalCount = 0,
+            .objects = NULL,
+            .objectCount = 0,
+            .objectNodes = NULL,
+            .objectNodeCount = 0,
+            .objectFaceIdxs = NULL,
+            .instanceHierarchy = (InstanceHierarchy) {
+                .instances = NULL,
+                .nodes = NULL,
+                .nodeCount = 0,
+                .instanceIdxs = NULL,
+            },
+            .clusterCache = NULL,
+            .clusterBudget = options->clusterBudget,
+            .textureCache = textureCache,
+            .shadingFeatures = 0,
+    };
+}
+
+// Reads the scene into its arena and decodes its images. inputFileWordsByLine is still the caller's.
+void parseScene(Scene* scene, char*** inputFileWordsByLine, bool softShadows) {
+    int line = 0;
+    readSceneSetup(inputFileWordsByLine, &line, scene, softShadows);
+    readSceneObjects(inputFileWordsByLine, &line, scene);
+    compactScene(scene);
+    decodeSceneImages(scene);
+}
+
+// Builds the shading kernel choice and the hierarchies of a parsed scene.
+void prepareScene(Scene* scene) {
+    scene->shadingFeatures = getShadingFeatures(scene);
+    buildObjectHierarchies(scene);
+    buildInstanceHierarchy(scene, NULL, &scene->instanceHierarchy);
+}
+
+void loadScene(Scene* scene, char*** inputFileWordsByLine, bool softShadows) {
+    parseScene(scene, inputFileWordsByLine, softShadows);
+    prepareScene(scene);
+}
+
+bool hasObjectTransforms(const Scene* scene, const ObjectTransform* transforms) {
+    for (int objectIdx = 0; objectIdx < scene->objectCount; objectIdx++) {
+        if (!isIdentityTransform(&transforms[objectIdx])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ImageRegion getFullImageRegion(const Scene* scene) {
+    return (ImageRegion) {
+            .x0 = 0,
+            .y0 = 0,
+            .x1 = scene->imSize.width,
+            .y1 = scene->imSize.height,
+    };
+}
+
+int getRegionTileCount(ImageRegion region) {
+    int tileColumns = (region.x1 - 1) / RENDER_TILE_SIZE - region.x0 / RENDER_TILE_SIZE + 1;
+    int tileRows = (region.y1 - 1) / RENDER_TILE_SIZE - region.y0 / RENDER_TILE_SIZE + 1;
+    return tileColumns * tileRows;
+}
+
+// Writes the keyframe's vertex positions into the shared scene and refits the hierarchies around them. Frames read
+// the vertexes while they render, so no frame may be rendering. Frames set up afterwards see the new geometry, and
+// ones with object transforms build their top level over the refitted objects. Returns how many objects were rebuilt.
+int moveSceneVertexes(Scene* scene, const CameraKeyframe* keyframe) {
+    for (int moveIdx = 0; moveIdx < keyframe->vertexMoveCount; moveIdx++) {
+        scene->vertexes[keyframe->vertexMoves[moveIdx].vertexIdx] = keyframe->vertexMoves[moveIdx].position;
+    }
+    return refitSceneHierarchies(scene);
+}
+
+// Sets up a frame of the shared scene seen through keyframe, or the scene's own camera when keyframe is NULL. Only
+// region is rendered and written, and the caller still has to pick the output file name.
+void initFrameRender(FrameRender* frame, const Scene* scene, const RenderOptions* options, const CameraKeyframe* keyframe, int frameIdx, ImageRegion region) {
+    frame->scene = (*scene);
+    if (keyframe != NULL) {
+        frame->scene.eye = keyframe->eye;
+        frame->scene.viewDir = keyframe->viewDir;
+        frame->scene.upDir = keyframe->upDir;
+        frame->scene.fov = keyframe->fov;
+    }
+    frame->ownsInstanceHierarchy = keyframe != NULL && keyframe->objectTransforms != NULL && hasObjectTransforms(scene, keyframe->objectTransforms);
+    if (frame->ownsInstanceHierarchy) {
+        buildInstanceHierarchy(scene, keyframe->objectTransforms, &frame->scene.instanceHierarchy);
+    }
+    frame->parallel = frame->scene.parallel.frustumWidth > 0.0f;
+    frame->viewParameters = getViewParameters(&frame->scene, frame->parallel);
+    frame->region = region;
+    frame->pixels = NULL;
+    frame->colors = NULL;
+    frame->features = NULL;
+    frame->triangleBinsReady = false;
+    frame->options = options;
+    frame->frameIdx = frameIdx;
+    frame->frameWritten = NULL;
+    frame->frameWrittenArg = NULL;
+    frame->keepBuffers = false;
+    frame->writeFailed = false;
+    frame->tileMaterialMasks = NULL;
+    frame->materialMaskWordCount = 0;
+    atomic_init(&frame->remainingTileCount, getRegionTileCount(region));
+    pthread_mutex_init(&frame->pixelsMutex, NULL);
+}
+
+// Queues the tiles that cover the frame's region, in rows. tiles must hold getRegionTileCount of them. Tiles keep
+// their index in the whole image's grid, which is what the triangle bins use, and are clipped to the region.
+void submitFrameTiles(ThreadPool* pool, FrameRender* frame, RenderTile* tiles) {
+    int tileColumns = (frame->scene.imSize.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    ImageRegion region = frame->region;
+    int tileCount = 0;
+    for (int tileRow = region.y0 / RENDER_TILE_SIZE; tileRow * RENDER_TILE_SIZE < region.y1; tileRow++) {
+        for (int tileColumn = region.x0 / RENDER_TILE_SIZE; tileColumn * RENDER_TILE_SIZE < region.x1; tileColumn++) {
+            RenderTile* tile = &tiles[tileCount++];
+            tile->frame = frame;
+            tile->tileIdx = tileRow * tileColumns + tileColumn;
+            tile->x0 = (int) max((float) (tileColumn * RENDER_TILE_SIZE), (float) region.x0);
+            tile->y0 = (int) max((float) (tileRow * RENDER_TILE_SIZE), (float) region.y0);
+            tile->x1 = (int) min((float) ((tileColumn + 1) * RENDER_TILE_SIZE), (float) region.x1);
+            tile->y1 = (int) min((float) ((tileRow + 1) * RENDER_TILE_SIZE), (float) region.y1);
+            submitThreadPoolTask(pool, renderTile, tile);
+        }
+    }
+}
+
+void destroyFrameRender(FrameRender* frame) {
+    freeFrameBuffers(frame);
+    free(frame->tileMaterialMasks);
+    frame->tileMaterialMasks = NULL;
+    pthread_mutex_destroy(&frame->pixelsMutex);
+    if (frame->ownsInstanceHierarchy) {
+        freeInstanceHierarchy(&frame->scene.instanceHierarchy);
+        frame->ownsInstanceHierarchy = false;
+    }
+}
+
+#endif
@@ -7,14 +7,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <float.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include "stringhelper.h"
+#include "threadpool.h"
+#include "cluster.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #define MAX_LINE_COUNT 500000
 #define MAX_WORDS_PER_LINE 500 // This will wrap if they have more than this many words in a line and cause weird behavior
 #define MAX_INPUT_LINE_LENGTH 5000
 #define MAX_TEXTURE_LINE_LENGTH 50000
 #define MAX_TEXTURE_WORDS_PER_LINE 10000
-#define KEYWORD_COUNT 21
+#define KEYWORD_COUNT 23
 #define INITIAL_LIGHT_COUNT 10
 #define INITIAL_MTLCOLOR_COUNT 10
 #define INITIAL_TEXTURE_COUNT 10
@@ -26,21 +35,120 @@
 #define INITIAL_VERTEX_NORMAL_COUNT 10000
 #define INITIAL_VERTEX_TEXTURE_COUNT 10000
 #define INITIAL_FACE_COUNT 10000
+#define INITIAL_OBJECT_COUNT 16
+#define SCENE_ARENA_ALIGNMENT 64
+#define INITIAL_MESH_MATERIAL_COUNT 16
+#define MAX_MESH_PATH_LENGTH 4096
+#define MAX_MESH_NAME_LENGTH 256
+#define INITIAL_CAMERA_KEYFRAME_COUNT 64
+#define INITIAL_VERTEX_MOVE_COUNT 16
+#define DEFAULT_SHADOW_RAY_COUNT 50
+#define CLUSTER_TRIANGLE_COUNT 128
+#define CLUSTER_GRID_TRIANGLES_PER_CELL 16
+#define MAX_CLUSTER_GRID_BITS 7
+#define CLUSTER_WRITE_BUFFER_TRIANGLE_COUNT 64
+#define MAX_CLUSTER_FILE_NAME_LENGTH 4096
+#define QUANTIZED_POSITION_STEPS 65535
+#define QUANTIZED_CLUSTER_ALIGNMENT 8
 
-void checkArgs(int argc, char* argv[]) {
-    if (argc > 3 || argc < 2) {
-        fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1d [-s:soft shadows] <path/to/input_file>`\n");
-        exit(-1);
-    }
+void printUsage() {
+    fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1d [-s:soft shadows] [-n <shadow rays>] [-d:denoise] [-a:write AOVs] [-p <path/to/camera_path>] [-j <threads>] [-m <out-of-core megabytes>] [-f <p3|p6|png>] [-D <path/to/socket|->] [-w|--watch] <path/to/input_file> [<path/to/input_file>...]`\n");
+}
+
+RenderOptions parseArgs(int argc, char* argv[]) {
     if (strcmp(argv[0], "./raytracer1d") != 0 && strcmp(argv[0], "/home/ben/github.com/fundamentals-of-computer-graphics/assignment1d/main") != 0  && strcmp(argv[0], "/Users/Z003YW4/github.com/fundamentals-of-computer-graphics/assignment1d/main") != 0) {
         fprintf(stderr, "Incorrect usage. Correct usage is `$ ./raytracer1c <path/to/input_file>`\n");
         exit(-1);
     }
+
+    RenderOptions options = (RenderOptions) {
+            .softShadows = false,
+            .inputFileName = NULL,
+            .inputFileNames = NULL,
+            .inputFileCount = 0,
+            .cameraPathFileName = NULL,
+            .threadCount = 0,
+            .shadowRayCount = DEFAULT_SHADOW_RAY_COUNT,
+            .denoise = false,
+            .writeAovs = false,
+            .clusterBudget = (size_t) DEFAULT_CLUSTER_BUDGET_MEGABYTES << 20,
+            .imageFormat = IMAGE_FORMAT_P3,
+            .daemonSocketName = NULL,
+            .watch = false,
+    };
+    const struct option longOptions[] = {
+            { "watch", no_argument, NULL, 'w' },
+            { NULL, 0, NULL, 0 },
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "sp:j:n:dam:f:D:w", longOptions, NULL)) != -1) {
+        if (option == 's') {
+            options.softShadows = true;
+        } else if (option == 'n') {
+            options.shadowRayCount = atoi(optarg);
+            if (options.shadowRayCount <= 0) {
+                fprintf(stderr, "The shadow ray count must be a positive number.\n");
+                exit(-1);
+            }
+        } else if (option == 'd') {
+            options.denoise = true;
+        } else if (option == 'a') {
+            options.writeAovs = true;
+        } else if (option == 'm') {
+            int budgetMegabytes = atoi(optarg);
+            if (budgetMegabytes <= 0) {
+                fprintf(stderr, "The out-of-core memory budget must be a positive number of megabytes.\n");
+                exit(-1);
+            }
+            options.clusterBudget = (size_t) budgetMegabytes << 20;
+        } else if (option == 'f') {
+            if (!parseImageFormat(optarg, &options.imageFormat)) {
+                fprintf(stderr, "The image format must be p3, p6 or png.\n");
+                exit(-1);
+            }
+        } else if (option == 'D') {
+            options.daemonSocketName = optarg;
+        } else if (option == 'w') {
+            options.watch = true;
+        } else if (option == 'p') {
+            options.cameraPathFileName = optarg;
+        } else if (option == 'j') {
+            options.threadCount = atoi(optarg);
+            if (options.threadCount <= 0) {
+                fprintf(stderr, "The thread count must be a positive number.\n");
+                exit(-1);
+            }
+        } else {
+            printUsage();
+            exit(-1);
+        }
+    }
+    if (optind >= argc) {
+        printUsage();
+        exit(-1);
+    }
+    if (options.daemonSocketName != NULL && options.cameraPathFileName != NULL) {
+        fprintf(stderr, "A daemon takes its cameras from its jobs, so -D and -p can not be combined.\n");
+        exit(-1);
+    }
+    options.inputFileName = argv[optind];
+    options.inputFileNames = &argv[optind];
+    options.inputFileCount = argc - optind;
+    if (options.inputFileCount > 1 && (options.daemonSocketName != NULL || options.cameraPathFileName != NULL || options.watch)) {
+        fprintf(stderr, "A batch renders each scene once from its own camera, so it can not be combined with -D, -p or --watch.\n");
+        exit(-1);
+    }
+    if (options.watch && (options.daemonSocketName != NULL || options.cameraPathFileName != NULL)) {
+        fprintf(stderr, "--watch re-renders the input file from its own camera, so it can not be combined with -D or -p.\n");
+        exit(-1);
+    }
+    return options;
 }
 
 char** readLine(char* line, char** wordsInLine, int maxWordsPerLine) {
     char* delimiters = " \t\n\r";
-    char* token = strtok(line, delimiters);
+    char* savePtr = NULL;
+    char* token = strtok_r(line, delimiters, &savePtr);
     int wordIdx = 0;
 
     while (token != NULL && wordIdx < maxWordsPerLine - 1) {
@@ -58,7 +166,7 @@ char** readLine(char* line, char** wordsInLine, int maxWordsPerLine) {
             }
         }
         strcpy(wordsInLine[wordIdx], token);
-        token = strtok(NULL, delimiters);
+        token = strtok_r(NULL, delimiters, &savePtr);
         wordIdx++;
     }
     wordsInLine[wordIdx] = NULL;
@@ -80,7 +188,8 @@ bool isKeyword(const char* target) {
             "imsize", "bkgcolor", "mtlcolor", "sphere",
             "parallel", "ellipse", "light", "depthcueing",
             "attlight", "v", "vn", "f", "texture",
-            "vt", "bump", "bvhsphere"
+            "vt", "bump", "bvhsphere", "mesh",
+            "clustermesh"
     };
     for (size_t i = 0; i < KEYWORD_COUNT; i++) {
         if (target == NULL || strcmp(target, keywords[i]) == 0) {
@@ -90,14 +199,14 @@ bool isKeyword(const char* target) {
     return false;
 }
 
-char*** readInputFile(char* argv[], bool softShadows) {
+char*** readInputFile(char* inputFileName) {
     char*** inputFileWordsByLine = NULL;
-    char* inputFileName = (softShadows) ? argv[2] : argv[1];
 
     FILE* inputFilePtr = fopen(inputFileName, "r");
 
     if (inputFilePtr != NULL) {
-        inputFileWordsByLine = malloc(MAX_LINE_COUNT * sizeof(char**));
+        // Zeroed, because the parser stops at the first line without words and only non-NULL words are freed.
+        inputFileWordsByLine = calloc(MAX_LINE_COUNT, sizeof(char**));
         if (inputFileWordsByLine == NULL) {
             fprintf(stderr, "Memory allocation error with reading the input file lines.\n");
             exit(-1);
@@ -105,7 +214,7 @@ char*** readInputFile(char* argv[], bool softShadows) {
 
         char currentLine[MAX_INPUT_LINE_LENGTH];
         int line = 0;
-        while ((inputFileWordsByLine[line] = malloc(MAX_WORDS_PER_LINE * sizeof(char*))) != NULL &&
+        while ((inputFileWordsByLine[line] = calloc(MAX_WORDS_PER_LINE, sizeof(char*))) != NULL &&
                fgets(currentLine, MAX_INPUT_LINE_LENGTH, inputFilePtr) != NULL) {
             if (currentLine[0] == '\n' || currentLine[0] == '\0' || currentLine[0] == '\r') {
                 continue;
@@ -144,6 +253,18 @@ void freeInputFileWordsByLine(char*** inputFileWordsByLine) {
     free(inputFileWordsByLine);
 }
 
+// Returns the first texture or bump map the scene names that can not be read, or NULL. Lets a batch skip the scene
+// up front instead of exiting in the middle of the others. Maps named by mesh materials are not checked.
+char* findMissingSceneImage(char*** inputFileWordsByLine) {
+    for (int line = 0; line < MAX_LINE_COUNT && inputFileWordsByLine[line] != NULL && inputFileWordsByLine[line][0] != NULL; line++) {
+        char** words = inputFileWordsByLine[line];
+        if ((strcmp(words[0], "texture") == 0 || strcmp(words[0], "bump") == 0) && words[1] != NULL && access(words[1], R_OK) != 0) {
+            return words[1];
+        }
+    }
+    return NULL;
+}
+
 float convertStringToFloat(char* s) {
     char* end;
     float result = strtof(s, &end);
@@ -203,17 +324,24 @@ float min(float a, float b) {
     return (a <= b) ? a : b;
 }
 
-
-void readLight(char** const* inputFileWordsByLine, const int* line, Scene* scene, int lightAllocationCount, bool attLight) {
-    if (scene->lightCount >= INITIAL_LIGHT_COUNT * lightAllocationCount) {
-        lightAllocationCount++;
-        Light* newLights = (Light*) realloc(scene->lights, (INITIAL_LIGHT_COUNT * lightAllocationCount) * sizeof(Light));
-        if (newLights == NULL) {
-            fprintf(stderr, "Memory allocation failed for light\n");
-            exit(-1);
-        }
-        scene->lights = newLights;
+void* growSceneArray(void* array, int count, int* capacity, int initialCapacity, size_t elementSize, char* type) {
+    if (count < (*capacity)) {
+        return array;
+    }
+    int newCapacity = (*capacity) > 0 ? (*capacity) * 2 : initialCapacity;
+    void* newArray = realloc(array, (size_t) newCapacity * elementSize);
+    if (newArray == NULL) {
+        fprintf(stderr, "Memory allocation failed for %s.\n", type);
+        exit(-1);
     }
+    // Optional values, like a mtlcolor's attenuation, are only set when given, so new elements start out zeroed.
+    memset((char*) newArray + (size_t) count * elementSize, 0, (size_t) (newCapacity - count) * elementSize);
+    (*capacity) = newCapacity;
+    return newArray;
+}
+
+void readLight(char** const* inputFileWordsByLine, const int* line, Scene* scene, bool attLight) {
+    scene->lights = (Light*) growSceneArray(scene->lights, scene->lightCount, &scene->arena.lightCapacity, INITIAL_LIGHT_COUNT, sizeof(Light), "lights");
     checkValues(inputFileWordsByLine[*line], attLight ? 8 : 5,  attLight ? "attlight" : "light");
     scene->lights[scene->lightCount].position = (Vector3) {
             .x = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -234,11 +362,12 @@ void readSceneSetup(
         Scene* scene,
         bool softShadows
 ) {
-    int lightAllocationCount = 1;
     while (inputFileWordsByLine[*line][0] != NULL &&
         strcmp(inputFileWordsByLine[*line][0], "mtlcolor") != 0 &&
         strcmp(inputFileWordsByLine[*line][0], "v") != 0 &&
-        strcmp(inputFileWordsByLine[*line][0], "texture") != 0
+        strcmp(inputFileWordsByLine[*line][0], "texture") != 0 &&
+        strcmp(inputFileWordsByLine[*line][0], "mesh") != 0 &&
+        strcmp(inputFileWordsByLine[*line][0], "clustermesh") != 0
     ) {
         if (strcmp(inputFileWordsByLine[*line][0], "eye") == 0) {
             checkValues(inputFileWordsByLine[*line], 3, "eye");
@@ -275,7 +404,7 @@ void readSceneSetup(
             checkValues(inputFileWordsByLine[*line], 1, "parallel");
             scene->parallel.frustumWidth = convertStringToFloat(inputFileWordsByLine[*line][1]);
         } else if (strcmp(inputFileWordsByLine[*line][0], "light") == 0) {
-            readLight(inputFileWordsByLine, line, scene, lightAllocationCount, false);
+            readLight(inputFileWordsByLine, line, scene, false);
         } else if (strcmp(inputFileWordsByLine[*line][0], "depthcueing") == 0) {
             scene->depthCueing = (DepthCueing) {
                     .color = (Vector3) {
@@ -289,23 +418,15 @@ void readSceneSetup(
                     .distMax = convertStringToFloat(inputFileWordsByLine[*line][7]),
             };
         } else if (strcmp(inputFileWordsByLine[*line][0], "attlight") == 0) {
-            readLight(inputFileWordsByLine, line, scene, lightAllocationCount, true);
+            readLight(inputFileWordsByLine, line, scene, true);
         }
         scene->softShadows = softShadows;
         (*line)++;
     }
 }
 
-void readVertex(char** const* inputFileWordsByLine, Scene* scene, int objectLine, int* vertexAllocationCount) {
-    if (scene->vertexCount >= INITIAL_VERTEX_COUNT * (*vertexAllocationCount)) {
-        (*vertexAllocationCount)++;
-        Vector3* newVertexes = (Vector3*) realloc(scene->vertexes, (INITIAL_VERTEX_COUNT * (*vertexAllocationCount)) * sizeof(Vector3));
-        if (newVertexes == NULL) {
-            fprintf(stderr, "Memory allocation failed for vertexes.");
-            exit(-1);
-        }
-        scene->vertexes = newVertexes;
-    }
+void readVertex(char** const* inputFileWordsByLine, Scene* scene, int objectLine) {
+    scene->vertexes = (Vector3*) growSceneArray(scene->vertexes, scene->vertexCount, &scene->arena.vertexCapacity, INITIAL_VERTEX_COUNT, sizeof(Vector3), "vertexes");
     checkValues(inputFileWordsByLine[objectLine], 3, "v");
     scene->vertexes[scene->vertexCount] = (Vector3) {
             .x = convertStringToFloat(inputFileWordsByLine[objectLine][1]),
@@ -315,19 +436,8 @@ void readVertex(char** const* inputFileWordsByLine, Scene* scene, int objectLine
     scene->vertexCount++;
 }
 
-void readVertexNormal(char** const* inputFileWordsByLine, Scene* scene, int line, int* vertexNormalAllocationCount) {
-    if (scene->vertexNormalCount == 0) {
-        (*vertexNormalAllocationCount) = 1;
-        scene->vertexNormals = (Vector3*) malloc(INITIAL_VERTEX_NORMAL_COUNT * sizeof(Vector3));
-    } else if (scene->vertexNormalCount >= INITIAL_VERTEX_NORMAL_COUNT * (*vertexNormalAllocationCount)) {
-        (*vertexNormalAllocationCount)++;
-        Vector3* newVertexNormals = (Vector3*) realloc(scene->vertexNormals, (INITIAL_VERTEX_NORMAL_COUNT * (*vertexNormalAllocationCount)) * sizeof(Vector3));
-        if (newVertexNormals == NULL) {
-            fprintf(stderr, "Memory allocation failed for vertex normals.");
-            exit(-1);
-        }
-        scene->vertexNormals = newVertexNormals;
-    }
+void readVertexNormal(char** const* inputFileWordsByLine, Scene* scene, int line) {
+    scene->vertexNormals = (Vector3*) growSceneArray(scene->vertexNormals, scene->vertexNormalCount, &scene->arena.vertexNormalCapacity, INITIAL_VERTEX_NORMAL_COUNT, sizeof(Vector3), "vertex normals");
     checkValues(inputFileWordsByLine[line], 3, "vn");
     scene->vertexNormals[scene->vertexNormalCount] = (Vector3) {
             .x = convertStringToFloat(inputFileWordsByLine[line][1]),
@@ -373,18 +483,14 @@ void parseFaceValues(char** objectLine, int faceIdx, const Scene* scene, int obj
     }
 }
 
-PPMImage readPPM(const char *filename) {
-    FILE *filePtr = fopen(filename, "rb");
-    if (filePtr == NULL) {
-        fprintf(stderr, "Error opening file: %s.\n", filename);
-        exit(1);
-    }
-
+PPMImage readPPMFile(FILE* filePtr) {
     PPMImage image = (PPMImage) {
         .width = 0,
         .height = 0,
         .maxColor = 0,
         .data = NULL,
+        .texels = NULL,
+        .cacheEntry = NULL,
     };
 
     char headerLine[MAX_INPUT_LINE_LENGTH];
@@ -402,7 +508,7 @@ PPMImage readPPM(const char *filename) {
     image.width = convertStringToInt(wordsInHeaderLine[1]);
     image.height = convertStringToInt(wordsInHeaderLine[2]);
     image.maxColor = convertStringToInt(wordsInHeaderLine[3]);
-    image.data = (RGBColor**) malloc(image.height * sizeof(RGBColor*));
+    image.data = (RGBColor**) calloc(image.height, sizeof(RGBColor*));
     if (image.data == NULL) {
         fprintf(stderr, "Memory allocation error while reading PPM data.\n");
         exit(1);
@@ -444,34 +550,1207 @@ PPMImage readPPM(const char *filename) {
         y++;
     }
 
+    return image;
+}
+
+PPMImage readPPM(const char *filename) {
+    FILE *filePtr = fopen(filename, "rb");
+    if (filePtr == NULL) {
+        fprintf(stderr, "Error opening file: %s.\n", filename);
+        exit(1);
+    }
+    PPMImage image = readPPMFile(filePtr);
     fclose(filePtr);
     return image;
 }
 
-void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
-    int mtlColorAllocationCount = 1;
-    int textureAllocationCount = 1;
-    int normalAllocationCount = 1;
-    int bvhSphereAllocationCount = 1;
-    int sphereAllocationCount = 1;
-    int vertexAllocationCount = 1;
-    int vertexNormalAllocationCount = 0;
-    int vertexTextureAllocationCount = 0;
-    int faceAllocationCount = 1;
-    int ellipsoidAllocationCount = 1;
+void freePPMImageData(PPMImage* image) {
+    if (image->data != NULL) {
+        for (int y = 0; y < image->height; y++) {
+            free(image->data[y]);
+        }
+        free(image->data);
+        image->data = NULL;
+    }
+}
 
-    // todo: break each of these out into a method?
-    while (inputFileWordsByLine[*line][0] != NULL) {
-        if (strcmp(inputFileWordsByLine[*line][0], "mtlcolor") == 0) {
-            if (scene->mtlColorCount >= INITIAL_MTLCOLOR_COUNT * mtlColorAllocationCount) {
-                mtlColorAllocationCount++;
-                MaterialColor* newMtlColors = (MaterialColor*) realloc(scene->mtlColors, (INITIAL_MTLCOLOR_COUNT * mtlColorAllocationCount) * sizeof(MaterialColor));
-                if (newMtlColors == NULL) {
-                    fprintf(stderr, "Memory allocation failed for material colors.");
+void freePPMImage(PPMImage* image) {
+    if (image->cacheEntry != NULL) {
+        // The cache still holds the pixels for other scenes and frees them itself.
+        image->texels = NULL;
+        return;
+    }
+    freePPMImageData(image);
+    free(image->texels);
+    image->texels = NULL;
+}
+
+void initTextureCache(TextureCache* cache) {
+    cache->entries = NULL;
+    cache->entryCount = 0;
+    cache->hitCount = 0;
+    pthread_mutex_init(&cache->mutex, NULL);
+}
+
+void freeTextureCache(TextureCache* cache) {
+    TextureCacheEntry* entry = cache->entries;
+    while (entry != NULL) {
+        TextureCacheEntry* next = entry->next;
+        freePPMImageData(&entry->image);
+        free(entry->colorTexels);
+        free(entry->normalTexels);
+        pthread_mutex_destroy(&entry->decodeMutex);
+        free(entry);
+        entry = next;
+    }
+    cache->entries = NULL;
+    cache->entryCount = 0;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+// 64-bit FNV-1a. Together with the size it tells images apart, it is not meant to resist crafted collisions.
+uint64_t hashImageContents(const char* contents, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t byteIdx = 0; byteIdx < size; byteIdx++) {
+        hash ^= (unsigned char) contents[byteIdx];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+TextureCacheEntry* findTextureCacheEntry(TextureCache* cache, uint64_t contentHash, size_t contentSize) {
+    for (TextureCacheEntry* entry = cache->entries; entry != NULL; entry = entry->next) {
+        if (entry->contentHash == contentHash && entry->contentSize == contentSize) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Reads the whole file to key it by its contents. Only contents that are not cached yet are parsed, outside of the
+// lock so scenes loading different images do not wait on each other. When two scenes miss on the same contents at
+// once, both parse them and the second copy is dropped.
+PPMImage readCachedPPM(TextureCache* cache, const char* filename) {
+    FILE* filePtr = fopen(filename, "rb");
+    if (filePtr == NULL) {
+        fprintf(stderr, "Error opening file: %s.\n", filename);
+        exit(1);
+    }
+    fseek(filePtr, 0, SEEK_END);
+    long fileSize = ftell(filePtr);
+    fseek(filePtr, 0, SEEK_SET);
+    char* contents = (char*) malloc(fileSize + 1);
+    if (contents == NULL) {
+        fprintf(stderr, "Memory allocation error while reading PPM data.\n");
+        exit(1);
+    }
+    size_t contentSize = fread(contents, 1, fileSize, filePtr);
+    contents[contentSize] = '\0';
+    fclose(filePtr);
+
+    uint64_t contentHash = hashImageContents(contents, contentSize);
+    pthread_mutex_lock(&cache->mutex);
+    TextureCacheEntry* entry = findTextureCacheEntry(cache, contentHash, contentSize);
+    if (entry != NULL) {
+        cache->hitCount++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (entry == NULL) {
+        FILE* contentsPtr = contentSize > 0 ? fmemopen(contents, contentSize, "r") : NULL;
+        if (contentsPtr == NULL) {
+            fprintf(stderr, "Invalid PPM file format.\n");
+            exit(1);
+        }
+        PPMImage image = readPPMFile(contentsPtr);
+        fclose(contentsPtr);
+
+        pthread_mutex_lock(&cache->mutex);
+        entry = findTextureCacheEntry(cache, contentHash, contentSize);
+        if (entry != NULL) {
+            freePPMImageData(&image);
+            cache->hitCount++;
+        } else {
+            entry = (TextureCacheEntry*) malloc(sizeof(TextureCacheEntry));
+            if (entry == NULL) {
+                fprintf(stderr, "Memory allocation error while caching PPM data.\n");
+                exit(1);
+            }
+            (*entry) = (TextureCacheEntry) {
+                    .contentHash = contentHash,
+                    .contentSize = contentSize,
+                    .image = image,
+                    .colorTexels = NULL,
+                    .normalTexels = NULL,
+                    .next = cache->entries,
+            };
+            pthread_mutex_init(&entry->decodeMutex, NULL);
+            cache->entries = entry;
+            cache->entryCount++;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    free(contents);
+
+    return (PPMImage) {
+        .width = entry->image.width,
+        .height = entry->image.height,
+        .maxColor = entry->image.maxColor,
+        .data = NULL,
+        .texels = NULL,
+        .cacheEntry = entry,
+    };
+}
+
+// Scene images go through the batch's cache when there is one.
+PPMImage readScenePPM(TextureCache* textureCache, const char* filename) {
+    return textureCache != NULL ? readCachedPPM(textureCache, filename) : readPPM(filename);
+}
+
+char* readMeshFile(const char* fileName) {
+    FILE* filePtr = fopen(fileName, "rb");
+    if (filePtr == NULL) {
+        fprintf(stderr, "Unable to open the mesh file: %s.\n", fileName);
+        exit(-1);
+    }
+
+    fseek(filePtr, 0, SEEK_END);
+    long fileSize = ftell(filePtr);
+    fseek(filePtr, 0, SEEK_SET);
+
+    char* contents = (char*) malloc(fileSize + 1);
+    if (contents == NULL) {
+        fprintf(stderr, "Memory allocation error while reading the mesh file: %s.\n", fileName);
+        exit(-1);
+    }
+    size_t bytesRead = fread(contents, 1, fileSize, filePtr);
+    contents[bytesRead] = '\0';
+
+    fclose(filePtr);
+    return contents;
+}
+
+// Paths inside OBJ and MTL files are relative to the file that names them, not to the working directory.
+void getMeshRelativePath(const char* baseFileName, const char* fileName, char* path) {
+    const char* separator = strrchr(baseFileName, '/');
+    if (fileName[0] == '/' || separator == NULL) {
+        snprintf(path, MAX_MESH_PATH_LENGTH, "%s", fileName);
+    } else {
+        snprintf(path, MAX_MESH_PATH_LENGTH, "%.*s/%s", (int) (separator - baseFileName), baseFileName, fileName);
+    }
+}
+
+char* skipMeshSpaces(char* cursor) {
+    while (*cursor == ' ' || *cursor == '\t') {
+        cursor++;
+    }
+    return cursor;
+}
+
+char* skipMeshLine(char* cursor) {
+    while (*cursor != '\0' && *cursor != '\n') {
+        cursor++;
+    }
+    return (*cursor == '\n') ? cursor + 1 : cursor;
+}
+
+bool isMeshKeyword(const char* cursor, const char* keyword) {
+    size_t length = strlen(keyword);
+    return strncmp(cursor, keyword, length) == 0 && (cursor[length] == ' ' || cursor[length] == '\t');
+}
+
+// Copies the rest of the line without surrounding whitespace. Used for names and file names.
+void readMeshLineRest(char* cursor, char* rest, size_t restLength) {
+    cursor = skipMeshSpaces(cursor);
+    size_t length = 0;
+    while (cursor[length] != '\0' && cursor[length] != '\n') {
+        length++;
+    }
+    while (length > 0 && isspace((unsigned char) cursor[length - 1])) {
+        length--;
+    }
+    if (length >= restLength) {
+        length = restLength - 1;
+    }
+    memcpy(rest, cursor, length);
+    rest[length] = '\0';
+}
+
+Vector3 readMeshVector3(char* cursor) {
+    Vector3 vector;
+    vector.x = strtof(cursor, &cursor);
+    vector.y = strtof(cursor, &cursor);
+    vector.z = strtof(cursor, &cursor);
+    return vector;
+}
+
+float getMaxComponent(Vector3 vector) {
+    return max(vector.x, max(vector.y, vector.z));
+}
+
+// Map options such as "-bm 1.0" can precede the file name, which is always the last word on the line.
+int readMeshMap(const char* mtlFileName, char* cursor, TextureCache* textureCache, PPMImage** images, int* imageCount, int* imageCapacity, int initialCapacity, char* type) {
+    char mapLine[MAX_MESH_PATH_LENGTH];
+    readMeshLineRest(cursor, mapLine, MAX_MESH_PATH_LENGTH);
+    char* mapFileName = strrchr(mapLine, ' ');
+    mapFileName = (mapFileName == NULL) ? mapLine : mapFileName + 1;
+
+    if (!endsWith(mapFileName, ".ppm")) {
+        fprintf(stderr, "Skipping %s %s, only PPM images are supported.\n", type, mapFileName);
+        return -1;
+    }
+
+    char path[MAX_MESH_PATH_LENGTH];
+    getMeshRelativePath(mtlFileName, mapFileName, path);
+    (*images) = (PPMImage*) growSceneArray(*images, *imageCount, imageCapacity, initialCapacity, sizeof(PPMImage), type);
+    (*images)[*imageCount] = readScenePPM(textureCache, path);
+    (*imageCount)++;
+    return (*imageCount) - 1;
+}
+
+void readMeshMaterialLibrary(const char* mtlFileName, Scene* scene, MeshMaterialLibrary* library) {
+    char* contents = readMeshFile(mtlFileName);
+    MeshMaterial* material = NULL;
+    MaterialColor* mtlColor = NULL;
+
+    char* cursor = contents;
+    while (*cursor != '\0') {
+        cursor = skipMeshSpaces(cursor);
+        if (isMeshKeyword(cursor, "newmtl")) {
+            scene->mtlColors = (MaterialColor*) growSceneArray(scene->mtlColors, scene->mtlColorCount, &scene->arena.mtlColorCapacity, INITIAL_MTLCOLOR_COUNT, sizeof(MaterialColor), "material colors");
+            library->materials = (MeshMaterial*) growSceneArray(library->materials, library->materialCount, &library->materialCapacity, INITIAL_MESH_MATERIAL_COUNT, sizeof(MeshMaterial), "mesh materials");
+
+            char name[MAX_MESH_NAME_LENGTH];
+            readMeshLineRest(cursor + strlen("newmtl"), name, MAX_MESH_NAME_LENGTH);
+            material = &library->materials[library->materialCount];
+            (*material) = (MeshMaterial) {
+                    .name = strdup(name),
+                    .mtlColorIdx = scene->mtlColorCount,
+                    .textureIdx = -1,
+                    .normalIdx = -1,
+            };
+            library->materialCount++;
+
+            // The MTL defaults: white diffuse, no specular, opaque.
+            mtlColor = &scene->mtlColors[scene->mtlColorCount];
+            (*mtlColor) = (MaterialColor) {
+                    .diffuseColor = (Vector3) { .x = 1.0f, .y = 1.0f, .z = 1.0f },
+                    .specularColor = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
+                    .ambientCoefficient = 0.0f,
+                    .diffuseCoefficient = 1.0f,
+                    .specularCoefficient = 0.0f,
+                    .specularExponent = 1.0f,
+                    .alpha = 1.0f,
+                    .refractionIndex = 1.0f,
+                    .attenuationCoefficient = 0.0f,
+            };
+            scene->mtlColorCount++;
+        } else if (mtlColor != NULL) {
+            // Colors are stored whole and the coefficients carry their strength, so ka is the brightest Ka channel.
+            if (isMeshKeyword(cursor, "Kd")) {
+                mtlColor->diffuseColor = readMeshVector3(cursor + 2);
+            } else if (isMeshKeyword(cursor, "Ks")) {
+                mtlColor->specularColor = readMeshVector3(cursor + 2);
+                mtlColor->specularCoefficient = getMaxComponent(mtlColor->specularColor) > 0.0f ? 1.0f : 0.0f;
+            } else if (isMeshKeyword(cursor, "Ka")) {
+                mtlColor->ambientCoefficient = getMaxComponent(readMeshVector3(cursor + 2));
+            } else if (isMeshKeyword(cursor, "Ns")) {
+                mtlColor->specularExponent = strtof(cursor + 2, NULL);
+            } else if (isMeshKeyword(cursor, "Ni")) {
+                mtlColor->refractionIndex = strtof(cursor + 2, NULL);
+            } else if (isMeshKeyword(cursor, "d")) {
+                mtlColor->alpha = strtof(cursor + 1, NULL);
+            } else if (isMeshKeyword(cursor, "Tr")) {
+                mtlColor->alpha = 1.0f - strtof(cursor + 2, NULL);
+            } else if (isMeshKeyword(cursor, "map_Kd")) {
+                material->textureIdx = readMeshMap(mtlFileName, cursor + strlen("map_Kd"), scene->textureCache, &scene->textures, &scene->textureCount, &scene->arena.textureCapacity, INITIAL_TEXTURE_COUNT, "textures");
+            } else if (isMeshKeyword(cursor, "map_bump") || isMeshKeyword(cursor, "bump")) {
+                material->normalIdx = readMeshMap(mtlFileName, strpbrk(cursor, " \t"), scene->textureCache, &scene->normals, &scene->normalCount, &scene->arena.normalCapacity, INITIAL_NORMAL_COUNT, "normals");
+            }
+        }
+        cursor = skipMeshLine(cursor);
+    }
+
+    free(contents);
+}
+
+int findMeshMaterial(const MeshMaterialLibrary* library, const char* name) {
+    for (int materialIdx = 0; materialIdx < library->materialCount; materialIdx++) {
+        if (strcmp(library->materials[materialIdx].name, name) == 0) {
+            return materialIdx;
+        }
+    }
+    return -1;
+}
+
+void freeMeshMaterialLibrary(MeshMaterialLibrary* library) {
+    for (int materialIdx = 0; materialIdx < library->materialCount; materialIdx++) {
+        free(library->materials[materialIdx].name);
+    }
+    free(library->materials);
+}
+
+// OBJ indices are 1-based within their own file, negative ones count back from the latest element.
+int resolveMeshIndex(int idx, int base, int count) {
+    if (idx > 0) {
+        return base + idx;
+    } else if (idx < 0) {
+        return count + idx + 1;
+    }
+    return 0;
+}
+
+char* readMeshFaceCorner(char* cursor, const Scene* scene, const int* bases, int* corner) {
+    char* end;
+    int v = (int) strtol(cursor, &end, 10);
+    if (end == cursor) {
+        return NULL;
+    }
+    int vt = 0;
+    int vn = 0;
+    if (*end == '/') {
+        end++;
+        if (*end != '/') {
+            vt = (int) strtol(end, &end, 10);
+        }
+        if (*end == '/') {
+            end++;
+            vn = (int) strtol(end, &end, 10);
+        }
+    }
+    corner[0] = resolveMeshIndex(v, bases[0], scene->vertexCount);
+    corner[1] = resolveMeshIndex(vt, bases[1], scene->vertexTextureCount);
+    corner[2] = resolveMeshIndex(vn, bases[2], scene->vertexNormalCount);
+    // A given index that counts back past the first element resolves to 0 like a missing one, so it is marked to be
+    // rejected instead.
+    int idxs[3] = { v, vt, vn };
+    for (int i = 0; i < 3; i++) {
+        if (idxs[i] != 0 && corner[i] <= 0) {
+            corner[i] = -1;
+        }
+    }
+    return end;
+}
+
+// Indexes that were left out are 0. The others have to name an element of the mesh's own file, which sits past the
+// elements of the scene and earlier meshes.
+bool isMeshFaceCornerValid(const Scene* scene, const int* bases, const int* corner) {
+    int counts[3] = { scene->vertexCount, scene->vertexTextureCount, scene->vertexNormalCount };
+    for (int i = 0; i < 3; i++) {
+        bool missing = i > 0 && corner[i] == 0;
+        if (!missing && (corner[i] <= bases[i] || corner[i] > counts[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void addMeshTriangle(Scene* scene, const int* first, const int* previous, const int* current, int mtlColorIdx, int textureIdx, int normalIdx) {
+    scene->faces = (Face*) growSceneArray(scene->faces, scene->faceCount, &scene->arena.faceCapacity, INITIAL_FACE_COUNT, sizeof(Face), "faces");
+    scene->faces[scene->faceCount] = (Face) {
+            .v1 = first[0],
+            .v2 = previous[0],
+            .v3 = current[0],
+            .vt1 = first[1],
+            .vt2 = previous[1],
+            .vt3 = current[1],
+            .vn1 = first[2],
+            .vn2 = previous[2],
+            .vn3 = current[2],
+            .mtlColorIdx = mtlColorIdx,
+            .textureIdx = textureIdx,
+            .normalIdx = normalIdx,
+    };
+    scene->faceCount++;
+}
+
+// Reads an OBJ file straight into the scene arrays. Polygons are split into a triangle fan.
+// Faces before any usemtl take the current mtlcolor, texture and bump, just like inline faces.
+void readMesh(const char* objFileName, const CurrentMaterial* currentMaterial, Scene* scene) {
+    char* contents = readMeshFile(objFileName);
+    MeshMaterialLibrary library = (MeshMaterialLibrary) {
+            .materials = NULL,
+            .materialCount = 0,
+            .materialCapacity = 0,
+    };
+    int bases[3] = { scene->vertexCount, scene->vertexTextureCount, scene->vertexNormalCount };
+    int mtlColorIdx = currentMaterial->mtlColorIdx;
+    int textureIdx = currentMaterial->textureIdx;
+    int normalIdx = currentMaterial->normalIdx;
+
+    int lineIdx = 1;
+    char* cursor = contents;
+    while (*cursor != '\0') {
+        cursor = skipMeshSpaces(cursor);
+        if (isMeshKeyword(cursor, "v")) {
+            scene->vertexes = (Vector3*) growSceneArray(scene->vertexes, scene->vertexCount, &scene->arena.vertexCapacity, INITIAL_VERTEX_COUNT, sizeof(Vector3), "vertexes");
+            scene->vertexes[scene->vertexCount] = readMeshVector3(cursor + 1);
+            scene->vertexCount++;
+        } else if (isMeshKeyword(cursor, "vn")) {
+            scene->vertexNormals = (Vector3*) growSceneArray(scene->vertexNormals, scene->vertexNormalCount, &scene->arena.vertexNormalCapacity, INITIAL_VERTEX_NORMAL_COUNT, sizeof(Vector3), "vertex normals");
+            scene->vertexNormals[scene->vertexNormalCount] = readMeshVector3(cursor + 2);
+            scene->vertexNormalCount++;
+        } else if (isMeshKeyword(cursor, "vt")) {
+            scene->vertexTextures = (TextureCoordinate*) growSceneArray(scene->vertexTextures, scene->vertexTextureCount, &scene->arena.vertexTextureCapacity, INITIAL_VERTEX_TEXTURE_COUNT, sizeof(TextureCoordinate), "vertex textures");
+            char* end;
+            float u = strtof(cursor + 2, &end);
+            float v = strtof(end, NULL);
+            scene->vertexTextures[scene->vertexTextureCount] = (TextureCoordinate) {
+                    .u = u,
+                    .v = v,
+            };
+            scene->vertexTextureCount++;
+        } else if (isMeshKeyword(cursor, "f")) {
+            if (mtlColorIdx < 0) {
+                fprintf(stderr, "Mesh face on line %d of %s has no material. Add a mtlcolor before the mesh or a usemtl to the file.\n", lineIdx, objFileName);
+                exit(-1);
+            }
+            int first[3];
+            int previous[3];
+            int current[3];
+            int cornerCount = 0;
+            char* corner = cursor + 1;
+            while ((corner = readMeshFaceCorner(skipMeshSpaces(corner), scene, bases, current)) != NULL) {
+                if (!isMeshFaceCornerValid(scene, bases, current)) {
+                    fprintf(stderr, "Mesh face on line %d of %s uses a vertex that does not exist.\n", lineIdx, objFileName);
+                    exit(-1);
+                }
+                if (cornerCount == 0) {
+                    memcpy(first, current, sizeof(first));
+                } else if (cornerCount >= 2) {
+                    addMeshTriangle(scene, first, previous, current, mtlColorIdx, textureIdx, normalIdx);
+                }
+                memcpy(previous, current, sizeof(previous));
+                cornerCount++;
+            }
+            if (cornerCount < 3) {
+                fprintf(stderr, "Mesh face on line %d of %s has fewer than 3 vertices.\n", lineIdx, objFileName);
+                exit(-1);
+            }
+        } else if (isMeshKeyword(cursor, "usemtl")) {
+            char name[MAX_MESH_NAME_LENGTH];
+            readMeshLineRest(cursor + strlen("usemtl"), name, MAX_MESH_NAME_LENGTH);
+            int materialIdx = findMeshMaterial(&library, name);
+            if (materialIdx < 0) {
+                fprintf(stderr, "Unknown material %s on line %d of %s.\n", name, lineIdx, objFileName);
+                exit(-1);
+            }
+            mtlColorIdx = library.materials[materialIdx].mtlColorIdx;
+            textureIdx = library.materials[materialIdx].textureIdx;
+            normalIdx = library.materials[materialIdx].normalIdx;
+        } else if (isMeshKeyword(cursor, "mtllib")) {
+            char mtlFileName[MAX_MESH_PATH_LENGTH];
+            char path[MAX_MESH_PATH_LENGTH];
+            readMeshLineRest(cursor + strlen("mtllib"), mtlFileName, MAX_MESH_PATH_LENGTH);
+            getMeshRelativePath(objFileName, mtlFileName, path);
+            readMeshMaterialLibrary(path, scene, &library);
+        }
+        cursor = skipMeshLine(cursor);
+        lineIdx++;
+    }
+
+    freeMeshMaterialLibrary(&library);
+    free(contents);
+}
+
+// Parses the vertex and normal of one face corner as 0-based indexes, -1 for a missing normal. Texture coordinates
+// are skipped. Returns NULL past the last corner.
+char* readClusterFaceCorner(char* cursor, int vertexCount, int vertexNormalCount, int* corner) {
+    char* end;
+    int v = (int) strtol(cursor, &end, 10);
+    if (end == cursor) {
+        return NULL;
+    }
+    int vn = 0;
+    if (*end == '/') {
+        end++;
+        if (*end != '/') {
+            strtol(end, &end, 10);
+        }
+        if (*end == '/') {
+            end++;
+            vn = (int) strtol(end, &end, 10);
+        }
+    }
+    corner[0] = resolveMeshIndex(v, 0, vertexCount) - 1;
+    corner[1] = resolveMeshIndex(vn, 0, vertexNormalCount) - 1;
+    return end;
+}
+
+// Interleaves the cell coordinates so cells that are close in space are close in the cell order.
+int getClusterCellIdx(const ClusterBuild* build, Vector3 centroid) {
+    int cellsPerAxis = 1 << build->gridBits;
+    float coordinates[3] = { centroid.x, centroid.y, centroid.z };
+    float minimums[3] = { build->centroidMin.x, build->centroidMin.y, build->centroidMin.z };
+    float maximums[3] = { build->centroidMax.x, build->centroidMax.y, build->centroidMax.z };
+    int cells[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = maximums[axis] - minimums[axis];
+        int cell = extent > 0.0f ? (int) ((coordinates[axis] - minimums[axis]) / extent * (float) cellsPerAxis) : 0;
+        cells[axis] = cell < 0 ? 0 : (cell >= cellsPerAxis ? cellsPerAxis - 1 : cell);
+    }
+    int cellIdx = 0;
+    for (int bit = build->gridBits - 1; bit >= 0; bit--) {
+        for (int axis = 0; axis < 3; axis++) {
+            cellIdx = (cellIdx << 1) | ((cells[axis] >> bit) & 1);
+        }
+    }
+    return cellIdx;
+}
+
+void flushClusterWriteBuffer(ClusterBuild* build, int clusterIdx) {
+    ClusterInfo* cluster = &build->clusters[clusterIdx];
+    size_t size = (size_t) build->writeBufferCounts[clusterIdx] * sizeof(ClusterTriangle);
+    long offset = cluster->offset + (long) cluster->triangleCount * (long) sizeof(ClusterTriangle);
+    if (pwrite(build->fileDescriptor, &build->writeBuffers[clusterIdx * CLUSTER_WRITE_BUFFER_TRIANGLE_COUNT], size, offset) != (ssize_t) size) {
+        fprintf(stderr, "Unable to write the out-of-core geometry.\n");
+        exit(-1);
+    }
+    cluster->triangleCount += build->writeBufferCounts[clusterIdx];
+    build->writeBufferCounts[clusterIdx] = 0;
+}
+
+// The first pass gathers the vertexes and the centroid bounds, the second counts triangles per grid cell and the
+// third writes every triangle into its cluster.
+void addClusterBuildTriangle(ClusterBuild* build, int pass, ClusterTriangle triangle) {
+    Vector3 centroid = {
+            .x = (triangle.v1.x + triangle.v2.x + triangle.v3.x) / 3.0f,
+            .y = (triangle.v1.y + triangle.v2.y + triangle.v3.y) / 3.0f,
+            .z = (triangle.v1.z + triangle.v2.z + triangle.v3.z) / 3.0f,
+    };
+    if (pass == 0) {
+        if (build->triangleCount == INT_MAX) {
+            fprintf(stderr, "Out-of-core meshes are limited to %d triangles.\n", INT_MAX);
+            exit(-1);
+        }
+        build->centroidMin = (Vector3) { .x = min(build->centroidMin.x, centroid.x), .y = min(build->centroidMin.y, centroid.y), .z = min(build->centroidMin.z, centroid.z) };
+        build->centroidMax = (Vector3) { .x = max(build->centroidMax.x, centroid.x), .y = max(build->centroidMax.y, centroid.y), .z = max(build->centroidMax.z, centroid.z) };
+        build->triangleCount++;
+        build->usesDefaultMaterial = build->usesDefaultMaterial || triangle.mtlColorIdx < 0;
+    } else if (pass == 1) {
+        build->cellTriangleCounts[getClusterCellIdx(build, centroid)]++;
+    } else {
+        int clusterIdx = build->cellClusterIdxs[getClusterCellIdx(build, centroid)];
+        ClusterInfo* cluster = &build->clusters[clusterIdx];
+        Vector3 corners[3] = { triangle.v1, triangle.v2, triangle.v3 };
+        for (int cornerIdx = 0; cornerIdx < 3; cornerIdx++) {
+            cluster->boundsMin = (Vector3) { .x = min(cluster->boundsMin.x, corners[cornerIdx].x), .y = min(cluster->boundsMin.y, corners[cornerIdx].y), .z = min(cluster->boundsMin.z, corners[cornerIdx].z) };
+            cluster->boundsMax = (Vector3) { .x = max(cluster->boundsMax.x, corners[cornerIdx].x), .y = max(cluster->boundsMax.y, corners[cornerIdx].y), .z = max(cluster->boundsMax.z, corners[cornerIdx].z) };
+        }
+        build->writeBuffers[clusterIdx * CLUSTER_WRITE_BUFFER_TRIANGLE_COUNT + build->writeBufferCounts[clusterIdx]] = triangle;
+        build->writeBufferCounts[clusterIdx]++;
+        if (build->writeBufferCounts[clusterIdx] == CLUSTER_WRITE_BUFFER_TRIANGLE_COUNT) {
+            flushClusterWriteBuffer(build, clusterIdx);
+        }
+    }
+}
+
+// Streams the OBJ file a line at a time, so only the vertex positions and normals of the mesh are ever held in memory.
+void readClusterBuildPass(const char* objFileName, int pass, ClusterBuild* build) {
+    FILE* filePtr = fopen(objFileName, "r");
+    if (filePtr == NULL) {
+        fprintf(stderr, "Unable to open the mesh file: %s.\n", objFileName);
+        exit(-1);
+    }
+
+    Scene materialScene = { 0 };
+    int mtlColorIdx = -1;
+    int vertexCount = 0;
+    int vertexNormalCount = 0;
+    int lineIdx = 1;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    while (getline(&line, &lineCapacity, filePtr) != -1) {
+        char* cursor = skipMeshSpaces(line);
+        if (isMeshKeyword(cursor, "v")) {
+            if (pass == 0) {
+                build->vertexes = (Vector3*) growSceneArray(build->vertexes, build->vertexCount, &build->vertexCapacity, INITIAL_VERTEX_COUNT, sizeof(Vector3), "vertexes");
+                build->vertexes[build->vertexCount] = readMeshVector3(cursor + 1);
+                build->vertexCount++;
+            }
+            vertexCount++;
+        } else if (isMeshKeyword(cursor, "vn")) {
+            if (pass == 0) {
+                build->vertexNormals = (Vector3*) growSceneArray(build->vertexNormals, build->vertexNormalCount, &build->vertexNormalCapacity, INITIAL_VERTEX_NORMAL_COUNT, sizeof(Vector3), "vertex normals");
+                build->vertexNormals[build->vertexNormalCount] = readMeshVector3(cursor + 2);
+                build->vertexNormalCount++;
+            }
+            vertexNormalCount++;
+        } else if (isMeshKeyword(cursor, "f")) {
+            int first[2] = { 0, -1 };
+            int previous[2] = { 0, -1 };
+            int current[2] = { 0, -1 };
+            int cornerCount = 0;
+            char* corner = cursor + 1;
+            while ((corner = readClusterFaceCorner(skipMeshSpaces(corner), vertexCount, vertexNormalCount, current)) != NULL) {
+                if (current[0] < 0 || current[0] >= vertexCount || current[1] < -1 || current[1] >= vertexNormalCount) {
+                    fprintf(stderr, "Mesh face on line %d of %s uses a vertex that does not exist.\n", lineIdx, objFileName);
+                    exit(-1);
+                }
+                if (cornerCount == 0) {
+                    memcpy(first, current, sizeof(first));
+                } else if (cornerCount >= 2) {
+                    // Like inline faces, a triangle is smooth shaded only when its first corner has a normal.
+                    bool smooth = first[1] >= 0 && previous[1] >= 0 && current[1] >= 0;
+                    Vector3 noNormal = { .x = 0.0f, .y = 0.0f, .z = 0.0f };
+                    addClusterBuildTriangle(build, pass, (ClusterTriangle) {
+                            .v1 = build->vertexes[first[0]],
+                            .v2 = build->vertexes[previous[0]],
+                            .v3 = build->vertexes[current[0]],
+                            .n1 = smooth ? build->vertexNormals[first[1]] : noNormal,
+                            .n2 = smooth ? build->vertexNormals[previous[1]] : noNormal,
+                            .n3 = smooth ? build->vertexNormals[current[1]] : noNormal,
+                            .mtlColorIdx = mtlColorIdx,
+                    });
+                }
+                memcpy(previous, current, sizeof(previous));
+                cornerCount++;
+            }
+            if (cornerCount < 3) {
+                fprintf(stderr, "Mesh face on line %d of %s has fewer than 3 vertices.\n", lineIdx, objFileName);
+                exit(-1);
+            }
+        } else if (isMeshKeyword(cursor, "usemtl")) {
+            char name[MAX_MESH_NAME_LENGTH];
+            readMeshLineRest(cursor + strlen("usemtl"), name, MAX_MESH_NAME_LENGTH);
+            int materialIdx = findMeshMaterial(&build->library, name);
+            if (materialIdx < 0) {
+                fprintf(stderr, "Unknown material %s on line %d of %s.\n", name, lineIdx, objFileName);
+                exit(-1);
+            }
+            mtlColorIdx = build->library.materials[materialIdx].mtlColorIdx;
+        } else if (pass == 0 && isMeshKeyword(cursor, "mtllib")) {
+            char mtlFileName[MAX_MESH_PATH_LENGTH];
+            char path[MAX_MESH_PATH_LENGTH];
+            readMeshLineRest(cursor + strlen("mtllib"), mtlFileName, MAX_MESH_PATH_LENGTH);
+            getMeshRelativePath(objFileName, mtlFileName, path);
+            readMeshMaterialLibrary(path, &materialScene, &build->library);
+        }
+        lineIdx++;
+    }
+
+    // Out-of-core triangles are shaded without textures, so only the material colors are kept.
+    if (pass == 0) {
+        build->mtlColors = materialScene.mtlColors;
+        build->mtlColorCount = materialScene.mtlColorCount;
+    }
+    for (int textureIdx = 0; textureIdx < materialScene.textureCount; textureIdx++) {
+        freePPMImage(&materialScene.textures[textureIdx]);
+    }
+    for (int normalIdx = 0; normalIdx < materialScene.normalCount; normalIdx++) {
+        freePPMImage(&materialScene.normals[normalIdx]);
+    }
+    free(materialScene.textures);
+    free(materialScene.normals);
+    free(line);
+    fclose(filePtr);
+}
+
+// Sorts the triangles of an OBJ file into a grid of cells and walks the cells in Morton order, closing a cluster
+// whenever the next cell would push it past CLUSTER_TRIANGLE_COUNT triangles. Each cluster is a contiguous,
+// spatially coherent run of triangles in the file.
+void buildClusterFile(const char* objFileName, const char* clusterFileName) {
+    ClusterBuild build = { 0 };
+    build.centroidMin = (Vector3) { .x = FLT_MAX, .y = FLT_MAX, .z = FLT_MAX };
+    build.centroidMax = (Vector3) { .x = -FLT_MAX, .y = -FLT_MAX, .z = -FLT_MAX };
+    readClusterBuildPass(objFileName, 0, &build);
+    if (build.triangleCount == 0) {
+        fprintf(stderr, "The mesh file %s has no faces.\n", objFileName);
+        exit(-1);
+    }
+
+    build.gridBits = 0;
+    while (build.gridBits < MAX_CLUSTER_GRID_BITS && (1L << (3 * build.gridBits)) * CLUSTER_GRID_TRIANGLES_PER_CELL < build.triangleCount) {
+        build.gridBits++;
+    }
+    int cellCount = 1 << (3 * build.gridBits);
+    build.cellTriangleCounts = (int*) calloc(cellCount, sizeof(int));
+    build.cellClusterIdxs = (int*) malloc(cellCount * sizeof(int));
+    if (build.cellTriangleCounts == NULL || build.cellClusterIdxs == NULL) {
+        fprintf(stderr, "Memory allocation error while building the out-of-core geometry.\n");
+        exit(-1);
+    }
+    readClusterBuildPass(objFileName, 1, &build);
+
+    int clusterTriangleCount = 0;
+    build.clusterCount = 0;
+    for (int cellIdx = 0; cellIdx < cellCount; cellIdx++) {
+        int cellTriangleCount = build.cellTriangleCounts[cellIdx];
+        if (cellTriangleCount > 0 && (build.clusterCount == 0 || clusterTriangleCount + cellTriangleCount > CLUSTER_TRIANGLE_COUNT)) {
+            build.clusterCount++;
+            clusterTriangleCount = 0;
+        }
+        build.cellClusterIdxs[cellIdx] = build.clusterCount - 1;
+        clusterTriangleCount += cellTriangleCount;
+    }
+
+    build.clusters = (ClusterInfo*) malloc(build.clusterCount * sizeof(ClusterInfo));
+    build.writeBuffers = (ClusterTriangle*) malloc((size_t) build.clusterCount * CLUSTER_WRITE_BUFFER_TRIANGLE_COUNT * sizeof(ClusterTriangle));
+    build.writeBufferCounts = (int*) calloc(build.clusterCount, sizeof(int));
+    if (build.clusters == NULL || build.writeBuffers == NULL || build.writeBufferCounts == NULL) {
+        fprintf(stderr, "Memory allocation error while building the out-of-core geometry.\n");
+        exit(-1);
+    }
+    long offset = (long) sizeof(ClusterFileHeader) + (long) build.mtlColorCount * (long) sizeof(MaterialColor) + (long) build.clusterCount * (long) sizeof(ClusterInfo);
+    for (int clusterIdx = 0; clusterIdx < build.clusterCount; clusterIdx++) {
+        build.clusters[clusterIdx] = (ClusterInfo) {
+                .boundsMin = (Vector3) { .x = FLT_MAX, .y = FLT_MAX, .z = FLT_MAX },
+                .boundsMax = (Vector3) { .x = -FLT_MAX, .y = -FLT_MAX, .z = -FLT_MAX },
+                .offset = 0,
+                .triangleCount = 0,
+                .firstTriangleIdx = 0,
+        };
+    }
+    // Cluster sizes are summed into firstTriangleIdx first and turned into running totals after.
+    for (int cellIdx = 0; cellIdx < cellCount; cellIdx++) {
+        if (build.cellTriangleCounts[cellIdx] > 0) {
+            build.clusters[build.cellClusterIdxs[cellIdx]].firstTriangleIdx += build.cellTriangleCounts[cellIdx];
+        }
+    }
+    int firstTriangleIdx = 0;
+    for (int clusterIdx = 0; clusterIdx < build.clusterCount; clusterIdx++) {
+        int triangleCount = build.clusters[clusterIdx].firstTriangleIdx;
+        build.clusters[clusterIdx].firstTriangleIdx = firstTriangleIdx;
+        build.clusters[clusterIdx].offset = offset + (long) firstTriangleIdx * (long) sizeof(ClusterTriangle);
+        build.clusters[clusterIdx].size = triangleCount * (int) sizeof(ClusterTriangle);
+        firstTriangleIdx += triangleCount;
+    }
+
+    build.fileDescriptor = open(clusterFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (build.fileDescriptor < 0) {
+        fprintf(stderr, "Unable to create the out-of-core geometry file: %s.\n", clusterFileName);
+        exit(-1);
+    }
+    readClusterBuildPass(objFileName, 2, &build);
+    for (int clusterIdx = 0; clusterIdx < build.clusterCount; clusterIdx++) {
+        flushClusterWriteBuffer(&build, clusterIdx);
+    }
+
+    ClusterFileHeader header = { 0 };
+    memcpy(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic));
+    header.materialCount = build.mtlColorCount;
+    header.clusterCount = build.clusterCount;
+    header.triangleCount = build.triangleCount;
+    header.usesDefaultMaterial = build.usesDefaultMaterial;
+    size_t materialsSize = (size_t) build.mtlColorCount * sizeof(MaterialColor);
+    size_t clustersSize = (size_t) build.clusterCount * sizeof(ClusterInfo);
+    if (pwrite(build.fileDescriptor, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        pwrite(build.fileDescriptor, build.mtlColors, materialsSize, sizeof(header)) != (ssize_t) materialsSize ||
+        pwrite(build.fileDescriptor, build.clusters, clustersSize, (off_t) (sizeof(header) + materialsSize)) != (ssize_t) clustersSize) {
+        fprintf(stderr, "Unable to write the out-of-core geometry file: %s.\n", clusterFileName);
+        exit(-1);
+    }
+    close(build.fileDescriptor);
+
+    freeMeshMaterialLibrary(&build.library);
+    free(build.vertexes);
+    free(build.vertexNormals);
+    free(build.mtlColors);
+    free(build.cellTriangleCounts);
+    free(build.cellClusterIdxs);
+    free(build.clusters);
+    free(build.writeBuffers);
+    free(build.writeBufferCounts);
+}
+
+
+void readClusterFileData(int fileDescriptor, void* data, size_t size, off_t offset, const char* clusterFileName) {
+    if (pread(fileDescriptor, data, size, offset) != (ssize_t) size) {
+        fprintf(stderr, "The out-of-core geometry file %s is truncated.\n", clusterFileName);
+        exit(-1);
+    }
+}
+
+int compareMaterialSortKeys(const void* a, const void* b) {
+    const MaterialSortKey* keyA = (const MaterialSortKey*) a;
+    const MaterialSortKey* keyB = (const MaterialSortKey*) b;
+    if (keyA->mtlColorIdx != keyB->mtlColorIdx) {
+        return keyA->mtlColorIdx < keyB->mtlColorIdx ? -1 : 1;
+    }
+    return keyA->triangleIdx - keyB->triangleIdx;
+}
+
+int compareQuantizedCorners(const void* a, const void* b) {
+    const QuantizedCorner* cornerA = (const QuantizedCorner*) a;
+    const QuantizedCorner* cornerB = (const QuantizedCorner*) b;
+    int difference = memcmp(cornerA->q, cornerB->q, sizeof(cornerA->q));
+    if (difference == 0) {
+        difference = memcmp(cornerA->normal, cornerB->normal, sizeof(cornerA->normal));
+    }
+    return difference != 0 ? difference : cornerA->cornerIdx - cornerB->cornerIdx;
+}
+
+// Sorted corners that share a lattice position and a normal become one vertex.
+bool isNewQuantizedVertex(const QuantizedCorner* corners, int cornerIdx) {
+    return cornerIdx == 0 ||
+           memcmp(corners[cornerIdx].q, corners[cornerIdx - 1].q, sizeof(corners[cornerIdx].q)) != 0 ||
+           memcmp(corners[cornerIdx].normal, corners[cornerIdx - 1].normal, sizeof(corners[cornerIdx].normal)) != 0;
+}
+
+size_t alignQuantizedCluster(size_t size) {
+    return (size + QUANTIZED_CLUSTER_ALIGNMENT - 1) / QUANTIZED_CLUSTER_ALIGNMENT * QUANTIZED_CLUSTER_ALIGNMENT;
+}
+
+int quantizeClusterCoordinate(float value, float origin, float step) {
+    return (int) lroundf((value - origin) / step);
+}
+
+// Packs one cluster: triangles are grouped by material into runs, corners with the same lattice position and
+// normal become one vertex, and vertexes are stored as 16-bit steps from the cluster's lowest lattice point.
+// Returns the packed size.
+size_t quantizeCluster(const ClusterFileHeader* header, const ClusterTriangle* triangles, int triangleCount, char* packed) {
+    MaterialSortKey* keys = (MaterialSortKey*) malloc((size_t) triangleCount * sizeof(MaterialSortKey));
+    QuantizedCorner* corners = (QuantizedCorner*) malloc((size_t) triangleCount * 3 * sizeof(QuantizedCorner));
+    if (keys == NULL || corners == NULL) {
+        fprintf(stderr, "Memory allocation error while quantizing the out-of-core geometry.\n");
+        exit(-1);
+    }
+    for (int triangleIdx = 0; triangleIdx < triangleCount; triangleIdx++) {
+        keys[triangleIdx] = (MaterialSortKey) {
+                .mtlColorIdx = triangles[triangleIdx].mtlColorIdx,
+                .triangleIdx = triangleIdx,
+        };
+    }
+    qsort(keys, triangleCount, sizeof(MaterialSortKey), compareMaterialSortKeys);
+
+    Vector3 origin = header->quantizationOrigin;
+    float step = header->quantizationStep;
+    for (int triangleIdx = 0; triangleIdx < triangleCount; triangleIdx++) {
+        const ClusterTriangle* triangle = &triangles[keys[triangleIdx].triangleIdx];
+        Vector3 positions[3] = { triangle->v1, triangle->v2, triangle->v3 };
+        Vector3 normals[3] = { triangle->n1, triangle->n2, triangle->n3 };
+        for (int cornerIdx = 0; cornerIdx < 3; cornerIdx++) {
+            QuantizedCorner* corner = &corners[triangleIdx * 3 + cornerIdx];
+            corner->q[0] = quantizeClusterCoordinate(positions[cornerIdx].x, origin.x, step);
+            corner->q[1] = quantizeClusterCoordinate(positions[cornerIdx].y, origin.y, step);
+            corner->q[2] = quantizeClusterCoordinate(positions[cornerIdx].z, origin.z, step);
+            encodeOctahedralNormal(normals[cornerIdx], corner->normal);
+            corner->cornerIdx = triangleIdx * 3 + cornerIdx;
+        }
+    }
+    qsort(corners, (size_t) triangleCount * 3, sizeof(QuantizedCorner), compareQuantizedCorners);
+
+    QuantizedClusterHeader* clusterHeader = (QuantizedClusterHeader*) packed;
+    clusterHeader->runCount = 0;
+    for (int triangleIdx = 0; triangleIdx < triangleCount; triangleIdx++) {
+        if (triangleIdx == 0 || keys[triangleIdx].mtlColorIdx != keys[triangleIdx - 1].mtlColorIdx) {
+            clusterHeader->runCount++;
+        }
+    }
+    int vertexCount = 0;
+    for (int cornerIdx = 0; cornerIdx < triangleCount * 3; cornerIdx++) {
+        if (isNewQuantizedVertex(corners, cornerIdx)) {
+            vertexCount++;
+        }
+    }
+    if (vertexCount > USHRT_MAX) {
+        fprintf(stderr, "A cluster of the out-of-core geometry has too many vertexes to quantize.\n");
+        exit(-1);
+    }
+    clusterHeader->vertexCount = (unsigned short) vertexCount;
+    for (int axis = 0; axis < 3; axis++) {
+        clusterHeader->base[axis] = INT_MAX;
+        for (int cornerIdx = 0; cornerIdx < triangleCount * 3; cornerIdx++) {
+            clusterHeader->base[axis] = corners[cornerIdx].q[axis] < clusterHeader->base[axis] ? corners[cornerIdx].q[axis] : clusterHeader->base[axis];
+        }
+    }
+
+    MaterialRun* runs = (MaterialRun*) getQuantizedMaterialRuns(clusterHeader);
+    int runIdx = -1;
+    for (int triangleIdx = 0; triangleIdx < triangleCount; triangleIdx++) {
+        if (triangleIdx == 0 || keys[triangleIdx].mtlColorIdx != keys[triangleIdx - 1].mtlColorIdx) {
+            runIdx++;
+            runs[runIdx] = (MaterialRun) {
+                    .mtlColorIdx = keys[triangleIdx].mtlColorIdx,
+                    .triangleCount = 0,
+            };
+        }
+        runs[runIdx].triangleCount++;
+    }
+
+    QuantizedVertex* vertexes = (QuantizedVertex*) getQuantizedVertexes(clusterHeader);
+    unsigned short* indexes = (unsigned short*) getQuantizedTriangles(clusterHeader);
+    int vertexIdx = -1;
+    for (int cornerIdx = 0; cornerIdx < triangleCount * 3; cornerIdx++) {
+        const QuantizedCorner* corner = &corners[cornerIdx];
+        if (isNewQuantizedVertex(corners, cornerIdx)) {
+            vertexIdx++;
+            for (int axis = 0; axis < 3; axis++) {
+                int position = corner->q[axis] - clusterHeader->base[axis];
+                if (position > USHRT_MAX) {
+                    fprintf(stderr, "A cluster of the out-of-core geometry is too large to quantize.\n");
                     exit(-1);
                 }
-                scene->mtlColors = newMtlColors;
+                vertexes[vertexIdx].position[axis] = (unsigned short) position;
             }
+            vertexes[vertexIdx].normal[0] = corner->normal[0];
+            vertexes[vertexIdx].normal[1] = corner->normal[1];
+        }
+        indexes[corner->cornerIdx] = (unsigned short) vertexIdx;
+    }
+
+    free(keys);
+    free(corners);
+    return alignQuantizedCluster((size_t) ((const char*) (indexes + triangleCount * 3) - packed));
+}
+
+// Rewrites a cluster file in the quantized layout, one cluster at a time. All clusters share one lattice whose
+// step is fine enough for the largest cluster to span it with 16 bits.
+void quantizeClusterFile(const char* floatFileName, const char* quantizedFileName) {
+    int input = open(floatFileName, O_RDONLY);
+    int output = open(quantizedFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (input < 0 || output < 0) {
+        fprintf(stderr, "Unable to create the out-of-core geometry file: %s.\n", quantizedFileName);
+        exit(-1);
+    }
+    ClusterFileHeader header;
+    readClusterFileData(input, &header, sizeof(header), 0, floatFileName);
+    size_t materialsSize = (size_t) header.materialCount * sizeof(MaterialColor);
+    size_t clustersSize = (size_t) header.clusterCount * sizeof(ClusterInfo);
+    MaterialColor* mtlColors = (MaterialColor*) malloc(materialsSize + 1);
+    ClusterInfo* clusters = (ClusterInfo*) malloc(clustersSize);
+    if (mtlColors == NULL || clusters == NULL) {
+        fprintf(stderr, "Memory allocation error while quantizing the out-of-core geometry.\n");
+        exit(-1);
+    }
+    readClusterFileData(input, mtlColors, materialsSize, sizeof(header), floatFileName);
+    readClusterFileData(input, clusters, clustersSize, (off_t) (sizeof(header) + materialsSize), floatFileName);
+
+    float maxExtent = 0.0f;
+    int maxTriangleCount = 0;
+    header.quantizationOrigin = (Vector3) { .x = FLT_MAX, .y = FLT_MAX, .z = FLT_MAX };
+    for (int clusterIdx = 0; clusterIdx < header.clusterCount; clusterIdx++) {
+        const ClusterInfo* cluster = &clusters[clusterIdx];
+        header.quantizationOrigin.x = min(header.quantizationOrigin.x, cluster->boundsMin.x);
+        header.quantizationOrigin.y = min(header.quantizationOrigin.y, cluster->boundsMin.y);
+        header.quantizationOrigin.z = min(header.quantizationOrigin.z, cluster->boundsMin.z);
+        maxExtent = max(maxExtent, max(cluster->boundsMax.x - cluster->boundsMin.x, max(cluster->boundsMax.y - cluster->boundsMin.y, cluster->boundsMax.z - cluster->boundsMin.z)));
+        maxTriangleCount = cluster->triangleCount > maxTriangleCount ? cluster->triangleCount : maxTriangleCount;
+    }
+    // Two steps of headroom absorb rounding at both ends of the largest cluster.
+    header.quantizationStep = maxExtent > 0.0f ? maxExtent / (float) (QUANTIZED_POSITION_STEPS - 2) : 1.0f;
+    header.quantized = true;
+
+    ClusterTriangle* triangles = (ClusterTriangle*) malloc((size_t) maxTriangleCount * sizeof(ClusterTriangle));
+    size_t maxPackedSize = alignQuantizedCluster(sizeof(QuantizedClusterHeader) + (size_t) maxTriangleCount * (sizeof(MaterialRun) + 3 * sizeof(QuantizedVertex) + 3 * sizeof(unsigned short)));
+    char* packed = (char*) malloc(maxPackedSize);
+    if (triangles == NULL || packed == NULL) {
+        fprintf(stderr, "Memory allocation error while quantizing the out-of-core geometry.\n");
+        exit(-1);
+    }
+    long offset = (long) alignQuantizedCluster(sizeof(header) + materialsSize + clustersSize);
+    for (int clusterIdx = 0; clusterIdx < header.clusterCount; clusterIdx++) {
+        ClusterInfo* cluster = &clusters[clusterIdx];
+        readClusterFileData(input, triangles, (size_t) cluster->triangleCount * sizeof(ClusterTriangle), cluster->offset, floatFileName);
+        size_t packedSize = quantizeCluster(&header, triangles, cluster->triangleCount, packed);
+        if (pwrite(output, packed, packedSize, offset) != (ssize_t) packedSize) {
+            fprintf(stderr, "Unable to write the out-of-core geometry file: %s.\n", quantizedFileName);
+            exit(-1);
+        }
+        cluster->offset = offset;
+        cluster->size = (int) packedSize;
+        offset += (long) packedSize;
+    }
+
+    if (pwrite(output, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        pwrite(output, mtlColors, materialsSize, sizeof(header)) != (ssize_t) materialsSize ||
+        pwrite(output, clusters, clustersSize, (off_t) (sizeof(header) + materialsSize)) != (ssize_t) clustersSize) {
+        fprintf(stderr, "Unable to write the out-of-core geometry file: %s.\n", quantizedFileName);
+        exit(-1);
+    }
+    close(input);
+    close(output);
+    free(mtlColors);
+    free(clusters);
+    free(triangles);
+    free(packed);
+}
+
+// Halves the cluster range at every level. Clusters are in Morton order, so each half is a compact region of space.
+int buildClusterNode(ClusterCache* cache, int start, int end) {
+    int nodeIdx = cache->nodeCount;
+    cache->nodeCount++;
+    ClusterNode* node = &cache->nodes[nodeIdx];
+    if (end - start == 1) {
+        (*node) = (ClusterNode) {
+                .boundsMin = cache->clusters[start].info.boundsMin,
+                .boundsMax = cache->clusters[start].info.boundsMax,
+                .left = -1,
+                .right = -1,
+                .clusterIdx = start,
+        };
+        return nodeIdx;
+    }
+    int middle = (start + end) / 2;
+    int left = buildClusterNode(cache, start, middle);
+    int right = buildClusterNode(cache, middle, end);
+    const ClusterNode* leftNode = &cache->nodes[left];
+    const ClusterNode* rightNode = &cache->nodes[right];
+    cache->nodes[nodeIdx] = (ClusterNode) {
+            .boundsMin = (Vector3) { .x = min(leftNode->boundsMin.x, rightNode->boundsMin.x), .y = min(leftNode->boundsMin.y, rightNode->boundsMin.y), .z = min(leftNode->boundsMin.z, rightNode->boundsMin.z) },
+            .boundsMax = (Vector3) { .x = max(leftNode->boundsMax.x, rightNode->boundsMax.x), .y = max(leftNode->boundsMax.y, rightNode->boundsMax.y), .z = max(leftNode->boundsMax.z, rightNode->boundsMax.z) },
+            .left = left,
+            .right = right,
+            .clusterIdx = -1,
+    };
+    return nodeIdx;
+}
+
+void buildClusterHierarchy(ClusterCache* cache) {
+    free(cache->nodes);
+    cache->nodes = (ClusterNode*) malloc((size_t) (2 * cache->clusterCount - 1) * sizeof(ClusterNode));
+    if (cache->nodes == NULL) {
+        fprintf(stderr, "Memory allocation error while building the cluster hierarchy.\n");
+        exit(-1);
+    }
+    cache->nodeCount = 0;
+    buildClusterNode(cache, 0, cache->clusterCount);
+}
+
+// A cluster file is reused while it is newer than its OBJ file and was written by this version of the program.
+bool isClusterFileCurrent(const char* clusterFileName, const struct stat* objStat) {
+    struct stat clusterStat;
+    if (stat(clusterFileName, &clusterStat) != 0 || clusterStat.st_mtime < objStat->st_mtime) {
+        return false;
+    }
+    FILE* filePtr = fopen(clusterFileName, "rb");
+    ClusterFileHeader header;
+    bool current = filePtr != NULL && fread(&header, sizeof(header), 1, filePtr) == 1 && memcmp(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic)) == 0;
+    if (filePtr != NULL) {
+        fclose(filePtr);
+    }
+    return current;
+}
+
+// A clustermesh is built into <mesh>.clusters, or <mesh>.qclusters when quantized, the first time it is used and
+// whenever the OBJ file is newer. Only the materials and the cluster bounds are read now, triangles are mapped in
+// while rendering.
+pthread_mutex_t clusterFileMutex = PTHREAD_MUTEX_INITIALIZER; // scenes of a batch may load the same mesh at once
+
+void readClusterMesh(const char* objFileName, bool quantized, const CurrentMaterial* currentMaterial, Scene* scene) {
+    char clusterFileName[MAX_CLUSTER_FILE_NAME_LENGTH];
+    // The quantized build writes its float clusters to <mesh>.qclusters.tmp first, so that name has to fit as well.
+    int clusterFileNameLength = snprintf(clusterFileName, MAX_CLUSTER_FILE_NAME_LENGTH, quantized ? "%s.qclusters" : "%s.clusters", objFileName);
+    if (clusterFileNameLength < 0 || clusterFileNameLength + (int) strlen(".tmp") >= MAX_CLUSTER_FILE_NAME_LENGTH) {
+        fprintf(stderr, "The mesh file path is too long: %s.\n", objFileName);
+        exit(-1);
+    }
+    struct stat objStat;
+    if (stat(objFileName, &objStat) != 0) {
+        fprintf(stderr, "Unable to open the mesh file: %s.\n", objFileName);
+        exit(-1);
+    }
+    pthread_mutex_lock(&clusterFileMutex);
+    if (!isClusterFileCurrent(clusterFileName, &objStat)) {
+        if (quantized) {
+            char floatFileName[MAX_CLUSTER_FILE_NAME_LENGTH];
+            if (snprintf(floatFileName, MAX_CLUSTER_FILE_NAME_LENGTH, "%s.tmp", clusterFileName) >= MAX_CLUSTER_FILE_NAME_LENGTH) {
+                fprintf(stderr, "The mesh file path is too long: %s.\n", objFileName);
+                exit(-1);
+            }
+            buildClusterFile(objFileName, floatFileName);
+            quantizeClusterFile(floatFileName, clusterFileName);
+            unlink(floatFileName);
+        } else {
+            buildClusterFile(objFileName, clusterFileName);
+        }
+    }
+    pthread_mutex_unlock(&clusterFileMutex);
+
+    int fileDescriptor = open(clusterFileName, O_RDONLY);
+    if (fileDescriptor < 0) {
+        fprintf(stderr, "Unable to open the out-of-core geometry file: %s.\n", clusterFileName);
+        exit(-1);
+    }
+    ClusterFileHeader header;
+    readClusterFileData(fileDescriptor, &header, sizeof(header), 0, clusterFileName);
+    if (header.usesDefaultMaterial && currentMaterial->mtlColorIdx < 0) {
+        fprintf(stderr, "%s has faces without a material. Add a mtlcolor before the clustermesh or a usemtl to the file.\n", objFileName);
+        exit(-1);
+    }
+
+    if (scene->clusterCache == NULL) {
+        scene->clusterCache = createClusterCache(scene->clusterBudget);
+    }
+    ClusterCache* cache = scene->clusterCache;
+    if ((long) cache->triangleCount + header.triangleCount > INT_MAX) {
+        fprintf(stderr, "Out-of-core meshes are limited to %d triangles.\n", INT_MAX);
+        exit(-1);
+    }
+    cache->files = (ClusterFile*) growSceneArray(cache->files, cache->fileCount, &cache->fileCapacity, 1, sizeof(ClusterFile), "cluster files");
+    cache->files[cache->fileCount] = (ClusterFile) {
+            .fileDescriptor = fileDescriptor,
+            .mtlColorBase = scene->mtlColorCount,
+            .defaultMtlColorIdx = currentMaterial->mtlColorIdx,
+            .quantized = header.quantized,
+            .quantizationOrigin = header.quantizationOrigin,
+            .quantizationStep = header.quantizationStep,
+    };
+
+    off_t offset = sizeof(header);
+    for (int materialIdx = 0; materialIdx < header.materialCount; materialIdx++) {
+        scene->mtlColors = (MaterialColor*) growSceneArray(scene->mtlColors, scene->mtlColorCount, &scene->arena.mtlColorCapacity, INITIAL_MTLCOLOR_COUNT, sizeof(MaterialColor), "material colors");
+        readClusterFileData(fileDescriptor, &scene->mtlColors[scene->mtlColorCount], sizeof(MaterialColor), offset, clusterFileName);
+        scene->mtlColorCount++;
+        offset += sizeof(MaterialColor);
+    }
+    for (int clusterIdx = 0; clusterIdx < header.clusterCount; clusterIdx++) {
+        cache->clusters = (Cluster*) growSceneArray(cache->clusters, cache->clusterCount, &cache->clusterCapacity, INITIAL_FACE_COUNT, sizeof(Cluster), "clusters");
+        Cluster* cluster = &cache->clusters[cache->clusterCount];
+        readClusterFileData(fileDescriptor, &cluster->info, sizeof(ClusterInfo), offset, clusterFileName);
+        cluster->info.firstTriangleIdx += cache->triangleCount;
+        cluster->fileIdx = cache->fileCount;
+        cluster->mapping = NULL;
+        cluster->mappingSize = 0;
+        atomic_init(&cluster->data, NULL);
+        atomic_init(&cluster->refCount, 0);
+        atomic_init(&cluster->referenced, false);
+        cluster->residentIdx = -1;
+        cache->clusterCount++;
+        offset += sizeof(ClusterInfo);
+    }
+    cache->triangleCount += header.triangleCount;
+    cache->fileCount++;
+    cache->residentClusterIdxs = (int*) realloc(cache->residentClusterIdxs, (size_t) cache->clusterCount * sizeof(int));
+    if (cache->residentClusterIdxs == NULL) {
+        fprintf(stderr, "Memory allocation error while reading %s.\n", clusterFileName);
+        exit(-1);
+    }
+    buildClusterHierarchy(cache);
+}
+
+// Every mesh file is an object of its own, and inline faces form one object per run between mesh files. Objects
+// are numbered in scene file order, which is how camera paths refer to them.
+void addSceneObject(Scene* scene, bool inlineFaces) {
+    scene->objects = (MeshObject*) growSceneArray(scene->objects, scene->objectCount, &scene->arena.objectCapacity, INITIAL_OBJECT_COUNT, sizeof(MeshObject), "objects");
+    scene->objects[scene->objectCount] = (MeshObject) {
+            .firstFace = scene->faceCount,
+            .faceCount = 0,
+            .inlineFaces = inlineFaces,
+            .rootNodeIdx = -1,
+    };
+    scene->objectCount++;
+}
+
+// Objects take the mtlcolor, texture and bump last given in the scene file, not the last ones a mesh added.
+int getCurrentMtlColorIdx(const CurrentMaterial* currentMaterial, const char* type) {
+    if (currentMaterial->mtlColorIdx < 0) {
+        fprintf(stderr, "A %s comes before any mtlcolor, add one before it.\n", type);
+        exit(-1);
+    }
+    return currentMaterial->mtlColorIdx;
+}
+
+void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
+    CurrentMaterial currentMaterial = (CurrentMaterial) {
+            .mtlColorIdx = -1,
+            .textureIdx = -1,
+            .normalIdx = -1,
+    };
+    // todo: break each of these out into a method?
+    while (inputFileWordsByLine[*line][0] != NULL) {
+        if (strcmp(inputFileWordsByLine[*line][0], "mtlcolor") == 0) {
+            scene->mtlColors = (MaterialColor*) growSceneArray(scene->mtlColors, scene->mtlColorCount, &scene->arena.mtlColorCapacity, INITIAL_MTLCOLOR_COUNT, sizeof(MaterialColor), "material colors");
             checkValues(inputFileWordsByLine[*line], 12, "mtlcolor");
             scene->mtlColors[scene->mtlColorCount].diffuseColor = (Vector3) {
                     .x = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -492,44 +1771,22 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
             if (inputFileWordsByLine[*line][13] != NULL) {
                 scene->mtlColors[scene->mtlColorCount].attenuationCoefficient = convertStringToFloat(inputFileWordsByLine[*line][13]);
             }
+            currentMaterial.mtlColorIdx = scene->mtlColorCount;
             scene->mtlColorCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "texture") == 0) {
-            if (scene->textureCount >= INITIAL_TEXTURE_COUNT * textureAllocationCount) {
-                textureAllocationCount++;
-                PPMImage* newTextures = (PPMImage*) realloc(scene->textures, (INITIAL_TEXTURE_COUNT * textureAllocationCount) * sizeof(PPMImage));
-                if (newTextures == NULL) {
-                    fprintf(stderr, "Memory allocation failed for textures.");
-                    exit(-1);
-                }
-                scene->textures = newTextures;
-            }
+            scene->textures = (PPMImage*) growSceneArray(scene->textures, scene->textureCount, &scene->arena.textureCapacity, INITIAL_TEXTURE_COUNT, sizeof(PPMImage), "textures");
             checkValues(inputFileWordsByLine[*line], 1, "texture");
-            scene->textures[scene->textureCount] = readPPM(inputFileWordsByLine[*line][1]);
+            scene->textures[scene->textureCount] = readScenePPM(scene->textureCache, inputFileWordsByLine[*line][1]);
+            currentMaterial.textureIdx = scene->textureCount;
             scene->textureCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "bump") == 0) {
-            if (scene->normalCount >= INITIAL_NORMAL_COUNT * normalAllocationCount) {
-                normalAllocationCount++;
-                PPMImage* newNormals = (PPMImage*) realloc(scene->normals, (INITIAL_NORMAL_COUNT * normalAllocationCount) * sizeof(PPMImage));
-                if (newNormals == NULL) {
-                    fprintf(stderr, "Memory allocation failed for normals.");
-                    exit(-1);
-                }
-                scene->normals = newNormals;
-            }
+            scene->normals = (PPMImage*) growSceneArray(scene->normals, scene->normalCount, &scene->arena.normalCapacity, INITIAL_NORMAL_COUNT, sizeof(PPMImage), "normals");
             checkValues(inputFileWordsByLine[*line], 1, "bump");
-            scene->normals[scene->normalCount] = readPPM(inputFileWordsByLine[*line][1]);
+            scene->normals[scene->normalCount] = readScenePPM(scene->textureCache, inputFileWordsByLine[*line][1]);
+            currentMaterial.normalIdx = scene->normalCount;
             scene->normalCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "sphere") == 0) {
-            if (scene->sphereCount >= INITIAL_SPHERE_COUNT * sphereAllocationCount) {
-                // todo, bumps apply to other textures below it...
-                sphereAllocationCount++;
-                Sphere* newSpheres = (Sphere*) realloc(scene->spheres, (INITIAL_SPHERE_COUNT * sphereAllocationCount) * sizeof(Sphere));
-                if (newSpheres == NULL) {
-                    fprintf(stderr, "Memory allocation failed for spheres.");
-                    exit(-1);
-                }
-                scene->spheres = newSpheres;
-            }
+            scene->spheres = (Sphere*) growSceneArray(scene->spheres, scene->sphereCount, &scene->arena.sphereCapacity, INITIAL_SPHERE_COUNT, sizeof(Sphere), "spheres");
             checkValues(inputFileWordsByLine[*line], 4, "sphere");
             Vector3 spherePosition = {
                     .x = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -538,21 +1795,12 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
             };
             scene->spheres[scene->sphereCount].center = spherePosition;
             scene->spheres[scene->sphereCount].radius = convertStringToFloat(inputFileWordsByLine[*line][4]);
-            scene->spheres[scene->sphereCount].mtlColorIdx = scene->mtlColorCount - 1;
-            scene->spheres[scene->sphereCount].textureIdx = scene->textureCount - 1;
-            scene->spheres[scene->sphereCount].normalIdx = scene->normalCount - 1;
+            scene->spheres[scene->sphereCount].mtlColorIdx = getCurrentMtlColorIdx(&currentMaterial, "sphere");
+            scene->spheres[scene->sphereCount].textureIdx = currentMaterial.textureIdx;
+            scene->spheres[scene->sphereCount].normalIdx = currentMaterial.normalIdx;
             scene->sphereCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "bvhsphere") == 0) {
-            if (scene->bvhSphereCount >= INITIAL_BVH_SPHERE_COUNT * bvhSphereAllocationCount) {
-                // todo, bumps apply to other textures below it...
-                bvhSphereAllocationCount++;
-                Sphere* newBvhSpheres = (Sphere*) realloc(scene->bvhSpheres, (INITIAL_BVH_SPHERE_COUNT * bvhSphereAllocationCount) * sizeof(Sphere));
-                if (newBvhSpheres == NULL) {
-                    fprintf(stderr, "Memory allocation failed for BVH spheres.");
-                    exit(-1);
-                }
-                scene->bvhSpheres = newBvhSpheres;
-            }
+            scene->bvhSpheres = (Sphere*) growSceneArray(scene->bvhSpheres, scene->bvhSphereCount, &scene->arena.bvhSphereCapacity, INITIAL_BVH_SPHERE_COUNT, sizeof(Sphere), "BVH spheres");
             checkValues(inputFileWordsByLine[*line], 4, "bvhSphere");
             Vector3 spherePosition = {
                     .x = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -561,20 +1809,12 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
             };
             scene->bvhSpheres[scene->bvhSphereCount].center = spherePosition;
             scene->bvhSpheres[scene->bvhSphereCount].radius = convertStringToFloat(inputFileWordsByLine[*line][4]);
-            scene->bvhSpheres[scene->bvhSphereCount].mtlColorIdx = scene->mtlColorCount - 1;
-            scene->bvhSpheres[scene->bvhSphereCount].textureIdx = scene->textureCount - 1;
-            scene->bvhSpheres[scene->bvhSphereCount].normalIdx = scene->normalCount - 1;
+            scene->bvhSpheres[scene->bvhSphereCount].mtlColorIdx = getCurrentMtlColorIdx(&currentMaterial, "bvhsphere");
+            scene->bvhSpheres[scene->bvhSphereCount].textureIdx = currentMaterial.textureIdx;
+            scene->bvhSpheres[scene->bvhSphereCount].normalIdx = currentMaterial.normalIdx;
             scene->bvhSphereCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "ellipse") == 0) {
-            if (scene->ellipsoidCount >= INITIAL_ELLIPSOID_COUNT * ellipsoidAllocationCount) {
-                ellipsoidAllocationCount++;
-                Ellipsoid* newEllipsoids = (Ellipsoid*) realloc(scene->ellipsoids, (INITIAL_ELLIPSOID_COUNT * ellipsoidAllocationCount) * sizeof(Ellipsoid));
-                if (newEllipsoids == NULL) {
-                    fprintf(stderr, "Memory allocation failed for ellipsoids.");
-                    exit(-1);
-                }
-                scene->ellipsoids = newEllipsoids;
-            }
+            scene->ellipsoids = (Ellipsoid*) growSceneArray(scene->ellipsoids, scene->ellipsoidCount, &scene->arena.ellipsoidCapacity, INITIAL_ELLIPSOID_COUNT, sizeof(Ellipsoid), "ellipsoids");
             checkValues(inputFileWordsByLine[*line], 6, "ellipse");
             Vector3 ellipsoidCenter = {
                     .x = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -588,27 +1828,16 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
             };
             scene->ellipsoids[scene->ellipsoidCount].center = ellipsoidCenter;
             scene->ellipsoids[scene->ellipsoidCount].radius = ellipsoidRadius;
-            scene->ellipsoids[scene->ellipsoidCount].mtlColorIdx = scene->mtlColorCount - 1;
-            scene->ellipsoids[scene->ellipsoidCount].textureIdx = scene->textureCount - 1;
-            scene->ellipsoids[scene->ellipsoidCount].normalIdx = scene->normalCount - 1;
+            scene->ellipsoids[scene->ellipsoidCount].mtlColorIdx = getCurrentMtlColorIdx(&currentMaterial, "ellipse");
+            scene->ellipsoids[scene->ellipsoidCount].textureIdx = currentMaterial.textureIdx;
+            scene->ellipsoids[scene->ellipsoidCount].normalIdx = currentMaterial.normalIdx;
             scene->ellipsoidCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "v") == 0) {
-            readVertex(inputFileWordsByLine, scene, *line, &vertexAllocationCount);
+            readVertex(inputFileWordsByLine, scene, *line);
         } else if (strcmp(inputFileWordsByLine[*line][0], "vn") == 0) {
-            readVertexNormal(inputFileWordsByLine, scene, *line, &vertexNormalAllocationCount);
+            readVertexNormal(inputFileWordsByLine, scene, *line);
         } else if (strcmp(inputFileWordsByLine[*line][0], "vt") == 0) {
-            if (scene->vertexTextureCount == 0) {
-                vertexTextureAllocationCount = 1;
-                scene->vertexTextures = (TextureCoordinate*) malloc(INITIAL_VERTEX_TEXTURE_COUNT * sizeof(TextureCoordinate));
-            } else if (scene->vertexTextureCount >= INITIAL_VERTEX_TEXTURE_COUNT * vertexTextureAllocationCount) {
-                vertexTextureAllocationCount++;
-                TextureCoordinate* newVertexTextures = (TextureCoordinate*) realloc(scene->vertexTextures, (INITIAL_VERTEX_TEXTURE_COUNT * vertexTextureAllocationCount) * sizeof(TextureCoordinate));
-                if (newVertexTextures == NULL) {
-                    fprintf(stderr, "Memory allocation failed for vertex textures.");
-                    exit(-1);
-                }
-                scene->vertexTextures = newVertexTextures;
-            }
+            scene->vertexTextures = (TextureCoordinate*) growSceneArray(scene->vertexTextures, scene->vertexTextureCount, &scene->arena.vertexTextureCapacity, INITIAL_VERTEX_TEXTURE_COUNT, sizeof(TextureCoordinate), "vertex textures");
             checkValues(inputFileWordsByLine[*line], 2, "vt");
             scene->vertexTextures[scene->vertexTextureCount] = (TextureCoordinate) {
                     .u = convertStringToFloat(inputFileWordsByLine[*line][1]),
@@ -616,15 +1845,7 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
             };
             scene->vertexTextureCount++;
         } else if (strcmp(inputFileWordsByLine[*line][0], "f") == 0) {
-            if (scene->faceCount >= INITIAL_FACE_COUNT * faceAllocationCount) {
-                faceAllocationCount++;
-                Face * newFaces = (Face *) realloc(scene->faces, (INITIAL_FACE_COUNT * faceAllocationCount) * sizeof(Face));
-                if (newFaces == NULL) {
-                    fprintf(stderr, "Memory allocation failed for faces.");
-                    exit(-1);
-                }
-                scene->faces = newFaces;
-            }
+            scene->faces = (Face*) growSceneArray(scene->faces, scene->faceCount, &scene->arena.faceCapacity, INITIAL_FACE_COUNT, sizeof(Face), "faces");
             checkValues(inputFileWordsByLine[*line], 3, "f");
             scene->faces[scene->faceCount] = (Face) {
                     .v1 = 0,
@@ -636,19 +1857,345 @@ void readSceneObjects(char*** inputFileWordsByLine, int* line, Scene* scene) {
                     .vn1 = 0,
                     .vn2 = 0,
                     .vn3 = 0,
-                    .mtlColorIdx = scene->mtlColorCount - 1,
-                    .textureIdx = scene->textureCount - 1,
-                    .normalIdx = scene->normalCount - 1,
+                    .mtlColorIdx = getCurrentMtlColorIdx(&currentMaterial, "face"),
+                    .textureIdx = currentMaterial.textureIdx,
+                    .normalIdx = currentMaterial.normalIdx,
             };
             parseFaceValues(inputFileWordsByLine[*line], 1, scene, *line);
             parseFaceValues(inputFileWordsByLine[*line], 2, scene, *line);
             parseFaceValues(inputFileWordsByLine[*line], 3, scene, *line);
+            if (scene->objectCount == 0 || !scene->objects[scene->objectCount - 1].inlineFaces) {
+                addSceneObject(scene, true);
+            }
+            scene->objects[scene->objectCount - 1].faceCount++;
             scene->faceCount++;
+        } else if (strcmp(inputFileWordsByLine[*line][0], "mesh") == 0) {
+            checkValues(inputFileWordsByLine[*line], 1, "mesh");
+            addSceneObject(scene, false);
+            readMesh(inputFileWordsByLine[*line][1], &currentMaterial, scene);
+            scene->objects[scene->objectCount - 1].faceCount = scene->faceCount - scene->objects[scene->objectCount - 1].firstFace;
+        } else if (strcmp(inputFileWordsByLine[*line][0], "clustermesh") == 0) {
+            bool quantized = inputFileWordsByLine[*line][1] != NULL && inputFileWordsByLine[*line][2] != NULL;
+            checkValues(inputFileWordsByLine[*line], quantized ? 2 : 1, "clustermesh");
+            if (quantized && strcmp(inputFileWordsByLine[*line][2], "quantized") != 0) {
+                fprintf(stderr, "Unknown clustermesh option '%s', the only option is 'quantized'.\n", inputFileWordsByLine[*line][2]);
+                exit(-1);
+            }
+            readClusterMesh(inputFileWordsByLine[*line][1], quantized, &currentMaterial, scene);
         }
         (*line)++;
     }
 }
 
+ObjectTransform getIdentityObjectTransform() {
+    return (ObjectTransform) {
+            .translation = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
+            .rotationAxis = (Vector3) { .x = 0.0f, .y = 1.0f, .z = 0.0f },
+            .rotationAngle = 0.0f,
+            .scale = (Vector3) { .x = 1.0f, .y = 1.0f, .z = 1.0f },
+    };
+}
+
+ObjectTransform* copyObjectTransforms(const ObjectTransform* transforms, int objectCount) {
+    ObjectTransform* copy = (ObjectTransform*) malloc((size_t) (objectCount + 1) * sizeof(ObjectTransform));
+    if (copy == NULL) {
+        fprintf(stderr, "Memory allocation error while reading the camera path.\n");
+        exit(-1);
+    }
+    memcpy(copy, transforms, (size_t) objectCount * sizeof(ObjectTransform));
+    return copy;
+}
+
+ObjectTransform* getKeyframeObjectTransform(char** wordsInLine, int expectedNumber, const Scene* scene, CameraKeyframe* keyframe) {
+    checkValues(wordsInLine, expectedNumber, wordsInLine[0]);
+    int objectIdx = convertStringToInt(wordsInLine[1]);
+    if (objectIdx < 0 || objectIdx >= scene->objectCount) {
+        fprintf(stderr, "Camera path refers to object %d, but the scene has %d objects.\n", objectIdx, scene->objectCount);
+        exit(-1);
+    }
+    return &keyframe->objectTransforms[objectIdx];
+}
+
+// A camera path is a list of `frame` blocks. Each frame starts from the previous frame's camera and object placement
+// (the scene's for the first one) and may override eye, viewdir, updir, hfov or vfov using the scene file syntax.
+// Objects are moved with `translate <object> x y z`, `rotate <object> x y z degrees` and `scale <object> x y z`,
+// applied as scale, then rotation, then translation. `vertex <v> x y z` moves the scene's v-th vertex, counted from 1
+// like in faces, for this frame and the ones after it.
+CameraPath readCameraPath(char* cameraPathFileName, const Scene* scene) {
+    FILE* cameraPathFilePtr = fopen(cameraPathFileName, "r");
+    if (cameraPathFilePtr == NULL) {
+        fprintf(stderr, "Unable to open the camera path file: %s.\n", cameraPathFileName);
+        exit(-1);
+    }
+
+    CameraPath cameraPath = (CameraPath) {
+            .keyframes = NULL,
+            .keyframeCount = 0,
+            .keyframeCapacity = 0,
+    };
+    CameraKeyframe keyframe = (CameraKeyframe) {
+            .eye = scene->eye,
+            .viewDir = scene->viewDir,
+            .upDir = scene->upDir,
+            .fov = scene->fov,
+            .objectTransforms = (ObjectTransform*) malloc((size_t) (scene->objectCount + 1) * sizeof(ObjectTransform)),
+            .vertexMoves = NULL,
+            .vertexMoveCount = 0,
+            .vertexMoveCapacity = 0,
+    };
+    if (keyframe.objectTransforms == NULL) {
+        fprintf(stderr, "Memory allocation error while reading the camera path.\n");
+        exit(-1);
+    }
+    for (int objectIdx = 0; objectIdx < scene->objectCount; objectIdx++) {
+        keyframe.objectTransforms[objectIdx] = getIdentityObjectTransform();
+    }
+
+    char currentLine[MAX_INPUT_LINE_LENGTH];
+    char* wordsInLine[MAX_WORDS_PER_LINE];
+    int line = 0;
+    while (fgets(currentLine, MAX_INPUT_LINE_LENGTH, cameraPathFilePtr) != NULL) {
+        line++;
+        readLine(currentLine, wordsInLine, MAX_WORDS_PER_LINE);
+        if (wordsInLine[0] == NULL) {
+            continue;
+        }
+        if (strcmp(wordsInLine[0], "frame") != 0 && cameraPath.keyframeCount == 0) {
+            fprintf(stderr, "Camera path line %d comes before the first 'frame'.\n", line);
+            exit(-1);
+        }
+        CameraKeyframe* currentKeyframe = cameraPath.keyframeCount > 0 ? &cameraPath.keyframes[cameraPath.keyframeCount - 1] : NULL;
+        if (strcmp(wordsInLine[0], "frame") == 0) {
+            cameraPath.keyframes = (CameraKeyframe*) growSceneArray(cameraPath.keyframes, cameraPath.keyframeCount, &cameraPath.keyframeCapacity, INITIAL_CAMERA_KEYFRAME_COUNT, sizeof(CameraKeyframe), "camera keyframes");
+            cameraPath.keyframes[cameraPath.keyframeCount] = keyframe;
+            cameraPath.keyframes[cameraPath.keyframeCount].objectTransforms = copyObjectTransforms(keyframe.objectTransforms, scene->objectCount);
+            currentKeyframe = &cameraPath.keyframes[cameraPath.keyframeCount];
+            cameraPath.keyframeCount++;
+        } else if (strcmp(wordsInLine[0], "eye") == 0) {
+            checkValues(wordsInLine, 3, "eye");
+            currentKeyframe->eye = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[1]),
+                    .y = convertStringToFloat(wordsInLine[2]),
+                    .z = convertStringToFloat(wordsInLine[3]),
+            };
+        } else if (strcmp(wordsInLine[0], "viewdir") == 0) {
+            checkValues(wordsInLine, 3, "viewdir");
+            currentKeyframe->viewDir = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[1]),
+                    .y = convertStringToFloat(wordsInLine[2]),
+                    .z = convertStringToFloat(wordsInLine[3]),
+            };
+        } else if (strcmp(wordsInLine[0], "updir") == 0) {
+            checkValues(wordsInLine, 3, "updir");
+            currentKeyframe->upDir = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[1]),
+                    .y = convertStringToFloat(wordsInLine[2]),
+                    .z = convertStringToFloat(wordsInLine[3]),
+            };
+        } else if (strcmp(wordsInLine[0], "hfov") == 0) {
+            checkValues(wordsInLine, 1, "hfov");
+            currentKeyframe->fov.h = convertStringToFloat(wordsInLine[1]) * (float) M_PI / 180.0f; // convert to radians
+        } else if (strcmp(wordsInLine[0], "vfov") == 0) {
+            checkValues(wordsInLine, 1, "vfov");
+            currentKeyframe->fov.v = convertStringToFloat(wordsInLine[1]) * (float) M_PI / 180.0f; // convert to radians
+            currentKeyframe->fov.h = 0.0f; // hfov wins when both are set, so a vfov keyframe clears it
+        } else if (strcmp(wordsInLine[0], "translate") == 0) {
+            ObjectTransform* transform = getKeyframeObjectTransform(wordsInLine, 4, scene, currentKeyframe);
+            transform->translation = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[2]),
+                    .y = convertStringToFloat(wordsInLine[3]),
+                    .z = convertStringToFloat(wordsInLine[4]),
+            };
+        } else if (strcmp(wordsInLine[0], "rotate") == 0) {
+            ObjectTransform* transform = getKeyframeObjectTransform(wordsInLine, 5, scene, currentKeyframe);
+            transform->rotationAxis = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[2]),
+                    .y = convertStringToFloat(wordsInLine[3]),
+                    .z = convertStringToFloat(wordsInLine[4]),
+            };
+            transform->rotationAngle = convertStringToFloat(wordsInLine[5]) * (float) M_PI / 180.0f; // convert to radians
+            if (transform->rotationAxis.x == 0.0f && transform->rotationAxis.y == 0.0f && transform->rotationAxis.z == 0.0f) {
+                fprintf(stderr, "Camera path line %d rotates about a zero axis.\n", line);
+                exit(-1);
+            }
+        } else if (strcmp(wordsInLine[0], "scale") == 0) {
+            ObjectTransform* transform = getKeyframeObjectTransform(wordsInLine, 4, scene, currentKeyframe);
+            transform->scale = (Vector3) {
+                    .x = convertStringToFloat(wordsInLine[2]),
+                    .y = convertStringToFloat(wordsInLine[3]),
+                    .z = convertStringToFloat(wordsInLine[4]),
+            };
+            if (transform->scale.x == 0.0f || transform->scale.y == 0.0f || transform->scale.z == 0.0f) {
+                fprintf(stderr, "Camera path line %d scales an object to nothing.\n", line);
+                exit(-1);
+            }
+        } else if (strcmp(wordsInLine[0], "vertex") == 0) {
+            checkValues(wordsInLine, 4, "vertex");
+            int vertexIdx = convertStringToInt(wordsInLine[1]) - 1;
+            if (vertexIdx < 0 || vertexIdx >= scene->vertexCount) {
+                fprintf(stderr, "Camera path line %d moves vertex %d, but the scene has %d vertexes.\n", line, vertexIdx + 1, scene->vertexCount);
+                exit(-1);
+            }
+            currentKeyframe->vertexMoves = (VertexMove*) growSceneArray(currentKeyframe->vertexMoves, currentKeyframe->vertexMoveCount, &currentKeyframe->vertexMoveCapacity, INITIAL_VERTEX_MOVE_COUNT, sizeof(VertexMove), "vertex moves");
+            currentKeyframe->vertexMoves[currentKeyframe->vertexMoveCount++] = (VertexMove) {
+                    .vertexIdx = vertexIdx,
+                    .position = (Vector3) {
+                            .x = convertStringToFloat(wordsInLine[2]),
+                            .y = convertStringToFloat(wordsInLine[3]),
+                            .z = convertStringToFloat(wordsInLine[4]),
+                    },
+            };
+        } else {
+            fprintf(stderr, "Invalid keyword in camera path file: %s\n", wordsInLine[0]);
+            exit(-1);
+        }
+        keyframe.eye = currentKeyframe->eye;
+        keyframe.viewDir = currentKeyframe->viewDir;
+        keyframe.upDir = currentKeyframe->upDir;
+        keyframe.fov = currentKeyframe->fov;
+        memcpy(keyframe.objectTransforms, currentKeyframe->objectTransforms, (size_t) scene->objectCount * sizeof(ObjectTransform));
+        for (int wordIdx = 0; wordsInLine[wordIdx] != NULL; wordIdx++) {
+            free(wordsInLine[wordIdx]);
+        }
+    }
+    fclose(cameraPathFilePtr);
+    free(keyframe.objectTransforms);
+
+    if (cameraPath.keyframeCount == 0) {
+        fprintf(stderr, "The camera path file %s has no frames.\n", cameraPathFileName);
+        exit(-1);
+    }
+    return cameraPath;
+}
+
+size_t alignToCacheLine(size_t size) {
+    return (size + SCENE_ARENA_ALIGNMENT - 1) & ~((size_t) SCENE_ARENA_ALIGNMENT - 1);
+}
+
+size_t getBatchLaneSize(int count) {
+    int batchCount = (count + INTERSECTION_BATCH_WIDTH - 1) / INTERSECTION_BATCH_WIDTH;
+    return alignToCacheLine((size_t) batchCount * INTERSECTION_BATCH_WIDTH * sizeof(float));
+}
+
+void* placeInSceneArena(char* block, size_t* offset, void* array, int count, size_t elementSize) {
+    if (count == 0) {
+        free(array);
+        return NULL;
+    }
+    void* placed = block + (*offset);
+    memcpy(placed, array, (size_t) count * elementSize);
+    free(array);
+    (*offset) += alignToCacheLine((size_t) count * elementSize);
+    return placed;
+}
+
+float* reserveBatchLanes(char* block, size_t* offset, int count) {
+    if (count == 0) {
+        return NULL;
+    }
+    float* lanes = (float*) (block + (*offset));
+    (*offset) += getBatchLaneSize(count);
+    return lanes;
+}
+
+SphereBatches buildSphereBatches(char* block, size_t* offset, const Sphere* spheres, int sphereCount) {
+    SphereBatches batches = (SphereBatches) {
+            .centerX = reserveBatchLanes(block, offset, sphereCount),
+            .centerY = reserveBatchLanes(block, offset, sphereCount),
+            .centerZ = reserveBatchLanes(block, offset, sphereCount),
+            .radiusSquared = reserveBatchLanes(block, offset, sphereCount),
+            .primitiveIdxs = NULL,
+            .count = sphereCount,
+            .batchCount = (sphereCount + INTERSECTION_BATCH_WIDTH - 1) / INTERSECTION_BATCH_WIDTH,
+    };
+    for (int sphereIdx = 0; sphereIdx < sphereCount; sphereIdx++) {
+        batches.centerX[sphereIdx] = spheres[sphereIdx].center.x;
+        batches.centerY[sphereIdx] = spheres[sphereIdx].center.y;
+        batches.centerZ[sphereIdx] = spheres[sphereIdx].center.z;
+        batches.radiusSquared[sphereIdx] = spheres[sphereIdx].radius * spheres[sphereIdx].radius;
+    }
+    return batches;
+}
+
+EllipsoidBatches buildEllipsoidBatches(char* block, size_t* offset, const Ellipsoid* ellipsoids, int ellipsoidCount) {
+    EllipsoidBatches batches = (EllipsoidBatches) {
+            .centerX = reserveBatchLanes(block, offset, ellipsoidCount),
+            .centerY = reserveBatchLanes(block, offset, ellipsoidCount),
+            .centerZ = reserveBatchLanes(block, offset, ellipsoidCount),
+            .radiusSquaredX = reserveBatchLanes(block, offset, ellipsoidCount),
+            .radiusSquaredY = reserveBatchLanes(block, offset, ellipsoidCount),
+            .radiusSquaredZ = reserveBatchLanes(block, offset, ellipsoidCount),
+            .primitiveIdxs = NULL,
+            .count = ellipsoidCount,
+            .batchCount = (ellipsoidCount + INTERSECTION_BATCH_WIDTH - 1) / INTERSECTION_BATCH_WIDTH,
+    };
+    for (int ellipsoidIdx = 0; ellipsoidIdx < ellipsoidCount; ellipsoidIdx++) {
+        Vector3 radius = ellipsoids[ellipsoidIdx].radius;
+        batches.centerX[ellipsoidIdx] = ellipsoids[ellipsoidIdx].center.x;
+        batches.centerY[ellipsoidIdx] = ellipsoids[ellipsoidIdx].center.y;
+        batches.centerZ[ellipsoidIdx] = ellipsoids[ellipsoidIdx].center.z;
+        batches.radiusSquaredX[ellipsoidIdx] = radius.x * radius.x;
+        batches.radiusSquaredY[ellipsoidIdx] = radius.y * radius.y;
+        batches.radiusSquaredZ[ellipsoidIdx] = radius.z * radius.z;
+    }
+    // Padding lanes keep a unit radius so the kernel never divides by zero.
+    for (int laneIdx = ellipsoidCount; laneIdx < batches.batchCount * INTERSECTION_BATCH_WIDTH; laneIdx++) {
+        batches.radiusSquaredX[laneIdx] = 1.0f;
+        batches.radiusSquaredY[laneIdx] = 1.0f;
+        batches.radiusSquaredZ[laneIdx] = 1.0f;
+    }
+    return batches;
+}
+
+// Moves every parsed array into one cache-aligned block sized exactly for the scene, followed by the
+// intersection batches, so the whole scene is released with a single free.
+void compactScene(Scene* scene) {
+    size_t size = alignToCacheLine((size_t) scene->lightCount * sizeof(Light))
+                  + alignToCacheLine((size_t) scene->mtlColorCount * sizeof(MaterialColor))
+                  + alignToCacheLine((size_t) scene->textureCount * sizeof(PPMImage))
+                  + alignToCacheLine((size_t) scene->normalCount * sizeof(PPMImage))
+                  + alignToCacheLine((size_t) scene->bvhSphereCount * sizeof(Sphere))
+                  + alignToCacheLine((size_t) scene->sphereCount * sizeof(Sphere))
+                  + alignToCacheLine((size_t) scene->ellipsoidCount * sizeof(Ellipsoid))
+                  + alignToCacheLine((size_t) scene->vertexCount * sizeof(Vector3))
+                  + alignToCacheLine((size_t) scene->vertexNormalCount * sizeof(Vector3))
+                  + alignToCacheLine((size_t) scene->vertexTextureCount * sizeof(TextureCoordinate))
+                  + alignToCacheLine((size_t) scene->faceCount * sizeof(Face))
+                  + alignToCacheLine((size_t) scene->objectCount * sizeof(MeshObject))
+                  + 4 * getBatchLaneSize(scene->bvhSphereCount)
+                  + 4 * getBatchLaneSize(scene->sphereCount)
+                  + 6 * getBatchLaneSize(scene->ellipsoidCount);
+
+    char* block = (char*) aligned_alloc(SCENE_ARENA_ALIGNMENT, size > 0 ? size : SCENE_ARENA_ALIGNMENT);
+    if (block == NULL) {
+        fprintf(stderr, "Memory allocation failed for the scene arena.\n");
+        exit(-1);
+    }
+    memset(block, 0, size);
+
+    size_t offset = 0;
+    scene->lights = (Light*) placeInSceneArena(block, &offset, scene->lights, scene->lightCount, sizeof(Light));
+    scene->mtlColors = (MaterialColor*) placeInSceneArena(block, &offset, scene->mtlColors, scene->mtlColorCount, sizeof(MaterialColor));
+    scene->textures = (PPMImage*) placeInSceneArena(block, &offset, scene->textures, scene->textureCount, sizeof(PPMImage));
+    scene->normals = (PPMImage*) placeInSceneArena(block, &offset, scene->normals, scene->normalCount, sizeof(PPMImage));
+    scene->bvhSpheres = (Sphere*) placeInSceneArena(block, &offset, scene->bvhSpheres, scene->bvhSphereCount, sizeof(Sphere));
+    scene->spheres = (Sphere*) placeInSceneArena(block, &offset, scene->spheres, scene->sphereCount, sizeof(Sphere));
+    scene->ellipsoids = (Ellipsoid*) placeInSceneArena(block, &offset, scene->ellipsoids, scene->ellipsoidCount, sizeof(Ellipsoid));
+    scene->vertexes = (Vector3*) placeInSceneArena(block, &offset, scene->vertexes, scene->vertexCount, sizeof(Vector3));
+    scene->vertexNormals = (Vector3*) placeInSceneArena(block, &offset, scene->vertexNormals, scene->vertexNormalCount, sizeof(Vector3));
+    scene->vertexTextures = (TextureCoordinate*) placeInSceneArena(block, &offset, scene->vertexTextures, scene->vertexTextureCount, sizeof(TextureCoordinate));
+    scene->faces = (Face*) placeInSceneArena(block, &offset, scene->faces, scene->faceCount, sizeof(Face));
+    scene->objects = (MeshObject*) placeInSceneArena(block, &offset, scene->objects, scene->objectCount, sizeof(MeshObject));
+    scene->bvhSphereBatches = buildSphereBatches(block, &offset, scene->bvhSpheres, scene->bvhSphereCount);
+    scene->sphereBatches = buildSphereBatches(block, &offset, scene->spheres, scene->sphereCount);
+    scene->ellipsoidBatches = buildEllipsoidBatches(block, &offset, scene->ellipsoids, scene->ellipsoidCount);
+
+    scene->arena = (SceneArena) {
+            .block = block,
+            .blockSize = size,
+    };
+}
+
 void printScene(Scene* scene) {
     printf("--------------------SCENE--------------------\n");
     printf("eye: %f %f %f\n", scene->eye.x, scene->eye.y, scene->eye.z);
@@ -734,33 +2281,19 @@ void printScene(Scene* scene) {
 }
 
 void freeInput(Scene* scene) {
-    if (scene->lights != NULL) {
-        free(scene->lights);
+    for (int textureIdx = 0; textureIdx < scene->textureCount; textureIdx++) {
+        freePPMImage(&scene->textures[textureIdx]);
     }
-    if (scene->mtlColors != NULL) {
-        free(scene->mtlColors);
-    }
-    if (scene->bvhSpheres != NULL) {
-        free(scene->bvhSpheres);
-    }
-    if (scene->textures != NULL) {
-        free(scene->textures);
-    }
-    if (scene->spheres != NULL) {
-        free(scene->spheres);
-    }
-    if (scene->ellipsoids != NULL) {
-        free(scene->ellipsoids);
-    }
-    if (scene->vertexes != NULL) {
-        free(scene->vertexes);
-    }
-    if (scene->vertexNormals != NULL) {
-        free(scene->vertexNormals);
-    }
-    if (scene->faces != NULL) {
-        free(scene->faces);
+    for (int normalIdx = 0; normalIdx < scene->normalCount; normalIdx++) {
+        freePPMImage(&scene->normals[normalIdx]);
     }
+    freeClusterCache(scene->clusterCache);
+    free(scene->objectNodes);
+    free(scene->objectFaceIdxs);
+    free(scene->instanceHierarchy.instances);
+    free(scene->instanceHierarchy.nodes);
+    free(scene->instanceHierarchy.instanceIdxs);
+    free(scene->arena.block);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,131 +1,82 @@
 #include "input.h"
-#include "output.h"
-#include "render.h"
+#include "frame.h"
+#include "daemon.h"
+#include "batch.h"
+#include "watch.h"
 
-void progressBar(int total, int current) {
-    const int barLength = 50;
-    float progress = (float) current / (float) total;
-    int barProgress = (int) (progress * (float) barLength);
+// Every frame shares the parsed scene, its arena, decoded textures and the objects' bottom-level hierarchies. Only
+// the camera and the object placement differ, so a frame is a shallow copy of the scene with its own top level when
+// objects moved. Tiles of all frames go through one pool in frame order, except that a frame that moves vertexes
+// waits for the frames before it, which still read the old positions.
+void render(Scene* scene, RenderOptions* options, CameraPath* cameraPath) {
+    int frameCount = cameraPath == NULL ? 1 : cameraPath->keyframeCount;
+    ImageRegion region = getFullImageRegion(scene);
+    int tilesPerFrame = getRegionTileCount(region);
+    totalTileCount = frameCount * tilesPerFrame;
 
-    printf("[");
-    for (int i = 0; i < barLength; ++i) {
-        if (i < barProgress) {
-            printf("=");
-        } else {
-            printf(" ");
-        }
+    FrameRender* frames = (FrameRender*) malloc(frameCount * sizeof(FrameRender));
+    RenderTile* tiles = (RenderTile*) malloc((size_t) totalTileCount * sizeof(RenderTile));
+    if (frames == NULL || tiles == NULL) {
+        fprintf(stderr, "Memory allocation error while scheduling the render.\n");
+        exit(-1);
     }
-    printf("] %.2f%%\r", progress * 100);
-    fflush(stdout);
-}
 
-void render(FILE* outputFilePtr, Scene* scene, ViewParameters* viewParameters, bool parallel) {
-    int i = 0;
-    for (int y = 0; y < scene->imSize.height; y++) {
-        for (int x = 0; x < scene->imSize.width; x++) {
-            Vector3 viewingWindowLocation = getViewingWindowLocation(viewParameters, x, y);
-            Ray viewingRay = traceViewingRay(scene, viewingWindowLocation, parallel);
-            RayState rayState = (RayState) {
-                .exclusion = (Exclusion) {
-                        .excludeSphereIdx = -1,
-                        .excludeEllipsoidIdx = -1,
-                        .excludeFaceIdx = -1
-                },
-                .reflectionDepth = 0,
-                .shadow = 1.0f,
-                .previousRefractionIndex = scene->bkgColor.refractionIndex
-            };
-            if (x == 210 && y == 294) {
-                int test = 1234;
-            }
-            writePixel(outputFilePtr, convertColorToRGBColor(shadeRay(viewingRay, scene, rayState)), x, scene->imSize.width);
-            progressBar(scene->imSize.width * scene->imSize.height, i);
-            i++;
+    ThreadPool pool;
+    createThreadPool(&pool, options->threadCount > 0 ? options->threadCount : getDefaultThreadCount());
+
+    for (int frameIdx = 0; frameIdx < frameCount; frameIdx++) {
+        FrameRender* frame = &frames[frameIdx];
+        CameraKeyframe* keyframe = cameraPath == NULL ? NULL : &cameraPath->keyframes[frameIdx];
+        if (keyframe != NULL && keyframe->vertexMoveCount > 0) {
+            waitThreadPool(&pool);
+            int rebuiltCount = moveSceneVertexes(scene, keyframe);
+            printf("\nFrame %d moved %d vertexes, %d of %d object hierarchies were rebuilt instead of refitted.\n",
+                   frameIdx, keyframe->vertexMoveCount, rebuiltCount, scene->objectCount);
         }
+        initFrameRender(frame, scene, options, keyframe, cameraPath == NULL ? -1 : frameIdx, region);
+        getOutputFileName(options->inputFileName, frame->frameIdx, options->imageFormat, frame->outputFileName);
+        submitFrameTiles(&pool, frame, &tiles[frameIdx * tilesPerFrame]);
     }
-}
 
-int main(int argc, char* argv[]) {
-    checkArgs(argc, argv);
-    bool softShadows = strcmp(argv[1], "-s") == 0;
+    waitThreadPool(&pool);
+    destroyThreadPool(&pool);
+    printf("\n");
 
-    char*** inputFileWordsByLine = readInputFile(argv, softShadows);
+    for (int frameIdx = 0; frameIdx < frameCount; frameIdx++) {
+        destroyFrameRender(&frames[frameIdx]);
+    }
+    free(tiles);
+    free(frames);
+}
 
-    Scene scene = {
-            .eye = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
-            .viewDir = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
-            .upDir = {.x = 0.0f, .y = 0.0f, .z = 0.0f},
-            .fov = {.h = 0.0f, .v = 0.0f },
-            .imSize = {.width = 0, .height = 0},
-            .bkgColor = (Background) {
-                .color = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
-                .refractionIndex = 1.0f
-            },
-            .parallel = {.frustumWidth = 0.0f},
-            .mtlColors = (MaterialColor*) malloc(INITIAL_MTLCOLOR_COUNT * sizeof(MaterialColor)),
-            .mtlColorCount = 0,
-            .bvhSpheres = (Sphere*) malloc(INITIAL_BVH_SPHERE_COUNT * sizeof(Sphere)),
-            .bvhSphereCount = 0,
-            .spheres = (Sphere*) malloc(INITIAL_SPHERE_COUNT * sizeof(Sphere)),
-            .sphereCount = 0,
-            .ellipsoids = (Ellipsoid*) malloc(INITIAL_ELLIPSOID_COUNT * sizeof(Ellipsoid)),
-            .ellipsoidCount = 0,
-            .lights = (Light*) malloc(INITIAL_LIGHT_COUNT * sizeof(Light)),
-            .lightCount = 0,
-            .softShadows = false,
-            .vertexes = (Vector3*) malloc(INITIAL_VERTEX_COUNT * sizeof(Vector3)),
-            .vertexCount = 0,
-            .vertexNormals = NULL,
-            .vertexNormalCount = 0,
-            .vertexTextures = NULL,
-            .vertexTextureCount = 0,
-            .faces = (Face*) malloc(INITIAL_FACE_COUNT * sizeof(Face)),
-            .faceCount = 0,
-            .textures = (PPMImage*) malloc(INITIAL_TEXTURE_COUNT * sizeof (PPMImage)),
-            .textureCount = 0,
-            .normals = (PPMImage*) malloc(INITIAL_TEXTURE_COUNT * sizeof (PPMImage)),
-            .normalCount = 0,
-    };
+int main(int argc, char* argv[]) {
+    RenderOptions options = parseArgs(argc, argv);
 
-    if (scene.mtlColors == NULL || scene.spheres == NULL || scene.ellipsoids == NULL || scene.lights == NULL || scene.faces == NULL || scene.textures == NULL || scene.normals == NULL) {
-        fprintf(stderr, "Memory allocation failed for scene initialization.\n");
-        exit(-1);
+    if (options.inputFileCount > 1) {
+        exit(runRenderBatch(&options) ? 0 : -1);
+    }
+    if (options.watch) {
+        runSceneWatch(&options);
     }
 
-    int line = 0;
-    readSceneSetup(inputFileWordsByLine, &line, &scene, softShadows);
-    readSceneObjects(inputFileWordsByLine, &line, &scene);
+    Scene scene = createScene(&options, NULL);
+    char*** inputFileWordsByLine = readInputFile(options.inputFileName);
+    loadScene(&scene, inputFileWordsByLine, options.softShadows);
     freeInputFileWordsByLine(inputFileWordsByLine);
-    bool parallel = scene.parallel.frustumWidth > 0.0f;
-    bool horizontalFov = scene.fov.h > 0.0f;
-
-    ViewParameters viewParameters = {
-            .w = normalize(multiply(scene.viewDir, -1)),
-            .u = normalize(cross(scene.viewDir, scene.upDir)),
-            .v = cross(viewParameters.u, normalize(scene.viewDir)),
-            .n = normalize(scene.viewDir),
-            .d = 1.0f,
-            .aspectRatio = (float) scene.imSize.width / (float) scene.imSize.height,
-            .viewingWindow = {
-                    .width = parallel ?
-                             (scene.parallel.frustumWidth) :
-                             horizontalFov ?
-                             (2 * viewParameters.d * tanf(scene.fov.h / 2.0f)) :
-                             (2 * viewParameters.d * tanf(scene.fov.v / 2.0f)) * viewParameters.aspectRatio,
-                    .height = parallel ?
-                              ((scene.parallel.frustumWidth / viewParameters.aspectRatio)) :
-                              horizontalFov ?
-                              (2 * viewParameters.d * (tanf(scene.fov.h / 2.0f) / viewParameters.aspectRatio)) :
-                              (2 * viewParameters.d * (tanf(scene.fov.v / 2.0f))),
-            }
-    };
 
-    setViewingWindow(&scene, &viewParameters, parallel);
-
-    FILE* outputFilePtr = openOutputFile(softShadows ? argv[2] : argv[1]);
-    writeHeader(outputFilePtr, scene.imSize.width, scene.imSize.height);
-
-    render(outputFilePtr, &scene, &viewParameters, parallel);
+    if (options.daemonSocketName != NULL) {
+        runRenderDaemon(&scene, &options);
+    } else if (options.cameraPathFileName != NULL) {
+        CameraPath cameraPath = readCameraPath(options.cameraPathFileName, &scene);
+        render(&scene, &options, &cameraPath);
+        for (int keyframeIdx = 0; keyframeIdx < cameraPath.keyframeCount; keyframeIdx++) {
+            free(cameraPath.keyframes[keyframeIdx].objectTransforms);
+            free(cameraPath.keyframes[keyframeIdx].vertexMoves);
+        }
+        free(cameraPath.keyframes);
+    } else {
+        render(&scene, &options, NULL);
+    }
 
     freeInput(&scene);
 
@@ -4,42 +4,78 @@
 #include "render.h"
 #include "stringhelper.h"
 
-#define MAX_INPUT_FILE_NAME_LENGTH 100
-#define OUTPUT_FILE_SUFFIX ".ppm"
-#define MAGIC_NUMBER "P3"
-#define MAX_COLOR_COMPONENT_VALUE "255"
-#define MAX_PIXELS_ON_LINE 5
-
-FILE* openOutputFile(char* inputFileName) {
+// Single renders are written next to the input as input.ppm, camera path frames as input_0000.ppm, input_0001.ppm, ...
+// PNGs end in .png.
+void getOutputFileName(char* inputFileName, int frameIdx, ImageFormat format, char* outputFileName) {
     if (!endsWith(inputFileName, ".txt")) {
         fprintf(stderr, "Incorrect input file format. Input file must be a '.txt' file.");
         exit(-1);
     }
-    char outputFileName[MAX_INPUT_FILE_NAME_LENGTH + 3];
     char* inputFileNameWithoutExtension = substr(inputFileName, 0, (int) strlen(inputFileName) - 4);
-    snprintf(outputFileName, sizeof(outputFileName), "%s%s", inputFileNameWithoutExtension, OUTPUT_FILE_SUFFIX);
+    char frameSuffix[16] = "";
+    if (frameIdx >= 0) {
+        snprintf(frameSuffix, sizeof(frameSuffix), "_%04d", frameIdx);
+    }
+    snprintf(outputFileName, MAX_OUTPUT_FILE_NAME_LENGTH, "%s%s%s", inputFileNameWithoutExtension, frameSuffix, getImageFormatExtension(format));
     free(inputFileNameWithoutExtension);
-
-    FILE* outputFilePtr;
-    outputFilePtr = fopen(outputFileName, "w");
-    return outputFilePtr;
 }
 
-void writeHeader(FILE* outputFilePtr, int width, int height) {
-    fprintf(outputFilePtr, "%s\n%d %d\n%s\n", MAGIC_NUMBER, width, height, MAX_COLOR_COMPONENT_VALUE);
+_Static_assert(sizeof(RGBColor) == 3, "Images are written as packed RGB bytes.");
+
+// Returns false if the image could not be written. The reason is already on stderr.
+bool writeImage(char* outputFileName, const RGBColor* pixels, int width, int height, ImageFormat format) {
+    return writeImageFile(outputFileName, (const unsigned char*) pixels, width, height, format);
 }
 
-void enforceMaxPixelsOnLine(FILE* outputFilePtr, int x, int width) {
-    if ((x % (MAX_PIXELS_ON_LINE) == (MAX_PIXELS_ON_LINE - 1)) || x == width - 1) {
-        fprintf(outputFilePtr, "\n");
-    } else {
-        fprintf(outputFilePtr, "\t");
+// AOV images get their buffer name appended to the image's name, e.g. input_depth.ppm or input_0000_normal.ppm.
+void getAovFileName(char* imageFileName, char* aovName, char* aovFileName) {
+    char* extension = strrchr(imageFileName, '.');
+    char* directoryEnd = strrchr(imageFileName, '/');
+    if (extension == NULL || (directoryEnd != NULL && extension < directoryEnd)) {
+        extension = &imageFileName[strlen(imageFileName)];
     }
+    snprintf(aovFileName, MAX_OUTPUT_FILE_NAME_LENGTH, "%.*s_%s%s", (int) (extension - imageFileName), imageFileName, aovName, extension);
 }
 
-void writePixel(FILE* outputFilePtr, RGBColor pixelColor, int x, int width) {
-    fprintf(outputFilePtr, "%d %d %d", pixelColor.red, pixelColor.green, pixelColor.blue);
-    enforceMaxPixelsOnLine(outputFilePtr, x, width);
+// Depth is scaled so the farthest hit is white, normals are mapped from -1..1 to 0..1. Misses are black.
+bool writeAovImages(char* imageFileName, const PixelFeatures* features, int width, int height, ImageFormat format) {
+    size_t pixelCount = (size_t) width * (size_t) height;
+    RGBColor* pixels = (RGBColor*) malloc(pixelCount * sizeof(RGBColor));
+    if (pixels == NULL) {
+        fprintf(stderr, "Memory allocation error while writing AOVs.\n");
+        exit(-1);
+    }
+    char outputFileName[MAX_OUTPUT_FILE_NAME_LENGTH];
+
+    float maxDepth = 0.0f;
+    for (size_t pixelIdx = 0; pixelIdx < pixelCount; pixelIdx++) {
+        if (features[pixelIdx].hit) {
+            maxDepth = max(maxDepth, features[pixelIdx].depth);
+        }
+    }
+    for (size_t pixelIdx = 0; pixelIdx < pixelCount; pixelIdx++) {
+        float depth = (features[pixelIdx].hit && maxDepth > 0.0f) ? features[pixelIdx].depth / maxDepth : 0.0f;
+        pixels[pixelIdx] = convertColorToRGBColor((Vector3) { .x = depth, .y = depth, .z = depth });
+    }
+    getAovFileName(imageFileName, "depth", outputFileName);
+    bool written = writeImage(outputFileName, pixels, width, height, format);
+
+    for (size_t pixelIdx = 0; pixelIdx < pixelCount; pixelIdx++) {
+        pixels[pixelIdx] = features[pixelIdx].hit
+                ? convertColorToRGBColor(addf(multiply(features[pixelIdx].normal, 0.5f), 0.5f))
+                : (RGBColor) { .red = 0, .green = 0, .blue = 0 };
+    }
+    getAovFileName(imageFileName, "normal", outputFileName);
+    written = writeImage(outputFileName, pixels, width, height, format) && written;
+
+    for (size_t pixelIdx = 0; pixelIdx < pixelCount; pixelIdx++) {
+        pixels[pixelIdx] = convertColorToRGBColor(features[pixelIdx].albedo);
+    }
+    getAovFileName(imageFileName, "albedo", outputFileName);
+    written = writeImage(outputFileName, pixels, width, height, format) && written;
+
+    free(pixels);
+    return written;
 }
 
 #endif
@@ -0,0 +1,287 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_RASTER_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_RASTER_H
+
+#include "types.h"
+#include "vector.h"
+#include "ray.h"
+
+// Projects a point onto the viewing window in pixel units, using the same ul/dh/dv the primary rays are built from.
+// Returns false for perspective points at or behind the eye, which have no finite projection.
+bool projectToPixel(const Scene* scene, const ViewParameters* viewParameters, bool parallel, Vector3 point, float* x, float* y) {
+    Vector3 windowPoint = point;
+    if (!parallel) {
+        Vector3 eyeToPoint = subtract(point, scene->eye);
+        float depth = dot(eyeToPoint, viewParameters->n);
+        if (depth <= 1e-6f) {
+            return false;
+        }
+        windowPoint = add(scene->eye, multiply(eyeToPoint, viewParameters->d / depth));
+    }
+    Vector3 ulToPoint = subtract(windowPoint, viewParameters->viewingWindow.ul);
+    (*x) = dot(ulToPoint, viewParameters->dh) / dot(viewParameters->dh, viewParameters->dh);
+    (*y) = dot(ulToPoint, viewParameters->dv) / dot(viewParameters->dv, viewParameters->dv);
+    return true;
+}
+
+// Screen rectangle that conservatively covers every pixel whose primary ray can hit the face. It is padded by a
+// pixel to absorb rounding, and faces reaching behind the eye cover the whole screen.
+bool getFaceScreenBounds(const Scene* scene, const ViewParameters* viewParameters, bool parallel, int faceIdx, int* bounds) {
+    const Face* face = &scene->faces[faceIdx];
+    const ObjectInstance* instance = getFaceInstance(scene, faceIdx);
+    int vertexIdxs[3] = { face->v1 - 1, face->v2 - 1, face->v3 - 1 };
+    float minX = FLT_MAX;
+    float minY = FLT_MAX;
+    float maxX = -FLT_MAX;
+    float maxY = -FLT_MAX;
+    bool projected = true;
+    for (int cornerIdx = 0; cornerIdx < 3 && projected; cornerIdx++) {
+        float x;
+        float y;
+        Vector3 vertex = scene->vertexes[vertexIdxs[cornerIdx]];
+        if (instance->transformed) {
+            vertex = transformPoint(&instance->objectToWorld, vertex);
+        }
+        projected = projectToPixel(scene, viewParameters, parallel, vertex, &x, &y);
+        minX = min(minX, x);
+        minY = min(minY, y);
+        maxX = max(maxX, x);
+        maxY = max(maxY, y);
+    }
+
+    int width = scene->imSize.width;
+    int height = scene->imSize.height;
+    if (!projected) {
+        bounds[0] = 0;
+        bounds[1] = 0;
+        bounds[2] = width - 1;
+        bounds[3] = height - 1;
+        return true;
+    }
+    if (maxX < -1.0f || maxY < -1.0f || minX > (float) width || minY > (float) height) {
+        return false;
+    }
+    bounds[0] = (int) max(floorf(minX) - 1.0f, 0.0f);
+    bounds[1] = (int) max(floorf(minY) - 1.0f, 0.0f);
+    bounds[2] = (int) min(ceilf(maxX) + 1.0f, (float) (width - 1));
+    bounds[3] = (int) min(ceilf(maxY) + 1.0f, (float) (height - 1));
+    return true;
+}
+
+// Bins every face into the render tiles its screen rectangle overlaps. Faces stay in ascending order inside a bin
+// so ties between equally distant faces resolve to the lowest index as soon as possible.
+void binTriangles(const Scene* scene, const ViewParameters* viewParameters, bool parallel, int tileSize, TriangleBins* bins) {
+    bins->tileColumns = (scene->imSize.width + tileSize - 1) / tileSize;
+    bins->tileRows = (scene->imSize.height + tileSize - 1) / tileSize;
+    int tileCount = bins->tileColumns * bins->tileRows;
+    bins->bounds = (int*) malloc((size_t) scene->faceCount * 4 * sizeof(int));
+    bins->tileOffsets = (int*) calloc(tileCount + 1, sizeof(int));
+    if (bins->bounds == NULL || bins->tileOffsets == NULL) {
+        fprintf(stderr, "Memory allocation error while binning triangles.\n");
+        exit(-1);
+    }
+
+    for (int faceIdx = 0; faceIdx < scene->faceCount; faceIdx++) {
+        int* bounds = &bins->bounds[faceIdx * 4];
+        if (!getFaceScreenBounds(scene, viewParameters, parallel, faceIdx, bounds)) {
+            bounds[0] = -1;
+            continue;
+        }
+        for (int tileY = bounds[1] / tileSize; tileY <= bounds[3] / tileSize; tileY++) {
+            for (int tileX = bounds[0] / tileSize; tileX <= bounds[2] / tileSize; tileX++) {
+                bins->tileOffsets[tileY * bins->tileColumns + tileX + 1]++;
+            }
+        }
+    }
+    for (int tileIdx = 0; tileIdx < tileCount; tileIdx++) {
+        bins->tileOffsets[tileIdx + 1] += bins->tileOffsets[tileIdx];
+    }
+
+    bins->triangles = (int*) malloc(((size_t) bins->tileOffsets[tileCount] + 1) * sizeof(int));
+    int* tileFill = (int*) malloc(tileCount * sizeof(int));
+    if (bins->triangles == NULL || tileFill == NULL) {
+        fprintf(stderr, "Memory allocation error while binning triangles.\n");
+        exit(-1);
+    }
+    memcpy(tileFill, bins->tileOffsets, tileCount * sizeof(int));
+    for (int faceIdx = 0; faceIdx < scene->faceCount; faceIdx++) {
+        const int* bounds = &bins->bounds[faceIdx * 4];
+        if (bounds[0] < 0) {
+            continue;
+        }
+        for (int tileY = bounds[1] / tileSize; tileY <= bounds[3] / tileSize; tileY++) {
+            for (int tileX = bounds[0] / tileSize; tileX <= bounds[2] / tileSize; tileX++) {
+                bins->triangles[tileFill[tileY * bins->tileColumns + tileX]++] = faceIdx;
+            }
+        }
+    }
+    free(tileFill);
+}
+
+void freeTriangleBins(TriangleBins* bins) {
+    free(bins->bounds);
+    free(bins->tileOffsets);
+    free(bins->triangles);
+    bins->bounds = NULL;
+    bins->tileOffsets = NULL;
+    bins->triangles = NULL;
+}
+
+// Fills the tile's visibility buffer with the closest face hit per pixel. Each face is only tested against the
+// pixels of its screen rectangle, with the exact primary ray and the same test castRay uses, so the result
+// matches casting through the object hierarchies.
+void rasterizeTile(const Scene* scene, const TriangleBins* bins, int tileIdx, const Ray* rays, int x0, int y0, int x1, int y1, Hit* faceHits) {
+    int tileWidth = x1 - x0;
+    for (int pixelIdx = 0; pixelIdx < tileWidth * (y1 - y0); pixelIdx++) {
+        faceHits[pixelIdx] = getEmptyHit();
+    }
+    for (int binIdx = bins->tileOffsets[tileIdx]; binIdx < bins->tileOffsets[tileIdx + 1]; binIdx++) {
+        int faceIdx = bins->triangles[binIdx];
+        const int* bounds = &bins->bounds[faceIdx * 4];
+        const ObjectInstance* instance = getFaceInstance(scene, faceIdx);
+        int startX = (int) max((float) bounds[0], (float) x0);
+        int startY = (int) max((float) bounds[1], (float) y0);
+        int endX = (int) min((float) bounds[2], (float) (x1 - 1));
+        int endY = (int) min((float) bounds[3], (float) (y1 - 1));
+        for (int y = startY; y <= endY; y++) {
+            for (int x = startX; x <= endX; x++) {
+                int pixelIdx = (y - y0) * tileWidth + (x - x0);
+                if (instance->transformed) {
+                    Ray objectRay = transformRayToObject(instance, &rays[pixelIdx]);
+                    checkFaceIntersection(&objectRay, scene, faceIdx, getSmallDistance(&rays[pixelIdx]), &faceHits[pixelIdx]);
+                } else {
+                    checkFaceIntersection(&rays[pixelIdx], scene, faceIdx, getSmallDistance(&rays[pixelIdx]), &faceHits[pixelIdx]);
+                }
+            }
+        }
+    }
+}
+
+// The four side planes around the primary rays of a tile, padded by a pixel on every side. Perspective planes pass
+// through the eye, parallel ones through the tile's corners on the viewing window.
+TileFrustum getTileFrustum(const Scene* scene, const ViewParameters* viewParameters, bool parallel, int x0, int y0, int x1, int y1) {
+    Vector3 corners[4] = {
+            getViewingWindowLocation((ViewParameters*) viewParameters, x0 - 1, y0 - 1),
+            getViewingWindowLocation((ViewParameters*) viewParameters, x1, y0 - 1),
+            getViewingWindowLocation((ViewParameters*) viewParameters, x1, y1),
+            getViewingWindowLocation((ViewParameters*) viewParameters, x0 - 1, y1),
+    };
+    Vector3 center = multiply(add(add(corners[0], corners[1]), add(corners[2], corners[3])), 0.25f);
+
+    TileFrustum frustum;
+    for (int planeIdx = 0; planeIdx < 4; planeIdx++) {
+        Vector3 corner = corners[planeIdx];
+        Vector3 nextCorner = corners[(planeIdx + 1) % 4];
+        if (parallel) {
+            frustum.planePoints[planeIdx] = corner;
+            frustum.planeNormals[planeIdx] = normalize(cross(subtract(nextCorner, corner), viewParameters->n));
+        } else {
+            frustum.planePoints[planeIdx] = scene->eye;
+            frustum.planeNormals[planeIdx] = normalize(cross(subtract(corner, scene->eye), subtract(nextCorner, scene->eye)));
+        }
+        if (dot(frustum.planeNormals[planeIdx], subtract(center, frustum.planePoints[planeIdx])) < 0.0f) {
+            frustum.planeNormals[planeIdx] = multiply(frustum.planeNormals[planeIdx], -1.0f);
+        }
+    }
+    return frustum;
+}
+
+bool isSphereInTileFrustum(const TileFrustum* frustum, Vector3 center, float radius) {
+    for (int planeIdx = 0; planeIdx < 4; planeIdx++) {
+        if (dot(frustum->planeNormals[planeIdx], subtract(center, frustum->planePoints[planeIdx])) < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Gathers the lanes of the spheres and ellipsoids whose bounding spheres touch the tile's frustum into batches of
+// their own. Survivors keep their scene order, so the closest hit and its ties come out as with the full batches.
+void buildTileCandidates(const Scene* scene, const TileFrustum* frustum, TileCandidates* candidates) {
+    int paddedSphereCount = scene->sphereBatches.batchCount * INTERSECTION_BATCH_WIDTH;
+    int paddedEllipsoidCount = scene->ellipsoidBatches.batchCount * INTERSECTION_BATCH_WIDTH;
+    size_t blockSize = (size_t) paddedSphereCount * (4 * sizeof(float) + sizeof(int)) +
+                       (size_t) paddedEllipsoidCount * (6 * sizeof(float) + sizeof(int));
+    candidates->block = blockSize > 0 ? malloc(blockSize) : NULL;
+    if (blockSize > 0 && candidates->block == NULL) {
+        fprintf(stderr, "Memory allocation error while culling a tile.\n");
+        exit(-1);
+    }
+
+    float* lanes = (float*) candidates->block;
+    SphereBatches* spheres = &candidates->sphereBatches;
+    spheres->centerX = lanes;
+    spheres->centerY = lanes + paddedSphereCount;
+    spheres->centerZ = lanes + 2 * paddedSphereCount;
+    spheres->radiusSquared = lanes + 3 * paddedSphereCount;
+    lanes += 4 * paddedSphereCount;
+    EllipsoidBatches* ellipsoids = &candidates->ellipsoidBatches;
+    ellipsoids->centerX = lanes;
+    ellipsoids->centerY = lanes + paddedEllipsoidCount;
+    ellipsoids->centerZ = lanes + 2 * paddedEllipsoidCount;
+    ellipsoids->radiusSquaredX = lanes + 3 * paddedEllipsoidCount;
+    ellipsoids->radiusSquaredY = lanes + 4 * paddedEllipsoidCount;
+    ellipsoids->radiusSquaredZ = lanes + 5 * paddedEllipsoidCount;
+    lanes += 6 * paddedEllipsoidCount;
+    spheres->primitiveIdxs = (int*) lanes;
+    ellipsoids->primitiveIdxs = spheres->primitiveIdxs + paddedSphereCount;
+
+    spheres->count = 0;
+    for (int sphereIdx = 0; sphereIdx < scene->sphereCount; sphereIdx++) {
+        const Sphere* sphere = &scene->spheres[sphereIdx];
+        if (isSphereInTileFrustum(frustum, sphere->center, sphere->radius)) {
+            spheres->centerX[spheres->count] = scene->sphereBatches.centerX[sphereIdx];
+            spheres->centerY[spheres->count] = scene->sphereBatches.centerY[sphereIdx];
+            spheres->centerZ[spheres->count] = scene->sphereBatches.centerZ[sphereIdx];
+            spheres->radiusSquared[spheres->count] = scene->sphereBatches.radiusSquared[sphereIdx];
+            spheres->primitiveIdxs[spheres->count] = sphereIdx;
+            spheres->count++;
+        }
+    }
+    spheres->batchCount = (spheres->count + INTERSECTION_BATCH_WIDTH - 1) / INTERSECTION_BATCH_WIDTH;
+
+    ellipsoids->count = 0;
+    for (int ellipsoidIdx = 0; ellipsoidIdx < scene->ellipsoidCount; ellipsoidIdx++) {
+        const Ellipsoid* ellipsoid = &scene->ellipsoids[ellipsoidIdx];
+        float boundingRadius = max(ellipsoid->radius.x, max(ellipsoid->radius.y, ellipsoid->radius.z));
+        if (isSphereInTileFrustum(frustum, ellipsoid->center, boundingRadius)) {
+            ellipsoids->centerX[ellipsoids->count] = scene->ellipsoidBatches.centerX[ellipsoidIdx];
+            ellipsoids->centerY[ellipsoids->count] = scene->ellipsoidBatches.centerY[ellipsoidIdx];
+            ellipsoids->centerZ[ellipsoids->count] = scene->ellipsoidBatches.centerZ[ellipsoidIdx];
+            ellipsoids->radiusSquaredX[ellipsoids->count] = scene->ellipsoidBatches.radiusSquaredX[ellipsoidIdx];
+            ellipsoids->radiusSquaredY[ellipsoids->count] = scene->ellipsoidBatches.radiusSquaredY[ellipsoidIdx];
+            ellipsoids->radiusSquaredZ[ellipsoids->count] = scene->ellipsoidBatches.radiusSquaredZ[ellipsoidIdx];
+            ellipsoids->primitiveIdxs[ellipsoids->count] = ellipsoidIdx;
+            ellipsoids->count++;
+        }
+    }
+    ellipsoids->batchCount = (ellipsoids->count + INTERSECTION_BATCH_WIDTH - 1) / INTERSECTION_BATCH_WIDTH;
+
+    // Out-of-core clusters are always traced in full, the count only tells whether the tile can see any of them.
+    candidates->clusterCount = 0;
+    for (int clusterIdx = 0; scene->clusterCache != NULL && clusterIdx < scene->clusterCache->clusterCount; clusterIdx++) {
+        const ClusterInfo* info = &scene->clusterCache->clusters[clusterIdx].info;
+        Vector3 center = multiply(add(info->boundsMin, info->boundsMax), 0.5f);
+        if (isSphereInTileFrustum(frustum, center, magnitude(subtract(info->boundsMax, center)))) {
+            candidates->clusterCount++;
+        }
+    }
+
+    // Padding lanes keep a unit radius so the kernel never divides by zero.
+    for (int laneIdx = ellipsoids->count; laneIdx < ellipsoids->batchCount * INTERSECTION_BATCH_WIDTH; laneIdx++) {
+        ellipsoids->radiusSquaredX[laneIdx] = 1.0f;
+        ellipsoids->radiusSquaredY[laneIdx] = 1.0f;
+        ellipsoids->radiusSquaredZ[laneIdx] = 1.0f;
+    }
+}
+
+bool isTileEmpty(const TileCandidates* candidates, const TriangleBins* bins, bool triangleBinsReady, int tileIdx) {
+    bool hasTriangles = triangleBinsReady && bins->tileOffsets[tileIdx + 1] > bins->tileOffsets[tileIdx];
+    return candidates->sphereBatches.count == 0 && candidates->ellipsoidBatches.count == 0 && candidates->clusterCount == 0 && !hasTriangles;
+}
+
+void freeTileCandidates(TileCandidates* candidates) {
+    free(candidates->block);
+    candidates->block = NULL;
+}
+
+#endif
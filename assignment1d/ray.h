@@ -2,6 +2,7 @@
 #define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_RAY_H
 
 #include "color.h"
+#include "bvh.h"
 
 void setViewingWindowValues(Scene* scene, ViewParameters* viewParameters, Vector3 viewDirTimesDistance) {
     float halfWidth = viewParameters->viewingWindow.width / 2.0f;
@@ -39,6 +40,32 @@ void setViewingWindow(Scene* scene, ViewParameters* viewParameters, bool paralle
     }
 }
 
+ViewParameters getViewParameters(Scene* scene, bool parallel) {
+    bool horizontalFov = scene->fov.h > 0.0f;
+    ViewParameters viewParameters;
+    viewParameters.w = normalize(multiply(scene->viewDir, -1));
+    viewParameters.u = normalize(cross(scene->viewDir, scene->upDir));
+    viewParameters.v = cross(viewParameters.u, normalize(scene->viewDir));
+    viewParameters.n = normalize(scene->viewDir);
+    viewParameters.d = 1.0f;
+    viewParameters.aspectRatio = (float) scene->imSize.width / (float) scene->imSize.height;
+    viewParameters.viewingWindow = (ViewingWindow) {
+            .width = parallel ?
+                     (scene->parallel.frustumWidth) :
+                     horizontalFov ?
+                     (2 * viewParameters.d * tanf(scene->fov.h / 2.0f)) :
+                     (2 * viewParameters.d * tanf(scene->fov.v / 2.0f)) * viewParameters.aspectRatio,
+            .height = parallel ?
+                      ((scene->parallel.frustumWidth / viewParameters.aspectRatio)) :
+                      horizontalFov ?
+                      (2 * viewParameters.d * (tanf(scene->fov.h / 2.0f) / viewParameters.aspectRatio)) :
+                      (2 * viewParameters.d * (tanf(scene->fov.v / 2.0f))),
+    };
+
+    setViewingWindow(scene, &viewParameters, parallel);
+    return viewParameters;
+}
+
 Vector3 getViewingWindowLocation(ViewParameters* viewParameters, int x, int y) {
     return add(
             add(
@@ -74,101 +101,113 @@ Ray traceViewingRay(Scene* scene, Vector3 viewingWindowLocation, bool parallel)
     }
 }
 
-void checkSphereIntersection(Ray* ray, Scene* scene, int excludeIdx, int sphereIdx, float* closestIntersection, enum ObjectType* closestObject, int* closestSphereIdx, bool bvh) {
-    if (sphereIdx != excludeIdx) {
-        Sphere sphere = bvh ? (*scene).bvhSpheres[sphereIdx] : (*scene).spheres[sphereIdx];
-        float A = dot((*ray).direction, (*ray).direction);
-        float B = 2.0f * dot((*ray).direction, subtract((*ray).origin, sphere.center));
-        float C = dot(subtract((*ray).origin, sphere.center), subtract((*ray).origin, sphere.center)) -
-                  sphere.radius * sphere.radius;
-
-        float discriminant = B * B - 4.0f * A * C;
-
-        if (discriminant >= 0.0f) {
-            float smallDistance = distance((*ray).origin, addf((*ray).origin, EPSILON));
-
-            float sqrtDiscriminant = sqrtf(discriminant);
-            float t1 = (-B + sqrtDiscriminant) / (2.0f * A);
-            float t2 = (-B - sqrtDiscriminant) / (2.0f * A);
+float getSmallDistance(const Ray* ray) {
+    return distance((*ray).origin, addf((*ray).origin, EPSILON));
+}
 
-            if (t1 >= 0.0f && t1 < (*closestIntersection) && t1 > smallDistance) {
-                (*closestIntersection) = t1;
-                (*closestSphereIdx) = sphereIdx;
-                (*closestObject) = SPHERE;
-            }
-            if (t2 >= 0.0f && t2 < (*closestIntersection) && t2 > smallDistance) {
-                (*closestIntersection) = t2;
-                (*closestSphereIdx) = sphereIdx;
-                (*closestObject) = SPHERE;
-            }
+void reduceBatchIntersections(const float* t1, const float* t2, int batchIdx, int count, const int* primitiveIdxs, int excludeIdx, float smallDistance, enum ObjectType objectType, Hit* closestHit) {
+    int firstIdx = batchIdx * INTERSECTION_BATCH_WIDTH;
+    int laneCount = min(INTERSECTION_BATCH_WIDTH, count - firstIdx);
+    for (int lane = 0; lane < laneCount; lane++) {
+        int primitiveIdx = primitiveIdxs == NULL ? firstIdx + lane : primitiveIdxs[firstIdx + lane];
+        if (primitiveIdx == excludeIdx) {
+            continue;
+        }
+        if (t1[lane] >= 0.0f && t1[lane] < closestHit->t && t1[lane] > smallDistance) {
+            closestHit->t = t1[lane];
+            closestHit->primitiveIdx = primitiveIdx;
+            closestHit->objectType = objectType;
+        }
+        if (t2[lane] >= 0.0f && t2[lane] < closestHit->t && t2[lane] > smallDistance) {
+            closestHit->t = t2[lane];
+            closestHit->primitiveIdx = primitiveIdx;
+            closestHit->objectType = objectType;
         }
     }
 }
 
+// Misses are written as a negative distance so the reduction can reject them without a separate mask.
+void checkSphereBatchIntersection(const Ray* ray, const SphereBatches* batches, int batchIdx, float A, float* restrict t1, float* restrict t2) {
+    const float* centerX = batches->centerX + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* centerY = batches->centerY + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* centerZ = batches->centerZ + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* radiusSquared = batches->radiusSquared + batchIdx * INTERSECTION_BATCH_WIDTH;
+    Vector3 origin = (*ray).origin;
+    Vector3 direction = (*ray).direction;
+
+    for (int lane = 0; lane < INTERSECTION_BATCH_WIDTH; lane++) {
+        float ocX = origin.x - centerX[lane];
+        float ocY = origin.y - centerY[lane];
+        float ocZ = origin.z - centerZ[lane];
+        float B = 2.0f * ((direction.x * ocX) + (direction.y * ocY) + (direction.z * ocZ));
+        float C = ((ocX * ocX) + (ocY * ocY) + (ocZ * ocZ)) - radiusSquared[lane];
 
-
-void checkSphereIntersections(int excludeIdx, Ray* ray, Scene* scene, float* closestIntersection, enum ObjectType* closestObject, int* closestSphereIdx, bool bvh) {
-    int sphereCount = bvh ? (*scene).bvhSphereCount : (*scene).sphereCount;
-    for (int sphereIdx = 0; sphereIdx < sphereCount; sphereIdx++) {
-        checkSphereIntersection(ray, scene, excludeIdx, sphereIdx, closestIntersection, closestObject, closestSphereIdx, bvh);
+        float discriminant = B * B - 4.0f * A * C;
+        float sqrtDiscriminant = sqrtf(max(discriminant, 0.0f));
+        float farT = (-B + sqrtDiscriminant) / (2.0f * A);
+        float nearT = (-B - sqrtDiscriminant) / (2.0f * A);
+        t1[lane] = discriminant >= 0.0f ? farT : -1.0f;
+        t2[lane] = discriminant >= 0.0f ? nearT : -1.0f;
     }
 }
 
-void checkEllipsoidIntersection(Ray* ray, Scene* scene, int excludeIdx, int ellipsoidIdx, float* closestIntersection, enum ObjectType* closestObject, int* closestEllipsoidIdx) {
-    if (ellipsoidIdx != excludeIdx) {
-        Ellipsoid ellipsoid = (*scene).ellipsoids[ellipsoidIdx];
+void checkSphereIntersections(int excludeIdx, const Ray* ray, const SphereBatches* batches, float smallDistance, Hit* closestHit) {
+    float A = dot((*ray).direction, (*ray).direction);
+    float t1[INTERSECTION_BATCH_WIDTH];
+    float t2[INTERSECTION_BATCH_WIDTH];
 
-        float A = ((*ray).direction.x * (*ray).direction.x) / (ellipsoid.radius.x * ellipsoid.radius.x)
-                  + ((*ray).direction.y * (*ray).direction.y) / (ellipsoid.radius.y * ellipsoid.radius.y)
-                  + ((*ray).direction.z * (*ray).direction.z) / (ellipsoid.radius.z * ellipsoid.radius.z);
-
-
-        float B = 2.0f * (((*ray).direction.x * ((*ray).origin.x - ellipsoid.center.x)) / (ellipsoid.radius.x * ellipsoid.radius.x)
-                          +
-                          ((*ray).direction.y * ((*ray).origin.y - ellipsoid.center.y)) / (ellipsoid.radius.y * ellipsoid.radius.y)
-                          + ((*ray).direction.z * ((*ray).origin.z - ellipsoid.center.z)) /
-                            (ellipsoid.radius.z * ellipsoid.radius.z));
-
-        float C = (((*ray).origin.x - ellipsoid.center.x) * ((*ray).origin.x - ellipsoid.center.x)) /
-                  (ellipsoid.radius.x * ellipsoid.radius.x)
-                  + (((*ray).origin.y - ellipsoid.center.y) * ((*ray).origin.y - ellipsoid.center.y)) /
-                    (ellipsoid.radius.y * ellipsoid.radius.y)
-                  + (((*ray).origin.z - ellipsoid.center.z) * ((*ray).origin.z - ellipsoid.center.z)) /
-                    (ellipsoid.radius.z * ellipsoid.radius.z) - 1.0f;
+    for (int batchIdx = 0; batchIdx < batches->batchCount; batchIdx++) {
+        checkSphereBatchIntersection(ray, batches, batchIdx, A, t1, t2);
+        reduceBatchIntersections(t1, t2, batchIdx, batches->count, batches->primitiveIdxs, excludeIdx, smallDistance, SPHERE, closestHit);
+    }
+}
 
+void checkEllipsoidBatchIntersection(const Ray* ray, const EllipsoidBatches* batches, int batchIdx, float* restrict t1, float* restrict t2) {
+    const float* centerX = batches->centerX + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* centerY = batches->centerY + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* centerZ = batches->centerZ + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* radiusSquaredX = batches->radiusSquaredX + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* radiusSquaredY = batches->radiusSquaredY + batchIdx * INTERSECTION_BATCH_WIDTH;
+    const float* radiusSquaredZ = batches->radiusSquaredZ + batchIdx * INTERSECTION_BATCH_WIDTH;
+    Vector3 origin = (*ray).origin;
+    Vector3 direction = (*ray).direction;
+
+    for (int lane = 0; lane < INTERSECTION_BATCH_WIDTH; lane++) {
+        float ocX = origin.x - centerX[lane];
+        float ocY = origin.y - centerY[lane];
+        float ocZ = origin.z - centerZ[lane];
+
+        float A = (direction.x * direction.x) / radiusSquaredX[lane]
+                  + (direction.y * direction.y) / radiusSquaredY[lane]
+                  + (direction.z * direction.z) / radiusSquaredZ[lane];
+        float B = 2.0f * ((direction.x * ocX) / radiusSquaredX[lane]
+                          + (direction.y * ocY) / radiusSquaredY[lane]
+                          + (direction.z * ocZ) / radiusSquaredZ[lane]);
+        float C = (ocX * ocX) / radiusSquaredX[lane]
+                  + (ocY * ocY) / radiusSquaredY[lane]
+                  + (ocZ * ocZ) / radiusSquaredZ[lane] - 1.0f;
 
         float discriminant = B * B - 4.0f * A * C;
-
-        if (discriminant >= 0.0f) {
-            float sqrtDiscriminant = sqrtf(discriminant);
-            float t1 = (-B + sqrtDiscriminant) / (2.0f * A);
-            float t2 = (-B - sqrtDiscriminant) / (2.0f * A);
-
-            if (t1 >= 0.0f && t1 < (*closestIntersection)) {
-                (*closestIntersection) = t1;
-                (*closestEllipsoidIdx) = ellipsoidIdx;
-                (*closestObject) = ELLIPSOID;
-            }
-            if (t2 >= 0.0f && t2 < (*closestIntersection)) {
-                (*closestIntersection) = t2;
-                (*closestEllipsoidIdx) = ellipsoidIdx;
-                (*closestObject) = ELLIPSOID;
-            }
-        }
+        float sqrtDiscriminant = sqrtf(max(discriminant, 0.0f));
+        float farT = (-B + sqrtDiscriminant) / (2.0f * A);
+        float nearT = (-B - sqrtDiscriminant) / (2.0f * A);
+        t1[lane] = discriminant >= 0.0f ? farT : -1.0f;
+        t2[lane] = discriminant >= 0.0f ? nearT : -1.0f;
     }
 }
 
-void checkEllipsoidIntersections(int excludeIdx, Ray* ray, Scene* scene, float* closestIntersection, enum ObjectType* closestObject, int* closestEllipsoidIdx) {
-    for (int ellipsoidIdx = 0; ellipsoidIdx < (*scene).ellipsoidCount; ellipsoidIdx++) {
-        checkEllipsoidIntersection(ray, scene, excludeIdx, ellipsoidIdx, closestIntersection, closestObject, closestEllipsoidIdx);
+void checkEllipsoidIntersections(int excludeIdx, const Ray* ray, const EllipsoidBatches* batches, Hit* closestHit) {
+    float t1[INTERSECTION_BATCH_WIDTH];
+    float t2[INTERSECTION_BATCH_WIDTH];
+
+    for (int batchIdx = 0; batchIdx < batches->batchCount; batchIdx++) {
+        checkEllipsoidBatchIntersection(ray, batches, batchIdx, t1, t2);
+        // Ellipsoids have never applied the self-intersection distance, so the threshold is -1.
+        reduceBatchIntersections(t1, t2, batchIdx, batches->count, batches->primitiveIdxs, excludeIdx, -1.0f, ELLIPSOID, closestHit);
     }
 }
 
-int checkFaceIntersection(const Ray* ray, const Scene* scene, float* closestIntersection, enum ObjectType* closestObject, FaceIntersection* closestFaceIntersection, int faceIdx) {
-    Vector3 p0 = (*scene).vertexes[(*scene).faces[faceIdx].v1 - 1];
-    Vector3 p1 = (*scene).vertexes[(*scene).faces[faceIdx].v2 - 1];
-    Vector3 p2 = (*scene).vertexes[(*scene).faces[faceIdx].v3 - 1];
-
+void checkTriangleIntersection(const Ray* ray, Vector3 p0, Vector3 p1, Vector3 p2, int faceIdx, float smallDistance, Hit* closestHit) {
     Vector3 e1 = subtract(p1, p0);
     Vector3 e2 = subtract(p2, p0);
     Vector3 N = cross(e1, e2);
@@ -177,7 +216,7 @@ int checkFaceIntersection(const Ray* ray, const Scene* scene, float* closestInte
 
     float denominator = dot(N, (*ray).direction);
     if (fabsf(denominator) < EPSILON) {
-        return -1;
+        return;
     }
 
     float t = (-1.0f * (dot(N, (*ray).origin) + D)) / denominator;
@@ -194,7 +233,7 @@ int checkFaceIntersection(const Ray* ray, const Scene* scene, float* closestInte
 
     float determinant = (d11 * d22) - (d12 * d12);
     if (fabsf(determinant) < EPSILON) {
-        return -1;
+        return;
     }
 
     float beta = (d22 * d1p - d12 * d2p) / determinant;
@@ -210,73 +249,329 @@ int checkFaceIntersection(const Ray* ray, const Scene* scene, float* closestInte
 
 
     if ((alpha > 0 && alpha < 1) && (beta > 0 && beta < 1) && (gamma > 0 && gamma < 1)) {
-        float smallDistance = distance((*ray).origin, addf((*ray).origin, EPSILON));
-
-        if (t >= 0.0f && t < (*closestIntersection) && t > smallDistance) {
-            (*closestIntersection) = t;
-
-            Vector3 T = (Vector3) { 0.0f, 0.0f, 0.0f };
-            Vector3 B = (Vector3) { 0.0f, 0.0f, 0.0f };
-            if ((*scene).vertexTextures != NULL) {
-                float u0 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt1 - 1].u;
-                float v0 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt1 - 1].v;
-                float u1 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt2 - 1].u;
-                float v1 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt2 - 1].v;
-                float u2 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt3 - 1].u;
-                float v2 = (*scene).vertexTextures[(*scene).faces[faceIdx].vt3 - 1].v;
-
-                float deltaU1 = u1 - u0;
-                float deltaU2 = u2 - u0;
-                float deltaV1 = v1 - v0;
-                float deltaV2 = v2 - v0;
-                float d = 1.0f / (((-1.0f * deltaU1) * deltaV2) + (deltaU2 * deltaV1));
-                T = normalize(multiply(add(multiply(e1, (-1.0f * deltaV2)), multiply(e2, deltaV1)), d));
-                B = normalize(multiply(add(multiply(e1, (-1.0f * deltaU2)), multiply(e2, deltaU1)), d));
-            }
-            (*closestFaceIntersection) = (FaceIntersection) {
-                    .faceIdx = faceIdx,
-                    .normalDirection = N,
-                    .alpha = alpha,
+        // Equally distant faces resolve to the lowest index, whatever order a hierarchy visits them in.
+        bool closer = t < closestHit->t || (t == closestHit->t && closestHit->objectType == TRIANGLE && faceIdx < closestHit->primitiveIdx);
+        if (t >= 0.0f && closer && t > smallDistance) {
+            (*closestHit) = (Hit) {
+                    .t = t,
+                    .primitiveIdx = faceIdx,
+                    .objectType = TRIANGLE,
                     .beta = beta,
                     .gamma = gamma,
-                    .tangentDirection = T,
-                    .bitangentDirection = B,
             };
-            (*closestObject) = TRIANGLE;
         }
     }
-    return 0;
 }
 
-void checkFaceIntersections(int excludeIdx, Ray* ray, Scene* scene, float* closestIntersection, enum ObjectType* closestObject, FaceIntersection* closestFaceIntersection) {
-    for (int faceIdx = 0; faceIdx < (*scene).faceCount; faceIdx++) {
-        if (faceIdx != excludeIdx) {
-            int earlyReturn = checkFaceIntersection(ray, scene, closestIntersection, closestObject, closestFaceIntersection, faceIdx);
-            if (earlyReturn == -1) {
+void checkFaceIntersection(const Ray* ray, const Scene* scene, int faceIdx, float smallDistance, Hit* closestHit) {
+    Vector3 p0 = (*scene).vertexes[(*scene).faces[faceIdx].v1 - 1];
+    Vector3 p1 = (*scene).vertexes[(*scene).faces[faceIdx].v2 - 1];
+    Vector3 p2 = (*scene).vertexes[(*scene).faces[faceIdx].v3 - 1];
+    checkTriangleIntersection(ray, p0, p1, p2, faceIdx, smallDistance, closestHit);
+}
+
+// Slab test against a bounding box. tEntry is where the ray enters the box, or 0 when it starts inside.
+bool intersectBounds(const Ray* ray, Vector3 boundsMin, Vector3 boundsMax, float tMax, float* tEntry) {
+    float origins[3] = { ray->origin.x, ray->origin.y, ray->origin.z };
+    float directions[3] = { ray->direction.x, ray->direction.y, ray->direction.z };
+    float minimums[3] = { boundsMin.x, boundsMin.y, boundsMin.z };
+    float maximums[3] = { boundsMax.x, boundsMax.y, boundsMax.z };
+    float tNear = 0.0f;
+    float tFar = tMax;
+    for (int axis = 0; axis < 3; axis++) {
+        if (directions[axis] == 0.0f) {
+            if (origins[axis] < minimums[axis] || origins[axis] > maximums[axis]) {
+                return false;
+            }
+            continue;
+        }
+        float t1 = (minimums[axis] - origins[axis]) / directions[axis];
+        float t2 = (maximums[axis] - origins[axis]) / directions[axis];
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+    // The slack keeps triangles lying in a face of the box from being missed to rounding.
+    (*tEntry) = tNear;
+    return tNear <= tFar + 1e-4f * (1.0f + tFar);
+}
+
+bool intersectClusterNode(const Ray* ray, const ClusterNode* node, float tMax, float* tEntry) {
+    return intersectBounds(ray, node->boundsMin, node->boundsMax, tMax, tEntry);
+}
+
+// Pushes the children of an inner node that the ray reaches before tMax. The nearer child is pushed last so it is
+// visited first.
+void pushBvhChildren(const Ray* ray, const BvhNode* nodes, const BvhNode* node, float tMax, int* nodeStack, float* entryStack, int* stackSize) {
+    float leftEntry;
+    float rightEntry;
+    bool hitsLeft = intersectBounds(ray, nodes[node->first].boundsMin, nodes[node->first].boundsMax, tMax, &leftEntry);
+    bool hitsRight = intersectBounds(ray, nodes[node->first + 1].boundsMin, nodes[node->first + 1].boundsMax, tMax, &rightEntry);
+    if (hitsLeft && hitsRight && leftEntry < rightEntry) {
+        nodeStack[*stackSize] = node->first + 1;
+        entryStack[*stackSize] = rightEntry;
+        nodeStack[*stackSize + 1] = node->first;
+        entryStack[*stackSize + 1] = leftEntry;
+        (*stackSize) += 2;
+    } else if (hitsLeft && hitsRight) {
+        nodeStack[*stackSize] = node->first;
+        entryStack[*stackSize] = leftEntry;
+        nodeStack[*stackSize + 1] = node->first + 1;
+        entryStack[*stackSize + 1] = rightEntry;
+        (*stackSize) += 2;
+    } else if (hitsLeft || hitsRight) {
+        nodeStack[*stackSize] = hitsLeft ? node->first : node->first + 1;
+        entryStack[*stackSize] = hitsLeft ? leftEntry : rightEntry;
+        (*stackSize)++;
+    }
+}
+
+// Walks one object's bottom-level hierarchy. The ray is already in the object's space.
+void checkObjectIntersections(int excludeIdx, const Ray* ray, const Scene* scene, const MeshObject* object, float smallDistance, Hit* closestHit) {
+    int nodeStack[MAX_BVH_DEPTH + 1];
+    float entryStack[MAX_BVH_DEPTH + 1];
+    int stackSize = 0;
+    const BvhNode* root = &scene->objectNodes[object->rootNodeIdx];
+    if (intersectBounds(ray, root->boundsMin, root->boundsMax, closestHit->t, &entryStack[0])) {
+        nodeStack[0] = object->rootNodeIdx;
+        stackSize = 1;
+    }
+    while (stackSize > 0) {
+        stackSize--;
+        if (entryStack[stackSize] > closestHit->t) {
+            continue;
+        }
+        const BvhNode* node = &scene->objectNodes[nodeStack[stackSize]];
+        if (node->count == 0) {
+            pushBvhChildren(ray, scene->objectNodes, node, closestHit->t, nodeStack, entryStack, &stackSize);
+            continue;
+        }
+        for (int leafIdx = node->first; leafIdx < node->first + node->count; leafIdx++) {
+            int faceIdx = scene->objectFaceIdxs[leafIdx];
+            if (faceIdx != excludeIdx) {
+                checkFaceIntersection(ray, scene, faceIdx, smallDistance, closestHit);
+            }
+        }
+    }
+}
+
+// Walks the top-level hierarchy over the placed objects. Rays enter a moved object in its own space, where t along
+// the ray stays the same, so hits from every object compare directly.
+void checkInstanceIntersections(int excludeIdx, const Ray* ray, const Scene* scene, float smallDistance, Hit* closestHit) {
+    const InstanceHierarchy* hierarchy = &scene->instanceHierarchy;
+    if (hierarchy->nodeCount == 0) {
+        return;
+    }
+    int nodeStack[MAX_BVH_DEPTH + 1];
+    float entryStack[MAX_BVH_DEPTH + 1];
+    int stackSize = 0;
+    if (intersectBounds(ray, hierarchy->nodes[0].boundsMin, hierarchy->nodes[0].boundsMax, closestHit->t, &entryStack[0])) {
+        nodeStack[0] = 0;
+        stackSize = 1;
+    }
+    while (stackSize > 0) {
+        stackSize--;
+        if (entryStack[stackSize] > closestHit->t) {
+            continue;
+        }
+        const BvhNode* node = &hierarchy->nodes[nodeStack[stackSize]];
+        if (node->count == 0) {
+            pushBvhChildren(ray, hierarchy->nodes, node, closestHit->t, nodeStack, entryStack, &stackSize);
+            continue;
+        }
+        for (int leafIdx = node->first; leafIdx < node->first + node->count; leafIdx++) {
+            int objectIdx = hierarchy->instanceIdxs[leafIdx];
+            const ObjectInstance* instance = &hierarchy->instances[objectIdx];
+            if (instance->transformed) {
+                Ray objectRay = transformRayToObject(instance, ray);
+                checkObjectIntersections(excludeIdx, &objectRay, scene, &scene->objects[objectIdx], smallDistance, closestHit);
+            } else {
+                checkObjectIntersections(excludeIdx, ray, scene, &scene->objects[objectIdx], smallDistance, closestHit);
+            }
+        }
+    }
+}
+
+void checkClusterTriangles(int excludeIdx, const Ray* ray, const Scene* scene, int clusterIdx, float smallDistance, Hit* closestHit) {
+    ClusterCache* cache = scene->clusterCache;
+    const ClusterInfo* info = &cache->clusters[clusterIdx].info;
+    const ClusterFile* file = &cache->files[cache->clusters[clusterIdx].fileIdx];
+    const void* data = acquireCluster(cache, clusterIdx);
+    if (file->quantized) {
+        // Positions are decoded on the stack for the duration of the visit, so the cluster stays compact in memory.
+        // Clusters cut from one oversized grid cell can hold more vertexes than the buffer and decode per corner.
+        const QuantizedClusterHeader* header = (const QuantizedClusterHeader*) data;
+        const QuantizedVertex* vertexes = getQuantizedVertexes(header);
+        const unsigned short* indexes = getQuantizedTriangles(header);
+        Vector3 positions[MAX_DECODED_CLUSTER_VERTEXES];
+        bool decoded = header->vertexCount <= MAX_DECODED_CLUSTER_VERTEXES;
+        for (int vertexIdx = 0; decoded && vertexIdx < header->vertexCount; vertexIdx++) {
+            positions[vertexIdx] = decodeQuantizedPosition(file, header, &vertexes[vertexIdx]);
+        }
+        for (int triangleIdx = 0; triangleIdx < info->triangleCount; triangleIdx++) {
+            int faceIdx = scene->faceCount + info->firstTriangleIdx + triangleIdx;
+            if (faceIdx == excludeIdx) {
                 continue;
             }
+            const unsigned short* corners = &indexes[triangleIdx * 3];
+            if (decoded) {
+                checkTriangleIntersection(ray, positions[corners[0]], positions[corners[1]], positions[corners[2]], faceIdx, smallDistance, closestHit);
+            } else {
+                Vector3 p0 = decodeQuantizedPosition(file, header, &vertexes[corners[0]]);
+                Vector3 p1 = decodeQuantizedPosition(file, header, &vertexes[corners[1]]);
+                Vector3 p2 = decodeQuantizedPosition(file, header, &vertexes[corners[2]]);
+                checkTriangleIntersection(ray, p0, p1, p2, faceIdx, smallDistance, closestHit);
+            }
+        }
+    } else {
+        const ClusterTriangle* triangles = (const ClusterTriangle*) data;
+        for (int triangleIdx = 0; triangleIdx < info->triangleCount; triangleIdx++) {
+            int faceIdx = scene->faceCount + info->firstTriangleIdx + triangleIdx;
+            if (faceIdx != excludeIdx) {
+                checkTriangleIntersection(ray, triangles[triangleIdx].v1, triangles[triangleIdx].v2, triangles[triangleIdx].v3, faceIdx, smallDistance, closestHit);
+            }
+        }
+    }
+    releaseCluster(cache, clusterIdx);
+}
+
+// Out-of-core triangles continue the face numbering after the in-memory faces. The cluster hierarchy is walked
+// nearest child first and boxes that start beyond the closest hit are skipped, so clusters hidden behind it are
+// rarely paged in.
+void checkClusterIntersections(int excludeIdx, const Ray* ray, const Scene* scene, float smallDistance, Hit* closestHit) {
+    ClusterCache* cache = scene->clusterCache;
+    if (cache == NULL) {
+        return;
+    }
+    int nodeStack[MAX_CLUSTER_HIERARCHY_DEPTH];
+    float entryStack[MAX_CLUSTER_HIERARCHY_DEPTH];
+    int stackSize = 0;
+    float tEntry;
+    if (intersectClusterNode(ray, &cache->nodes[0], closestHit->t, &tEntry)) {
+        nodeStack[stackSize] = 0;
+        entryStack[stackSize] = tEntry;
+        stackSize++;
+    }
+    while (stackSize > 0) {
+        stackSize--;
+        if (entryStack[stackSize] > closestHit->t) {
+            continue;
+        }
+        const ClusterNode* node = &cache->nodes[nodeStack[stackSize]];
+        if (node->clusterIdx >= 0) {
+            checkClusterTriangles(excludeIdx, ray, scene, node->clusterIdx, smallDistance, closestHit);
+            continue;
+        }
+        float leftEntry;
+        float rightEntry;
+        bool hitsLeft = intersectClusterNode(ray, &cache->nodes[node->left], closestHit->t, &leftEntry);
+        bool hitsRight = intersectClusterNode(ray, &cache->nodes[node->right], closestHit->t, &rightEntry);
+        // The nearer child is pushed last so it is visited first.
+        if (hitsLeft && hitsRight && leftEntry < rightEntry) {
+            nodeStack[stackSize] = node->right;
+            entryStack[stackSize] = rightEntry;
+            nodeStack[stackSize + 1] = node->left;
+            entryStack[stackSize + 1] = leftEntry;
+            stackSize += 2;
+        } else if (hitsLeft && hitsRight) {
+            nodeStack[stackSize] = node->left;
+            entryStack[stackSize] = leftEntry;
+            nodeStack[stackSize + 1] = node->right;
+            entryStack[stackSize + 1] = rightEntry;
+            stackSize += 2;
+        } else if (hitsLeft) {
+            nodeStack[stackSize] = node->left;
+            entryStack[stackSize] = leftEntry;
+            stackSize++;
+        } else if (hitsRight) {
+            nodeStack[stackSize] = node->right;
+            entryStack[stackSize] = rightEntry;
+            stackSize++;
+        }
+    }
+}
+
+PPMImage getPPMImage(const PPMImage* images, int imageIdx) {
+    if (imageIdx < 0) {
+        return (PPMImage) { .width = 0, .height = 0, .maxColor = 0, .data = NULL, .texels = NULL, .cacheEntry = NULL };
+    }
+    return images[imageIdx];
+}
+
+bool hasTextureData(PPMImage texture) { return texture.height > 0 && texture.width > 0 && texture.maxColor == 255 && texture.texels != NULL; }
+
+Vector3 getTexel(PPMImage image, int x, int y) {
+    return image.texels[y * image.width + x];
+}
+
+// Converts every texel up front so lookups while shading are plain loads. Normal maps are stored as
+// unit tangent-space vectors, textures as 0-1 colors. Rows missing from a short file decode to black.
+Vector3* decodePPMTexels(const PPMImage* image, bool normalMap) {
+    if (image->data == NULL || image->width <= 0 || image->height <= 0) {
+        return NULL;
+    }
+    Vector3* texels = (Vector3*) malloc((size_t) image->width * (size_t) image->height * sizeof(Vector3));
+    if (texels == NULL) {
+        fprintf(stderr, "Memory allocation error while decoding PPM data.\n");
+        exit(-1);
+    }
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            if (image->data[y] == NULL) {
+                texels[y * image->width + x] = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f };
+            } else if (normalMap) {
+                texels[y * image->width + x] = normalize(convertNormalToVector(image->data[y][x]));
+            } else {
+                texels[y * image->width + x] = convertRGBColorToColor(image->data[y][x]);
+            }
         }
     }
+    return texels;
 }
 
-bool hasTextureData(PPMImage texture) { return texture.height > 0 && texture.width > 0 && texture.maxColor == 255 && texture.data != NULL; }
+// Cached images are decoded by the first scene that uses them as a texture or as a normal map, the other scenes
+// share those texels.
+void decodePPMImage(PPMImage* image, bool normalMap) {
+    if (image->cacheEntry != NULL) {
+        TextureCacheEntry* entry = image->cacheEntry;
+        Vector3** texels = normalMap ? &entry->normalTexels : &entry->colorTexels;
+        pthread_mutex_lock(&entry->decodeMutex);
+        if ((*texels) == NULL) {
+            (*texels) = decodePPMTexels(&entry->image, normalMap);
+        }
+        image->texels = (*texels);
+        pthread_mutex_unlock(&entry->decodeMutex);
+        return;
+    }
+    image->texels = decodePPMTexels(image, normalMap);
+    freePPMImageData(image);
+}
 
-void handleSphereIntersection(Scene* scene, int closestSphereIdx, Vector3 intersectionPoint, MaterialColor* mtlColor, Vector3* surfaceNormal) {
-    Sphere sphere = scene->spheres[closestSphereIdx];
-    (*mtlColor) = scene->mtlColors[sphere.mtlColorIdx];
-    PPMImage texture = scene->textures[sphere.textureIdx];
-    PPMImage normal = scene->normals[sphere.normalIdx];
-    (*surfaceNormal) = normalize(divide(subtract(intersectionPoint, sphere.center), sphere.radius));
+void decodeSceneImages(Scene* scene) {
+    for (int textureIdx = 0; textureIdx < scene->textureCount; textureIdx++) {
+        decodePPMImage(&scene->textures[textureIdx], false);
+    }
+    for (int normalIdx = 0; normalIdx < scene->normalCount; normalIdx++) {
+        decodePPMImage(&scene->normals[normalIdx], true);
+    }
+}
+
+void handleSphereIntersection(Scene* scene, int sphereIdx, Intersection* intersection) {
+    Sphere sphere = scene->spheres[sphereIdx];
+    intersection->mtlColorIdx = sphere.mtlColorIdx;
+    intersection->diffuseColor = scene->mtlColors[sphere.mtlColorIdx].diffuseColor;
+    PPMImage texture = getPPMImage(scene->textures, sphere.textureIdx);
+    PPMImage normal = getPPMImage(scene->normals, sphere.normalIdx);
+    intersection->surfaceNormal = normalize(divide(subtract(intersection->intersectionPoint, sphere.center), sphere.radius));
     if (hasTextureData(texture)) {
-        float phi = acosf((*surfaceNormal).z);
-        float theta = atan2f((*surfaceNormal).y, (*surfaceNormal).x);
+        float phi = acosf(intersection->surfaceNormal.z);
+        float theta = atan2f(intersection->surfaceNormal.y, intersection->surfaceNormal.x);
         float v = phi / (float) M_PI;
         float u = max(theta/(2.0f * (float) M_PI), (theta + 2.0f * (float) M_PI) / (2.0f * (float) M_PI));
         int x = (int) roundf(u * (float) (texture.width-1)) % (texture.width - 1);
         int y = (int) roundf(v * (float) (texture.height-1)) % (texture.height - 1);
 
-        if (normal.height > 0 && normal.width > 0 && normal.maxColor == 255 && normal.data != NULL) {
-            Vector3 normalMatrix = normalize(convertNormalToVector(normal.data[y][x]));
+        if (hasTextureData(normal)) {
+            Vector3 normalMatrix = getTexel(normal, x, y);
             Vector3 normalDirection = normalize((Vector3) {
                     .x = cosf(theta) * sinf(phi),
                     .y = sinf(theta) * sinf(phi),
@@ -293,85 +588,113 @@ void handleSphereIntersection(Scene* scene, int closestSphereIdx, Vector3 inters
                     .z = sqrtf((normalDirection.x * normalDirection.x) + (normalDirection.y * normalDirection.y)),
             };
 
-            (*surfaceNormal) = tangentSpaceToWorldSpace(normalMatrix, tangentDirection, bitangentDirection, (*surfaceNormal));
+            intersection->surfaceNormal = tangentSpaceToWorldSpace(normalMatrix, tangentDirection, bitangentDirection, intersection->surfaceNormal);
         }
-        (*mtlColor).diffuseColor = convertRGBColorToColor(texture.data[y][x]);
+        intersection->diffuseColor = getTexel(texture, x, y);
     }
 }
 
 
-void handleEllipsoidIntersection(Scene* scene, int closestEllipsoidIdx, Vector3 intersectionPoint, MaterialColor* mtlColor, Vector3* surfaceNormal) {
-    Ellipsoid ellipsoid = scene->ellipsoids[closestEllipsoidIdx];
-    (*mtlColor) = scene->mtlColors[ellipsoid.mtlColorIdx];
+void handleEllipsoidIntersection(Scene* scene, int ellipsoidIdx, Intersection* intersection) {
+    Ellipsoid ellipsoid = scene->ellipsoids[ellipsoidIdx];
+    intersection->mtlColorIdx = ellipsoid.mtlColorIdx;
+    intersection->diffuseColor = scene->mtlColors[ellipsoid.mtlColorIdx].diffuseColor;
     // todo: Calculate the surface normal for the ellipsoid
-    (*surfaceNormal) = normalize(divide(subtract(intersectionPoint, ellipsoid.center), ellipsoid.radius.x));
+    intersection->surfaceNormal = normalize(divide(subtract(intersection->intersectionPoint, ellipsoid.center), ellipsoid.radius.x));
 }
 
-Vector3 applyBilinearInterpolation(FaceIntersection intersection, RGBColor** textureData, int x, int y) {
+Vector3 applyBilinearInterpolation(float alpha, float beta, PPMImage texture, int x, int y) {
     return add(
             add(
                     add(
                             multiply(
                                     multiply(
-                                            convertRGBColorToColor(textureData[y][x]),
-                                            (1 - intersection.alpha)
+                                            getTexel(texture, x, y),
+                                            (1 - alpha)
                                     ),
-                                    (1 - intersection.beta)
+                                    (1 - beta)
                             ),
                             multiply(
                                     multiply(
-                                            convertRGBColorToColor(textureData[y][x + 1]),
-                                            (intersection.alpha)
+                                            getTexel(texture, x + 1, y),
+                                            (alpha)
                                     ),
-                                    (1 - intersection.beta)
+                                    (1 - beta)
                             )
                     ),
                     multiply(
                             multiply(
-                                    convertRGBColorToColor(textureData[y + 1][x]),
-                                    (1 - intersection.alpha)
+                                    getTexel(texture, x, y + 1),
+                                    (1 - alpha)
                             ),
-                            (intersection.beta)
+                            (beta)
                     )
             ),
             multiply(
                     multiply(
-                            convertRGBColorToColor(textureData[y + 1][x + 1]),
-                            (intersection.alpha)
+                            getTexel(texture, x + 1, y + 1),
+                            (alpha)
                     ),
-                    (intersection.beta)
+                    (beta)
             )
     );
 }
 
-void handleFaceIntersection(Scene* scene, FaceIntersection closestFaceIntersection, MaterialColor* mtlColor, Vector3* surfaceNormal) {
-    Face face = scene->faces[closestFaceIntersection.faceIdx];
-    PPMImage texture = scene->textures[face.textureIdx];
-    PPMImage normal = scene->normals[face.normalIdx];
-    (*mtlColor) = scene->mtlColors[face.mtlColorIdx];
+// Out-of-core triangles are shaded with their mesh material, flat unless the mesh has vertex normals.
+void handleClusterTriangleIntersection(Scene* scene, Hit hit, Intersection* intersection) {
+    ClusterTriangle triangle = readClusterTriangle(scene->clusterCache, hit.primitiveIdx - scene->faceCount);
+    intersection->mtlColorIdx = triangle.mtlColorIdx;
+    intersection->diffuseColor = scene->mtlColors[triangle.mtlColorIdx].diffuseColor;
 
-    if (scene->vertexNormals == NULL) {
-        (*surfaceNormal) = normalize(closestFaceIntersection.normalDirection);
+    if (magnitude(triangle.n1) == 0.0f) {
+        intersection->surfaceNormal = normalize(cross(subtract(triangle.v2, triangle.v1), subtract(triangle.v3, triangle.v1)));
     } else {
-        Vector3 n0 = normalize(scene->vertexNormals[scene->faces[closestFaceIntersection.faceIdx].vn1 - 1]);
-        Vector3 n1 = normalize(scene->vertexNormals[scene->faces[closestFaceIntersection.faceIdx].vn2 - 1]);
-        Vector3 n2 = normalize(scene->vertexNormals[scene->faces[closestFaceIntersection.faceIdx].vn3 - 1]);
-        Vector3 alphaComponent = multiply(n0, closestFaceIntersection.alpha);
-        Vector3 betaComponent = multiply(n1, closestFaceIntersection.beta);
-        Vector3 gammaComponent = multiply(n2, closestFaceIntersection.gamma);
-        (*surfaceNormal) = normalize(add(alphaComponent, add(betaComponent, gammaComponent)));
-    }
-
-    if (scene->vertexTextures != NULL && hasTextureData(texture)) {
-        float u0 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt1 - 1].u;
-        float v0 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt1 - 1].v;
-        float u1 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt2 - 1].u;
-        float v1 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt2 - 1].v;
-        float u2 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt3 - 1].u;
-        float v2 = scene->vertexTextures[scene->faces[closestFaceIntersection.faceIdx].vt3 - 1].v;
-
-        float u = closestFaceIntersection.alpha * u0 + closestFaceIntersection.beta * u1 + closestFaceIntersection.gamma * u2;
-        float v = closestFaceIntersection.alpha * v0 + closestFaceIntersection.beta * v1 + closestFaceIntersection.gamma * v2;
+        float alpha = 1.0f - hit.beta - hit.gamma;
+        Vector3 alphaComponent = multiply(normalize(triangle.n1), alpha);
+        Vector3 betaComponent = multiply(normalize(triangle.n2), hit.beta);
+        Vector3 gammaComponent = multiply(normalize(triangle.n3), hit.gamma);
+        intersection->surfaceNormal = normalize(add(alphaComponent, add(betaComponent, gammaComponent)));
+    }
+}
+
+void handleFaceIntersection(Scene* scene, Hit hit, Intersection* intersection) {
+    if (hit.primitiveIdx >= scene->faceCount) {
+        handleClusterTriangleIntersection(scene, hit, intersection);
+        return;
+    }
+    Face face = scene->faces[hit.primitiveIdx];
+    PPMImage texture = getPPMImage(scene->textures, face.textureIdx);
+    PPMImage normal = getPPMImage(scene->normals, face.normalIdx);
+    intersection->mtlColorIdx = face.mtlColorIdx;
+    intersection->diffuseColor = scene->mtlColors[face.mtlColorIdx].diffuseColor;
+
+    Vector3 p0 = scene->vertexes[face.v1 - 1];
+    Vector3 e1 = subtract(scene->vertexes[face.v2 - 1], p0);
+    Vector3 e2 = subtract(scene->vertexes[face.v3 - 1], p0);
+    float alpha = 1.0f - hit.beta - hit.gamma;
+
+    if (scene->vertexNormals == NULL || face.vn1 == 0) {
+        intersection->surfaceNormal = normalize(cross(e1, e2));
+    } else {
+        Vector3 n0 = normalize(scene->vertexNormals[face.vn1 - 1]);
+        Vector3 n1 = normalize(scene->vertexNormals[face.vn2 - 1]);
+        Vector3 n2 = normalize(scene->vertexNormals[face.vn3 - 1]);
+        Vector3 alphaComponent = multiply(n0, alpha);
+        Vector3 betaComponent = multiply(n1, hit.beta);
+        Vector3 gammaComponent = multiply(n2, hit.gamma);
+        intersection->surfaceNormal = normalize(add(alphaComponent, add(betaComponent, gammaComponent)));
+    }
+
+    if (scene->vertexTextures != NULL && face.vt1 != 0 && hasTextureData(texture)) {
+        float u0 = scene->vertexTextures[face.vt1 - 1].u;
+        float v0 = scene->vertexTextures[face.vt1 - 1].v;
+        float u1 = scene->vertexTextures[face.vt2 - 1].u;
+        float v1 = scene->vertexTextures[face.vt2 - 1].v;
+        float u2 = scene->vertexTextures[face.vt3 - 1].u;
+        float v2 = scene->vertexTextures[face.vt3 - 1].v;
+
+        float u = alpha * u0 + hit.beta * u1 + hit.gamma * u2;
+        float v = alpha * v0 + hit.beta * v1 + hit.gamma * v2;
 
         float uInt;
         float uFractional = modff(u, &uInt);
@@ -382,20 +705,75 @@ void handleFaceIntersection(Scene* scene, FaceIntersection closestFaceIntersecti
         int x = (int) roundf(uFractional * ((float) texture.width - 1.0f)) % (texture.width - 1);
         int y = (int) roundf(vFractional * ((float) texture.height - 1.0f)) % (texture.height - 1);
 
-        if (normal.height > 0 && normal.width > 0 && normal.maxColor == 255 && normal.data != NULL) {
-            Vector3 normalMatrix = normalize(convertNormalToVector(normal.data[y][x]));
-            (*surfaceNormal) = tangentSpaceToWorldSpace(normalMatrix, closestFaceIntersection.tangentDirection, closestFaceIntersection.bitangentDirection, (*surfaceNormal));
-
+        if (hasTextureData(normal)) {
+            float deltaU1 = u1 - u0;
+            float deltaU2 = u2 - u0;
+            float deltaV1 = v1 - v0;
+            float deltaV2 = v2 - v0;
+            float d = 1.0f / (((-1.0f * deltaU1) * deltaV2) + (deltaU2 * deltaV1));
+            Vector3 tangentDirection = normalize(multiply(add(multiply(e1, (-1.0f * deltaV2)), multiply(e2, deltaV1)), d));
+            Vector3 bitangentDirection = normalize(multiply(add(multiply(e1, (-1.0f * deltaU2)), multiply(e2, deltaU1)), d));
+
+            Vector3 normalMatrix = getTexel(normal, x, y);
+            intersection->surfaceNormal = tangentSpaceToWorldSpace(normalMatrix, tangentDirection, bitangentDirection, intersection->surfaceNormal);
         }
 
-        (*mtlColor).diffuseColor = applyBilinearInterpolation(closestFaceIntersection, texture.data, x, y);
+        intersection->diffuseColor = applyBilinearInterpolation(alpha, hit.beta, texture, x, y);
+    }
+
+    // Everything above works on the object's own vertexes, so a moved object's normal is taken to world space last.
+    const ObjectInstance* instance = getFaceInstance(scene, hit.primitiveIdx);
+    if (instance->transformed) {
+        intersection->surfaceNormal = transformNormal(instance, intersection->surfaceNormal);
+    }
+}
+
+bool hitExists(Hit hit) {
+    return hit.primitiveIdx != -1;
+}
+
+Exclusion getHitExclusion(Hit hit) {
+    return (Exclusion) {
+            .excludeSphereIdx = hit.objectType == SPHERE ? hit.primitiveIdx : -1,
+            .excludeEllipsoidIdx = hit.objectType == ELLIPSOID ? hit.primitiveIdx : -1,
+            .excludeFaceIdx = hit.objectType == TRIANGLE ? hit.primitiveIdx : -1,
+    };
+}
+
+int getHitMtlColorIdx(Scene* scene, Hit hit) {
+    if (hit.objectType == SPHERE) {
+        return scene->spheres[hit.primitiveIdx].mtlColorIdx;
+    } else if (hit.objectType == ELLIPSOID) {
+        return scene->ellipsoids[hit.primitiveIdx].mtlColorIdx;
+    } else if (hit.primitiveIdx >= scene->faceCount) {
+        return readClusterTriangle(scene->clusterCache, hit.primitiveIdx - scene->faceCount).mtlColorIdx;
     }
+    return scene->faces[hit.primitiveIdx].mtlColorIdx;
+}
+
+// Shadow rays only need the opacity of what they hit, which never depends on textures or normals.
+float getHitAlpha(Scene* scene, Hit hit) {
+    return scene->mtlColors[getHitMtlColorIdx(scene, hit)].alpha;
 }
 
-bool intersectionExists(Intersection intersection) {
-    return (intersection.closestSphereIdx != -1 && intersection.closestObject == SPHERE) ||
-        (intersection.closestEllipsoidIdx != -1 && intersection.closestObject == ELLIPSOID) ||
-        (intersection.closestFaceIntersection.faceIdx != -1 && intersection.closestObject == TRIANGLE);
+// Watch mode points this at the tile's material mask while the tile is shaded, to learn which edits can change the
+// tile. Bit 0 is set by any hit, bit mtlColorIdx + 1 by every material that was shaded or cast a shadow. NULL otherwise.
+_Thread_local uint64_t* shadedMaterialMask = NULL;
+
+static inline void markShadedMaterial(int mtlColorIdx) {
+    if (shadedMaterialMask != NULL) {
+        shadedMaterialMask[0] |= 1;
+        if (mtlColorIdx >= 0) {
+            shadedMaterialMask[(mtlColorIdx + 1) >> 6] |= (uint64_t) 1 << ((mtlColorIdx + 1) & 63);
+        }
+    }
+}
+
+// The occluder's alpha only matters with transparency, but an edit can make it transparent, so it is always marked.
+static inline void markShadowOccluder(Scene* scene, Hit hit) {
+    if (shadedMaterialMask != NULL) {
+        markShadedMaterial(getHitMtlColorIdx(scene, hit));
+    }
 }
 
 Ray reflectRay(Vector3 intersectionPoint, Vector3 reverseIncidentDirection, Vector3 surfaceNormal) {
@@ -405,89 +783,72 @@ Ray reflectRay(Vector3 intersectionPoint, Vector3 reverseIncidentDirection, Vect
     };
 }
 
-Intersection castBvhRay(Ray ray, Scene* scene) {
-    float closestIntersection = FLT_MAX; // Initialize with a large value
-    enum ObjectType closestObject;
-    int closestBvhSphereIdx = -1;
-    checkSphereIntersections(-1, &ray, scene, &closestIntersection, &closestObject, &closestBvhSphereIdx, true);
-    return (Intersection) {
-            .closestIntersection = closestIntersection,
-            .closestSphereIdx = closestBvhSphereIdx,
-            .closestEllipsoidIdx = -1,
-            .closestFaceIntersection = (FaceIntersection) {
-                .faceIdx = -1,
-                .normalDirection = (Vector3) {
-                        .x = 0.0f,
-                        .y = 0.0f,
-                        .z = 0.0f,
-                },
-                .alpha = 0.0f,
-                .beta = 0.0f,
-                .gamma = 0.0f,
-            },
-            .closestObject = closestObject,
-    };
-}
-
-Intersection castRay(Ray ray, Scene* scene, Exclusion exclusion) {
-    float closestIntersection = FLT_MAX; // Initialize with a large value
-    enum ObjectType closestObject;
-    int closestSphereIdx = -1;
-    int closestEllipsoidIdx = -1;
-    FaceIntersection closestFaceIntersection = (FaceIntersection) {
-            .faceIdx = -1,
-            .normalDirection = (Vector3) {
-                    .x = 0.0f,
-                    .y = 0.0f,
-                    .z = 0.0f,
-            },
-            .alpha = 0.0f,
+Hit getEmptyHit() {
+    return (Hit) {
+            .t = FLT_MAX, // Initialize with a large value
+            .primitiveIdx = -1,
+            .objectType = SPHERE,
             .beta = 0.0f,
             .gamma = 0.0f,
     };
-    checkSphereIntersections(exclusion.excludeSphereIdx, &ray, scene, &closestIntersection, &closestObject, &closestSphereIdx, false);
+}
 
-    checkEllipsoidIntersections(exclusion.excludeEllipsoidIdx, &ray, scene, &closestIntersection, &closestObject, &closestEllipsoidIdx);
+Hit castBvhRay(Ray ray, Scene* scene) {
+    Hit closestHit = getEmptyHit();
+    checkSphereIntersections(-1, &ray, &scene->bvhSphereBatches, getSmallDistance(&ray), &closestHit);
+    return closestHit;
+}
 
-    checkFaceIntersections(exclusion.excludeFaceIdx, &ray, scene, &closestIntersection, &closestObject, &closestFaceIntersection);
+// Primary rays pass the candidates left after tile culling and rasterization. Faces come last, so a rasterized face
+// hit only wins when strictly closer, the same as in the face loop.
+Hit castRayWithCandidates(Ray ray, Scene* scene, Exclusion exclusion, const RayCandidates* candidates) {
+    Hit closestHit = getEmptyHit();
+    float smallDistance = getSmallDistance(&ray);
+    const SphereBatches* sphereBatches = (candidates != NULL && candidates->sphereBatches != NULL) ? candidates->sphereBatches : &scene->sphereBatches;
+    const EllipsoidBatches* ellipsoidBatches = (candidates != NULL && candidates->ellipsoidBatches != NULL) ? candidates->ellipsoidBatches : &scene->ellipsoidBatches;
+    const Hit* faceHit = candidates != NULL ? candidates->faceHit : NULL;
 
-    Vector3 intersectionPoint = add(
-            ray.origin,
-            multiply(
-                    ray.direction,
-                    closestIntersection
-            )
-    );
+    checkSphereIntersections(exclusion.excludeSphereIdx, &ray, sphereBatches, smallDistance, &closestHit);
 
-    MaterialColor mtlColor;
-    Vector3 surfaceNormal;
+    checkEllipsoidIntersections(exclusion.excludeEllipsoidIdx, &ray, ellipsoidBatches, &closestHit);
 
-    if (closestSphereIdx != -1 && closestObject == SPHERE) {
-        handleSphereIntersection(scene, closestSphereIdx, intersectionPoint, &mtlColor, &surfaceNormal);
-    } else if (closestEllipsoidIdx != -1 && closestObject == ELLIPSOID) {
-        handleEllipsoidIntersection(scene, closestEllipsoidIdx, intersectionPoint, &mtlColor, &surfaceNormal);
-    } else if (closestFaceIntersection.faceIdx != -1 && closestObject == TRIANGLE) {
-        handleFaceIntersection(scene, closestFaceIntersection, &mtlColor, &surfaceNormal);
-    } else {
-        // didn't hit anything
-    }
-
-    return (Intersection) {
-            .closestIntersection = closestIntersection,
-            .closestSphereIdx = closestSphereIdx,
-            .closestEllipsoidIdx = closestEllipsoidIdx,
-            .closestFaceIntersection = closestFaceIntersection,
-            .closestObject = closestObject,
-            .intersectionPoint = intersectionPoint,
-            .surfaceNormal = surfaceNormal,
-            .mtlColor = mtlColor,
+    if (faceHit == NULL) {
+        checkInstanceIntersections(exclusion.excludeFaceIdx, &ray, scene, smallDistance, &closestHit);
+    } else if (hitExists(*faceHit) && faceHit->t < closestHit.t) {
+        closestHit = (*faceHit);
+    }
+
+    checkClusterIntersections(exclusion.excludeFaceIdx, &ray, scene, smallDistance, &closestHit);
+
+    return closestHit;
+}
+
+Hit castRay(Ray ray, Scene* scene, Exclusion exclusion) {
+    return castRayWithCandidates(ray, scene, exclusion, NULL);
+}
+
+Intersection resolveIntersection(Scene* scene, Ray ray, Hit hit) {
+    Intersection intersection = (Intersection) {
+            .hit = hit,
+            .intersectionPoint = add(
+                    ray.origin,
+                    multiply(
+                            ray.direction,
+                            hit.t
+                    )
+            ),
             .incidentDirection = ray.direction,
-            .exclusion = (Exclusion) {
-                .excludeSphereIdx = closestSphereIdx,
-                .excludeEllipsoidIdx = closestEllipsoidIdx,
-                .excludeFaceIdx = closestFaceIntersection.faceIdx
-            }
     };
+
+    if (hit.objectType == SPHERE) {
+        handleSphereIntersection(scene, hit.primitiveIdx, &intersection);
+    } else if (hit.objectType == ELLIPSOID) {
+        handleEllipsoidIntersection(scene, hit.primitiveIdx, &intersection);
+    } else {
+        handleFaceIntersection(scene, hit, &intersection);
+    }
+
+    return intersection;
 }
 
 void printViewParameters(ViewParameters viewParameters) {
@@ -1,25 +1,57 @@
 #!/bin/bash
 
-make
+make || exit 1
 
 testDirectory="./tests/"
-textureDirectory="./textures/"
+# Any scene that fails to render or any image that does not match makes the script exit with 1.
+status=0
+
+# Prints whether two images that have to be the same are, and fails the run when they are not.
+compareImages() {
+    if cmp -s "$1" "$2"; then
+        echo "$3 matches $4."
+    else
+        echo "$3 does not match $4."
+        status=1
+    fi
+}
 
 if [ -d "$testDirectory" ]; then
-    rm -f "$testDirectory"*.ppm
-    cp "$textureDirectory"*.ppm "$testDirectory"
+    rm -f "$testDirectory"*.ppm "$testDirectory"*.clusters "$testDirectory"*.qclusters
+    # Scenes name their textures in ./textures/ directly. All scenes but the soft shadow one render in one process,
+    # which shares the textures between them.
+    scenes=()
     for file in "$testDirectory"*.txt; do
         if [ -f "$file" ]; then
-            echo "Rendering $file..."
-            if [[ "$file" == "./tests/softshadows.txt" ]]; then
-              ./raytracer1d -s "$file"
-            else
-              ./raytracer1d "$file"
+            if [[ "$file" != "./tests/softshadows.txt" ]]; then
+                scenes+=("$file")
             fi
         else
             echo "Skipping non-regular file: $file"
         fi
     done
+    echo "Rendering ${#scenes[@]} scenes..."
+    ./raytracer1d "${scenes[@]}" || status=1
+    if [ -f "./tests/softshadows.txt" ]; then
+        echo "Rendering ./tests/softshadows.txt..."
+        ./raytracer1d -s "./tests/softshadows.txt" || status=1
+    fi
+    # Each camera path in tests/paths/ animates the scene with the same name.
+    for path in "$testDirectory"paths/*.txt; do
+        if [ -f "$path" ]; then
+            scene="$testDirectory$(basename "$path")"
+            echo "Rendering $scene along $path..."
+            ./raytracer1d -p "$path" "$scene" || status=1
+        fi
+    done
+    # The out-of-core scene is the in-memory mesh scene loaded through a cluster file, so the two have to match.
+    compareImages "${testDirectory}clustermesh.ppm" "${testDirectory}mesh.ppm" "The clustered mesh" "the in-memory mesh"
+    # The last frame only refits the hierarchies to the moved vertexes, so it has to match a fresh load of them.
+    compareImages "${testDirectory}vertexanimation_0002.ppm" "${testDirectory}vertexanimationmoved.ppm" \
+        "The refitted vertex animation" "the freshly built scene"
 else
     echo "Directory $testDirectory does not exist."
+    status=1
 fi
+
+exit $status
@@ -8,118 +8,154 @@
 
 #define MAX_REFLECTION_DEPTH 3
 
+// Features the shading kernels are specialized on. A kernel compiled without a feature has none of its checks.
+#define SHADING_SOFT_SHADOWS 1
+#define SHADING_ATTENUATION 2
+#define SHADING_DEPTH_CUEING_BLEND 4
+#define SHADING_DEPTH_CUEING_COLOR 8
+#define SHADING_TRANSPARENCY 16
+#define SHADING_KERNEL_COUNT 32
+
+// The shading steps below take the features as a constant and are forced inline into every kernel, so each
+// kernel keeps only the code of its own features.
+#define SHADING_STEP static inline __attribute__((always_inline))
+
 Vector3 shadeRay(Ray ray, Scene* scene, RayState rayState);
 
-Illumination applyLights(Scene* scene, Intersection intersection, float shadow) {
+// Everything about a light that does not depend on shadow rays, each term computed once, in the same order of
+// operations as the shading below has always used.
+SHADING_STEP LightTerms computeLightTerms(const Intersection* intersection, const Light* light, float specularExponent, Vector3 viewDirection, int features) {
+    Vector3 lightDirection = light->pointOrDirectional == 1.0f
+                             ? normalize(subtract(light->position, intersection->intersectionPoint))
+                             : normalize(multiply(light->position, -1.0f));
+    Vector3 halfwayLightDirection = normalize(add(lightDirection, viewDirection));
+    float lightDistance = distance(intersection->intersectionPoint, light->position);
+    LightTerms terms = (LightTerms) {
+            .direction = lightDirection,
+            .diffuseFactor = max(dot(intersection->surfaceNormal, lightDirection), 0.0f),
+            .specularFactor = powf(max(dot(intersection->surfaceNormal, halfwayLightDirection), 0.0f), specularExponent),
+            .distance = lightDistance,
+            .attenuation = 1.0f,
+    };
+    if ((features & SHADING_ATTENUATION) && (light->constantAttenuation > 0.0f || light->linearAttenuation > 0.0f || light->quadraticAttenuation > 0.0f)) {
+        terms.attenuation = 1.0f / (light->constantAttenuation + light->linearAttenuation * lightDistance + light->quadraticAttenuation * powf(lightDistance, 2.0f));
+    }
+    return terms;
+}
+
+// Opacity of an occluder, which is always fully opaque in scenes without transparency.
+SHADING_STEP float getShadingAlpha(Scene* scene, Hit hit, int features) {
+    return (features & SHADING_TRANSPARENCY) ? getHitAlpha(scene, hit) : 1.0f;
+}
+
+// Fraction of the light that reaches the intersection. Hard shadows keep multiplying into the shadow they are
+// given, so an occluder of one light also darkens the lights after it, as it always has.
+SHADING_STEP float getLightShadow(Scene* scene, const Intersection* intersection, const Light* light, Vector3 lightDirection, float lightDistance, Exclusion shadowExclusion, float shadow, int features) {
+    if (features & SHADING_SOFT_SHADOWS) {
+        float softShadow = 0.0f;
+        int numShadowRays = scene->shadowRayCount;
+
+        Hit centralShadowHit = castRay((Ray) {
+                .origin = intersection->intersectionPoint,
+                .direction = lightDirection
+        }, scene, shadowExclusion);
+        for (int i = 0; i < numShadowRays; ++i) {
+            Vector3 jitteredLightDirection = add(lightDirection, multiply(randomUnitVector(), 0.005f));
+
+            Hit shadowHit = castRay((Ray) {
+                    .origin = intersection->intersectionPoint,
+                    .direction = normalize(jitteredLightDirection)
+            }, scene, shadowExclusion);
+
+            if (hitExists(shadowHit)) {
+                if ((light->pointOrDirectional == 1.0f && shadowHit.t < lightDistance) ||
+                    (light->pointOrDirectional == 0.0f && shadowHit.t > 0.0f)) {
+                    softShadow += 1.0f / (float) numShadowRays;
+                }
+            }
+        }
+        // A central ray that escapes sees no occluder, so there is nothing to let light through.
+        if (hitExists(centralShadowHit)) {
+            markShadowOccluder(scene, centralShadowHit);
+        }
+        if (hitExists(centralShadowHit) && getShadingAlpha(scene, centralShadowHit, features) < 1.0f) {
+            softShadow *= (1.0f - getShadingAlpha(scene, centralShadowHit, features));
+        }
+        return 1.0f - softShadow;
+    }
+
+    Hit shadowHit = castRay((Ray) {
+            .origin = intersection->intersectionPoint,
+            .direction = lightDirection
+    }, scene, shadowExclusion);
+    if (hitExists(shadowHit)) {
+        if (
+                (light->pointOrDirectional == 1.0f && shadowHit.t < lightDistance) ||
+                (light->pointOrDirectional == 0.0f && shadowHit.t > 0.0f)
+                ) {
+            markShadowOccluder(scene, shadowHit);
+            shadow *= (1.0f - getShadingAlpha(scene, shadowHit, features));
+        }
+    }
+    return shadow;
+}
+
+// Each light's shadow-independent terms are computed once, then its shadow rays and sums. Material products are
+// hoisted out of the loop, the depth-cueing blend is left out without a dist max, and the depth-cued light terms are
+// left out without a depth-cueing color, where they are all zero.
+SHADING_STEP Illumination applyLights(Scene* scene, const Intersection* intersection, float shadow, int features) {
+    const MaterialColor* mtlColor = &scene->mtlColors[intersection->mtlColorIdx];
+    Exclusion shadowExclusion = getHitExclusion(intersection->hit);
     Vector3 ambient = (Vector3) {
-            .x = intersection.mtlColor.diffuseColor.x * intersection.mtlColor.ambientCoefficient,
-            .y = intersection.mtlColor.diffuseColor.y * intersection.mtlColor.ambientCoefficient,
-            .z = intersection.mtlColor.diffuseColor.z * intersection.mtlColor.ambientCoefficient,
+            .x = intersection->diffuseColor.x * mtlColor->ambientCoefficient,
+            .y = intersection->diffuseColor.y * mtlColor->ambientCoefficient,
+            .z = intersection->diffuseColor.z * mtlColor->ambientCoefficient,
     };
     Vector3 depthCueingAmbient = (Vector3) {
-            .x = scene->depthCueing.color.x * intersection.mtlColor.ambientCoefficient,
-            .y = scene->depthCueing.color.y * intersection.mtlColor.ambientCoefficient,
-            .z = scene->depthCueing.color.z * intersection.mtlColor.ambientCoefficient,
+            .x = scene->depthCueing.color.x * mtlColor->ambientCoefficient,
+            .y = scene->depthCueing.color.y * mtlColor->ambientCoefficient,
+            .z = scene->depthCueing.color.z * mtlColor->ambientCoefficient,
     };
     Vector3 lightsApplied = (Vector3) {.x = 0.0f, .y = 0.0f, .z = 0.0f};
     Vector3 depthCueingLightsApplied = (Vector3) {.x = 0.0f, .y = 0.0f, .z = 0.0f};
-    if (scene->lightCount > 0) {
-        for (int lightIdx = 0; lightIdx < scene->lightCount; lightIdx++) {
-            Light light = scene->lights[lightIdx];
-            Vector3 lightDirection = light.pointOrDirectional == 1.0f
-                                     ? normalize(subtract(light.position, intersection.intersectionPoint))
-                                     : normalize(multiply(light.position, -1.0f));
-            Vector3 halfwayLightDirection = normalize(add(lightDirection, multiply(intersection.incidentDirection, -1.0f)));
-            float lightIntensity = light.intensity;
-            Vector3 diffuse = (Vector3) {
-                    .x = intersection.mtlColor.diffuseColor.x * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-                    .y = intersection.mtlColor.diffuseColor.y * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-                    .z = intersection.mtlColor.diffuseColor.z * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-            };
-            Vector3 depthCueingDiffuse = (Vector3) {
-                    .x = scene->depthCueing.color.x * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-                    .y = scene->depthCueing.color.y * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-                    .z = scene->depthCueing.color.z * intersection.mtlColor.diffuseCoefficient * max(dot(intersection.surfaceNormal, lightDirection), 0.0f),
-            };
-            Vector3 specular = (Vector3) {
-                    .x =  intersection.mtlColor.specularColor.x * intersection.mtlColor.specularCoefficient *
-                          powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-                    .y = intersection.mtlColor.specularColor.y * intersection.mtlColor.specularCoefficient *
-                         powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-                    .z = intersection.mtlColor.specularColor.z * intersection.mtlColor.specularCoefficient *
-                         powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-            };
-            Vector3 depthCueingSpecular = (Vector3) {
-                    .x =  scene->depthCueing.color.x * intersection.mtlColor.specularCoefficient *
-                          powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-                    .y = scene->depthCueing.color.y * intersection.mtlColor.specularCoefficient *
-                         powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-                    .z = scene->depthCueing.color.z * intersection.mtlColor.specularCoefficient *
-                         powf(max(dot(intersection.surfaceNormal, halfwayLightDirection), 0.0f), intersection.mtlColor.specularExponent),
-            };
-
-            if (scene->softShadows) {
-                float softShadow = 0.0f;
-                int numShadowRays = 50;
-
-                Intersection centralShadowIntersection = castRay((Ray) {
-                        .origin = intersection.intersectionPoint,
-                        .direction = lightDirection
-                }, scene, intersection.exclusion);
-                for (int i = 0; i < numShadowRays; ++i) {
-                    Vector3 jitteredLightDirection = add(lightDirection, multiply(randomUnitVector(), 0.005f));
-
-                    Intersection shadowIntersection = castRay((Ray) {
-                            .origin = intersection.intersectionPoint,
-                            .direction = normalize(jitteredLightDirection)
-                    }, scene, intersection.exclusion);
-
-                    if (shadowIntersection.closestSphereIdx != -1 || shadowIntersection.closestEllipsoidIdx != -1 || shadowIntersection.closestFaceIntersection.faceIdx != -1) {
-                        if ((light.pointOrDirectional == 1.0f && shadowIntersection.closestIntersection < distance(intersection.intersectionPoint, light.position)) ||
-                            (light.pointOrDirectional == 0.0f && shadowIntersection.closestIntersection > 0.0f)) {
-                            softShadow += 1.0f / (float) numShadowRays;
-                        }
-                    }
-                }
-                if (centralShadowIntersection.mtlColor.alpha < 1.0f) {
-                    softShadow *= (1.0f - centralShadowIntersection.mtlColor.alpha);
-                }
-                shadow = 1.0f - softShadow;
-            } else {
-                Intersection shadowIntersection = castRay((Ray) {
-                        .origin = intersection.intersectionPoint,
-                        .direction = lightDirection
-                }, scene, intersection.exclusion);
-                if (shadowIntersection.closestSphereIdx != -1 || shadowIntersection.closestEllipsoidIdx != -1 || shadowIntersection.closestFaceIntersection.faceIdx != -1) {
-                    if (
-                            (light.pointOrDirectional == 1.0f && shadowIntersection.closestIntersection < distance(intersection.intersectionPoint, light.position)) ||
-                            (light.pointOrDirectional == 0.0f && shadowIntersection.closestIntersection > 0.0f)
-                            ) {
-                        shadow *= (1.0f - shadowIntersection.mtlColor.alpha);
-                    }
-                }
-            }
 
-            if (scene->depthCueing.distMax > 0.0f) {
-                float distanceToCamera = distance(scene->eye, intersection.intersectionPoint);
-                float depthCueFactor = normalizef(distanceToCamera, scene->depthCueing.distMin, scene->depthCueing.distMax);
-                diffuse = multiply(diffuse, 1.0f - depthCueFactor);
-                specular = multiply(specular, 1.0f - depthCueFactor);
-                ambient = multiply(ambient, 1.0f - depthCueFactor);
-                depthCueingDiffuse = multiply(depthCueingDiffuse, depthCueFactor);
-                depthCueingSpecular = multiply(depthCueingSpecular, depthCueFactor);
-                depthCueingAmbient = multiply(depthCueingAmbient, depthCueFactor);
-            }
+    Vector3 materialDiffuse = multiply(intersection->diffuseColor, mtlColor->diffuseCoefficient);
+    Vector3 materialSpecular = multiply(mtlColor->specularColor, mtlColor->specularCoefficient);
+    Vector3 depthCueingDiffuseColor = multiply(scene->depthCueing.color, mtlColor->diffuseCoefficient);
+    Vector3 depthCueingSpecularColor = multiply(scene->depthCueing.color, mtlColor->specularCoefficient);
+    Vector3 viewDirection = multiply(intersection->incidentDirection, -1.0f);
+    float depthCueFactor = 0.0f;
+    if (features & SHADING_DEPTH_CUEING_BLEND) {
+        float distanceToCamera = distance(scene->eye, intersection->intersectionPoint);
+        depthCueFactor = normalizef(distanceToCamera, scene->depthCueing.distMin, scene->depthCueing.distMax);
+    }
 
-            float attenuationFactor = 1.0f;
-            if (light.constantAttenuation > 0.0f || light.linearAttenuation > 0.0f || light.quadraticAttenuation > 0.0f) {
-                attenuationFactor = 1.0f / (light.constantAttenuation + light.linearAttenuation * distance(intersection.intersectionPoint, light.position) + light.quadraticAttenuation * powf(distance(
-                        intersection.intersectionPoint, light.position), 2.0f));
-            }
-            Vector3 lightSourceAttenuationApplied = multiply(multiply(add(diffuse, specular), lightIntensity), attenuationFactor);
-            Vector3 shadowsApplied = multiply(lightSourceAttenuationApplied, shadow);
-            Vector3 depthCueingShadowsApplied = multiply(multiply(add(depthCueingDiffuse, depthCueingSpecular), lightIntensity), shadow);
-            lightsApplied = add(lightsApplied, shadowsApplied);
+    for (int lightIdx = 0; lightIdx < scene->lightCount; lightIdx++) {
+        const Light* light = &scene->lights[lightIdx];
+        LightTerms terms = computeLightTerms(intersection, light, mtlColor->specularExponent, viewDirection, features);
+        shadow = getLightShadow(scene, intersection, light, terms.direction, terms.distance, shadowExclusion, shadow, features);
+
+        Vector3 diffuse = multiply(materialDiffuse, terms.diffuseFactor);
+        Vector3 specular = multiply(materialSpecular, terms.specularFactor);
+        Vector3 depthCueingDiffuse = multiply(depthCueingDiffuseColor, terms.diffuseFactor);
+        Vector3 depthCueingSpecular = multiply(depthCueingSpecularColor, terms.specularFactor);
+        if (features & SHADING_DEPTH_CUEING_BLEND) {
+            diffuse = multiply(diffuse, 1.0f - depthCueFactor);
+            specular = multiply(specular, 1.0f - depthCueFactor);
+            // The ambient terms are blended once per light, which compounds with several lights. Renders
+            // depend on it, so it stays.
+            ambient = multiply(ambient, 1.0f - depthCueFactor);
+            depthCueingDiffuse = multiply(depthCueingDiffuse, depthCueFactor);
+            depthCueingSpecular = multiply(depthCueingSpecular, depthCueFactor);
+            depthCueingAmbient = multiply(depthCueingAmbient, depthCueFactor);
+        }
+
+        Vector3 lightSourceAttenuationApplied = multiply(multiply(add(diffuse, specular), light->intensity), terms.attenuation);
+        lightsApplied = add(lightsApplied, multiply(lightSourceAttenuationApplied, shadow));
+        // Starts from the lights so far rather than the depth-cued sum so far, which renders also depend on.
+        depthCueingLightsApplied = lightsApplied;
+        if (features & SHADING_DEPTH_CUEING_COLOR) {
+            Vector3 depthCueingShadowsApplied = multiply(multiply(add(depthCueingDiffuse, depthCueingSpecular), light->intensity), shadow);
             depthCueingLightsApplied = add(lightsApplied, depthCueingShadowsApplied);
         }
     }
@@ -136,11 +172,12 @@ Illumination applyLights(Scene* scene, Intersection intersection, float shadow)
 
 Reflection applyReflections(
         Scene* scene,
-        Intersection intersection,
+        const Intersection* intersection,
         Illumination illumination,
         RayState rayState,
         float Fr
 ) {
+    const MaterialColor* mtlColor = &scene->mtlColors[intersection->mtlColorIdx];
     Vector3 baseColor = illumination.color;
     Vector3 reflectionColor = (Vector3) {
         .x = 0.0f,
@@ -153,12 +190,12 @@ Reflection applyReflections(
         .z = 0.0f
     };
 
-    if (intersection.mtlColor.specularCoefficient > 0.0f) {
+    if (mtlColor->specularCoefficient > 0.0f) {
         reflectionColor = shadeRay(
             reflectRay(
-                    intersection.intersectionPoint,
-                    multiply(intersection.incidentDirection, -1.0f),
-                    intersection.surfaceNormal
+                    intersection->intersectionPoint,
+                    multiply(intersection->incidentDirection, -1.0f),
+                    intersection->surfaceNormal
                 ),
                 scene,
                 (RayState) {
@@ -191,28 +228,29 @@ Reflection applyReflections(
     };
 }
 
-Vector3 applyTransparency(Scene* scene, Intersection intersection, RayState rayState, Reflection reflection, float intersectionPointReflectionCoefficient, float currentRefractionIndex, float nextRefractionIndex, Exclusion newExclusion) {
-    if (intersection.mtlColor.alpha >= 1.0f) {
+Vector3 applyTransparency(Scene* scene, const Intersection* intersection, RayState rayState, Reflection reflection, float intersectionPointReflectionCoefficient, float currentRefractionIndex, float nextRefractionIndex) {
+    const MaterialColor* mtlColor = &scene->mtlColors[intersection->mtlColorIdx];
+    if (mtlColor->alpha >= 1.0f) {
         return reflection.color;
     }
 
-    Vector3 I = multiply(intersection.incidentDirection, -1.0f);
+    Vector3 I = multiply(intersection->incidentDirection, -1.0f);
 
-    float cosThetaEntering = dot(intersection.surfaceNormal, I);
+    float cosThetaEntering = dot(intersection->surfaceNormal, I);
     float refractionCoefficient = currentRefractionIndex / nextRefractionIndex;
     float partUnderSqrt = 1.0f - powf(refractionCoefficient, 2.0f) * (1.0f - powf(cosThetaEntering, 2.0f));
     if (partUnderSqrt < 0.0f) {
         return reflection.reflectionColor;
     }
 
-    Vector3 refractionDirToMultiply = subtract(multiply(intersection.surfaceNormal, cosThetaEntering), I);
+    Vector3 refractionDirToMultiply = subtract(multiply(intersection->surfaceNormal, cosThetaEntering), I);
 
     float cosThetaExiting = sqrtf(partUnderSqrt);
 
     Ray nextIncident = (Ray) {
-            .origin = intersection.intersectionPoint,
+            .origin = intersection->intersectionPoint,
             .direction = add(
-                    multiply(multiply(intersection.surfaceNormal, -1.0f), cosThetaExiting),
+                    multiply(multiply(intersection->surfaceNormal, -1.0f), cosThetaExiting),
                     multiply(refractionDirToMultiply, refractionCoefficient)
             )
     };
@@ -224,67 +262,140 @@ Vector3 applyTransparency(Scene* scene, Intersection intersection, RayState rayS
         .previousRefractionIndex = currentRefractionIndex
     });
 
-    float distanceTraveled = magnitude(subtract(nextIncident.origin, intersection.intersectionPoint));
+    float distanceTraveled = magnitude(subtract(nextIncident.origin, intersection->intersectionPoint));
 
-    float attenuationCoefficient = intersection.mtlColor.attenuationCoefficient;
+    float attenuationCoefficient = mtlColor->attenuationCoefficient;
     float attenuationFactor = expf(-attenuationCoefficient * distanceTraveled);
     Vector3 attenuatedTransparencyColor = multiply(transparencyColor, attenuationFactor);
-    Vector3 transparency = multiply(attenuatedTransparencyColor, (1.0f - intersectionPointReflectionCoefficient) * (1.0f - intersection.mtlColor.alpha));
+    Vector3 transparency = multiply(attenuatedTransparencyColor, (1.0f - intersectionPointReflectionCoefficient) * (1.0f - mtlColor->alpha));
 
     return add(reflection.color, transparency);
 }
 
-Vector3 applyBlinnPhongIllumination(
+SHADING_STEP Vector3 applyBlinnPhongIllumination(
         Scene* scene,
-        Intersection intersection,
-        RayState rayState
+        Intersection* intersection,
+        RayState rayState,
+        int features
 ) {
-    Illumination illumination = applyLights(scene, intersection,  rayState.shadow);
+    const MaterialColor* mtlColor = &scene->mtlColors[intersection->mtlColorIdx];
+    Illumination illumination = applyLights(scene, intersection,  rayState.shadow, features);
 
     float currentRefractionIndex = rayState.previousRefractionIndex;
-    float nextRefractionIndex = intersection.mtlColor.refractionIndex;
+    float nextRefractionIndex = mtlColor->refractionIndex;
 
-    Exclusion newExclusion = rayState.exclusion;
-    bool exiting = dot(intersection.surfaceNormal, intersection.incidentDirection) >= 0;
+    bool exiting = dot(intersection->surfaceNormal, intersection->incidentDirection) >= 0;
     if (exiting) {
         float tempRefractionIndex = currentRefractionIndex;
         currentRefractionIndex = nextRefractionIndex;
         nextRefractionIndex = tempRefractionIndex;
-        intersection.surfaceNormal = multiply(intersection.surfaceNormal, -1.0f);
-        newExclusion = (Exclusion) {
-            .excludeSphereIdx = -1,
-            .excludeEllipsoidIdx = -1,
-            .excludeFaceIdx = intersection.exclusion.excludeFaceIdx
-        };
+        intersection->surfaceNormal = multiply(intersection->surfaceNormal, -1.0f);
     }
 
     float F0 = powf(((nextRefractionIndex - currentRefractionIndex) / (nextRefractionIndex + currentRefractionIndex)), 2);
-    float Fr = F0 + ((1.0f - F0) * powf(1.0f - dot(multiply(intersection.incidentDirection, -1.0f), intersection.surfaceNormal), 5));
+    float Fr = F0 + ((1.0f - F0) * powf(1.0f - dot(multiply(intersection->incidentDirection, -1.0f), intersection->surfaceNormal), 5));
     Reflection reflection = applyReflections(scene, intersection, illumination, rayState, Fr);
 
-    if (exiting && intersection.mtlColor.alpha >= 1.0f) {
+    if (!(features & SHADING_TRANSPARENCY) || (exiting && mtlColor->alpha >= 1.0f)) {
         return reflection.color;
     }
 
-    return applyTransparency(scene, intersection, rayState, reflection, Fr, currentRefractionIndex, nextRefractionIndex, newExclusion);
+    return applyTransparency(scene, intersection, rayState, reflection, Fr, currentRefractionIndex, nextRefractionIndex);
 }
 
-Vector3 shadeRay(Ray ray, Scene* scene, RayState rayState) {
+#define DEFINE_SHADING_KERNEL(features) \
+    Vector3 shadeIntersection##features(Scene* scene, Intersection* intersection, RayState rayState) { \
+        return applyBlinnPhongIllumination(scene, intersection, rayState, features); \
+    }
+
+DEFINE_SHADING_KERNEL(0) DEFINE_SHADING_KERNEL(1) DEFINE_SHADING_KERNEL(2) DEFINE_SHADING_KERNEL(3)
+DEFINE_SHADING_KERNEL(4) DEFINE_SHADING_KERNEL(5) DEFINE_SHADING_KERNEL(6) DEFINE_SHADING_KERNEL(7)
+DEFINE_SHADING_KERNEL(8) DEFINE_SHADING_KERNEL(9) DEFINE_SHADING_KERNEL(10) DEFINE_SHADING_KERNEL(11)
+DEFINE_SHADING_KERNEL(12) DEFINE_SHADING_KERNEL(13) DEFINE_SHADING_KERNEL(14) DEFINE_SHADING_KERNEL(15)
+DEFINE_SHADING_KERNEL(16) DEFINE_SHADING_KERNEL(17) DEFINE_SHADING_KERNEL(18) DEFINE_SHADING_KERNEL(19)
+DEFINE_SHADING_KERNEL(20) DEFINE_SHADING_KERNEL(21) DEFINE_SHADING_KERNEL(22) DEFINE_SHADING_KERNEL(23)
+DEFINE_SHADING_KERNEL(24) DEFINE_SHADING_KERNEL(25) DEFINE_SHADING_KERNEL(26) DEFINE_SHADING_KERNEL(27)
+DEFINE_SHADING_KERNEL(28) DEFINE_SHADING_KERNEL(29) DEFINE_SHADING_KERNEL(30) DEFINE_SHADING_KERNEL(31)
+
+// Indexed by the scene's shadingFeatures.
+Vector3 (*const shadingKernels[SHADING_KERNEL_COUNT])(Scene* scene, Intersection* intersection, RayState rayState) = {
+        shadeIntersection0, shadeIntersection1, shadeIntersection2, shadeIntersection3,
+        shadeIntersection4, shadeIntersection5, shadeIntersection6, shadeIntersection7,
+        shadeIntersection8, shadeIntersection9, shadeIntersection10, shadeIntersection11,
+        shadeIntersection12, shadeIntersection13, shadeIntersection14, shadeIntersection15,
+        shadeIntersection16, shadeIntersection17, shadeIntersection18, shadeIntersection19,
+        shadeIntersection20, shadeIntersection21, shadeIntersection22, shadeIntersection23,
+        shadeIntersection24, shadeIntersection25, shadeIntersection26, shadeIntersection27,
+        shadeIntersection28, shadeIntersection29, shadeIntersection30, shadeIntersection31,
+};
+
+// Called once after parsing. A feature is only left out when leaving it out cannot change a single pixel.
+int getShadingFeatures(const Scene* scene) {
+    int features = 0;
+    if (scene->softShadows) {
+        features |= SHADING_SOFT_SHADOWS;
+    }
+    for (int lightIdx = 0; lightIdx < scene->lightCount; lightIdx++) {
+        const Light* light = &scene->lights[lightIdx];
+        if (light->constantAttenuation > 0.0f || light->linearAttenuation > 0.0f || light->quadraticAttenuation > 0.0f) {
+            features |= SHADING_ATTENUATION;
+        }
+    }
+    if (scene->depthCueing.distMax > 0.0f) {
+        features |= SHADING_DEPTH_CUEING_BLEND;
+    }
+    if (scene->depthCueing.color.x != 0.0f || scene->depthCueing.color.y != 0.0f || scene->depthCueing.color.z != 0.0f) {
+        features |= SHADING_DEPTH_CUEING_COLOR;
+    }
+    for (int mtlColorIdx = 0; mtlColorIdx < scene->mtlColorCount; mtlColorIdx++) {
+        if (scene->mtlColors[mtlColorIdx].alpha != 1.0f) {
+            features |= SHADING_TRANSPARENCY;
+        }
+    }
+    return features;
+}
+
+// Shades a ray and, when features is given, records what the ray hit first for the denoiser and AOV output.
+// candidates narrows down what primary rays test, NULL tests the whole scene.
+Vector3 shadePrimaryRay(Ray ray, Scene* scene, RayState rayState, const RayCandidates* candidates, PixelFeatures* features) {
+    if (features != NULL) {
+        (*features) = (PixelFeatures) {
+                .normal = (Vector3) { .x = 0.0f, .y = 0.0f, .z = 0.0f },
+                .albedo = scene->bkgColor.color,
+                .depth = 0.0f,
+                .hit = false,
+        };
+    }
+
     if (rayState.reflectionDepth > MAX_REFLECTION_DEPTH) {
         return scene->bkgColor.color;
     }
 
-    Intersection bvhIntersection = castBvhRay(ray, scene);
-    if (scene->bvhSphereCount > 0 && !intersectionExists(bvhIntersection)) {
+    Hit bvhHit = castBvhRay(ray, scene);
+    if (scene->bvhSphereCount > 0 && !hitExists(bvhHit)) {
         return scene->bkgColor.color;
     }
 
-    Intersection intersection = castRay(ray, scene, rayState.exclusion);
-    if (!intersectionExists(intersection)) {
+    Hit hit = castRayWithCandidates(ray, scene, rayState.exclusion, candidates);
+    if (!hitExists(hit)) {
         return scene->bkgColor.color;
     }
 
-    return applyBlinnPhongIllumination(scene, intersection, rayState);
+    Intersection intersection = resolveIntersection(scene, ray, hit);
+    markShadedMaterial(intersection.mtlColorIdx);
+    if (features != NULL) {
+        (*features) = (PixelFeatures) {
+                .normal = intersection.surfaceNormal,
+                .albedo = intersection.diffuseColor,
+                .depth = hit.t,
+                .hit = true,
+        };
+    }
+    return shadingKernels[scene->shadingFeatures](scene, &intersection, rayState);
+}
+
+Vector3 shadeRay(Ray ray, Scene* scene, RayState rayState) {
+    return shadePrimaryRay(ray, scene, rayState, NULL, NULL);
 }
 
 #endif
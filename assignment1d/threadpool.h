@@ -0,0 +1,119 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_THREADPOOL_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_THREADPOOL_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include "types.h"
+
+#define INITIAL_THREAD_POOL_TASK_COUNT 256
+
+int getDefaultThreadCount() {
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+    return processorCount > 0 ? (int) processorCount : 1;
+}
+
+void* runThreadPoolWorker(void* arg) {
+    ThreadPool* pool = (ThreadPool*) arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->queuedTaskCount == 0 && !pool->shuttingDown) {
+            pthread_cond_wait(&pool->taskAvailable, &pool->mutex);
+        }
+        if (pool->queuedTaskCount == 0 && pool->shuttingDown) {
+            break;
+        }
+        ThreadPoolTask task = pool->tasks[pool->taskHead];
+        pool->taskHead = (pool->taskHead + 1) % pool->taskCapacity;
+        pool->queuedTaskCount--;
+        pool->activeTaskCount++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        task.function(task.arg);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->activeTaskCount--;
+        if (pool->queuedTaskCount == 0 && pool->activeTaskCount == 0) {
+            pthread_cond_broadcast(&pool->tasksFinished);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void createThreadPool(ThreadPool* pool, int threadCount) {
+    (*pool) = (ThreadPool) {
+            .threads = (pthread_t*) malloc(threadCount * sizeof(pthread_t)),
+            .threadCount = threadCount,
+            .tasks = (ThreadPoolTask*) malloc(INITIAL_THREAD_POOL_TASK_COUNT * sizeof(ThreadPoolTask)),
+            .taskCapacity = INITIAL_THREAD_POOL_TASK_COUNT,
+            .taskHead = 0,
+            .queuedTaskCount = 0,
+            .activeTaskCount = 0,
+            .shuttingDown = false,
+    };
+    if (pool->threads == NULL || pool->tasks == NULL) {
+        fprintf(stderr, "Memory allocation error while creating the thread pool.\n");
+        exit(-1);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->taskAvailable, NULL);
+    pthread_cond_init(&pool->tasksFinished, NULL);
+    for (int threadIdx = 0; threadIdx < threadCount; threadIdx++) {
+        if (pthread_create(&pool->threads[threadIdx], NULL, runThreadPoolWorker, pool) != 0) {
+            fprintf(stderr, "Unable to start render thread %d.\n", threadIdx);
+            exit(-1);
+        }
+    }
+}
+
+// Tasks run in the order they are submitted, so queueing whole frames one after another
+// keeps only the first few frames in flight.
+void submitThreadPoolTask(ThreadPool* pool, ThreadPoolTaskFunction function, void* arg) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->queuedTaskCount == pool->taskCapacity) {
+        ThreadPoolTask* tasks = (ThreadPoolTask*) malloc(pool->taskCapacity * 2 * sizeof(ThreadPoolTask));
+        if (tasks == NULL) {
+            fprintf(stderr, "Memory allocation error while growing the thread pool queue.\n");
+            exit(-1);
+        }
+        for (int taskIdx = 0; taskIdx < pool->queuedTaskCount; taskIdx++) {
+            tasks[taskIdx] = pool->tasks[(pool->taskHead + taskIdx) % pool->taskCapacity];
+        }
+        free(pool->tasks);
+        pool->tasks = tasks;
+        pool->taskHead = 0;
+        pool->taskCapacity *= 2;
+    }
+    pool->tasks[(pool->taskHead + pool->queuedTaskCount) % pool->taskCapacity] = (ThreadPoolTask) {
+            .function = function,
+            .arg = arg,
+    };
+    pool->queuedTaskCount++;
+    pthread_cond_signal(&pool->taskAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void waitThreadPool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->queuedTaskCount > 0 || pool->activeTaskCount > 0) {
+        pthread_cond_wait(&pool->tasksFinished, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void destroyThreadPool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shuttingDown = true;
+    pthread_cond_broadcast(&pool->taskAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int threadIdx = 0; threadIdx < pool->threadCount; threadIdx++) {
+        pthread_join(pool->threads[threadIdx], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->taskAvailable);
+    pthread_cond_destroy(&pool->tasksFinished);
+    free(pool->threads);
+    free(pool->tasks);
+}
+
+#endif
@@ -2,6 +2,13 @@
 #define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_TYPES_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "../common/imagewriter.h"
+
+#define MAX_OUTPUT_FILE_NAME_LENGTH 4096
 
 typedef struct {
     float x;
@@ -62,6 +69,30 @@ typedef struct {
     int normalIdx;
 } Ellipsoid;
 
+#define INTERSECTION_BATCH_WIDTH 8
+
+typedef struct {
+    float* centerX;
+    float* centerY;
+    float* centerZ;
+    float* radiusSquared;
+    int* primitiveIdxs; // scene index of each lane, NULL when lanes are in scene order
+    int count;
+    int batchCount;
+} SphereBatches;
+
+typedef struct {
+    float* centerX;
+    float* centerY;
+    float* centerZ;
+    float* radiusSquaredX;
+    float* radiusSquaredY;
+    float* radiusSquaredZ;
+    int* primitiveIdxs; // scene index of each lane, NULL when lanes are in scene order
+    int count;
+    int batchCount;
+} EllipsoidBatches;
+
 typedef struct {
     Vector3 position;
     float pointOrDirectional;
@@ -79,6 +110,15 @@ typedef struct {
     float distMax;
 } DepthCueing;
 
+// The terms of one light at an intersection that do not depend on its shadow.
+typedef struct {
+    Vector3 direction;
+    float diffuseFactor; // max(N.L, 0)
+    float specularFactor; // max(N.H, 0) to the specular exponent
+    float distance; // from the intersection to the light's position
+    float attenuation;
+} LightTerms;
+
 typedef struct {
     int v1;
     int v2;
@@ -94,13 +134,36 @@ typedef struct {
     int normalIdx;
 } Face;
 
+typedef struct TextureCacheEntry TextureCacheEntry;
+
 typedef struct {
     int width;
     int height;
     int maxColor;
     RGBColor** data;
+    Vector3* texels; // decoded once by decodeSceneImages, row-major
+    TextureCacheEntry* cacheEntry; // owns data and texels when the image came from a TextureCache, otherwise NULL
 } PPMImage;
 
+// Images are keyed by their file contents, so the same texture under two paths is parsed once. Each entry keeps the
+// parsed pixels and decodes them at most once as a texture and once as a normal map.
+struct TextureCacheEntry {
+    uint64_t contentHash;
+    size_t contentSize;
+    PPMImage image;
+    Vector3* colorTexels;
+    Vector3* normalTexels;
+    pthread_mutex_t decodeMutex;
+    struct TextureCacheEntry* next;
+};
+
+typedef struct {
+    TextureCacheEntry* entries;
+    int entryCount;
+    int hitCount; // loads that found their contents already parsed
+    pthread_mutex_t mutex;
+} TextureCache;
+
 typedef struct {
     float u;
     float v;
@@ -111,6 +174,238 @@ typedef struct {
     float refractionIndex;
 } Background;
 
+typedef struct {
+    char* name;
+    int mtlColorIdx;
+    int textureIdx;
+    int normalIdx;
+} MeshMaterial;
+
+// The mtlcolor, texture and bump that objects in the scene file take, -1 before the first of each. Meshes add their
+// materials to the same arrays, but those never become current.
+typedef struct {
+    int mtlColorIdx;
+    int textureIdx;
+    int normalIdx;
+} CurrentMaterial;
+
+typedef struct {
+    MeshMaterial* materials;
+    int materialCount;
+    int materialCapacity;
+} MeshMaterialLibrary;
+
+typedef struct {
+    int lightCapacity;
+    int mtlColorCapacity;
+    int textureCapacity;
+    int normalCapacity;
+    int bvhSphereCapacity;
+    int sphereCapacity;
+    int ellipsoidCapacity;
+    int vertexCapacity;
+    int vertexNormalCapacity;
+    int vertexTextureCapacity;
+    int faceCapacity;
+    int objectCapacity;
+    void* block;
+    size_t blockSize;
+} SceneArena;
+
+// Bounding volume hierarchy node. Inner nodes have count 0 and their children at first and first + 1, leaves hold
+// count items starting at first in the hierarchy's item index array. Children always come after their parent.
+typedef struct {
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    int first;
+    int count;
+} BvhNode;
+
+// A mesh file or a run of inline faces. Its bottom-level hierarchy is built once in object space.
+typedef struct {
+    int firstFace;
+    int faceCount;
+    bool inlineFaces;
+    int rootNodeIdx; // -1 for objects without faces, the object owns 2 * faceCount - 1 nodes from here on
+    int nodeCount;
+    float builtCost; // surface area cost right after the last full build, refits are measured against it
+} MeshObject;
+
+typedef struct {
+    float m[3][4];
+} Matrix3x4;
+
+typedef struct {
+    Vector3 translation;
+    Vector3 rotationAxis;
+    float rotationAngle; // radians
+    Vector3 scale;
+} ObjectTransform;
+
+// Places an object in the world. Untransformed instances skip every matrix product, so they trace exactly like
+// world-space faces.
+typedef struct {
+    bool transformed;
+    Matrix3x4 objectToWorld;
+    Matrix3x4 worldToObject;
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+} ObjectInstance;
+
+typedef struct {
+    ObjectInstance* instances; // one per object
+    BvhNode* nodes;
+    int nodeCount;
+    int* instanceIdxs;
+} InstanceHierarchy;
+
+typedef struct {
+    const Vector3* itemMins;
+    const Vector3* itemMaxs;
+    Vector3* centroids;
+    int* itemIdxs;
+    BvhNode* nodes;
+    int nodeCount;
+    int leafSize;
+    int itemOffset; // the item arrays start at this item index
+} BvhBuild;
+
+// An out-of-core mesh file starts with this header, followed by the mesh's materials, one ClusterInfo per cluster
+// and then the triangles of every cluster.
+typedef struct {
+    char magic[8];
+    int materialCount;
+    int clusterCount;
+    int triangleCount;
+    bool usesDefaultMaterial; // triangles before any usemtl take the mtlcolor in effect at the clustermesh line
+    bool quantized;
+    Vector3 quantizationOrigin;
+    float quantizationStep;
+} ClusterFileHeader;
+
+typedef struct {
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    long offset; // of the cluster's data in the file
+    int size;
+    int triangleCount;
+    int firstTriangleIdx;
+} ClusterInfo;
+
+typedef struct {
+    Vector3 v1;
+    Vector3 v2;
+    Vector3 v3;
+    Vector3 n1; // all zero when the face has no vertex normals
+    Vector3 n2;
+    Vector3 n3;
+    int mtlColorIdx; // into the file's materials, -1 for the default material
+} ClusterTriangle;
+
+// A quantized cluster starts with this header, followed by its material runs, its vertexes and then three vertex
+// indexes per triangle. Vertex positions are steps on a lattice shared by the whole file, stored relative to base,
+// so vertexes shared between clusters decode to the same point.
+typedef struct {
+    int base[3];
+    unsigned short vertexCount;
+    unsigned short runCount;
+} QuantizedClusterHeader;
+
+typedef struct {
+    int mtlColorIdx;
+    int triangleCount;
+} MaterialRun;
+
+typedef struct {
+    unsigned short position[3];
+    short normal[2]; // octahedral, both -32768 without a normal
+} QuantizedVertex;
+
+typedef struct {
+    int q[3];
+    short normal[2];
+    int cornerIdx;
+} QuantizedCorner;
+
+typedef struct {
+    int mtlColorIdx;
+    int triangleIdx;
+} MaterialSortKey;
+
+typedef struct {
+    int fileDescriptor;
+    int mtlColorBase;
+    int defaultMtlColorIdx;
+    bool quantized;
+    Vector3 quantizationOrigin;
+    float quantizationStep;
+} ClusterFile;
+
+typedef struct {
+    ClusterInfo info; // firstTriangleIdx counts over every cluster file of the scene
+    int fileIdx;
+    void* mapping;
+    size_t mappingSize;
+    _Atomic(const void*) data; // NULL while the cluster is not mapped
+    atomic_int refCount; // rays reading the cluster, CLUSTER_EVICTING is added while it is being unmapped
+    atomic_bool referenced; // read since the clock hand last passed it
+    int residentIdx; // in residentClusterIdxs, -1 when not mapped
+} Cluster;
+
+typedef struct {
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    int left;
+    int right;
+    int clusterIdx; // -1 for inner nodes
+} ClusterNode;
+
+// Clusters are mapped in when a ray reaches their bounds and unmapped with the clock algorithm once the mapped size
+// exceeds the budget: a clock hand sweeps the resident clusters and unmaps the first one that has not been read
+// since the hand last passed it. Clusters in use by a ray are never unmapped. Rays pin and read resident clusters
+// without the mutex, which is only taken to map a cluster in or to unmap some.
+typedef struct {
+    ClusterFile* files;
+    int fileCount;
+    int fileCapacity;
+    Cluster* clusters;
+    int clusterCount;
+    int clusterCapacity;
+    ClusterNode* nodes;
+    int nodeCount;
+    int triangleCount;
+    size_t budget;
+    size_t residentSize;
+    int* residentClusterIdxs;
+    int residentCount;
+    int clockHand; // next index in residentClusterIdxs to look at
+    pthread_mutex_t mutex;
+} ClusterCache;
+
+typedef struct {
+    Vector3* vertexes;
+    int vertexCount;
+    int vertexCapacity;
+    Vector3* vertexNormals;
+    int vertexNormalCount;
+    int vertexNormalCapacity;
+    int triangleCount;
+    bool usesDefaultMaterial;
+    MeshMaterialLibrary library;
+    MaterialColor* mtlColors;
+    int mtlColorCount;
+    Vector3 centroidMin;
+    Vector3 centroidMax;
+    int gridBits;
+    int* cellTriangleCounts;
+    int* cellClusterIdxs;
+    ClusterInfo* clusters;
+    int clusterCount;
+    ClusterTriangle* writeBuffers;
+    int* writeBufferCounts;
+    int fileDescriptor;
+} ClusterBuild;
+
 typedef struct {
     Vector3 eye;
     Vector3 viewDir;
@@ -131,6 +426,7 @@ typedef struct {
     int lightCount;
     DepthCueing depthCueing;
     bool softShadows;
+    int shadowRayCount;
     Vector3* vertexes;
     int vertexCount;
     Vector3* vertexNormals;
@@ -143,6 +439,20 @@ typedef struct {
     int textureCount;
     PPMImage* normals;
     int normalCount;
+    SphereBatches bvhSphereBatches;
+    SphereBatches sphereBatches;
+    EllipsoidBatches ellipsoidBatches;
+    SceneArena arena;
+    MeshObject* objects;
+    int objectCount;
+    BvhNode* objectNodes; // bottom-level hierarchies of all objects
+    int objectNodeCount;
+    int* objectFaceIdxs; // leaf face order, each object's faces stay inside its own range
+    InstanceHierarchy instanceHierarchy;
+    ClusterCache* clusterCache;
+    size_t clusterBudget;
+    TextureCache* textureCache; // shared by the scenes of a batch or the versions of a watched scene, NULL otherwise
+    int shadingFeatures; // SHADING_* bits of the features the scene uses, picks the shading kernel
 } Scene;
 
 typedef struct {
@@ -173,14 +483,19 @@ enum ObjectType {
 };
 
 typedef struct {
-    int faceIdx;
-    Vector3 normalDirection;
-    float alpha;
+    float t;
+    int primitiveIdx;
+    enum ObjectType objectType;
     float beta;
     float gamma;
-    Vector3 tangentDirection;
-    Vector3 bitangentDirection;
-} FaceIntersection;
+} Hit;
+
+// Narrowed-down primitives for a primary ray. Any NULL member means every primitive of that kind is tested.
+typedef struct {
+    const SphereBatches* sphereBatches;
+    const EllipsoidBatches* ellipsoidBatches;
+    const Hit* faceHit; // closest face from the rasterized visibility buffer
+} RayCandidates;
 
 typedef struct {
     int excludeSphereIdx;
@@ -189,16 +504,12 @@ typedef struct {
 } Exclusion;
 
 typedef struct {
-    float closestIntersection;
-    int closestSphereIdx;
-    int closestEllipsoidIdx;
-    FaceIntersection closestFaceIntersection;
-    enum ObjectType closestObject;
+    Hit hit;
     Vector3 intersectionPoint;
     Vector3 surfaceNormal;
     Vector3 incidentDirection;
-    MaterialColor mtlColor;
-    Exclusion exclusion;
+    Vector3 diffuseColor;
+    int mtlColorIdx;
 } Intersection;
 
 typedef struct {
@@ -219,4 +530,220 @@ typedef struct {
     float previousRefractionIndex;
 } RayState;
 
+typedef struct {
+    bool softShadows;
+    char* inputFileName; // the first of inputFileNames
+    char** inputFileNames;
+    int inputFileCount; // more than one renders the scenes as a batch
+    char* cameraPathFileName;
+    int threadCount;
+    int shadowRayCount;
+    bool denoise;
+    bool writeAovs;
+    size_t clusterBudget;
+    ImageFormat imageFormat;
+    char* daemonSocketName; // "-" reads jobs from stdin, NULL renders the input file once
+    bool watch; // re-render whenever the input file is saved
+} RenderOptions;
+
+typedef struct {
+    Vector3 normal;
+    Vector3 albedo;
+    float depth;
+    bool hit;
+} PixelFeatures;
+
+// A new position for one of the scene's vertexes, set by a camera path frame. Later frames keep it.
+typedef struct {
+    int vertexIdx;
+    Vector3 position;
+} VertexMove;
+
+typedef struct {
+    Vector3 eye;
+    Vector3 viewDir;
+    Vector3 upDir;
+    FieldOfView fov;
+    ObjectTransform* objectTransforms; // one per scene object
+    VertexMove* vertexMoves; // applied to the shared scene right before this frame is rendered
+    int vertexMoveCount;
+    int vertexMoveCapacity;
+} CameraKeyframe;
+
+typedef struct {
+    CameraKeyframe* keyframes;
+    int keyframeCount;
+    int keyframeCapacity;
+} CameraPath;
+
+typedef void (*ThreadPoolTaskFunction)(void* arg);
+
+typedef struct {
+    ThreadPoolTaskFunction function;
+    void* arg;
+} ThreadPoolTask;
+
+typedef struct {
+    pthread_t* threads;
+    int threadCount;
+    ThreadPoolTask* tasks; // ring buffer
+    int taskCapacity;
+    int taskHead;
+    int queuedTaskCount;
+    int activeTaskCount;
+    bool shuttingDown;
+    pthread_mutex_t mutex;
+    pthread_cond_t taskAvailable;
+    pthread_cond_t tasksFinished;
+} ThreadPool;
+
+typedef struct {
+    Vector3 planePoints[4];
+    Vector3 planeNormals[4]; // unit length, pointing into the frustum
+} TileFrustum;
+
+typedef struct {
+    SphereBatches sphereBatches;
+    EllipsoidBatches ellipsoidBatches;
+    int clusterCount;
+    void* block;
+} TileCandidates;
+
+typedef struct {
+    int* bounds; // per face: first and last covered pixel column and row, or -1 when off screen
+    int* tileOffsets; // faces of tile i are triangles[tileOffsets[i]] up to triangles[tileOffsets[i + 1]]
+    int* triangles;
+    int tileColumns;
+    int tileRows;
+} TriangleBins;
+
+// The pixels x0 <= x < x1 and y0 <= y < y1 of an image.
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} ImageRegion;
+
+typedef struct {
+    Scene scene; // shallow copy of the shared scene with this frame's camera
+    ViewParameters viewParameters;
+    bool parallel;
+    ImageRegion region; // the part of the image that is rendered and written, all buffers are its size
+    RGBColor* pixels;
+    Vector3* colors; // unquantized colors, only kept when denoising
+    PixelFeatures* features; // primary hit depth, normal and albedo, only kept when denoising or writing AOVs
+    TriangleBins triangleBins;
+    bool triangleBinsReady;
+    bool ownsInstanceHierarchy; // scene.instanceHierarchy was built for this frame's object transforms
+    const RenderOptions* options;
+    int frameIdx; // -1 outside of camera path renders
+    atomic_int remainingTileCount;
+    pthread_mutex_t pixelsMutex;
+    char outputFileName[MAX_OUTPUT_FILE_NAME_LENGTH];
+    ThreadPoolTaskFunction frameWritten; // called with frameWrittenArg once the frame is written, or NULL
+    void* frameWrittenArg;
+    bool writeFailed; // the image or one of its AOVs could not be written, set before frameWritten is called
+    bool keepBuffers; // buffers and triangle bins outlive the write, so later passes can re-render only some tiles
+    uint64_t* tileMaterialMasks; // materialMaskWordCount words per tile of the whole image, see shadedMaterialMask
+    int materialMaskWordCount;
+} FrameRender;
+
+typedef struct {
+    FrameRender* frame;
+    int tileIdx;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} RenderTile;
+
+typedef struct RenderDaemon RenderDaemon;
+
+// A connection that sends jobs, or stdin and stdout. Queued jobs keep it alive until they have replied.
+typedef struct DaemonClient {
+    RenderDaemon* daemon;
+    int inputFd;
+    int outputFd;
+    bool ownsFds; // sockets are closed with the client, stdin and stdout are not
+    int referenceCount;
+    pthread_mutex_t mutex; // guards replies and referenceCount
+    struct DaemonClient* next; // in the daemon's list of connected clients
+} DaemonClient;
+
+struct RenderDaemon {
+    Scene* scene;
+    const RenderOptions* options;
+    ThreadPool pool;
+    int listenFd; // -1 when reading jobs from stdin
+    DaemonClient* clients;
+    int clientCount;
+    int queuedJobCount;
+    size_t queuedPixelCount;
+    int nextJobId;
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobsFinished;
+    pthread_cond_t clientsFinished;
+};
+
+// The settings a client sent since its last `render`.
+typedef struct {
+    CameraKeyframe camera;
+    ImageRegion region;
+    ImageFormat imageFormat;
+    char outputFileName[MAX_OUTPUT_FILE_NAME_LENGTH];
+    int invalidSettings; // DAEMON_SETTING_* of the settings whose last line could not be read
+} DaemonJobRequest;
+
+typedef struct {
+    RenderDaemon* daemon;
+    DaemonClient* client;
+    int jobId;
+    size_t pixelCount;
+    RenderOptions options; // the daemon's options with the job's image format
+    FrameRender frame;
+    RenderTile* tiles;
+} DaemonJob;
+
+typedef struct RenderBatch RenderBatch;
+
+// One scene of a batch. It is only loaded while it renders, and freed once its image is written.
+typedef struct {
+    RenderBatch* batch;
+    char* inputFileName;
+    Scene scene;
+    FrameRender frame;
+    RenderTile* tiles;
+} BatchScene;
+
+struct RenderBatch {
+    const RenderOptions* options;
+    ThreadPool pool;
+    TextureCache textureCache;
+    BatchScene* scenes;
+    int sceneCount;
+    int nextSceneIdx; // the next scene to load
+    int renderedSceneCount;
+    int skippedSceneCount;
+    pthread_mutex_t mutex;
+};
+
+// What a scene edit changed, from the widest to the narrowest re-render.
+#define SCENE_CHANGE_GEOMETRY 1 // anything rays can hit, or how many materials or lights there are: rebuild
+#define SCENE_CHANGE_VIEW 2 // camera, image size, background or depth cueing: every tile, same hierarchies
+#define SCENE_CHANGE_LIGHTS 4 // every tile that hit anything
+#define SCENE_CHANGE_MATERIALS 8 // the tiles that used an edited material
+
+typedef struct {
+    const RenderOptions* options;
+    TextureCache textureCache; // images that did not change are not parsed again
+    Scene scene;
+    FrameRender frame;
+    RenderTile* tiles; // one per tile of the whole image, in tileIdx order
+    int tileCount;
+    ThreadPool pool;
+    int inotifyFd;
+} SceneWatch;
+
 #endif
@@ -95,8 +95,16 @@ Vector3 convertNormalToVector(RGBColor rgbColor) {
     };
 }
 
+// Each render thread keeps its own generator, reseeded per pixel, so soft shadows come out the same
+// regardless of thread count or the order tiles are rendered in.
+_Thread_local unsigned int randomState = 1;
+
+void seedRandom(int x, int y) {
+    randomState = ((unsigned int) y * 73856093u) ^ ((unsigned int) x * 19349663u) ^ 0x9e3779b9u;
+}
+
 float randomFloat() {
-    return ((float) rand() / (float) RAND_MAX);
+    return ((float) rand_r(&randomState) / (float) RAND_MAX);
 }
 
 Vector3 randomUnitVector() {
@@ -0,0 +1,292 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_WATCH_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_WATCH_H
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "frame.h"
+
+#define WATCH_EVENT_BUFFER_SIZE 4096
+#define WATCH_SETTLE_MILLISECONDS 100
+
+/*
+* Watch mode renders the input file, then re-renders it every time it is saved. Each save is parsed into a new scene
+* and compared with the one on screen:
+*
+*     geometry, textures, or the number of materials or lights     the new scene replaces the old one and every
+*                                                                  tile is rendered again
+*     camera, image size, background or depth cueing              the old scene keeps its hierarchies, every tile is
+*                                                                  rendered again
+*     light values                                                only tiles where some ray hit something
+*     material values                                             only tiles where some ray shaded that material or
+*                                                                 was shadowed by it
+*
+* The frame keeps its pixels, triangle bins and a material mask per tile between saves, so the other tiles keep what
+* they rendered before. Pixels are seeded by their position, so the image matches a full render of the saved scene.
+*/
+
+#define SCENE_FIELD_CHANGED(scene, edited, field) (memcmp(&(scene)->field, &(edited)->field, sizeof((scene)->field)) != 0)
+
+bool isSameSceneArray(const void* array, int count, const void* editedArray, int editedCount, size_t elementSize) {
+    return count == editedCount && (count == 0 || memcmp(array, editedArray, (size_t) count * elementSize) == 0);
+}
+
+// Images come from the watch's cache, so the same entry means the same file contents.
+bool isSameSceneImages(const PPMImage* images, int count, const PPMImage* editedImages, int editedCount) {
+    if (count != editedCount) {
+        return false;
+    }
+    for (int imageIdx = 0; imageIdx < count; imageIdx++) {
+        if (images[imageIdx].cacheEntry != editedImages[imageIdx].cacheEntry) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only the parsed ranges are compared, the rest of a MeshObject is filled in when its hierarchy is built.
+bool isSameSceneObjects(const MeshObject* objects, int count, const MeshObject* editedObjects, int editedCount) {
+    if (count != editedCount) {
+        return false;
+    }
+    for (int objectIdx = 0; objectIdx < count; objectIdx++) {
+        if (objects[objectIdx].firstFace != editedObjects[objectIdx].firstFace ||
+            objects[objectIdx].faceCount != editedObjects[objectIdx].faceCount ||
+            objects[objectIdx].inlineFaces != editedObjects[objectIdx].inlineFaces) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int getMaterialMaskWordCount(const Scene* scene) {
+    return (scene->mtlColorCount + 1 + 63) / 64;
+}
+
+// Returns the SCENE_CHANGE_* bits of what differs between the scene on screen and its edited version. For material
+// edits, changedMaterialMask gets the bit of every edited material in the layout of shadedMaterialMask.
+int diffScenes(const Scene* scene, const Scene* edited, uint64_t* changedMaterialMask) {
+    // Out-of-core geometry has its own cache per scene, so it is always treated as changed.
+    if (scene->clusterCache != NULL || edited->clusterCache != NULL ||
+        scene->mtlColorCount != edited->mtlColorCount || scene->lightCount != edited->lightCount ||
+        !isSameSceneArray(scene->bvhSpheres, scene->bvhSphereCount, edited->bvhSpheres, edited->bvhSphereCount, sizeof(Sphere)) ||
+        !isSameSceneArray(scene->spheres, scene->sphereCount, edited->spheres, edited->sphereCount, sizeof(Sphere)) ||
+        !isSameSceneArray(scene->ellipsoids, scene->ellipsoidCount, edited->ellipsoids, edited->ellipsoidCount, sizeof(Ellipsoid)) ||
+        !isSameSceneArray(scene->vertexes, scene->vertexCount, edited->vertexes, edited->vertexCount, sizeof(Vector3)) ||
+        !isSameSceneArray(scene->vertexNormals, scene->vertexNormalCount, edited->vertexNormals, edited->vertexNormalCount, sizeof(Vector3)) ||
+        !isSameSceneArray(scene->vertexTextures, scene->vertexTextureCount, edited->vertexTextures, edited->vertexTextureCount, sizeof(TextureCoordinate)) ||
+        !isSameSceneArray(scene->faces, scene->faceCount, edited->faces, edited->faceCount, sizeof(Face)) ||
+        !isSameSceneObjects(scene->objects, scene->objectCount, edited->objects, edited->objectCount) ||
+        !isSameSceneImages(scene->textures, scene->textureCount, edited->textures, edited->textureCount) ||
+        !isSameSceneImages(scene->normals, scene->normalCount, edited->normals, edited->normalCount)) {
+        return SCENE_CHANGE_GEOMETRY;
+    }
+
+    int changes = 0;
+    if (SCENE_FIELD_CHANGED(scene, edited, eye) || SCENE_FIELD_CHANGED(scene, edited, viewDir) ||
+        SCENE_FIELD_CHANGED(scene, edited, upDir) || SCENE_FIELD_CHANGED(scene, edited, fov) ||
+        SCENE_FIELD_CHANGED(scene, edited, imSize) || SCENE_FIELD_CHANGED(scene, edited, parallel) ||
+        SCENE_FIELD_CHANGED(scene, edited, bkgColor) || SCENE_FIELD_CHANGED(scene, edited, depthCueing)) {
+        changes |= SCENE_CHANGE_VIEW;
+    }
+    if (!isSameSceneArray(scene->lights, scene->lightCount, edited->lights, edited->lightCount, sizeof(Light))) {
+        changes |= SCENE_CHANGE_LIGHTS;
+    }
+    for (int mtlColorIdx = 0; mtlColorIdx < scene->mtlColorCount; mtlColorIdx++) {
+        if (memcmp(&scene->mtlColors[mtlColorIdx], &edited->mtlColors[mtlColorIdx], sizeof(MaterialColor)) != 0) {
+            changedMaterialMask[(mtlColorIdx + 1) >> 6] |= (uint64_t) 1 << ((mtlColorIdx + 1) & 63);
+            changes |= SCENE_CHANGE_MATERIALS;
+        }
+    }
+    return changes;
+}
+
+// Copies everything but the geometry from the edited scene, which has the same number of materials and lights.
+void applySceneEdit(Scene* scene, const Scene* edited) {
+    scene->eye = edited->eye;
+    scene->viewDir = edited->viewDir;
+    scene->upDir = edited->upDir;
+    scene->fov = edited->fov;
+    scene->imSize = edited->imSize;
+    scene->parallel = edited->parallel;
+    scene->bkgColor = edited->bkgColor;
+    scene->depthCueing = edited->depthCueing;
+    memcpy(scene->lights, edited->lights, (size_t) scene->lightCount * sizeof(Light));
+    memcpy(scene->mtlColors, edited->mtlColors, (size_t) scene->mtlColorCount * sizeof(MaterialColor));
+    scene->shadingFeatures = getShadingFeatures(scene);
+}
+
+// Renders every tile of a new frame of the watched scene. The frame's buffers and material masks are kept for later
+// passes.
+void startWatchFrame(SceneWatch* watch) {
+    ImageRegion region = getFullImageRegion(&watch->scene);
+    watch->tileCount = getRegionTileCount(region);
+    free(watch->tiles);
+    watch->tiles = (RenderTile*) malloc((size_t) watch->tileCount * sizeof(RenderTile));
+    initFrameRender(&watch->frame, &watch->scene, watch->options, NULL, -1, region);
+    getOutputFileName(watch->options->inputFileName, -1, watch->options->imageFormat, watch->frame.outputFileName);
+    watch->frame.keepBuffers = true;
+    watch->frame.materialMaskWordCount = getMaterialMaskWordCount(&watch->scene);
+    watch->frame.tileMaterialMasks = (uint64_t*) calloc((size_t) watch->tileCount * (size_t) watch->frame.materialMaskWordCount, sizeof(uint64_t));
+    if (watch->tiles == NULL || watch->frame.tileMaterialMasks == NULL) {
+        fprintf(stderr, "Memory allocation error while scheduling the render.\n");
+        exit(-1);
+    }
+
+    totalTileCount = watch->tileCount;
+    atomic_store(&renderedTileCount, 0);
+    submitFrameTiles(&watch->pool, &watch->frame, watch->tiles);
+    waitThreadPool(&watch->pool);
+    printf("\n");
+}
+
+// Re-renders the tiles that an edit of lights or materials can change and writes the image again. Returns how many
+// tiles that was.
+int renderChangedTiles(SceneWatch* watch, int changes, const uint64_t* changedMaterialMask) {
+    int wordCount = watch->frame.materialMaskWordCount;
+    bool* changedTiles = (bool*) calloc((size_t) watch->tileCount, sizeof(bool));
+    if (changedTiles == NULL) {
+        fprintf(stderr, "Memory allocation error while scheduling the render.\n");
+        exit(-1);
+    }
+    int changedTileCount = 0;
+    for (int tileIdx = 0; tileIdx < watch->tileCount; tileIdx++) {
+        const uint64_t* mask = &watch->frame.tileMaterialMasks[(size_t) watch->tiles[tileIdx].tileIdx * (size_t) wordCount];
+        changedTiles[tileIdx] = (changes & SCENE_CHANGE_LIGHTS) && (mask[0] & 1);
+        for (int wordIdx = 0; !changedTiles[tileIdx] && (changes & SCENE_CHANGE_MATERIALS) && wordIdx < wordCount; wordIdx++) {
+            changedTiles[tileIdx] = (mask[wordIdx] & changedMaterialMask[wordIdx]) != 0;
+        }
+        changedTileCount += changedTiles[tileIdx] ? 1 : 0;
+    }
+
+    // Every tile is counted before the first one is queued, so the last of them writes the image.
+    if (changedTileCount > 0) {
+        totalTileCount = changedTileCount;
+        atomic_store(&renderedTileCount, 0);
+        atomic_store(&watch->frame.remainingTileCount, changedTileCount);
+        for (int tileIdx = 0; tileIdx < watch->tileCount; tileIdx++) {
+            if (changedTiles[tileIdx]) {
+                submitThreadPoolTask(&watch->pool, renderTile, &watch->tiles[tileIdx]);
+            }
+        }
+        waitThreadPool(&watch->pool);
+        printf("\n");
+    }
+    free(changedTiles);
+    return changedTileCount;
+}
+
+// Editors either write the file in place or move a temporary file over it, so the directory is watched for both.
+int openSceneWatch(const char* inputFileName) {
+    char directoryName[MAX_OUTPUT_FILE_NAME_LENGTH];
+    const char* separator = strrchr(inputFileName, '/');
+    if (separator == NULL) {
+        snprintf(directoryName, MAX_OUTPUT_FILE_NAME_LENGTH, ".");
+    } else {
+        snprintf(directoryName, MAX_OUTPUT_FILE_NAME_LENGTH, "%.*s", (int) (separator - inputFileName) + 1, inputFileName);
+    }
+    int inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0 || inotify_add_watch(inotifyFd, directoryName, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Unable to watch %s for changes.\n", directoryName);
+        exit(-1);
+    }
+    return inotifyFd;
+}
+
+// Blocks until the input file is saved. Events that follow within WATCH_SETTLE_MILLISECONDS belong to the same save.
+void waitForSceneSave(int inotifyFd, const char* inputFileName) {
+    const char* separator = strrchr(inputFileName, '/');
+    const char* baseName = separator == NULL ? inputFileName : separator + 1;
+    char events[WATCH_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    bool saved = false;
+    while (!saved) {
+        ssize_t length = read(inotifyFd, events, sizeof(events));
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Unable to read changes of %s.\n", inputFileName);
+            exit(-1);
+        }
+        const struct inotify_event* event;
+        for (char* cursor = events; cursor < events + length; cursor += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) cursor;
+            if (event->len > 0 && strcmp(event->name, baseName) == 0) {
+                saved = true;
+            }
+        }
+    }
+
+    struct pollfd pollFd = (struct pollfd) { .fd = inotifyFd, .events = POLLIN };
+    while (poll(&pollFd, 1, WATCH_SETTLE_MILLISECONDS) > 0 && read(inotifyFd, events, sizeof(events)) > 0) {
+    }
+}
+
+void loadWatchedScene(SceneWatch* watch, Scene* scene, bool prepare) {
+    (*scene) = createScene(watch->options, &watch->textureCache);
+    char*** inputFileWordsByLine = readInputFile(watch->options->inputFileName);
+    parseScene(scene, inputFileWordsByLine, watch->options->softShadows);
+    freeInputFileWordsByLine(inputFileWordsByLine);
+    if (prepare) {
+        prepareScene(scene);
+    }
+}
+
+// Runs until the process is stopped. A save that does not parse ends it, like any other invalid input file.
+void runSceneWatch(const RenderOptions* options) {
+    SceneWatch watch = (SceneWatch) {
+            .options = options,
+            .tiles = NULL,
+            .tileCount = 0,
+    };
+    initTextureCache(&watch.textureCache);
+    createThreadPool(&watch.pool, options->threadCount > 0 ? options->threadCount : getDefaultThreadCount());
+    watch.inotifyFd = openSceneWatch(options->inputFileName);
+
+    loadWatchedScene(&watch, &watch.scene, true);
+    startWatchFrame(&watch);
+    printf("Rendered %s to %s, watching it for changes.\n", options->inputFileName, watch.frame.outputFileName);
+    fflush(stdout);
+
+    while (true) {
+        waitForSceneSave(watch.inotifyFd, options->inputFileName);
+        Scene edited;
+        loadWatchedScene(&watch, &edited, false);
+        uint64_t* changedMaterialMask = (uint64_t*) calloc((size_t) getMaterialMaskWordCount(&watch.scene), sizeof(uint64_t));
+        if (changedMaterialMask == NULL) {
+            fprintf(stderr, "Memory allocation error while comparing the scene.\n");
+            exit(-1);
+        }
+        int changes = diffScenes(&watch.scene, &edited, changedMaterialMask);
+
+        if (changes & SCENE_CHANGE_GEOMETRY) {
+            destroyFrameRender(&watch.frame);
+            freeInput(&watch.scene);
+            prepareScene(&edited);
+            watch.scene = edited;
+            startWatchFrame(&watch);
+            printf("Geometry changed, rebuilt the scene and re-rendered all %d tiles.\n", watch.tileCount);
+        } else {
+            applySceneEdit(&watch.scene, &edited);
+            freeInput(&edited);
+            if (changes & SCENE_CHANGE_VIEW) {
+                destroyFrameRender(&watch.frame);
+                startWatchFrame(&watch);
+                printf("View changed, re-rendered all %d tiles.\n", watch.tileCount);
+            } else if (changes != 0) {
+                watch.frame.scene.shadingFeatures = watch.scene.shadingFeatures;
+                int changedTileCount = renderChangedTiles(&watch, changes, changedMaterialMask);
+                printf("%s changed, re-rendered %d of %d tiles.\n",
+                       changes == SCENE_CHANGE_LIGHTS ? "Lights" : (changes == SCENE_CHANGE_MATERIALS ? "Materials" : "Lights and materials"),
+                       changedTileCount, watch.tileCount);
+            } else {
+                printf("Nothing that changes the image was edited.\n");
+            }
+        }
+        free(changedMaterialMask);
+        fflush(stdout);
+    }
+}
+
+#endif
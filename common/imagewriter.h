@@ -0,0 +1,422 @@
+#ifndef FUNDAMENTALS_OF_COMPUTER_GRAPHICS_IMAGEWRITER_H
+#define FUNDAMENTALS_OF_COMPUTER_GRAPHICS_IMAGEWRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+* Image output shared by assignment0 and the raytracers. Pixels are packed 8 bit RGB, 3 bytes per pixel, which is
+* how every RGBColor in this repository is laid out. Images are encoded in chunks of whole rows that any thread can
+* encode, and are written in order. PNG chunks are separate raw deflate streams that end on a byte boundary, so
+* they can be compressed in parallel and simply concatenated. Encoding and writing report failures on stderr and
+* return false instead of exiting, so a program that writes many images can carry on with the others.
+*/
+
+#define IMAGE_PPM_EXTENSION ".ppm"
+#define IMAGE_PNG_EXTENSION ".png"
+#define IMAGE_MAX_PIXELS_ON_LINE 5
+// The longest a P3 pixel can get, "255 255 255" and its separator.
+#define IMAGE_MAX_P3_PIXEL_LENGTH 12
+#define IMAGE_PNG_COMPRESSION_LEVEL 6
+// Rows are compressed in chunks of about this many bytes, big enough that splitting costs little compression.
+#define IMAGE_CHUNK_BYTE_COUNT (1 << 20)
+// Longer chunks are written as several IDAT chunks.
+#define IMAGE_MAX_PNG_DATA_LENGTH (1u << 30)
+#define IMAGE_MAX_THREAD_COUNT 256
+
+typedef enum {
+    IMAGE_FORMAT_P3,
+    IMAGE_FORMAT_P6,
+    IMAGE_FORMAT_PNG,
+} ImageFormat;
+
+// The encoded bytes of some rows. For PNG, adler and rawLength describe the filtered rows before compression.
+typedef struct {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+    unsigned long adler;
+    size_t rawLength;
+} ImageChunk;
+
+typedef struct {
+    FILE* file;
+    ImageFormat format;
+    int width;
+    int height;
+    unsigned long adler; // of all the filtered PNG rows written so far
+} ImageWriter;
+
+typedef struct {
+    ImageFormat format;
+    const unsigned char* pixels;
+    int width;
+    int height;
+    int chunkRowCount;
+    int chunkCount;
+    ImageChunk* chunks;
+    int nextChunkIdx;
+    bool failed; // some chunk could not be encoded
+} ImageEncodeJob;
+
+// Returns false for anything but p3, p6 and png.
+bool parseImageFormat(const char* name, ImageFormat* format) {
+    if (strcmp(name, "p3") == 0) {
+        *format = IMAGE_FORMAT_P3;
+    } else if (strcmp(name, "p6") == 0) {
+        *format = IMAGE_FORMAT_P6;
+    } else if (strcmp(name, "png") == 0) {
+        *format = IMAGE_FORMAT_PNG;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* getImageFormatExtension(ImageFormat format) {
+    return format == IMAGE_FORMAT_PNG ? IMAGE_PNG_EXTENSION : IMAGE_PPM_EXTENSION;
+}
+
+void initImageChunk(ImageChunk* chunk) {
+    chunk->data = NULL;
+    chunk->length = 0;
+    chunk->capacity = 0;
+    chunk->adler = 1;
+    chunk->rawLength = 0;
+}
+
+void freeImageChunk(ImageChunk* chunk) {
+    free(chunk->data);
+    initImageChunk(chunk);
+}
+
+bool reserveImageChunk(ImageChunk* chunk, size_t capacity) {
+    if (chunk->capacity >= capacity) {
+        return true;
+    }
+    unsigned char* data = (unsigned char*) realloc(chunk->data, capacity);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation error while encoding the image.\n");
+        return false;
+    }
+    chunk->data = data;
+    chunk->capacity = capacity;
+    return true;
+}
+
+bool writeImageBytes(FILE* file, const void* bytes, size_t length) {
+    if (fwrite(bytes, 1, length, file) != length) {
+        fprintf(stderr, "Unable to write the output image.\n");
+        return false;
+    }
+    return true;
+}
+
+void writeBigEndian32(unsigned char* bytes, unsigned long value) {
+    bytes[0] = (unsigned char) (value >> 24);
+    bytes[1] = (unsigned char) (value >> 16);
+    bytes[2] = (unsigned char) (value >> 8);
+    bytes[3] = (unsigned char) value;
+}
+
+bool writePngChunk(FILE* file, const char* type, const unsigned char* data, size_t length) {
+    unsigned char lengthBytes[4];
+    unsigned char crcBytes[4];
+    writeBigEndian32(lengthBytes, length);
+    unsigned long crc = crc32(0L, (const Bytef*) type, 4);
+    // crc32 with a NULL buffer returns the initial value, so empty chunks like IEND skip it.
+    if (length > 0) {
+        crc = crc32(crc, data, (uInt) length);
+    }
+    writeBigEndian32(crcBytes, crc);
+    return writeImageBytes(file, lengthBytes, 4) && writeImageBytes(file, type, 4) && writeImageBytes(file, data, length) &&
+           writeImageBytes(file, crcBytes, 4);
+}
+
+// P3 rows put a newline after every IMAGE_MAX_PIXELS_ON_LINE pixels and at the end of the row, tabs elsewhere.
+bool encodeP3Rows(const unsigned char* pixels, int width, int rowCount, ImageChunk* chunk) {
+    if (!reserveImageChunk(chunk, (size_t) width * rowCount * IMAGE_MAX_P3_PIXEL_LENGTH + 1)) {
+        return false;
+    }
+    unsigned char* text = chunk->data;
+    for (int y = 0; y < rowCount; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int component = 0; component < 3; component++) {
+                int value = *pixels++;
+                if (value >= 100) {
+                    *text++ = (unsigned char) ('0' + value / 100);
+                }
+                if (value >= 10) {
+                    *text++ = (unsigned char) ('0' + value / 10 % 10);
+                }
+                *text++ = (unsigned char) ('0' + value % 10);
+                *text++ = component < 2 ? ' ' : (x % IMAGE_MAX_PIXELS_ON_LINE == IMAGE_MAX_PIXELS_ON_LINE - 1 || x == width - 1) ? '\n' : '\t';
+            }
+        }
+    }
+    chunk->length = text - chunk->data;
+    return true;
+}
+
+unsigned char getPaethPredictor(int left, int up, int upLeft) {
+    int estimate = left + up - upLeft;
+    int leftDistance = abs(estimate - left);
+    int upDistance = abs(estimate - up);
+    int upLeftDistance = abs(estimate - upLeft);
+    if (leftDistance <= upDistance && leftDistance <= upLeftDistance) {
+        return (unsigned char) left;
+    }
+    return (unsigned char) (upDistance <= upLeftDistance ? up : upLeft);
+}
+
+/*
+* Filters a row with each of PNG's filters and keeps the one whose bytes, read as signed, add up to the least, the
+* usual heuristic for which one compresses best. previousRow is NULL for the first row of a chunk that doesn't
+* know the row above, which leaves None and Sub.
+*/
+void filterPngRow(const unsigned char* row, const unsigned char* previousRow, int rowLength, unsigned char* candidates, unsigned char* filtered) {
+    int filterCount = previousRow != NULL ? 5 : 2;
+    unsigned long bestSum = 0;
+    for (int filter = 0; filter < filterCount; filter++) {
+        unsigned char* candidate = &candidates[(size_t) filter * rowLength];
+        unsigned long sum = 0;
+        for (int i = 0; i < rowLength; i++) {
+            int left = i >= 3 ? row[i - 3] : 0;
+            int up = previousRow != NULL ? previousRow[i] : 0;
+            int upLeft = previousRow != NULL && i >= 3 ? previousRow[i - 3] : 0;
+            unsigned char prediction = 0;
+            if (filter == 1) {
+                prediction = (unsigned char) left;
+            } else if (filter == 2) {
+                prediction = (unsigned char) up;
+            } else if (filter == 3) {
+                prediction = (unsigned char) ((left + up) / 2);
+            } else if (filter == 4) {
+                prediction = getPaethPredictor(left, up, upLeft);
+            }
+            candidate[i] = (unsigned char) (row[i] - prediction);
+            sum += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+        }
+        if (filter == 0 || sum < bestSum) {
+            bestSum = sum;
+            filtered[0] = (unsigned char) filter;
+            memcpy(&filtered[1], candidate, rowLength);
+        }
+    }
+}
+
+// Compresses the filtered rows into a raw deflate stream that ends on a byte boundary without a final block.
+bool encodePngRows(const unsigned char* pixels, const unsigned char* previousRow, int width, int rowCount, ImageChunk* chunk) {
+    int rowLength = width * 3;
+    size_t rawLength = (size_t) (rowLength + 1) * rowCount;
+    unsigned char* raw = (unsigned char*) malloc(rawLength + 1);
+    unsigned char* candidates = (unsigned char*) malloc((size_t) rowLength * 5 + 1);
+    if (raw == NULL || candidates == NULL) {
+        fprintf(stderr, "Memory allocation error while encoding the image.\n");
+        free(raw);
+        free(candidates);
+        return false;
+    }
+    for (int y = 0; y < rowCount; y++) {
+        const unsigned char* row = &pixels[(size_t) y * rowLength];
+        filterPngRow(row, y > 0 ? row - rowLength : previousRow, rowLength, candidates, &raw[(size_t) y * (rowLength + 1)]);
+    }
+    free(candidates);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, IMAGE_PNG_COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Unable to start compressing the image.\n");
+        free(raw);
+        return false;
+    }
+    // A sync flush adds at most 5 bytes and a few more for every 16 KB block stored uncompressed.
+    if (!reserveImageChunk(chunk, deflateBound(&stream, rawLength) + 16)) {
+        deflateEnd(&stream);
+        free(raw);
+        return false;
+    }
+    stream.next_in = raw;
+    stream.avail_in = (uInt) rawLength;
+    stream.next_out = chunk->data;
+    stream.avail_out = (uInt) chunk->capacity;
+    bool compressed = deflate(&stream, Z_SYNC_FLUSH) == Z_OK && stream.avail_in == 0;
+    chunk->length = chunk->capacity - stream.avail_out;
+    deflateEnd(&stream);
+    if (!compressed) {
+        fprintf(stderr, "Unable to compress the image.\n");
+        free(raw);
+        return false;
+    }
+
+    chunk->adler = adler32(adler32(0L, Z_NULL, 0), raw, (uInt) rawLength);
+    chunk->rawLength = rawLength;
+    free(raw);
+    return true;
+}
+
+/*
+* Encodes rowCount rows into chunk. Safe to call from any number of threads at once. previousRow is the row above
+* the first one, or NULL, which only makes PNG compress that row a little worse.
+*/
+bool encodeImageRows(ImageFormat format, const unsigned char* pixels, const unsigned char* previousRow, int width, int rowCount, ImageChunk* chunk) {
+    if (format == IMAGE_FORMAT_P3) {
+        return encodeP3Rows(pixels, width, rowCount, chunk);
+    }
+    if (format == IMAGE_FORMAT_P6) {
+        if (!reserveImageChunk(chunk, (size_t) width * rowCount * 3 + 1)) {
+            return false;
+        }
+        chunk->length = (size_t) width * rowCount * 3;
+        memcpy(chunk->data, pixels, chunk->length);
+        return true;
+    }
+    return encodePngRows(pixels, previousRow, width, rowCount, chunk);
+}
+
+bool beginImage(ImageWriter* writer, FILE* file, ImageFormat format, int width, int height) {
+    writer->file = file;
+    writer->format = format;
+    writer->width = width;
+    writer->height = height;
+    writer->adler = adler32(0L, Z_NULL, 0);
+    if (format != IMAGE_FORMAT_PNG) {
+        if (fprintf(file, "%s\n%d %d\n255\n", format == IMAGE_FORMAT_P3 ? "P3" : "P6", width, height) < 0) {
+            fprintf(stderr, "Unable to write the output image.\n");
+            return false;
+        }
+        return true;
+    }
+    const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    unsigned char header[13];
+    writeBigEndian32(&header[0], (unsigned long) width);
+    writeBigEndian32(&header[4], (unsigned long) height);
+    header[8] = 8; // bits per component
+    header[9] = 2; // RGB
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // no interlacing
+    // The zlib header: deflate with a 32 KB window and the default compression level.
+    const unsigned char zlibHeader[2] = {0x78, 0x9c};
+    return writeImageBytes(file, signature, sizeof(signature)) && writePngChunk(file, "IHDR", header, sizeof(header)) &&
+           writePngChunk(file, "IDAT", zlibHeader, sizeof(zlibHeader));
+}
+
+// Chunks have to be written in the order of their rows.
+bool writeImageChunk(ImageWriter* writer, const ImageChunk* chunk) {
+    if (writer->format != IMAGE_FORMAT_PNG) {
+        return writeImageBytes(writer->file, chunk->data, chunk->length);
+    }
+    for (size_t offset = 0; offset < chunk->length; offset += IMAGE_MAX_PNG_DATA_LENGTH) {
+        size_t length = chunk->length - offset < IMAGE_MAX_PNG_DATA_LENGTH ? chunk->length - offset : IMAGE_MAX_PNG_DATA_LENGTH;
+        if (!writePngChunk(writer->file, "IDAT", &chunk->data[offset], length)) {
+            return false;
+        }
+    }
+    writer->adler = adler32_combine(writer->adler, chunk->adler, (z_off_t) chunk->rawLength);
+    return true;
+}
+
+// Ends the deflate stream with an empty final block and the checksum of all the rows.
+bool finishImage(ImageWriter* writer) {
+    if (writer->format != IMAGE_FORMAT_PNG) {
+        return true;
+    }
+    unsigned char ending[6] = {0x03, 0x00};
+    writeBigEndian32(&ending[2], writer->adler);
+    return writePngChunk(writer->file, "IDAT", ending, sizeof(ending)) && writePngChunk(writer->file, "IEND", NULL, 0);
+}
+
+void* encodeImageChunks(void* arg) {
+    ImageEncodeJob* job = (ImageEncodeJob*) arg;
+    size_t rowLength = (size_t) job->width * 3;
+    while (true) {
+        int chunkIdx = __atomic_fetch_add(&job->nextChunkIdx, 1, __ATOMIC_RELAXED);
+        if (chunkIdx >= job->chunkCount) {
+            break;
+        }
+        int firstRow = chunkIdx * job->chunkRowCount;
+        int rowCount = job->height - firstRow < job->chunkRowCount ? job->height - firstRow : job->chunkRowCount;
+        const unsigned char* rows = &job->pixels[(size_t) firstRow * rowLength];
+        if (!encodeImageRows(job->format, rows, firstRow > 0 ? rows - rowLength : NULL, job->width, rowCount, &job->chunks[chunkIdx])) {
+            __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Encodes the image in chunks with one thread per core and writes them in order. Returns false if any step failed.
+bool writeImageRowsInChunks(ImageWriter* writer, const unsigned char* pixels, int width, int height, ImageFormat format) {
+    size_t rowLength = (size_t) width * 3;
+    ImageEncodeJob job = (ImageEncodeJob) {
+            .format = format,
+            .pixels = pixels,
+            .width = width,
+            .height = height,
+            .chunkRowCount = rowLength > 0 && rowLength < IMAGE_CHUNK_BYTE_COUNT ? (int) (IMAGE_CHUNK_BYTE_COUNT / rowLength) : 1,
+            .nextChunkIdx = 0,
+            .failed = false,
+    };
+    job.chunkCount = (height + job.chunkRowCount - 1) / job.chunkRowCount;
+    job.chunks = (ImageChunk*) malloc((size_t) job.chunkCount * sizeof(ImageChunk));
+    if (job.chunks == NULL) {
+        fprintf(stderr, "Memory allocation error while encoding the image.\n");
+        return false;
+    }
+    for (int chunkIdx = 0; chunkIdx < job.chunkCount; chunkIdx++) {
+        initImageChunk(&job.chunks[chunkIdx]);
+    }
+
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = threadCount < 1 ? 1 : threadCount > IMAGE_MAX_THREAD_COUNT ? IMAGE_MAX_THREAD_COUNT : threadCount;
+    threadCount = threadCount > job.chunkCount ? job.chunkCount : threadCount;
+    pthread_t threads[IMAGE_MAX_THREAD_COUNT];
+    for (int threadIdx = 1; threadIdx < threadCount; threadIdx++) {
+        // The threads that did start, and this one, still encode every chunk.
+        if (pthread_create(&threads[threadIdx], NULL, encodeImageChunks, &job) != 0) {
+            threadCount = threadIdx;
+            break;
+        }
+    }
+    encodeImageChunks(&job);
+    for (int threadIdx = 1; threadIdx < threadCount; threadIdx++) {
+        pthread_join(threads[threadIdx], NULL);
+    }
+
+    bool written = !job.failed;
+    for (int chunkIdx = 0; chunkIdx < job.chunkCount; chunkIdx++) {
+        written = written && writeImageChunk(writer, &job.chunks[chunkIdx]);
+        freeImageChunk(&job.chunks[chunkIdx]);
+    }
+    free(job.chunks);
+    return written;
+}
+
+// Encodes a whole image and writes it to fileName. Returns false if the image could not be written completely.
+bool writeImageFile(const char* fileName, const unsigned char* pixels, int width, int height, ImageFormat format) {
+    FILE* file = fopen(fileName, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open the output file: %s.\n", fileName);
+        return false;
+    }
+    ImageWriter writer;
+    bool written = beginImage(&writer, file, format, width, height);
+    if (written && format == IMAGE_FORMAT_P6) {
+        written = writeImageBytes(file, pixels, (size_t) width * 3 * height);
+    } else if (written && height > 0) {
+        written = writeImageRowsInChunks(&writer, pixels, width, height, format);
+    }
+    written = written && finishImage(&writer);
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Unable to write the output file: %s.\n", fileName);
+        return false;
+    }
+    return true;
+}
+
+#endif